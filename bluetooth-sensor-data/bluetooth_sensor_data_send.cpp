@@ -7,22 +7,32 @@
 #include "../data-server/include/bluetooth/bluetooth_con.hpp"
 #include "../data-server/include/bluetooth_utils.hpp"
 #include "../data-server/include/datasource.hpp"
+#include "../data-server/include/packet_sizer.hpp"
+#include "../data-server/include/pacer.hpp"
 
 #include "./scoped_screen.hpp"
 #include "./mock_sensor.hpp"
 
-// samples per second to send
-#define SAMPLE_RATE 64
+// samples per second to send unless the command line says otherwise, higher rates are for stress tests.
+// The server is told the rate in the hello ack, a server that never says hello times samples at BT_SAMPLE_RATE
+#define SAMPLE_RATE BT_SAMPLE_RATE
 
-// samples per packet
+// samples per packet to start with, the packet sizer adapts it to the link
 #define PACKET_SIZE 5
 
+// longest a sample should take to reach the server, packets never grow past it
+#define LATENCY_BUDGET_MS 250
+
+// longest a packet waits to be merged with the other sensors' packets into one write
+#define COALESCE_BUDGET_US 2000
+
 // struct for holding each sensor and its associated data
 struct Sensor_Data
 {
     Mock_Sensor sensor;
     std::deque<Sample> samples;
     bool set_valid{true};
+    uint16_t sequence{0};
 
     Sensor_Data(Inner_Sensor *i);
 };
@@ -32,6 +42,19 @@ Sensor_Data::Sensor_Data(Inner_Sensor *i) : sensor(i){};
 int total_samples{0};
 int total_valid_samples{0};
 int packets_sent{0};
+long bytes_sent{0};
+
+// protocol version sent, version 1 until the server's hello says it decodes a newer one
+uint8_t protocol_version{BT_PROTOCOL_V1};
+
+// samples per packet from the link's feedback, round trips measured on sensor 0's packets
+Packet_Sizer sizer(Sizer_Config(), PACKET_SIZE);
+Sizer_Stats sizer_stats;
+
+// the send loop's deadlines and the rate it really held
+unsigned long sample_rate{SAMPLE_RATE};
+Pacer_Stats pacer_stats;
+double achieved_rate{0};
 
 int pilot_states_received{0};
 int last_pilot_state{0};
@@ -42,6 +65,8 @@ const char *pilot_states[4] = {
     "extra stressed",
     "unknown"};
 
+// sends and receives on one thread, declared first so it outlives the link
+PHMS_Bluetooth::Reactor reactor;
 PHMS_Bluetooth::Communicator c;
 
 std::mutex sensor_guard;
@@ -83,6 +108,13 @@ void ui(Inner_Sensor *i)
         mvprintw(4, 0, "Pilot states recieved: %i", pilot_states_received);
         mvprintw(5, 0, "Last received pilot state: %s", pilot_states[last_pilot_state]);
         mvprintw(6, 0, "Current pilot stress level %i/10", current_pilot_stress);
+        mvprintw(7, 0, "Protocol version: %i, bytes per sample: %.2f", protocol_version, total_samples ? (double)bytes_sent / total_samples : 0.0);
+        mvprintw(8, 0, "Samples per packet: %zu (budget allows %zu), rtt: %.1f ms (base %.1f ms), in flight: %u, latency: %.1f ms",
+                 sizer_stats.samples, sizer_stats.limit, sizer_stats.srtt_us / 1000, sizer_stats.min_rtt_us / 1000.0,
+                 sizer_stats.in_flight, sizer_stats.latency_us / 1000.0);
+        mvprintw(9, 0, "Sample rate: %lu Hz, held: %.3f Hz, missed deadlines: %llu, skipped samples: %llu, woke late by %.1f us (max %.1f us)",
+                 sample_rate, achieved_rate, (unsigned long long)pacer_stats.missed, (unsigned long long)pacer_stats.skipped,
+                 pacer_stats.mean_late_ns / 1000, pacer_stats.max_late_ns / 1000.0);
         refresh();
 
         // print control instructions
@@ -125,8 +157,8 @@ void ui(Inner_Sensor *i)
             break;
 
         case 'a':
-            // dont add more than 255 sensors
-            if (sensors.size() == 0xff)
+            // sensor ids from BT_MSG_RESERVED up would be read as control messages
+            if (sensors.size() == BT_MSG_RESERVED)
                 break;
             sensor_guard.lock();
             sensors.push_back(Sensor_Data(&inner_sensor));
@@ -165,71 +197,139 @@ void ui(Inner_Sensor *i)
 // data thread - control sensors
 int main(int argc, char *argv[])
 {
-    if (argc != 4)
+    if (argc < 4 || argc > 6)
     {
-        std::cerr << "Exactly three command line arguments required: " << argv[0] << " [blueooth address] [stressed input file] [unstressed input file]" << std::endl;
+        std::cerr << "Three to five command line arguments required: " << argv[0] << " [blueooth address] [stressed input file] [unstressed input file] [listen address (optional, ie: unix:@phms-sender)] [sample rate (optional, Hz, ie: 2000 for a stress test)]" << std::endl;
         return 1;
     }
 
     std::string bluetooth_address = argv[1];
     std::string stressed_filename = argv[2];
     std::string unstressed_filename = argv[3];
+    std::string listen_address = (argc >= 5) ? argv[4] : BT_L2CAP_ANY;
+    if (argc == 6)
+        sample_rate = std::min(0xffffUL, std::max(1UL, strtoul(argv[5], nullptr, 10)));
 
     // this gets passed to each mock_sensor to ensure each sensor begins with the same values csv
     static Inner_Sensor inner_sensor(stressed_filename, unstressed_filename);
 
     // open bluetooth connection
-    int con_stat = c.open_con(bluetooth_address, 5);
+    int con_stat = c.open_con(listen_address, bluetooth_address, 5);
     if (con_stat != 0)
     {
         std::cerr << "Error opening connection to bluetooth device at " << bluetooth_address << '.' << std::endl;
         return 1;
     }
 
-    // spawn bluetooth communication in a new thread
-    c.run();
+    // every sensor's packet of one tick goes out in as few writes as fit the MTU
+    c.set_coalescing(BT_L2CAP_MTU, std::chrono::microseconds(COALESCE_BUDGET_US));
+
+    // run bluetooth communication on the reactor thread
+    c.run_on(reactor);
+    std::thread reactor_thread(&PHMS_Bluetooth::Reactor::run, &reactor);
 
     sensors.push_back(Sensor_Data(&inner_sensor));
 
+    // the budget bounds the packet size, the protocol version the largest packet that fits one L2CAP write
+    Sizer_Config sizer_config;
+    sizer_config.latency_budget_us = LATENCY_BUDGET_MS * 1000;
+    sizer_config.max_samples = BT_MTU_SAMPLES_PER_PACKET;
+    sizer_config.sample_period_us = std::max(1L, (long)(1000000 / sample_rate));
+    sizer.configure(sizer_config);
+
+    // version 2 packets carry the time of their first sample in ms since the start,
+    // time requests are answered in us on the same clock
+    auto start_time = std::chrono::steady_clock::now();
+
     // ui thread
     std::thread ui_thread(&ui, &inner_sensor);
 
+    // a deadline per sample, so neither rounding nor the loop's work slows the rate down
+    Pacer pacer(sample_rate);
+
     while (!global_is_quit)
     {
 
-        // calculate approximate sleep for desired sample rate with packet size
-        usleep(1000000 / (SAMPLE_RATE / PACKET_SIZE));
+        // as many samples as the link wants per packet, sleeping while the sensor takes them
+        size_t packet_size = sizer.next_size(bt_time_us(std::chrono::system_clock::now()), c.queue_depth(), c.stalls());
+        sizer_stats = sizer.stats();
+        pacer.wait(packet_size);
+        pacer_stats = pacer.stats();
+        achieved_rate = (double)(pacer_stats.periods - pacer_stats.skipped) / std::max(1e-9, std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count());
 
         // grab samples from each sensor
         // send all samples over bluetooth
         int valid_sensor_count{0};
+        // the newest sample of each packet was just taken, the first one packet_size - 1 periods earlier
+        uint64_t now_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start_time).count();
+        uint64_t first_ms = (now_us - std::min(now_us, (uint64_t)(packet_size - 1) * 1000000 / sample_rate)) / 1000;
         sensor_guard.lock();
         for (int i = 0; i < sensors.size(); i++)
         {
-            // construct bluetooth packet from sensor data
-            std::vector<Sample> samples = sensors[i].sensor.get(PACKET_SIZE);
-            PHMS_Bluetooth::Packet pkt = packet_from_Sample_buffer(i, samples);
+            // construct bluetooth packet from sensor data, in the version the server asked for
+            std::vector<Sample> samples = sensors[i].sensor.get(packet_size);
+            if (i == 0 && protocol_version >= BT_PROTOCOL_V2)
+                sizer.on_sent(sensors[i].sequence, bt_time_us(std::chrono::system_clock::now()));
+            PHMS_Bluetooth::Packet pkt = (protocol_version >= BT_PROTOCOL_V2)
+                                             ? packet_from_Sample_buffer_v2(i, sensors[i].sequence++, first_ms, samples)
+                                             : packet_from_Sample_buffer(i, samples);
 
-            c.push(pkt);
+            bytes_sent += pkt.size();
+            c.push(std::move(pkt));
 
             // update variables
             packets_sent++;
-            total_samples += PACKET_SIZE;
+            total_samples += packet_size;
             if (sensors[i].set_valid)
                 valid_sensor_count++;
         }
-        total_valid_samples += (valid_sensor_count * PACKET_SIZE);
+        total_valid_samples += (valid_sensor_count * packet_size);
         sensor_guard.unlock();
 
         // update sensor position
-        inner_sensor.inc_pos(PACKET_SIZE);
+        inner_sensor.inc_pos(packet_size);
 
         // set pilot state variables
         if (c.available())
         {
             auto v = c.get_all();
-            pilot_states_received += v.size();
-            for (auto vi : v)
+            for (auto &vi : v)
+            {
+                // the server says which protocol version it decodes, answer with the one we send from now on
+                if (vi.size() >= 2 && vi.get()[0] == BT_MSG_HELLO)
+                {
+                    protocol_version = bt_negotiate_version(vi.get()[1]);
+                    sizer_config.max_samples = (protocol_version >= BT_PROTOCOL_V2) ? BT_V2_MTU_SAMPLES_PER_PACKET : BT_MTU_SAMPLES_PER_PACKET;
+                    sizer.configure(sizer_config);
+                    uint8_t ack[BT_HELLO_ACK_SIZE];
+                    c.push(ack, bt_hello_ack(protocol_version, (uint16_t)sample_rate, ack));
+                    continue;
+                }
+
+                // the server saying how far sensor 0's packets got, its round trip sizes the packets
+                uint8_t ack_sensor;
+                uint16_t ack_sequence;
+                if (bt_parse_ack(vi.get(), vi.size(), ack_sensor, ack_sequence))
+                {
+                    if (ack_sensor == 0)
+                        sizer.on_ack(ack_sequence, bt_time_us(vi.time()));
+                    continue;
+                }
+
+                // the server measuring our clock: when the request arrived and when it is answered
+                if (vi.size() > 0 && vi.get()[0] == BT_MSG_TIME_REQUEST)
+                {
+                    auto now = std::chrono::steady_clock::now();
+                    uint64_t t3 = std::chrono::duration_cast<std::chrono::microseconds>(now - start_time).count();
+                    uint64_t waited = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now() - vi.time()).count();
+                    uint8_t response[BT_TIME_RESPONSE_SIZE];
+                    size_t len = bt_time_response(vi.get(), vi.size(), t3 - std::min(t3, waited), t3, response);
+                    if (len > 0)
+                        c.push(response, len);
+                    continue;
+                }
+
+                pilot_states_received++;
                 switch (vi.get()[0])
                 {
                 case (0):
@@ -244,10 +344,13 @@ int main(int argc, char *argv[])
                 default:
                     last_pilot_state = 3;
                 }
+            }
         }
     }
 
     // end bluetooth connection and thread
+    reactor.quit();
+    reactor_thread.join();
     c.quit();
 
     ui_thread.join();
@@ -5,10 +5,12 @@
 #include <unistd.h>
 #include <sys/socket.h>
 
-// requires library libbluetooth-dev to be installed
+// requires library libbluetooth-dev to be installed, unless built with PHMS_NO_BLUETOOTH
+#ifndef PHMS_NO_BLUETOOTH
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/hci.h>
 #include <bluetooth/hci_lib.h>
+#endif
 
 #include <random>
 #include <vector>
@@ -17,6 +19,8 @@
 #include "./bt_client.hpp"
 #include "./bt_server.hpp"
 #include "./bt_packet.hpp"
+#include "./bt_reactor.hpp"
+#include "./bt_transport.hpp"
 
 // https://people.csail.mit.edu/albert/bluez-intro/x559.html
 // uses l2cap sockets?
@@ -48,6 +52,10 @@ std::vector<PHMS_Bluetooth::Possible_Connection> PHMS_Bluetooth::available_conne
 
     std::vector<Possible_Connection> cons;
 
+#ifdef PHMS_NO_BLUETOOTH
+    std::cerr << "Built with PHMS_NO_BLUETOOTH, there are no bluetooth devices to scan for." << std::endl;
+    return cons;
+#else
     inquiry_info *ii{nullptr};
     int max_rsp, num_rsp;
     int dev_id, sock, len, flags;
@@ -83,4 +91,5 @@ std::vector<PHMS_Bluetooth::Possible_Connection> PHMS_Bluetooth::available_conne
     close(sock);
 
     return cons;
+#endif
 }
\ No newline at end of file
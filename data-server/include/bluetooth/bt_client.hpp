@@ -2,39 +2,89 @@
 
 #include <iostream>
 #include <string>
-#include <queue>
 #include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <atomic>
+#include <cerrno>
 #include <unistd.h>
 
 #include <sys/socket.h>
-#include <bluetooth/bluetooth.h>
-#include <bluetooth/l2cap.h>
+#include <sys/uio.h>
 
 #include "./bt_packet.hpp"
+#include "./bt_transport.hpp"
+#include "./bt_reactor.hpp"
+
+// packets waiting to be sent before push() starts dropping them
+#define BT_TX_QUEUE_SLOTS 64
 
 namespace PHMS_Bluetooth
 {
     /*
     * Client: Bluetooth client
     * Code adapted (stolen) from https://people.csail.mit.edu/albert/bluez-intro/x559.html
-    * Uses L2CAP sockets.
+    * Uses L2CAP sockets, or any other Transport.
+    * Sent either by a run() thread of its own or, after run_on() or the
+    * asynchronous open_con(), by a Reactor thread shared with other links.
     */
-    class Client
+    class Client : public Reactor_Handler
     {
     private:
-        std::queue<Packet> pkt_queue;
+        // fixed ring of queued packets, only the packets' buffer pointers move in and out
+        Packet pkt_queue[BT_TX_QUEUE_SLOTS];
+        size_t queue_head{0};
+        size_t queued{0};
+        size_t queued_bytes{0};
+        std::chrono::steady_clock::time_point first_queued;
+        std::atomic<uint64_t> dropped_count{0};
         std::mutex pkt_guard;
 
+        // signalled by push() and quit(), run() sleeps on it while there is nothing to send
+        std::condition_variable pkt_ready;
+
+        // coalescing settings, guarded by pkt_guard
+        size_t coalesce_bytes{0};
+        std::chrono::microseconds latency_budget{0};
+
+        std::atomic<uint64_t> sent_count{0};
+        std::atomic<uint64_t> write_count{0};
+        std::atomic<uint64_t> stall_count{0};
+
         bool is_quit{false};
 
+        size_t take_batch(Packet *batch, size_t &bytes);
+        bool encode_batch(Packet *batch, size_t n, size_t bytes, uint8_t *bundle, const uint8_t *&out, size_t &len);
+        void release_batch(Packet *batch, size_t n);
+        ssize_t write_message(const uint8_t *out, size_t len, size_t &done);
+
+        // stream transports frame every message with its length
+        bool stream{false};
+
+        // reactor mode, reactor is set under pkt_guard, registered and everything below it are reactor thread only
+        Reactor *reactor{nullptr};
+        bool registered{false};
+        bool connecting{false};
+
+        // the write in progress, kept until the socket takes it
+        Packet tx_batch[BT_TX_QUEUE_SLOTS];
+        size_t tx_count{0};
+        uint8_t tx_bundle[MAX_PKT_SIZE];
+        const uint8_t *tx_out{nullptr};
+        size_t tx_len{0};
+        size_t tx_done{0};
+
+        int start_connect(Reactor &r, int fd, const struct sockaddr *addr, socklen_t len);
+        void flush();
+        void disconnect();
+
         std::string connected_address;
 
         // bluetooth variables
 
-        bool connection_created{false};
+        std::atomic<bool> connection_created{false};
 
-        struct sockaddr_l2 socket_addr = {0};
-        int s{0};
+        int s{-1};
         int status{0};
 
         // end bluetooth variables
@@ -45,16 +95,31 @@ namespace PHMS_Bluetooth
         ~Client();
 
         int open_con(std::string addr);
+        int open_con(const Transport &t);
+        int open_con(Reactor &r, std::string addr);
+        int open_con(Reactor &r, const Transport &t);
+        int attach(int fd);
         int close_con();
 
         std::string get_connected_address();
+        bool connected() const { return connection_created; }
 
-        void push(const Packet &p);
-        void push(const void* src, size_t len);
+        bool push(Packet &&p);
+        bool push(const void *src, size_t len);
+
+        void set_coalescing(size_t max_bytes, std::chrono::microseconds budget);
+
+        uint64_t dropped() const { return dropped_count.load(std::memory_order_relaxed); }
+        uint64_t sent() const { return sent_count.load(std::memory_order_relaxed); }
+        uint64_t writes() const { return write_count.load(std::memory_order_relaxed); }
+        uint64_t stalls() const { return stall_count.load(std::memory_order_relaxed); }
+        size_t queue_depth();
 
         void quit();
 
         void run();
+        int run_on(Reactor &r);
+        void on_event(uint32_t events) override;
 
     };
 } // namespace PHMS_Bluetooth
@@ -85,62 +150,147 @@ PHMS_Bluetooth::Client::~Client()
 
 /**
  * open: Creates a bluetooth connection.
- * @param addr The bluetooth address of device to connect to.
+ * @param addr The bluetooth address of device to connect to, or any other transport address, see Transport::from_address().
  * @returns 0 on success.
  */
 int PHMS_Bluetooth::Client::open_con(std::string addr)
 {
-    // allocate a socket
-    s = socket(AF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP);
+    std::unique_ptr<Transport> t = Transport::from_address(addr);
+    if (t == nullptr)
+    {
+        std::cerr << "(Bluetooth Client) cannot connect to " << addr << std::endl;
+        return -1;
+    }
 
-    // set the connection parameters (who to connect to)
-    socket_addr.l2_family = AF_BLUETOOTH;
-    socket_addr.l2_psm = htobs(0x1001);
-    str2ba(addr.c_str(), &socket_addr.l2_bdaddr);
+    status = open_con(*t);
+    if (status == 0)
+        connected_address = addr;
+    return status;
+}
+
+/**
+ * open: Connect over a transport.
+ * @param t Transport to connect to
+ * @returns 0 on success.
+ */
+int PHMS_Bluetooth::Client::open_con(const Transport &t)
+{
+    if (connection_created == true)
+        return -1;
 
     // connect to server
-    status = connect(s, (struct sockaddr *)&socket_addr, sizeof(sockaddr_l2));
+    int fd = t.open_connection();
+    status = (fd < 0) ? -1 : 0;
 
     if (status == 0)
     {
+        s = fd;
+        stream = bt_is_stream_socket(fd);
         connection_created = true;
-        connected_address = addr;
+        connected_address = t.name();
         fprintf(stderr, "(Bluetooth Client) connected to %s\n", connected_address.c_str());
     }
 
     return status;
 }
 
+/**
+ * attach: Send over an already connected socket instead of connecting over bluetooth.
+ * Message sockets (ie: SOCK_SEQPACKET, one end of a socketpair in tests) get a packet per write,
+ * stream sockets (ie: TCP) get every packet framed with its length.
+ * @param fd Connected socket, closed by close_con()
+ * @returns 0 on success.
+ */
+int PHMS_Bluetooth::Client::attach(int fd)
+{
+    if (connection_created == true || fd < 0)
+        return -1;
+
+    s = fd;
+    stream = bt_is_stream_socket(fd);
+    connection_created = true;
+    connected_address = "fd:" + std::to_string(fd);
+    return 0;
+}
+
 /**
  * close: Closes existing bluetooth connection.
  * @return 0 on success.
  */
 int PHMS_Bluetooth::Client::close_con()
 {
+    if (registered)
+        disconnect();
     close(s);
+    s = -1;
     connection_created = false;
     return 0;
 }
 
 /**
- * push: Add a packet to the queue to be transmitted over bluetooth.
- * @param p The packet to be transmitted.
- * @returns True if a connection was created, false otherwise.
+ * push: Move a packet into the queue to be transmitted over bluetooth.
+ * @param p The packet to be transmitted. Left untouched if the queue is full.
+ * @returns True if the packet was queued, false if the queue was full and it was dropped.
  */
-void PHMS_Bluetooth::Client::push(const PHMS_Bluetooth::Packet &p)
+bool PHMS_Bluetooth::Client::push(PHMS_Bluetooth::Packet &&p)
 {
-    pkt_guard.lock();
-    pkt_queue.push(p);
-    pkt_guard.unlock();
+    Reactor *r;
+    {
+        std::lock_guard<std::mutex> lock(pkt_guard);
+        if (queued == BT_TX_QUEUE_SLOTS)
+        {
+            dropped_count.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        if (queued == 0)
+            first_queued = std::chrono::steady_clock::now();
+        queued_bytes += p.size();
+        pkt_queue[(queue_head + queued) % BT_TX_QUEUE_SLOTS] = std::move(p);
+        queued++;
+        pkt_ready.notify_one();
+        r = reactor;
+    }
+
+    if (r != nullptr)
+        r->notify(this);
+    return true;
 }
 
 /**
  * push: Add data to be transmitted over bluetooth.
  * @param src Location of data to be put into packet.
  * @param len Number of bytes to be transmitted.
+ * @returns True if the packet was queued.
+ */
+bool PHMS_Bluetooth::Client::push(const void *src, size_t len)
+{
+    return push(PHMS_Bluetooth::Packet(len, src));
+}
+
+/**
+ * set_coalescing: Merge queued packets into one write of up to max_bytes.
+ * The receiving Server splits them up again, so its reader sees the packets
+ * that were pushed. When a packet is queued, run() waits up to budget for
+ * more packets before sending, unless max_bytes are already waiting.
+ * @param max_bytes Largest merged write, ie: BT_L2CAP_MTU. 0 sends one packet per write (default)
+ * @param budget Longest time a packet waits for others to merge with, 0 only merges packets already queued
+ */
+void PHMS_Bluetooth::Client::set_coalescing(size_t max_bytes, std::chrono::microseconds budget)
+{
+    std::lock_guard<std::mutex> lock(pkt_guard);
+    coalesce_bytes = (max_bytes > MAX_PKT_SIZE) ? MAX_PKT_SIZE : max_bytes;
+    latency_budget = budget;
+}
+
+/**
+ * queue_depth: Number of packets waiting to be sent, not counting a write in progress.
+ * A queue that keeps growing means the link is not keeping up.
  */
-void PHMS_Bluetooth::Client::push(const void *src, size_t len) {
-    push(PHMS_Bluetooth::Packet(len, src));
+size_t PHMS_Bluetooth::Client::queue_depth()
+{
+    std::lock_guard<std::mutex> lock(pkt_guard);
+    return queued;
 }
 
 /**
@@ -148,11 +298,47 @@ void PHMS_Bluetooth::Client::push(const void *src, size_t len) {
  */
 void PHMS_Bluetooth::Client::quit()
 {
-    is_quit = true;
+    {
+        std::lock_guard<std::mutex> lock(pkt_guard);
+        is_quit = true;
+    }
+    pkt_ready.notify_all();
+}
+
+/**
+ * take_batch: Internal function. Move the packets of the next write out of the queue, pkt_guard must be held.
+ * @param batch Destination for at least BT_TX_QUEUE_SLOTS packets
+ * @param bytes Set to the total size of the packets taken
+ * @returns Number of packets taken, at least one
+ */
+size_t PHMS_Bluetooth::Client::take_batch(Packet *batch, size_t &bytes)
+{
+    size_t n{0};
+    bytes = 0;
+    while (n < queued)
+    {
+        Packet &p = pkt_queue[(queue_head + n) % BT_TX_QUEUE_SLOTS];
+
+        // the first packet always goes, later ones only while the bundle fits
+        if (n > 0 && bt_bundle_size(bytes + p.size(), n + 1) > coalesce_bytes)
+            break;
+
+        bytes += p.size();
+        batch[n++] = std::move(p);
+
+        if (coalesce_bytes == 0)
+            break;
+    }
+
+    queue_head = (queue_head + n) % BT_TX_QUEUE_SLOTS;
+    queued -= n;
+    queued_bytes -= bytes;
+    return n;
 }
 
 /**
  * run: Thread entry point. Sends packets from the pkt_queue until quit() is called.
+ * Sleeps while the queue is empty. See run_on() to send from a shared reactor thread instead.
  */
 void PHMS_Bluetooth::Client::run()
 {
@@ -160,26 +346,346 @@ void PHMS_Bluetooth::Client::run()
     if (connection_created == false)
         return;
 
-    while (is_quit == false)
+    Packet batch[BT_TX_QUEUE_SLOTS];
+    uint8_t bundle[MAX_PKT_SIZE];
+
+    while (true)
     {
-        if (pkt_queue.size() > 0)
+        size_t n, bytes;
         {
-            // get the front packet from the queue
-            pkt_guard.lock();
-            Packet p(pkt_queue.front());
-            pkt_queue.pop();
-            pkt_guard.unlock();
-
-            // attempt to send the packet's data over bluetooth
-            int status = write(s, p.get(), p.size());
-            if (status < 0)
+            std::unique_lock<std::mutex> lock(pkt_guard);
+            pkt_ready.wait(lock, [this]() { return queued > 0 || is_quit; });
+            if (is_quit)
+                break;
+
+            // give other packets a chance to join this write, up to the latency budget
+            if (coalesce_bytes > 0 && latency_budget.count() > 0)
             {
-                std::cerr << "An error occurred transmitting packet (CLIENT)" << std::endl;
+                auto deadline = std::chrono::steady_clock::now() + latency_budget;
+                pkt_ready.wait_until(lock, deadline, [this]() {
+                    return is_quit || queued == BT_TX_QUEUE_SLOTS || bt_bundle_size(queued_bytes, queued) >= coalesce_bytes;
+                });
+                if (is_quit)
+                    break;
             }
+
+            n = take_batch(batch, bytes);
         }
+
+        const uint8_t *out;
+        size_t len;
+        if (!encode_batch(batch, n, bytes, bundle, out, len))
+        {
+            release_batch(batch, n);
+            continue;
+        }
+
+        // attempt to send the packets' data over bluetooth
+        size_t done{0};
+        ssize_t status = write_message(out, len, done);
+        write_count.fetch_add(1, std::memory_order_relaxed);
+        if (status < 0)
+            std::cerr << "An error occurred transmitting packet (CLIENT)" << std::endl;
+        else
+            sent_count.fetch_add(n, std::memory_order_relaxed);
+
+        release_batch(batch, n);
     }
 }
 
+/**
+ * encode_batch: Internal function. Lay out the packets taken for one write.
+ * A single packet goes out as it is, unless it could be mistaken for a bundle.
+ * @param batch Packets from take_batch()
+ * @param n Number of packets
+ * @param bytes Total size of the packets
+ * @param bundle Buffer of MAX_PKT_SIZE bytes to build a bundle in
+ * @param out Set to the data to write
+ * @param len Set to the number of bytes to write
+ * @returns False if the packet does not fit a bundle and was dropped
+ */
+bool PHMS_Bluetooth::Client::encode_batch(Packet *batch, size_t n, size_t bytes, uint8_t *bundle, const uint8_t *&out, size_t &len)
+{
+    out = batch[0].get();
+    len = batch[0].size();
+    if (n == 1 && !(len > 0 && out[0] == BT_BUNDLE_MARKER))
+        return true;
+
+    if (bt_bundle_size(bytes, n) > MAX_PKT_SIZE)
+    {
+        dropped_count.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    len = 0;
+    bundle[len++] = BT_BUNDLE_MARKER;
+    for (size_t i = 0; i < n; i++)
+        bt_bundle_append(bundle, len, batch[i].get(), batch[i].size());
+    out = bundle;
+    return true;
+}
+
+/**
+ * release_batch: Internal function. Return the buffers of sent packets to the pool.
+ */
+void PHMS_Bluetooth::Client::release_batch(Packet *batch, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        batch[i] = Packet();
+}
+
+/**
+ * run_on: Send on a Reactor thread instead of a thread of our own.
+ * The socket is made non-blocking. push() wakes the reactor, which writes
+ * until the queue is empty or the socket is full, then carries on when the
+ * socket becomes writable again. The coalescing budget is kept with a reactor
+ * deadline. The reactor must outlive the Client and be stopped before the
+ * Client is closed or destroyed.
+ * @param r Reactor to send from
+ * @returns 0 on success.
+ */
+int PHMS_Bluetooth::Client::run_on(Reactor &r)
+{
+    {
+        std::lock_guard<std::mutex> lock(pkt_guard);
+        if (connection_created == false || reactor != nullptr)
+            return -1;
+        reactor = &r;
+    }
+
+    registered = true;
+    return reactor->add(s, this, EPOLLOUT);
+}
+
+/**
+ * open_con: Connect over bluetooth without blocking, then send from the Reactor thread.
+ * Packets pushed while connecting are sent once the connection is up, see connected().
+ * @param r Reactor to connect and send from
+ * @param addr The bluetooth address of device to connect to, or any other transport address, see Transport::from_address().
+ * @returns 0 if the connection was started.
+ */
+int PHMS_Bluetooth::Client::open_con(Reactor &r, std::string addr)
+{
+    std::unique_ptr<Transport> t = Transport::from_address(addr);
+    if (t == nullptr)
+    {
+        std::cerr << "(Bluetooth Client) cannot connect to " << addr << std::endl;
+        return -1;
+    }
+
+    if (open_con(r, *t) != 0)
+        return -1;
+    connected_address = addr;
+    return 0;
+}
+
+/**
+ * open_con: Connect over a transport without blocking, then send from the Reactor thread.
+ * @param r Reactor to connect and send from
+ * @param t Transport to connect to
+ * @returns 0 if the connection was started.
+ */
+int PHMS_Bluetooth::Client::open_con(Reactor &r, const Transport &t)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = t.get_address(addr);
+    if (len == 0 || start_connect(r, t.open_socket(), (struct sockaddr *)&addr, len) != 0)
+        return -1;
+    connected_address = t.name();
+    return 0;
+}
+
+/**
+ * start_connect: Internal function. Start a non-blocking connect and register the socket.
+ * The reactor finishes the connection when the socket becomes writable.
+ */
+int PHMS_Bluetooth::Client::start_connect(Reactor &r, int fd, const struct sockaddr *addr, socklen_t len)
+{
+    if (connection_created == true || registered || fd < 0 || bt_set_nonblocking(fd) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    status = connect(fd, addr, len);
+    if (status != 0 && errno != EINPROGRESS)
+    {
+        close(fd);
+        return status;
+    }
+
+    s = fd;
+    stream = bt_is_stream_socket(fd);
+    connecting = (status != 0);
+    connection_created = (status == 0);
+    {
+        std::lock_guard<std::mutex> lock(pkt_guard);
+        reactor = &r;
+    }
+    registered = true;
+    return reactor->add(s, this, EPOLLOUT);
+}
+
+/**
+ * on_event: Reactor thread. Finish connecting, then send whatever is queued.
+ */
+void PHMS_Bluetooth::Client::on_event(uint32_t events)
+{
+    if (!registered)
+        return;
+
+    if (connecting)
+    {
+        if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+            return;
+
+        int error{0};
+        socklen_t len{sizeof(error)};
+        getsockopt(s, SOL_SOCKET, SO_ERROR, &error, &len);
+        connecting = false;
+        if (error != 0)
+        {
+            fprintf(stderr, "(Bluetooth Client) could not connect to %s\n", connected_address.c_str());
+            disconnect();
+            return;
+        }
+
+        connection_created = true;
+        fprintf(stderr, "(Bluetooth Client) connected to %s\n", connected_address.c_str());
+    }
+
+    if (events & (EPOLLERR | EPOLLHUP))
+    {
+        fprintf(stderr, "(Bluetooth Client) lost connection to %s\n", connected_address.c_str());
+        disconnect();
+        return;
+    }
+
+    flush();
+}
+
+/**
+ * flush: Internal function. Reactor thread. Write queued packets until the queue is empty or the socket is full.
+ * While the coalescing budget has not run out and the bundle is not full, waits on a reactor deadline instead.
+ */
+void PHMS_Bluetooth::Client::flush()
+{
+    while (true)
+    {
+        if (tx_count == 0)
+        {
+            size_t bytes;
+            {
+                std::lock_guard<std::mutex> lock(pkt_guard);
+                if (queued == 0)
+                    return;
+
+                // give other packets a chance to join this write, up to the latency budget
+                if (coalesce_bytes > 0 && latency_budget.count() > 0 && queued < BT_TX_QUEUE_SLOTS &&
+                    bt_bundle_size(queued_bytes, queued) < coalesce_bytes)
+                {
+                    auto deadline = first_queued + latency_budget;
+                    if (std::chrono::steady_clock::now() < deadline)
+                    {
+                        reactor->schedule(this, deadline);
+                        return;
+                    }
+                }
+
+                tx_count = take_batch(tx_batch, bytes);
+            }
+
+            if (!encode_batch(tx_batch, tx_count, bytes, tx_bundle, tx_out, tx_len))
+            {
+                release_batch(tx_batch, tx_count);
+                tx_count = 0;
+                continue;
+            }
+        }
+
+        ssize_t status = write_message(tx_out, tx_len, tx_done);
+        if (status < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            // keep the write, EPOLLOUT brings us back when the socket has room
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                stall_count.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+        }
+
+        write_count.fetch_add(1, std::memory_order_relaxed);
+        if (status < 0)
+            std::cerr << "An error occurred transmitting packet (CLIENT)" << std::endl;
+        else
+            sent_count.fetch_add(tx_count, std::memory_order_relaxed);
+
+        release_batch(tx_batch, tx_count);
+        tx_count = 0;
+        tx_done = 0;
+    }
+}
+
+/**
+ * write_message: Internal function. Write one message, framed with its length on stream transports.
+ * A non-blocking stream socket may take only part of a frame, done keeps track of how much
+ * so the next call writes the rest.
+ * @param out Message
+ * @param len Size of the message
+ * @param done Bytes of the frame written by earlier calls, advanced. 0 for a new message
+ * @returns len once the whole message is written, -1 on error (errno EAGAIN when the socket is full)
+ */
+ssize_t PHMS_Bluetooth::Client::write_message(const uint8_t *out, size_t len, size_t &done)
+{
+    if (!stream)
+        return send(s, out, len, MSG_NOSIGNAL);
+
+    uint8_t header[BT_FRAME_HEADER] = {(uint8_t)(len >> 8), (uint8_t)len};
+    while (done < BT_FRAME_HEADER + len)
+    {
+        struct iovec iov[2];
+        int n{0};
+        if (done < BT_FRAME_HEADER)
+        {
+            iov[n].iov_base = header + done;
+            iov[n++].iov_len = BT_FRAME_HEADER - done;
+        }
+        size_t offset = (done < BT_FRAME_HEADER) ? 0 : done - BT_FRAME_HEADER;
+        iov[n].iov_base = const_cast<uint8_t *>(out) + offset;
+        iov[n++].iov_len = len - offset;
+
+        struct msghdr msg{};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+        ssize_t written = sendmsg(s, &msg, MSG_NOSIGNAL);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        done += written;
+    }
+    return len;
+}
+
+/**
+ * disconnect: Internal function. Stop sending through the reactor. Reactor thread, or while it is stopped.
+ */
+void PHMS_Bluetooth::Client::disconnect()
+{
+    reactor->remove(s, this);
+    registered = false;
+    connecting = false;
+    connection_created = false;
+    release_batch(tx_batch, tx_count);
+    tx_count = 0;
+    tx_done = 0;
+}
+
 std::string PHMS_Bluetooth::Client::get_connected_address()
 {
     return connected_address;
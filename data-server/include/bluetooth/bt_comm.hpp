@@ -2,6 +2,7 @@
 
 #include <thread>
 
+#include "bt_reactor.hpp"
 #include "bt_server.hpp"
 #include "bt_client.hpp"
 
@@ -21,18 +22,35 @@ namespace PHMS_Bluetooth
         std::string get_client_connected_address() { return c.get_connected_address(); }
 
         int open_con(std::string addr, int tries);
+        int open_con(const std::string &local, const std::string &remote, int tries);
+        int attach(int rx_fd, int tx_fd);
         int close_con();
 
         void run();
+        int run_on(Reactor &r);
         void quit();
 
         // client functions
-        void push(const Packet &p) { c.push(p); }
-        void push(const void *src, size_t len) { c.push(src, len); }
+        bool push(Packet &&p) { return c.push(std::move(p)); }
+        bool push(const void *src, size_t len) { return c.push(src, len); }
+        void set_coalescing(size_t max_bytes, std::chrono::microseconds budget) { c.set_coalescing(max_bytes, budget); }
+        uint64_t dropped() const { return c.dropped(); }
+        uint64_t sent() const { return c.sent(); }
+        uint64_t writes() const { return c.writes(); }
+        uint64_t stalls() const { return c.stalls(); }
+        size_t queue_depth() { return c.queue_depth(); }
 
         // server functions
         size_t available() { return s.available(); }
+        bool wait_for(std::chrono::milliseconds timeout) { return s.wait_for(timeout); }
         std::vector<Packet> get_all() { return s.get_all(); }
+        template <typename FUNC>
+        size_t consume(FUNC f, size_t max = SIZE_MAX) { return s.consume(f, max); }
+        template <typename FUNC>
+        size_t consume_timed(FUNC f, size_t max = SIZE_MAX) { return s.consume_timed(f, max); }
+        uint64_t received() const { return s.received(); }
+        uint64_t overruns() const { return s.overruns(); }
+        uint64_t malformed() const { return s.malformed(); }
     };
 } // namespace PHMS_Bluetooth
 
@@ -43,19 +61,32 @@ namespace PHMS_Bluetooth
  * @returns 0 if successful two way connection was created.
  */
 int PHMS_Bluetooth::Communicator::open_con(std::string addr, int tries = 1)
+{
+    return open_con(BT_L2CAP_ANY, addr, tries);
+}
+
+/**
+ * open_con: Creates a two way connection over any transport, see Transport::from_address().
+ * The server side listens on local while the client side connects to the other device's listening address.
+ * @param local Address to accept the other device's connection on, ie: BT_L2CAP_ANY or "unix:@phms-receiver"
+ * @param remote Address of the other device, ie: a bluetooth address or "unix:@phms-sender"
+ * @param tries (optional) Number of times to attempt the connection until success. -1 to block until successful connection is created (or until integer underflow).
+ * @returns 0 if successful two way connection was created.
+ */
+int PHMS_Bluetooth::Communicator::open_con(const std::string &local, const std::string &remote, int tries = 1)
 {
 
     // open the server connection creation method in a temporary thread to accept a connection first
     // run tries amount of times, a timeout is implemented in s.open_con()
     int s_tries = tries;
     std::thread server_connect([&]() {
-        while (s.open_con() && s_tries--) {}
+        while (s.open_con(local) && s_tries--) {}
     });
 
     int con_status{1};
     do
     {
-        con_status = c.open_con(addr);
+        con_status = c.open_con(remote);
         if (con_status == 0)
             break;
 
@@ -68,12 +99,27 @@ int PHMS_Bluetooth::Communicator::open_con(std::string addr, int tries = 1)
 
     if (con_status != 0 || s.get_connected_address().empty())
     {
-        std::cerr << "(Bluetooth Communicator) an error occurred connecting to device at address " << addr << std::endl;
+        std::cerr << "(Bluetooth Communicator) an error occurred connecting to device at address " << remote << std::endl;
         return -1;
     }
     return 0;
 }
 
+/**
+ * attach: Use already connected sockets instead of bluetooth connections, ie: a socketpair in tests.
+ * @param rx_fd Socket to receive packets from
+ * @param tx_fd Socket to send packets to, -1 to only receive
+ * @returns 0 on success.
+ */
+int PHMS_Bluetooth::Communicator::attach(int rx_fd, int tx_fd = -1)
+{
+    if (s.attach(rx_fd) != 0)
+        return -1;
+    if (tx_fd >= 0 && c.attach(tx_fd) != 0)
+        return -1;
+    return 0;
+}
+
 /**
  * close_con: Closes existing bluetooth connections.
  * @return 0 on success.
@@ -93,6 +139,21 @@ void PHMS_Bluetooth::Communicator::run()
     client_thread = std::thread(&Client::run, &c);
 }
 
+/**
+ * run_on: Receive and send on a Reactor thread shared with other links instead of spawning threads.
+ * The reactor must outlive the Communicator and be stopped before it is closed or destroyed.
+ * @param r Reactor to run the link on
+ * @returns 0 on success.
+ */
+int PHMS_Bluetooth::Communicator::run_on(Reactor &r)
+{
+    if (s.run_on(r) != 0)
+        return -1;
+    if (c.connected() && c.run_on(r) != 0)
+        return -1;
+    return 0;
+}
+
 /**
  * quit: stop receiving and sending over Bluetooth. Join server and client threads
  */
@@ -101,6 +162,8 @@ void PHMS_Bluetooth::Communicator::quit()
     s.quit();
     c.quit();
 
-    server_thread.join();
-    client_thread.join();
+    if (server_thread.joinable())
+        server_thread.join();
+    if (client_thread.joinable())
+        client_thread.join();
 }
\ No newline at end of file
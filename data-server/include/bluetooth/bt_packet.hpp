@@ -3,101 +3,388 @@
 #include <chrono>
 #include <memory>
 #include <cstring>
+#include <cstdint>
+#include <cstdio>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+// largest packet in bytes, above the L2CAP MTU so any packet the link delivers fits
+#define MAX_PKT_SIZE 1024
+
+// packet buffers preallocated by the shared Packet_Pool
+#define BT_PACKET_POOL_SIZE 256
+
+// default L2CAP MTU of BlueZ, the most a Client bundles into one write
+#define BT_L2CAP_MTU 672
+
+// first byte of a packet holding several payloads, each one prefixed by its 2 byte big endian length.
+// Sample packets start with their source sensor (0-15) and pilot state packets with 0 or 1, so
+// payloads only start with the marker when a caller sends arbitrary data, and then are always bundled
+#define BT_BUNDLE_MARKER 0xFF
+#define BT_BUNDLE_ENTRY_HEADER 2
 
 namespace PHMS_Bluetooth
 {
+    /*
+    * Packet_Buffer: Fixed size storage for the contents of one packet
+    */
+    struct Packet_Buffer
+    {
+        uint8_t data[MAX_PKT_SIZE];
+    };
+
+    /*
+    * Packet_Pool: Preallocated packet buffers recycled through a free list so
+    * packets can be created, queued and dropped without new/delete. Buffers may
+    * be taken and returned from any thread. If every buffer is in use acquire()
+    * falls back to the heap and counts it, so heap_allocations() staying at zero
+    * shows the pool is sized correctly.
+    */
+    class Packet_Pool
+    {
+    private:
+        std::unique_ptr<Packet_Buffer[]> buffers;
+        size_t buffer_count{0};
+
+        std::vector<Packet_Buffer *> free_list;
+        std::mutex guard;
+
+        std::atomic<uint64_t> heap_allocation_count{0};
+
+        bool owns(const Packet_Buffer *b) const;
+
+    public:
+        Packet_Pool(size_t n = BT_PACKET_POOL_SIZE);
+
+        Packet_Buffer *acquire();
+        void release(Packet_Buffer *b);
+
+        size_t size() const;
+        size_t available();
+        uint64_t heap_allocations() const;
+
+        static Packet_Pool &shared();
+    };
+
     /*
     * Packet: Timestamped packet for arbitrary data
+    * The contents live in a buffer from the shared Packet_Pool. Packets can
+    * only be moved, so queueing and passing them around never copies the
+    * contents. Use clone() where a copy is really wanted.
     */
     class Packet
     {
     private:
         std::chrono::system_clock::time_point timestamp;
-        // size_t length{0};
-        // std::unique_ptr<uint8_t> data;
-        // uint8_t *data{nullptr};
-        std::vector<uint8_t> data;
-
-        Packet();
+        Packet_Buffer *buffer{nullptr};
+        size_t length{0};
 
     public:
+        Packet();
+        explicit Packet(size_t len);
         Packet(size_t len, const void *src);
-        Packet(const Packet &p);
+        Packet(const Packet &p) = delete;
         Packet(Packet &&p);
 
+        Packet &operator=(const Packet &p) = delete;
+        Packet &operator=(Packet &&p);
+
         ~Packet();
 
-        size_t size();
-        std::chrono::system_clock::time_point time();
-        const uint8_t *get();
+        size_t size() const;
+        bool empty() const;
+        std::chrono::system_clock::time_point time() const;
+        void set_time(std::chrono::system_clock::time_point t);
+        const uint8_t *get() const;
+        uint8_t *data();
+        void resize(size_t len);
+
+        Packet clone() const;
 
         void print();
     };
 } // namespace PHMS_Bluetooth
 
+/**
+ * bt_bundle_size: Bytes a bundle of payloads takes on the wire.
+ * @param payload_bytes Total size of the payloads
+ * @param count Number of payloads
+ */
+inline size_t bt_bundle_size(size_t payload_bytes, size_t count)
+{
+    return 1 + payload_bytes + count * BT_BUNDLE_ENTRY_HEADER;
+}
+
+/**
+ * bt_bundle_append: Append a payload to a bundle being built in dst.
+ * dst[0] must already hold BT_BUNDLE_MARKER and len must start at 1.
+ * @param dst Bundle buffer
+ * @param len Current size of the bundle, advanced past the new entry
+ * @param src Payload
+ * @param n Size of the payload, at most 65535 bytes
+ */
+inline void bt_bundle_append(uint8_t *dst, size_t &len, const uint8_t *src, size_t n)
+{
+    dst[len++] = (uint8_t)(n >> 8);
+    dst[len++] = (uint8_t)n;
+    memcpy(dst + len, src, n);
+    len += n;
+}
+
+/**
+ * bt_for_each_in_bundle: Call f(const uint8_t *payload, size_t len) for every payload in a bundle.
+ * @param data Packet starting with BT_BUNDLE_MARKER
+ * @param len Size of the packet
+ * @returns False if the bundle was cut short, the payloads before that were still passed to f
+ */
+template <typename FUNC>
+bool bt_for_each_in_bundle(const uint8_t *data, size_t len, FUNC f)
+{
+    size_t pos{1};
+    while (pos + BT_BUNDLE_ENTRY_HEADER <= len)
+    {
+        size_t n = ((size_t)data[pos] << 8) | data[pos + 1];
+        pos += BT_BUNDLE_ENTRY_HEADER;
+        if (pos + n > len)
+            return false;
+        f(data + pos, n);
+        pos += n;
+    }
+    return pos == len;
+}
+
+/**
+ * Packet_Pool: Allocate every buffer up front.
+ * @param n Number of buffers
+ */
+PHMS_Bluetooth::Packet_Pool::Packet_Pool(size_t n) : buffers(new Packet_Buffer[n]), buffer_count(n)
+{
+    free_list.reserve(n);
+    for (size_t i = 0; i < n; i++)
+        free_list.push_back(&buffers[i]);
+}
+
+/**
+ * acquire: Take an unused buffer. Falls back to the heap if the pool is exhausted.
+ * @returns Buffer to be handed back with release()
+ */
+PHMS_Bluetooth::Packet_Buffer *PHMS_Bluetooth::Packet_Pool::acquire()
+{
+    {
+        std::lock_guard<std::mutex> lock(guard);
+        if (!free_list.empty())
+        {
+            Packet_Buffer *b = free_list.back();
+            free_list.pop_back();
+            return b;
+        }
+    }
+
+    heap_allocation_count.fetch_add(1, std::memory_order_relaxed);
+    return new Packet_Buffer;
+}
+
+/**
+ * release: Return a buffer obtained from acquire().
+ * @param b Buffer to return
+ */
+void PHMS_Bluetooth::Packet_Pool::release(Packet_Buffer *b)
+{
+    if (b == nullptr)
+        return;
+
+    if (!owns(b))
+    {
+        delete b;
+        return;
+    }
+
+    // never reallocates, the free list was reserved for every buffer
+    std::lock_guard<std::mutex> lock(guard);
+    free_list.push_back(b);
+}
+
+/**
+ * owns: Internal function. Check if a buffer lives inside the pool.
+ */
+bool PHMS_Bluetooth::Packet_Pool::owns(const Packet_Buffer *b) const
+{
+    return b >= buffers.get() && b < buffers.get() + buffer_count;
+}
+
+/**
+ * size: Get the number of preallocated buffers.
+ */
+size_t PHMS_Bluetooth::Packet_Pool::size() const
+{
+    return buffer_count;
+}
+
+/**
+ * available: Get the number of unused buffers.
+ * @returns Buffers that can be acquired without touching the heap
+ */
+size_t PHMS_Bluetooth::Packet_Pool::available()
+{
+    std::lock_guard<std::mutex> lock(guard);
+    return free_list.size();
+}
+
+/**
+ * heap_allocations: Get the number of acquire() calls that had to use the heap.
+ * @returns Total heap allocations, zero in steady state
+ */
+uint64_t PHMS_Bluetooth::Packet_Pool::heap_allocations() const
+{
+    return heap_allocation_count.load(std::memory_order_relaxed);
+}
+
+/**
+ * shared: The pool every Packet takes its buffer from.
+ * Never destroyed, so packets held by static objects can still be released at exit.
+ */
+PHMS_Bluetooth::Packet_Pool &PHMS_Bluetooth::Packet_Pool::shared()
+{
+    static Packet_Pool *pool = new Packet_Pool();
+    return *pool;
+}
+
+/**
+ * Packet: Create an empty packet with no buffer.
+ */
 PHMS_Bluetooth::Packet::Packet()
 {
     timestamp = std::chrono::system_clock::now();
 }
 
 /**
- * Copy constructor
- * @param p: Bluetooth packet with data to be copied into current packet
+ * Packet: Create a packet to be filled in through data()
+ * @param len Size of the new packet in bytes, at most MAX_PKT_SIZE
  */
-PHMS_Bluetooth::Packet::Packet(const PHMS_Bluetooth::Packet &p)
+PHMS_Bluetooth::Packet::Packet(size_t len)
 {
-    timestamp = p.timestamp;
-    data = p.data;
+    timestamp = std::chrono::system_clock::now();
+    buffer = Packet_Pool::shared().acquire();
+    length = (len > MAX_PKT_SIZE) ? MAX_PKT_SIZE : len;
+}
+
+/**
+ * Packet: Create a packet
+ * @param len Size of the new packet in bytes, anything past MAX_PKT_SIZE is cut off
+ * @param src Location of the data to construct the packet from
+ */
+PHMS_Bluetooth::Packet::Packet(size_t len, const void *src) : Packet(len)
+{
+    memcpy(buffer->data, src, length);
 }
 
 /**
  * Move constructor
- * @param p: Bluetooth packet with data to be moved into current packet.
+ * @param p: Bluetooth packet with data to be moved into current packet. Left empty.
  */
 PHMS_Bluetooth::Packet::Packet(PHMS_Bluetooth::Packet &&p)
 {
     timestamp = p.timestamp;
-    data = std::move(p.data);
+    buffer = p.buffer;
+    length = p.length;
+    p.buffer = nullptr;
+    p.length = 0;
 }
 
 /**
- * Packet: Create a packet
- * @param len Size of the new packet in bytes
- * @param src Location of the data to construct the packet from
+ * Move assignment
+ * @param p: Bluetooth packet with data to be moved into current packet. Left empty.
  */
-PHMS_Bluetooth::Packet::Packet(size_t len, const void *src)
+PHMS_Bluetooth::Packet &PHMS_Bluetooth::Packet::operator=(PHMS_Bluetooth::Packet &&p)
 {
-    timestamp = std::chrono::system_clock::now();
-    data = std::vector<uint8_t>(reinterpret_cast<const uint8_t *>(src),reinterpret_cast<const uint8_t *>(src) + len);
+    if (this != &p)
+    {
+        Packet_Pool::shared().release(buffer);
+        timestamp = p.timestamp;
+        buffer = p.buffer;
+        length = p.length;
+        p.buffer = nullptr;
+        p.length = 0;
+    }
+    return *this;
 }
 
-// default destructor
+/**
+ * Destructor: Return the buffer to the pool
+ */
 PHMS_Bluetooth::Packet::~Packet()
 {
+    Packet_Pool::shared().release(buffer);
 }
 
 /**
  * size: Return the size in bytes of the packet.
  */
-size_t PHMS_Bluetooth::Packet::size()
+size_t PHMS_Bluetooth::Packet::size() const
 {
-    return data.size();
+    return length;
+}
+
+/**
+ * empty: Return true if the packet holds no data, ie: after it was moved from.
+ */
+bool PHMS_Bluetooth::Packet::empty() const
+{
+    return length == 0;
 }
 
 /**
  * time: Return the time the packet was recevied.
  */
-std::chrono::system_clock::time_point PHMS_Bluetooth::Packet::time()
+std::chrono::system_clock::time_point PHMS_Bluetooth::Packet::time() const
 {
     return timestamp;
 }
 
+/**
+ * set_time: Set the time the packet was received, ie: when it was read from the socket rather than copied.
+ */
+void PHMS_Bluetooth::Packet::set_time(std::chrono::system_clock::time_point t)
+{
+    timestamp = t;
+}
+
 /**
  * get: Return a pointer to the data held inside the packet.
  */
-const uint8_t *PHMS_Bluetooth::Packet::get()
+const uint8_t *PHMS_Bluetooth::Packet::get() const
 {
-    return &data.front();
+    return buffer ? buffer->data : nullptr;
+}
+
+/**
+ * data: Return a pointer to the data held inside the packet for writing.
+ */
+uint8_t *PHMS_Bluetooth::Packet::data()
+{
+    return buffer ? buffer->data : nullptr;
+}
+
+/**
+ * resize: Change the size of the packet, the first bytes are kept.
+ * @param len New size in bytes, at most MAX_PKT_SIZE
+ */
+void PHMS_Bluetooth::Packet::resize(size_t len)
+{
+    if (buffer == nullptr)
+        buffer = Packet_Pool::shared().acquire();
+    length = (len > MAX_PKT_SIZE) ? MAX_PKT_SIZE : len;
+}
+
+/**
+ * clone: Return a copy of the packet in a buffer of its own.
+ */
+PHMS_Bluetooth::Packet PHMS_Bluetooth::Packet::clone() const
+{
+    Packet ret(length, get());
+    ret.timestamp = timestamp;
+    return ret;
 }
 
 /**
@@ -105,9 +392,11 @@ const uint8_t *PHMS_Bluetooth::Packet::get()
  */
 void PHMS_Bluetooth::Packet::print()
 {
+    const uint8_t *data = get();
+
     printf("== PACKET ============================\n");
-    printf("= timestamp: %12u            =\n", timestamp.time_since_epoch());
-    printf("= length: %4i                       =\n", size());
+    printf("= timestamp: %12lld            =\n", (long long)timestamp.time_since_epoch().count());
+    printf("= length: %4zu                       =\n", size());
     printf("======================================");
     for (int i = 0; i < (size() / 8) + 1; i++)
     {
@@ -135,4 +424,4 @@ void PHMS_Bluetooth::Packet::print()
         printf(" =");
     }
     printf("\n======================================\n");
-}
\ No newline at end of file
+}
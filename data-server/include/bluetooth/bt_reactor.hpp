@@ -0,0 +1,472 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <atomic>
+#include <functional>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "./bt_transport.hpp"
+
+// events handed out by one epoll_wait call
+#define BT_REACTOR_MAX_EVENTS 64
+
+// passed to Reactor_Handler::on_event for Reactor::notify() and expired deadlines, next to the epoll flags
+#define BT_REACTOR_NOTIFY (1u << 30)
+#define BT_REACTOR_TIMER (1u << 29)
+
+namespace PHMS_Bluetooth
+{
+    class Reactor;
+
+    /*
+    * Reactor_Handler: Something a Reactor dispatches events to, ie: a Server or Client.
+    * on_event() always runs on the reactor thread.
+    */
+    class Reactor_Handler
+    {
+    private:
+        friend class Reactor;
+
+        std::atomic<bool> notify_pending{false};
+        bool timer_set{false};
+        std::chrono::steady_clock::time_point deadline;
+
+    public:
+        virtual ~Reactor_Handler() {}
+
+        /**
+         * on_event: Handle readiness of the handler's socket.
+         * @param events EPOLLIN, EPOLLOUT, EPOLLERR, EPOLLHUP, BT_REACTOR_NOTIFY or BT_REACTOR_TIMER
+         */
+        virtual void on_event(uint32_t events) = 0;
+    };
+
+    /*
+    * Reactor: One thread serving every bluetooth socket of the process.
+    * Sockets are registered non-blocking and edge-triggered, so handlers read
+    * and write until EAGAIN. Other threads hand work to a handler through
+    * notify(), which wakes the reactor through an eventfd, and handlers on the
+    * reactor thread can ask to be called back at a deadline.
+    */
+    class Reactor
+    {
+    private:
+        int epoll_fd{-1};
+        int wake_fd{-1};
+
+        std::atomic<bool> is_quit{false};
+
+        // handlers notify() was called for, reserved so notifying does not allocate
+        std::vector<Reactor_Handler *> notified;
+        std::mutex notify_guard;
+
+        // handlers with a deadline, reactor thread only
+        std::vector<Reactor_Handler *> timers;
+
+        std::atomic<uint64_t> wakeup_count{0};
+        std::atomic<uint64_t> event_count{0};
+
+        int next_timeout_ms();
+        void run_notified();
+        void run_timers();
+
+    public:
+        Reactor();
+        ~Reactor();
+
+        int add(int fd, Reactor_Handler *h, uint32_t events = EPOLLIN | EPOLLOUT);
+        int remove(int fd, Reactor_Handler *h);
+
+        void notify(Reactor_Handler *h);
+        void schedule(Reactor_Handler *h, std::chrono::steady_clock::time_point deadline);
+
+        void run();
+        void quit();
+
+        uint64_t wakeups() const { return wakeup_count.load(std::memory_order_relaxed); }
+        uint64_t events() const { return event_count.load(std::memory_order_relaxed); }
+    };
+
+    /*
+    * Listener: Accepts connections on a listening socket from the reactor thread.
+    * Every accepted socket is non-blocking and handed to on_accept, which owns it.
+    */
+    class Listener : public Reactor_Handler
+    {
+    private:
+        int s{-1};
+        Reactor *reactor{nullptr};
+        std::function<void(int fd, const std::string &addr)> on_accept;
+
+    public:
+        ~Listener();
+
+        int listen(Reactor &r, const Transport &t, std::function<void(int, const std::string &)> f);
+        int listen(Reactor &r, const std::string &local, std::function<void(int, const std::string &)> f);
+#ifndef PHMS_NO_BLUETOOTH
+        int listen_l2cap(Reactor &r, uint16_t psm, std::function<void(int, const std::string &)> f);
+#endif
+        int attach(Reactor &r, int fd, std::function<void(int, const std::string &)> f);
+        void close_con();
+
+        void on_event(uint32_t events) override;
+    };
+} // namespace PHMS_Bluetooth
+
+/**
+ * bt_set_nonblocking: Put a socket into non-blocking mode.
+ * @returns 0 on success.
+ */
+inline int bt_set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    return (flags < 0) ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/**
+ * Default constructor. Creates the epoll instance and the eventfd used to wake it.
+ */
+PHMS_Bluetooth::Reactor::Reactor()
+{
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    struct epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = nullptr;
+    if (epoll_fd < 0 || wake_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev) != 0)
+        std::cerr << "(Bluetooth Reactor) an error occurred creating the reactor" << std::endl;
+
+    notified.reserve(BT_REACTOR_MAX_EVENTS);
+    timers.reserve(BT_REACTOR_MAX_EVENTS);
+}
+
+/**
+ * Default destructor
+ */
+PHMS_Bluetooth::Reactor::~Reactor()
+{
+    close(wake_fd);
+    close(epoll_fd);
+}
+
+/**
+ * add: Watch a socket, edge-triggered. The socket is made non-blocking.
+ * @param fd Socket to watch
+ * @param h Handler called on the reactor thread when the socket is ready
+ * @param events EPOLLIN and/or EPOLLOUT
+ * @returns 0 on success.
+ */
+int PHMS_Bluetooth::Reactor::add(int fd, Reactor_Handler *h, uint32_t events)
+{
+    if (bt_set_nonblocking(fd) != 0)
+        return -1;
+
+    struct epoll_event ev{};
+    ev.events = events | EPOLLET | EPOLLRDHUP;
+    ev.data.ptr = h;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/**
+ * remove: Stop watching a socket and forget the handler's deadline.
+ * Call from the reactor thread, or while the reactor is not running.
+ * @returns 0 on success.
+ */
+int PHMS_Bluetooth::Reactor::remove(int fd, Reactor_Handler *h)
+{
+    for (size_t i = 0; i < timers.size(); i++)
+        if (timers[i] == h)
+        {
+            timers[i] = timers.back();
+            timers.pop_back();
+            break;
+        }
+    h->timer_set = false;
+
+    {
+        std::lock_guard<std::mutex> lock(notify_guard);
+        for (size_t i = 0; i < notified.size(); i++)
+            if (notified[i] == h)
+                notified[i] = nullptr;
+    }
+
+    return epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+/**
+ * notify: Have h->on_event(BT_REACTOR_NOTIFY) called on the reactor thread. Any thread.
+ * Repeated calls before the handler runs are merged into one.
+ */
+void PHMS_Bluetooth::Reactor::notify(Reactor_Handler *h)
+{
+    if (h->notify_pending.exchange(true))
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(notify_guard);
+        notified.push_back(h);
+    }
+
+    uint64_t one{1};
+    if (write(wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        std::cerr << "(Bluetooth Reactor) an error occurred waking the reactor" << std::endl;
+}
+
+/**
+ * schedule: Have h->on_event(BT_REACTOR_TIMER) called once the deadline passes. Reactor thread only.
+ * A handler has at most one deadline, the earlier one is kept.
+ */
+void PHMS_Bluetooth::Reactor::schedule(Reactor_Handler *h, std::chrono::steady_clock::time_point deadline)
+{
+    if (h->timer_set)
+    {
+        if (deadline < h->deadline)
+            h->deadline = deadline;
+        return;
+    }
+
+    h->timer_set = true;
+    h->deadline = deadline;
+    timers.push_back(h);
+}
+
+/**
+ * next_timeout_ms: Internal function. Milliseconds until the earliest deadline, -1 for none.
+ */
+int PHMS_Bluetooth::Reactor::next_timeout_ms()
+{
+    if (timers.empty())
+        return -1;
+
+    auto now = std::chrono::steady_clock::now();
+    auto earliest = timers[0]->deadline;
+    for (auto h : timers)
+        if (h->deadline < earliest)
+            earliest = h->deadline;
+
+    if (earliest <= now)
+        return 0;
+
+    // round up so the deadline has passed when epoll_wait returns
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(earliest - now).count();
+    return (int)((us + 999) / 1000);
+}
+
+/**
+ * run_notified: Internal function. Call every handler notify() was called for.
+ */
+void PHMS_Bluetooth::Reactor::run_notified()
+{
+    uint64_t count;
+    while (read(wake_fd, &count, sizeof(count)) > 0)
+    {
+    }
+
+    // handlers may notify themselves again while running, so take the list as it is now
+    size_t i{0};
+    while (true)
+    {
+        Reactor_Handler *h;
+        {
+            std::lock_guard<std::mutex> lock(notify_guard);
+            if (i == notified.size())
+            {
+                notified.clear();
+                return;
+            }
+            h = notified[i++];
+        }
+
+        if (h != nullptr)
+        {
+            h->notify_pending = false;
+            h->on_event(BT_REACTOR_NOTIFY);
+        }
+    }
+}
+
+/**
+ * run_timers: Internal function. Call every handler whose deadline passed.
+ */
+void PHMS_Bluetooth::Reactor::run_timers()
+{
+    auto now = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < timers.size();)
+    {
+        Reactor_Handler *h = timers[i];
+        if (h->deadline > now)
+        {
+            i++;
+            continue;
+        }
+
+        timers[i] = timers.back();
+        timers.pop_back();
+        h->timer_set = false;
+        h->on_event(BT_REACTOR_TIMER);
+    }
+}
+
+/**
+ * run: Thread entry point. Dispatches events until quit() is called.
+ */
+void PHMS_Bluetooth::Reactor::run()
+{
+    struct epoll_event events[BT_REACTOR_MAX_EVENTS];
+
+    while (is_quit == false)
+    {
+        int n = epoll_wait(epoll_fd, events, BT_REACTOR_MAX_EVENTS, next_timeout_ms());
+        wakeup_count.fetch_add(1, std::memory_order_relaxed);
+        if (n < 0 && errno != EINTR)
+        {
+            std::cerr << "(Bluetooth Reactor) an error occurred waiting for events" << std::endl;
+            break;
+        }
+
+        bool woken{false};
+        for (int i = 0; i < n; i++)
+        {
+            Reactor_Handler *h = static_cast<Reactor_Handler *>(events[i].data.ptr);
+            if (h == nullptr)
+            {
+                woken = true;
+                continue;
+            }
+
+            event_count.fetch_add(1, std::memory_order_relaxed);
+            h->on_event(events[i].events);
+        }
+
+        if (woken)
+            run_notified();
+        run_timers();
+    }
+}
+
+/**
+ * quit: Stops execution of the run() function. Any thread.
+ */
+void PHMS_Bluetooth::Reactor::quit()
+{
+    is_quit = true;
+    uint64_t one{1};
+    if (write(wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        std::cerr << "(Bluetooth Reactor) an error occurred waking the reactor" << std::endl;
+}
+
+/**
+ * Default destructor
+ */
+PHMS_Bluetooth::Listener::~Listener()
+{
+    close_con();
+}
+
+/**
+ * listen: Accept connections on a transport from the reactor thread.
+ * @param r Reactor to accept from
+ * @param t Transport to listen on
+ * @param f Called with every accepted socket and the address it came from
+ * @returns 0 on success.
+ */
+int PHMS_Bluetooth::Listener::listen(Reactor &r, const Transport &t, std::function<void(int, const std::string &)> f)
+{
+    int fd = t.open_listener(16);
+    if (fd < 0)
+        return -1;
+    return attach(r, fd, f);
+}
+
+/**
+ * listen: Accept connections on a transport address, see Transport::from_address().
+ * @param local Address to listen on, ie: BT_L2CAP_ANY or "unix:@phms-receiver"
+ * @returns 0 on success.
+ */
+int PHMS_Bluetooth::Listener::listen(Reactor &r, const std::string &local, std::function<void(int, const std::string &)> f)
+{
+    std::unique_ptr<Transport> t = Transport::from_address(local);
+    return (t == nullptr) ? -1 : listen(r, *t, f);
+}
+
+#ifndef PHMS_NO_BLUETOOTH
+/**
+ * listen_l2cap: Accept bluetooth connections on an L2CAP PSM from the reactor thread.
+ * @param r Reactor to accept from
+ * @param psm Protocol service multiplexer to listen on, ie: BT_L2CAP_PSM
+ * @param f Called with every accepted socket and the address it came from
+ * @returns 0 on success.
+ */
+int PHMS_Bluetooth::Listener::listen_l2cap(Reactor &r, uint16_t psm, std::function<void(int, const std::string &)> f)
+{
+    return listen(r, L2CAP_Transport("00:00:00:00:00:00", psm), f);
+}
+#endif
+
+/**
+ * attach: Accept connections on an already listening socket, ie: an AF_UNIX socket in tests.
+ * @param r Reactor to accept from
+ * @param fd Listening socket, closed by close_con()
+ * @param f Called with every accepted socket and the address it came from
+ * @returns 0 on success.
+ */
+int PHMS_Bluetooth::Listener::attach(Reactor &r, int fd, std::function<void(int, const std::string &)> f)
+{
+    if (s != -1 || fd < 0)
+        return -1;
+
+    s = fd;
+    reactor = &r;
+    on_accept = f;
+    return reactor->add(s, this, EPOLLIN);
+}
+
+/**
+ * close_con: Stop accepting connections. Call from the reactor thread or while it is not running.
+ */
+void PHMS_Bluetooth::Listener::close_con()
+{
+    if (s == -1)
+        return;
+
+    reactor->remove(s, this);
+    close(s);
+    s = -1;
+}
+
+/**
+ * on_event: Accept every pending connection.
+ */
+void PHMS_Bluetooth::Listener::on_event(uint32_t events)
+{
+    if (!(events & EPOLLIN))
+        return;
+
+    while (true)
+    {
+        struct sockaddr_storage addr;
+        socklen_t len = sizeof(addr);
+        int fd = accept4(s, (struct sockaddr *)&addr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                std::cerr << "(Bluetooth Listener) an error occurred accepting a connection" << std::endl;
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+
+        on_accept(fd, bt_peer_name(addr, fd));
+    }
+}
@@ -4,43 +4,100 @@
 #include <string>
 #include <vector>
 #include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <atomic>
+#include <memory>
+#include <cstdint>
+#include <cerrno>
 #include <unistd.h>
 
 #include <sys/socket.h>
-#include <bluetooth/bluetooth.h>
-#include <bluetooth/l2cap.h>
 
 #include "./bt_packet.hpp"
+#include "./bt_transport.hpp"
+#include "./bt_reactor.hpp"
 
-#define MAX_PKT_SIZE 1024
+// packets the receive ring holds before new packets are dropped, must be a power of two
+#define BT_RX_RING_SLOTS 64
+
+// bytes read at once from stream transports, room for several framed packets
+#define BT_STREAM_BUFFER (4 * (MAX_PKT_SIZE + BT_FRAME_HEADER))
 
 namespace PHMS_Bluetooth
 {
     /*
     * Server: Bluetooth server
     * Code adapted (stolen) from https://people.csail.mit.edu/albert/bluez-intro/x559.html
-    * Uses L2CAP sockets.
+    * Uses L2CAP sockets, or any other Transport.
+    * Received either by a run() thread of its own or, after run_on(), by
+    * a Reactor thread shared with other links.
     */
-    class Server
+    class Server : public Reactor_Handler
     {
+        static_assert((BT_RX_RING_SLOTS & (BT_RX_RING_SLOTS - 1)) == 0, "BT_RX_RING_SLOTS must be a power of two");
+
     private:
-        std::vector<Packet> pkt_buffer;
+        // one received packet, read straight into data by the run() thread
+        struct Rx_Slot
+        {
+            size_t len{0};
+            std::chrono::system_clock::time_point time;
+            uint8_t data[MAX_PKT_SIZE];
+        };
+
+        // single producer (run) single consumer ring, allocated once
+        std::unique_ptr<Rx_Slot[]> ring{new Rx_Slot[BT_RX_RING_SLOTS]};
+
+        // consumer owned
+        alignas(64) std::atomic<uint32_t> head{0};
+
+        // run() owned
+        alignas(64) std::atomic<uint32_t> tail{0};
+        std::atomic<uint64_t> received_count{0};
+        std::atomic<uint64_t> overrun_count{0};
+        std::atomic<uint64_t> malformed_count{0};
+
+        // only used when the consumer goes to sleep in wait_for()
+        alignas(64) std::atomic<bool> consumer_waiting{false};
         std::mutex pkt_guard;
+        std::condition_variable pkt_ready;
+
+        std::atomic<bool> is_quit{false};
+
+        // bundles are split from here, and packets that do not fit the ring are read into it
+        uint8_t scratch[MAX_PKT_SIZE];
+
+        // when the last read returned, every packet it held is stamped with it
+        std::chrono::system_clock::time_point rx_time;
+
+        // stream transports: bytes read but not yet delivered as whole packets
+        bool stream{false};
+        uint8_t stream_buffer[BT_STREAM_BUFFER];
+        size_t stream_len{0};
 
-        bool is_quit{false};
+        // set by run_on(), registered is reactor thread only
+        Reactor *reactor{nullptr};
+        bool registered{false};
 
-        bool connection_created{false};
+        void wake_consumer();
+        void store(const uint8_t *data, size_t len);
+        void deliver(const uint8_t *data, size_t len);
+        int receive_one();
+        int receive_stream();
+        void disconnect();
+
+        std::atomic<bool> connection_created{false};
 
         std::string connected_address;
 
         // bluetooth variables
 
-        struct sockaddr_l2 loc_addr = {0};
-        struct sockaddr_l2 rem_addr = {0};
-        int s{0};
+        struct sockaddr_storage rem_addr;
+        int s{-1};
         int client{-1};
         int bytes_read{0};
-        socklen_t opt{sizeof(sockaddr_l2)};
+        socklen_t opt{sizeof(rem_addr)};
 
         // end bluetooth variables
 
@@ -48,16 +105,35 @@ namespace PHMS_Bluetooth
         ~Server();
 
         int open_con();
+        int open_con(const std::string &local);
+        int open_con(const Transport &t);
+        int attach(int fd);
         int close_con();
 
         std::string get_connected_address();
+        bool connected() const { return connection_created; }
 
         size_t available();
+        bool wait_for(std::chrono::milliseconds timeout);
+
+        template <typename FUNC>
+        size_t consume(FUNC f, size_t max = SIZE_MAX);
+        template <typename FUNC>
+        size_t consume_timed(FUNC f, size_t max = SIZE_MAX);
+        const uint8_t *peek(size_t i, size_t &len);
+        void release(size_t n);
+
         std::vector<Packet> get_all();
 
+        uint64_t received() const { return received_count.load(std::memory_order_relaxed); }
+        uint64_t overruns() const { return overrun_count.load(std::memory_order_relaxed); }
+        uint64_t malformed() const { return malformed_count.load(std::memory_order_relaxed); }
+
         void quit();
 
         void run();
+        int run_on(Reactor &r);
+        void on_event(uint32_t events) override;
     };
 } // namespace PHMS_Bluetooth
 
@@ -71,28 +147,44 @@ PHMS_Bluetooth::Server::~Server()
 
 /**
  * open: Creates a bluetooth connection.
- * @param addr The bluetooth address of device to connect to.
+ * Accepts one connection on PSM BT_L2CAP_PSM of the first bluetooth adapter.
  * @returns 0 on success.
  */
 int PHMS_Bluetooth::Server::open_con()
 {
-    if (connection_created == true)
-        return -1;
-
-    // allocate socket
-    s = socket(AF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP);
+    return open_con(BT_L2CAP_ANY);
+}
 
-    // bind socket to port 0x1001 of the first available
-    // bluetooth adapter
-    bdaddr_t tmp = {{0, 0, 0, 0, 0, 0}};
-    loc_addr.l2_family = AF_BLUETOOTH;
-    loc_addr.l2_bdaddr = tmp;
-    loc_addr.l2_psm = htobs(0x1001);
+/**
+ * open: Accept a connection on a transport address, see Transport::from_address().
+ * @param local Address to listen on, ie: "unix:@phms-receiver" or "tcp:127.0.0.1:5000"
+ * @returns 0 on success.
+ */
+int PHMS_Bluetooth::Server::open_con(const std::string &local)
+{
+    std::unique_ptr<Transport> t = Transport::from_address(local);
+    if (t == nullptr)
+    {
+        std::cerr << "(Bluetooth Server) cannot listen on " << local << std::endl;
+        return -1;
+    }
+    return open_con(*t);
+}
 
-    bind(s, (struct sockaddr *)&loc_addr, sizeof(sockaddr_l2));
+/**
+ * open: Accept a connection on a transport. Waits up to 5 seconds.
+ * @param t Transport to listen on
+ * @returns 0 on success.
+ */
+int PHMS_Bluetooth::Server::open_con(const Transport &t)
+{
+    if (connection_created == true)
+        return -1;
 
-    // put socket into listening mode
-    listen(s, 1);
+    // allocate a socket listening on the transport's address
+    s = t.open_listener();
+    if (s < 0)
+        return -1;
 
     // timeout
     struct timeval tv;
@@ -104,30 +196,61 @@ int PHMS_Bluetooth::Server::open_con()
     FD_ZERO(&readfds);
     FD_SET(s, &readfds);
 
-    if(select(s + 1, &readfds, NULL, NULL, &tv) == 0)
+    // stop listening, so the next attempt can bind the address again
+    if (select(s + 1, &readfds, NULL, NULL, &tv) <= 0)
+    {
+        close(s);
+        s = -1;
         return -1;
-        
+    }
+
     // accept one connection
+    opt = sizeof(rem_addr);
     client = accept(s, (struct sockaddr *)&rem_addr, &opt);
     if (client != -1)
     {
         connection_created = true;
-        char buffer[256]{0};
-        ba2str(&rem_addr.l2_bdaddr, reinterpret_cast<char *>(buffer));
-        fprintf(stderr, "(Bluetooth Server) accepted connection from %s\n", buffer);
-        connected_address = buffer;
+        stream = bt_is_stream_socket(client);
+        stream_len = 0;
+        connected_address = bt_peer_name(rem_addr, client);
+        fprintf(stderr, "(Bluetooth Server) accepted connection from %s\n", connected_address.c_str());
     }
     return (client == -1) ? -1 : 0;
 }
 
+/**
+ * attach: Receive from an already connected socket instead of accepting a bluetooth connection.
+ * Message sockets (ie: SOCK_SEQPACKET, one end of a socketpair in tests) are read a packet at a time,
+ * stream sockets (ie: TCP) are read as framed messages.
+ * @param fd Connected socket, closed by close_con()
+ * @returns 0 on success.
+ */
+int PHMS_Bluetooth::Server::attach(int fd)
+{
+    if (connection_created == true || fd < 0)
+        return -1;
+
+    s = -1;
+    client = fd;
+    connection_created = true;
+    stream = bt_is_stream_socket(fd);
+    stream_len = 0;
+    connected_address = "fd:" + std::to_string(fd);
+    return 0;
+}
+
 /**
  * close: Closes existing bluetooth connection.
  * @return 0 on success.
  */
 int PHMS_Bluetooth::Server::close_con()
 {
+    if (registered)
+        disconnect();
     close(client);
     close(s);
+    client = -1;
+    s = -1;
     connection_created = false;
     connected_address.clear();
     return 0;
@@ -144,68 +267,360 @@ std::string PHMS_Bluetooth::Server::get_connected_address()
  */
 size_t PHMS_Bluetooth::Server::available()
 {
-    return pkt_buffer.size();
+    return tail.load(std::memory_order_acquire) - head.load(std::memory_order_relaxed);
 }
 
 /**
- * quit: Stops execution of the run() function.
+ * wait_for: Block until a packet is available, quit() is called or the timeout expires.
+ * @param timeout Longest time to wait
+ * @return True if packets are available.
+ */
+bool PHMS_Bluetooth::Server::wait_for(std::chrono::milliseconds timeout)
+{
+    if (available() > 0)
+        return true;
+
+    std::unique_lock<std::mutex> lock(pkt_guard);
+    consumer_waiting.store(true, std::memory_order_relaxed);
+
+    // pairs with the fence in wake_consumer() - either run() sees
+    // consumer_waiting or we see the new tail, never neither
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    pkt_ready.wait_for(lock, timeout, [this]() { return available() > 0 || is_quit; });
+    consumer_waiting.store(false, std::memory_order_relaxed);
+    return available() > 0;
+}
+
+/**
+ * wake_consumer: Internal function. Signal the consumer only if it is asleep in wait_for(),
+ * so a busy consumer costs the run() thread no system calls.
+ */
+void PHMS_Bluetooth::Server::wake_consumer()
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (consumer_waiting.load(std::memory_order_relaxed))
+    {
+        std::lock_guard<std::mutex> lock(pkt_guard);
+        pkt_ready.notify_one();
+    }
+}
+
+/**
+ * quit: Stops execution of the run() function and wakes up any thread in wait_for().
  */
 void PHMS_Bluetooth::Server::quit()
 {
-    is_quit = true;
+    {
+        std::lock_guard<std::mutex> lock(pkt_guard);
+        is_quit = true;
+    }
+    pkt_ready.notify_all();
 }
 
 /**
  * run: Thread entry point. Receives packets until quit() is called.
+ * Packets are read straight into the next free ring slot. When the ring is
+ * full the packet is read into a scratch buffer and dropped, and counted as
+ * an overrun. Bundles from a coalescing Client are split back into their
+ * packets, one slot each.
  */
 void PHMS_Bluetooth::Server::run()
 {
     if (connection_created == false)
         return;
 
-    uint8_t buffer[MAX_PKT_SIZE]{0};
-
     while (is_quit == false)
     {
-        memset(buffer, 0, MAX_PKT_SIZE);
-
         // used for a timeout - https://stackoverflow.com/questions/2917881/how-to-implement-a-timeout-in-read-function-call
         fd_set set;
         FD_ZERO(&set);        // clear the set
         FD_SET(client, &set); // add our file descriptor to the set
 
-        bytes_read = 0;
         struct timeval timeout;
         timeout.tv_sec = 0;
         timeout.tv_usec = 10000;
 
         int rv = select(client + 1, &set, NULL, NULL, &timeout);
 
-        // read data from the client, -1: error, 0: timeout
-        if (rv != -1 && rv != 0)
-            bytes_read = read(client, buffer, MAX_PKT_SIZE);
+        // -1: error, 0: timeout
+        if (rv == -1 || rv == 0)
+            continue;
+
+        // wake up the receiver
+        if (receive_one() > 0)
+            wake_consumer();
+    }
+}
+
+/**
+ * run_on: Receive on a Reactor thread instead of a thread of our own.
+ * The socket is made non-blocking and drained every time it becomes readable,
+ * so there is no polling timeout. The reactor must outlive the Server and be
+ * stopped before the Server is closed or destroyed.
+ * @param r Reactor to receive from
+ * @returns 0 on success.
+ */
+int PHMS_Bluetooth::Server::run_on(Reactor &r)
+{
+    if (connection_created == false || registered)
+        return -1;
+
+    reactor = &r;
+    registered = true;
+    return reactor->add(client, this, EPOLLIN);
+}
+
+/**
+ * on_event: Reactor thread. Read every waiting packet, then wake the consumer once.
+ * The link is dropped from the reactor when the other side hangs up.
+ */
+void PHMS_Bluetooth::Server::on_event(uint32_t events)
+{
+    if (!registered || !(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+        return;
+
+    bool got{false};
+    int n;
+    while (true)
+    {
+        n = receive_one();
+        if (n > 0)
+            got = true;
+        else if (!(n < 0 && errno == EINTR))
+            break;
+    }
+
+    if (got)
+        wake_consumer();
+
+    if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+    {
+        fprintf(stderr, "(Bluetooth Server) lost connection to %s\n", connected_address.c_str());
+        disconnect();
+    }
+}
+
+/**
+ * disconnect: Internal function. Stop receiving through the reactor. Reactor thread, or while it is stopped.
+ */
+void PHMS_Bluetooth::Server::disconnect()
+{
+    reactor->remove(client, this);
+    registered = false;
+    connection_created = false;
+}
+
+/**
+ * receive_one: Internal function. Read one packet from the socket into the ring.
+ * Bundles are split into one slot per packet. When the ring is full the packet
+ * is read into the scratch buffer and counted as an overrun.
+ * @returns Bytes read, 0 if the other side hung up, -1 on error (errno EAGAIN when nothing was waiting)
+ */
+int PHMS_Bluetooth::Server::receive_one()
+{
+    if (stream)
+        return receive_stream();
+
+    const uint32_t t = tail.load(std::memory_order_relaxed);
+    bool full = (t - head.load(std::memory_order_acquire)) == BT_RX_RING_SLOTS;
+    Rx_Slot &slot = ring[t & (BT_RX_RING_SLOTS - 1)];
+
+    uint8_t *dst = full ? scratch : slot.data;
+    bytes_read = read(client, dst, MAX_PKT_SIZE);
+    if (bytes_read <= 0)
+        return bytes_read;
+    rx_time = std::chrono::system_clock::now();
+
+    // several packets merged by a coalescing Client, each gets a slot of its own
+    if (dst[0] == BT_BUNDLE_MARKER)
+    {
+        if (dst != scratch)
+            memcpy(scratch, dst, bytes_read);
+        deliver(scratch, bytes_read);
+        return bytes_read;
+    }
+
+    if (full)
+    {
+        overrun_count.fetch_add(1, std::memory_order_relaxed);
+        return bytes_read;
+    }
+
+    slot.len = bytes_read;
+    slot.time = rx_time;
+    tail.store(t + 1, std::memory_order_release);
+    received_count.fetch_add(1, std::memory_order_relaxed);
+    return bytes_read;
+}
 
-        if (bytes_read > 0)
+/**
+ * receive_stream: Internal function. Read from a stream transport and deliver every whole framed packet.
+ * A partly received packet is kept for the next read. A frame longer than MAX_PKT_SIZE means the
+ * stream is out of step, it is counted as malformed and the buffered bytes are dropped.
+ * @returns Bytes read, 0 if the other side hung up, -1 on error (errno EAGAIN when nothing was waiting)
+ */
+int PHMS_Bluetooth::Server::receive_stream()
+{
+    bytes_read = read(client, stream_buffer + stream_len, BT_STREAM_BUFFER - stream_len);
+    if (bytes_read <= 0)
+        return bytes_read;
+    rx_time = std::chrono::system_clock::now();
+    stream_len += bytes_read;
+
+    size_t pos{0};
+    while (stream_len - pos >= BT_FRAME_HEADER)
+    {
+        size_t len = ((size_t)stream_buffer[pos] << 8) | stream_buffer[pos + 1];
+        if (len > MAX_PKT_SIZE)
         {
-            // printf("received [%s]\n", buffer);
-            pkt_guard.lock();
-            PHMS_Bluetooth::Packet p(bytes_read, buffer);
-            pkt_buffer.push_back(p);
-            pkt_guard.unlock();
+            malformed_count.fetch_add(1, std::memory_order_relaxed);
+            stream_len = 0;
+            return bytes_read;
         }
+        if (stream_len - pos < BT_FRAME_HEADER + len)
+            break;
+
+        deliver(stream_buffer + pos + BT_FRAME_HEADER, len);
+        pos += BT_FRAME_HEADER + len;
     }
+
+    memmove(stream_buffer, stream_buffer + pos, stream_len - pos);
+    stream_len -= pos;
+    return bytes_read;
 }
 
 /**
- * get_all: Get a vector containing all received packets.
- * Clears the packet buffer.
- * TODO: This is super inefficient. Gets the job done I guess.
+ * deliver: Internal function. Store a received packet, or every packet in a bundle.
+ */
+void PHMS_Bluetooth::Server::deliver(const uint8_t *data, size_t len)
+{
+    if (len > 0 && data[0] == BT_BUNDLE_MARKER)
+    {
+        if (!bt_for_each_in_bundle(data, len, [this](const uint8_t *p, size_t n) { store(p, n); }))
+            malformed_count.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    store(data, len);
+}
+
+/**
+ * store: Internal function. Copy a packet into the next free slot, or count an overrun if there is none.
+ * run() or reactor thread only.
+ */
+void PHMS_Bluetooth::Server::store(const uint8_t *data, size_t len)
+{
+    const uint32_t t = tail.load(std::memory_order_relaxed);
+    if ((t - head.load(std::memory_order_acquire)) == BT_RX_RING_SLOTS)
+    {
+        overrun_count.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    Rx_Slot &slot = ring[t & (BT_RX_RING_SLOTS - 1)];
+    memcpy(slot.data, data, len);
+    slot.len = len;
+    slot.time = rx_time;
+    tail.store(t + 1, std::memory_order_release);
+    received_count.fetch_add(1, std::memory_order_relaxed);
+}
+
+/**
+ * consume: Pass every available packet to f in place, then free their slots.
+ * Consumer thread only. f must not keep the pointer after it returns.
+ * @param f Called as f(const uint8_t *data, size_t len) once per packet, oldest first
+ * @param max Most packets to consume
+ * @returns Number of packets consumed
+ */
+template <typename FUNC>
+size_t PHMS_Bluetooth::Server::consume(FUNC f, size_t max)
+{
+    const uint32_t h = head.load(std::memory_order_relaxed);
+    size_t n = tail.load(std::memory_order_acquire) - h;
+    if (n > max)
+        n = max;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        const Rx_Slot &slot = ring[(h + i) & (BT_RX_RING_SLOTS - 1)];
+        f(static_cast<const uint8_t *>(slot.data), slot.len);
+    }
+
+    head.store(h + n, std::memory_order_release);
+    return n;
+}
+
+/**
+ * consume_timed: Like consume(), with the time each packet was read from the socket.
+ * Consumer thread only. f must not keep the pointer after it returns.
+ * @param f Called as f(const uint8_t *data, size_t len, std::chrono::system_clock::time_point received) once per packet, oldest first
+ * @param max Most packets to consume
+ * @returns Number of packets consumed
+ */
+template <typename FUNC>
+size_t PHMS_Bluetooth::Server::consume_timed(FUNC f, size_t max)
+{
+    const uint32_t h = head.load(std::memory_order_relaxed);
+    size_t n = tail.load(std::memory_order_acquire) - h;
+    if (n > max)
+        n = max;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        const Rx_Slot &slot = ring[(h + i) & (BT_RX_RING_SLOTS - 1)];
+        f(static_cast<const uint8_t *>(slot.data), slot.len, slot.time);
+    }
+
+    head.store(h + n, std::memory_order_release);
+    return n;
+}
+
+/**
+ * peek: Look at an available packet without copying it. Consumer thread only.
+ * The data stays valid until the packet is released.
+ * @param i Index of the packet, 0 is the oldest
+ * @param len Set to the size of the packet
+ * @returns Pointer to the packet data, nullptr if fewer than i + 1 packets are available
+ */
+const uint8_t *PHMS_Bluetooth::Server::peek(size_t i, size_t &len)
+{
+    if (i >= available())
+        return nullptr;
+
+    const Rx_Slot &slot = ring[(head.load(std::memory_order_relaxed) + i) & (BT_RX_RING_SLOTS - 1)];
+    len = slot.len;
+    return slot.data;
+}
+
+/**
+ * release: Free the oldest n packets after they were read with peek(). Consumer thread only.
+ * @param n Number of packets to free, at most available()
+ */
+void PHMS_Bluetooth::Server::release(size_t n)
+{
+    size_t a = available();
+    head.fetch_add((n > a) ? a : n, std::memory_order_release);
+}
+
+/**
+ * get_all: Get a vector containing copies of all received packets.
+ * Each packet's time() is when it was read from the socket.
+ * Frees their slots. consume() reads the packets without copying them.
  */
 std::vector<PHMS_Bluetooth::Packet> PHMS_Bluetooth::Server::get_all()
 {
-    pkt_guard.lock();
-    std::vector<Packet> ret = pkt_buffer;
-    pkt_buffer.clear();
-    pkt_guard.unlock();
+    std::vector<Packet> ret;
+    ret.reserve(available());
+
+    const uint32_t h = head.load(std::memory_order_relaxed);
+    size_t n = tail.load(std::memory_order_acquire) - h;
+    for (size_t i = 0; i < n; i++)
+    {
+        const Rx_Slot &slot = ring[(h + i) & (BT_RX_RING_SLOTS - 1)];
+        ret.emplace_back(slot.len, slot.data);
+        ret.back().set_time(slot.time);
+    }
+
+    head.store(h + n, std::memory_order_release);
     return ret;
-}
\ No newline at end of file
+}
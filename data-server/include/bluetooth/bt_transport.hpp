@@ -0,0 +1,311 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <memory>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+// define PHMS_NO_BLUETOOTH to build without BlueZ, only the unix: and tcp: transports are left
+#ifndef PHMS_NO_BLUETOOTH
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/l2cap.h>
+#endif
+
+// L2CAP protocol service multiplexer the sensor box and the server talk on
+#define BT_L2CAP_PSM 0x1001
+
+// listening address of the first bluetooth adapter
+#define BT_L2CAP_ANY "l2cap:00:00:00:00:00:00"
+
+// length prefixed to every message on stream transports (TCP), 2 bytes big endian
+#define BT_FRAME_HEADER 2
+
+namespace PHMS_Bluetooth
+{
+    /*
+    * Transport: The kind of socket a link runs over.
+    * Every transport delivers whole messages: L2CAP and AF_UNIX SOCK_SEQPACKET
+    * keep message boundaries themselves, on TCP the Server and Client frame
+    * every message with its BT_FRAME_HEADER byte length. Transports are named
+    * by address strings, see from_address().
+    */
+    class Transport
+    {
+    public:
+        virtual ~Transport() {}
+
+        virtual int open_socket() const = 0;
+        virtual socklen_t get_address(struct sockaddr_storage &addr) const = 0;
+        virtual std::string name() const = 0;
+
+        int open_listener(int backlog = 1) const;
+        int open_connection() const;
+
+        static std::unique_ptr<Transport> from_address(const std::string &addr);
+
+    protected:
+        virtual void prepare_listener(int fd) const {}
+    };
+
+#ifndef PHMS_NO_BLUETOOTH
+    /*
+    * L2CAP_Transport: Bluetooth L2CAP sequenced packets, the transport used by the sensor box.
+    */
+    class L2CAP_Transport : public Transport
+    {
+    private:
+        std::string address;
+        uint16_t psm;
+
+    public:
+        L2CAP_Transport(const std::string &addr, uint16_t psm = BT_L2CAP_PSM) : address(addr), psm(psm) {}
+
+        int open_socket() const override;
+        socklen_t get_address(struct sockaddr_storage &addr) const override;
+        std::string name() const override { return "l2cap:" + address; }
+    };
+#endif
+
+    /*
+    * Unix_Transport: AF_UNIX sequenced packets, for running both ends on one machine.
+    * A path starting with '@' is in the abstract namespace and leaves no file behind.
+    */
+    class Unix_Transport : public Transport
+    {
+    private:
+        std::string path;
+
+    protected:
+        void prepare_listener(int fd) const override;
+
+    public:
+        Unix_Transport(const std::string &path) : path(path) {}
+
+        int open_socket() const override;
+        socklen_t get_address(struct sockaddr_storage &addr) const override;
+        std::string name() const override { return "unix:" + path; }
+    };
+
+    /*
+    * TCP_Transport: IPv4 TCP with Nagle turned off, messages are framed by the Server and Client.
+    */
+    class TCP_Transport : public Transport
+    {
+    private:
+        std::string host;
+        uint16_t port;
+
+    protected:
+        void prepare_listener(int fd) const override;
+
+    public:
+        TCP_Transport(const std::string &host, uint16_t port) : host(host), port(port) {}
+
+        int open_socket() const override;
+        socklen_t get_address(struct sockaddr_storage &addr) const override;
+        std::string name() const override { return "tcp:" + host + ":" + std::to_string(port); }
+    };
+} // namespace PHMS_Bluetooth
+
+/**
+ * bt_is_stream_socket: Check if a socket is a byte stream whose messages need framing.
+ */
+inline bool bt_is_stream_socket(int fd)
+{
+    int type{0};
+    socklen_t len{sizeof(type)};
+    return getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) == 0 && type == SOCK_STREAM;
+}
+
+/**
+ * bt_peer_name: Describe the other end of an accepted connection.
+ * @param addr Address returned by accept()
+ * @param fd Accepted socket
+ * @returns The bluetooth address, tcp:ip:port, or fd:<fd> for unix sockets
+ */
+inline std::string bt_peer_name(const struct sockaddr_storage &addr, int fd)
+{
+#ifndef PHMS_NO_BLUETOOTH
+    if (addr.ss_family == AF_BLUETOOTH)
+    {
+        char buffer[19]{0};
+        ba2str(&reinterpret_cast<const struct sockaddr_l2 *>(&addr)->l2_bdaddr, buffer);
+        return buffer;
+    }
+#endif
+    if (addr.ss_family == AF_INET)
+    {
+        const struct sockaddr_in *in = reinterpret_cast<const struct sockaddr_in *>(&addr);
+        char buffer[INET_ADDRSTRLEN]{0};
+        inet_ntop(AF_INET, &in->sin_addr, buffer, sizeof(buffer));
+        return std::string("tcp:") + buffer + ":" + std::to_string(ntohs(in->sin_port));
+    }
+    return "fd:" + std::to_string(fd);
+}
+
+/**
+ * open_listener: Create a socket listening on the transport's address.
+ * @param backlog Connections that may wait to be accepted
+ * @returns The listening socket, -1 on error.
+ */
+int PHMS_Bluetooth::Transport::open_listener(int backlog) const
+{
+    int fd = open_socket();
+    if (fd < 0)
+        return -1;
+
+    prepare_listener(fd);
+
+    struct sockaddr_storage addr;
+    socklen_t len = get_address(addr);
+    if (len == 0 || bind(fd, (struct sockaddr *)&addr, len) != 0 || listen(fd, backlog) != 0)
+    {
+        std::cerr << "(Bluetooth Transport) an error occurred listening on " << name() << std::endl;
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * open_connection: Create a socket connected to the transport's address. Blocks until connected.
+ * @returns The connected socket, -1 on error.
+ */
+int PHMS_Bluetooth::Transport::open_connection() const
+{
+    int fd = open_socket();
+    if (fd < 0)
+        return -1;
+
+    struct sockaddr_storage addr;
+    socklen_t len = get_address(addr);
+    if (len == 0 || connect(fd, (struct sockaddr *)&addr, len) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * from_address: Create the transport an address string names.
+ * @param addr One of
+ *   "AA:BB:CC:DD:EE:FF" or "l2cap:AA:BB:CC:DD:EE:FF" - bluetooth device, PSM BT_L2CAP_PSM
+ *   "unix:/path/to/socket" or "unix:@name"           - AF_UNIX SOCK_SEQPACKET
+ *   "tcp:127.0.0.1:5000" or "tcp:localhost:5000"      - TCP over IPv4
+ * @returns The transport, nullptr if the address is not understood
+ */
+std::unique_ptr<PHMS_Bluetooth::Transport> PHMS_Bluetooth::Transport::from_address(const std::string &addr)
+{
+    if (addr.compare(0, 5, "unix:") == 0 && addr.size() > 5)
+        return std::unique_ptr<Transport>(new Unix_Transport(addr.substr(5)));
+
+    if (addr.compare(0, 4, "tcp:") == 0)
+    {
+        size_t colon = addr.rfind(':');
+        int port = atoi(addr.c_str() + colon + 1);
+        if (colon <= 4 || port <= 0 || port > 65535)
+            return nullptr;
+        return std::unique_ptr<Transport>(new TCP_Transport(addr.substr(4, colon - 4), port));
+    }
+
+    std::string device = (addr.compare(0, 6, "l2cap:") == 0) ? addr.substr(6) : addr;
+    if (device.size() != 17)
+        return nullptr;
+
+#ifndef PHMS_NO_BLUETOOTH
+    return std::unique_ptr<Transport>(new L2CAP_Transport(device));
+#else
+    std::cerr << "(Bluetooth Transport) built with PHMS_NO_BLUETOOTH, cannot use " << addr << std::endl;
+    return nullptr;
+#endif
+}
+
+#ifndef PHMS_NO_BLUETOOTH
+int PHMS_Bluetooth::L2CAP_Transport::open_socket() const
+{
+    return socket(AF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP);
+}
+
+socklen_t PHMS_Bluetooth::L2CAP_Transport::get_address(struct sockaddr_storage &addr) const
+{
+    memset(&addr, 0, sizeof(addr));
+    struct sockaddr_l2 *l2 = reinterpret_cast<struct sockaddr_l2 *>(&addr);
+    l2->l2_family = AF_BLUETOOTH;
+    l2->l2_psm = htobs(psm);
+    str2ba(address.c_str(), &l2->l2_bdaddr);
+    return sizeof(struct sockaddr_l2);
+}
+#endif
+
+int PHMS_Bluetooth::Unix_Transport::open_socket() const
+{
+    return socket(AF_UNIX, SOCK_SEQPACKET, 0);
+}
+
+socklen_t PHMS_Bluetooth::Unix_Transport::get_address(struct sockaddr_storage &addr) const
+{
+    memset(&addr, 0, sizeof(addr));
+    struct sockaddr_un *un = reinterpret_cast<struct sockaddr_un *>(&addr);
+    if (path.empty() || path.size() >= sizeof(un->sun_path))
+        return 0;
+
+    un->sun_family = AF_UNIX;
+    memcpy(un->sun_path, path.data(), path.size());
+
+    // abstract names are not nul terminated, their length is all there is
+    if (path[0] == '@')
+    {
+        un->sun_path[0] = '\0';
+        return offsetof(struct sockaddr_un, sun_path) + path.size();
+    }
+    return sizeof(struct sockaddr_un);
+}
+
+/**
+ * prepare_listener: Remove a socket file left behind by an earlier run.
+ */
+void PHMS_Bluetooth::Unix_Transport::prepare_listener(int fd) const
+{
+    if (!path.empty() && path[0] != '@')
+        unlink(path.c_str());
+}
+
+int PHMS_Bluetooth::TCP_Transport::open_socket() const
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one{1};
+    if (fd >= 0)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+socklen_t PHMS_Bluetooth::TCP_Transport::get_address(struct sockaddr_storage &addr) const
+{
+    memset(&addr, 0, sizeof(addr));
+    struct sockaddr_in *in = reinterpret_cast<struct sockaddr_in *>(&addr);
+    in->sin_family = AF_INET;
+    in->sin_port = htons(port);
+    if (inet_pton(AF_INET, (host == "localhost") ? "127.0.0.1" : host.c_str(), &in->sin_addr) != 1)
+        return 0;
+    return sizeof(struct sockaddr_in);
+}
+
+/**
+ * prepare_listener: Allow listening again straight after an earlier run.
+ */
+void PHMS_Bluetooth::TCP_Transport::prepare_listener(int fd) const
+{
+    int one{1};
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+}
@@ -28,7 +28,7 @@ int main(int argc, char *argv[])
     {
         std::getline(std::cin, in);
         PHMS_Bluetooth::Packet p(in.length(), in.c_str());
-        c.push(p);
+        c.push(std::move(p));
     }
 
     c.quit();
@@ -1,31 +1,77 @@
 #pragma once
 
+#include <atomic>
 #include <iostream>
+#include <mutex>
 #include <thread>
 
 #include "../include/bluetooth/bluetooth_con.hpp"
 #include "datasource.hpp"
 #include "../include/bluetooth_utils.hpp"
+#include "spo2_estimator.hpp"
+#include "heart_rate_detector.hpp"
+#include "sensor_validator.hpp"
+#include "sensor_fusion.hpp"
+#include "sequence_tracker.hpp"
+#include "clock_sync.hpp"
 
 #define MITIGATE_SENSOR_MALFUNCTION 1
 
+// longest time the receive thread sleeps without checking whether it should quit
+#define RECEIVE_WAIT_MS 100
+
+// time requests go out this often until the sensor box's clock is known, then every CLOCK_SYNC_INTERVAL_MS
+#define CLOCK_SYNC_FAST_INTERVAL_MS 100
+#define CLOCK_SYNC_INTERVAL_MS 1000
+
 class BluetoothReceiver : public Datasource
 {
 private:
-	bool quit_receive_thread{false};
+	std::atomic<bool> quit_receive_thread{false};
 	int received_samples{0};
 
+	// sends and receives on one thread, declared first so it outlives the link
+	PHMS_Bluetooth::Reactor reactor;
+	std::thread reactor_thread;
 	PHMS_Bluetooth::Communicator c;
 	std::string bluetooth_address;
+	std::string listen_address{BT_L2CAP_ANY};
 
 	std::thread callback_thread;
 
 	bool connection_initialized{false};
 
+	// protocol version the sensor box said it sends, version 1 until it answers our hello
+	std::atomic<uint8_t> protocol_version{BT_PROTOCOL_V1};
+
+	// time between the sensor box's samples, from its hello ack
+	std::atomic<uint32_t> sample_period_us{BT_SAMPLE_PERIOD_US};
+
 	void run_receive();
 
 	int pilot_state{0};
 
+	// one SpO2 estimate per sensor source
+	SpO2_Estimator spo2_estimators[16];
+
+	// one heart rate detector per sensor source, guarded so beat intervals can be read from other threads
+	Heart_Rate_Detector heart_rate_detectors[16];
+	std::mutex heart_rate_guard;
+
+	// one sequence tracker per sensor source for version 2 packets, guarded so stats can be read from other threads
+	Sequence_Tracker sequence_trackers[16];
+	std::mutex sequence_guard;
+
+	// the sensor box's clock against ours, from version 2 time requests, guarded so stats can be read from other threads
+	Clock_Sync clock_sync;
+	std::mutex clock_guard;
+
+	// one validator per sensor source and the stage fusing their samples,
+	// guarded so stats can be read and settings changed from other threads
+	Sensor_Validator validators[16];
+	Sensor_Fusion fusion;
+	std::mutex validation_guard;
+
 public:
 	BluetoothReceiver();
 	~BluetoothReceiver();
@@ -35,6 +81,27 @@ public:
 	void send_pilot_state(uint8_t state);
 
 	void set_bt_address(const std::string &s);
+	void set_listen_address(const std::string &s);
+
+	void set_validation_config(const Validation_Config &config);
+	Validation_Stats get_validation_stats(int sensor);
+	void print_validation_stats();
+
+	void set_fusion_config(const Fusion_Config &config);
+	Fusion_Stats get_fusion_stats();
+
+	uint8_t get_protocol_version();
+	uint32_t get_sample_period_us();
+
+	Sequence_Stats get_sequence_stats(int sensor);
+	Sequence_Stats get_link_stats();
+	void print_link_stats();
+
+	Clock_Sync_Stats get_clock_stats();
+
+	uint16_t get_heart_rate(int sensor);
+	size_t get_beat_intervals(int sensor, uint16_t *dst, size_t max);
+	int get_heart_rate_sensor();
 };
 
 void BluetoothReceiver::run_receive()
@@ -46,157 +113,205 @@ void BluetoothReceiver::run_receive()
 		exit(1);
 	}
 
-	int samples_before_analysis{100};
-	int errors[16]{0};
 	bool sensor_seen[16]{false, false, false, false, false, false, false, false, false, false, false, false, false, false, false, false};
-	bool sensor_valid[16] = {true, true, true, true, true, true, true, true, true, true, true, true, true, true, true, true};
-	int error_threshold{500};
-	int active_sensor{0};
+	bool any_valid{true};
 
-	while (!quit_receive_thread)
-	{
-		if (c.available())
-		{
-			// grab all available bluetooth packets
-			std::vector<PHMS_Bluetooth::Packet> v = c.get_all();
-			received_samples += v.size();
+	// every packet is decoded into this buffer, nothing is allocated per packet
+	Sample samples[BT_MAX_SAMPLES_PER_PACKET];
+	uint8_t flags[BT_MAX_SAMPLES_PER_PACKET];
+	Sample fused[FUSION_WINDOW];
 
-			long time = (long)std::chrono::time_point_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now()).time_since_epoch().count();
+	auto next_time_request = std::chrono::steady_clock::now();
 
-			// for each bluetooth packet received, get the samples
-			// keep track of errors at each sensor
+	// newest sequence number received from each sensor in this batch, acked after it
+	uint16_t ack_sequence[16];
+	bool ack_pending[16]{};
 
-			for (auto i : v)
+	while (!quit_receive_thread)
+	{
+		// measure the sensor box's clock, only senders of version 2 know the time messages
+		if (protocol_version >= BT_PROTOCOL_V2 && std::chrono::steady_clock::now() >= next_time_request)
+		{
+			bool synced;
 			{
-				auto smp = sample_buffer_from_bt_packet(i);
-				std::vector<Sample> samples = smp.samples;
-				int source = smp.src;
+				std::lock_guard<std::mutex> lock(clock_guard);
+				synced = clock_sync.synced();
+			}
+			uint8_t request[BT_TIME_REQUEST_SIZE];
+			c.push(request, bt_time_request(bt_time_us(std::chrono::system_clock::now()), request));
+			next_time_request = std::chrono::steady_clock::now() + std::chrono::milliseconds(synced ? CLOCK_SYNC_INTERVAL_MS : CLOCK_SYNC_FAST_INTERVAL_MS);
+		}
 
-				if (!sensor_seen[source])
-				{
-					std::cout << "New connected sensor: " << source << std::endl;
-					sensor_seen[source] = true;
-				}
+		// sleep until the server thread signals that packets arrived
+		if (c.wait_for(std::chrono::milliseconds(RECEIVE_WAIT_MS)))
+		{
+			unsigned long time{0};
 
-// quickly disable error checking
-#ifdef MITIGATE_SENSOR_MALFUNCTION
-				// mitigate sensor malfunction
+			// for each bluetooth packet received, get the samples straight from the server's
+			// receive ring, keep track of errors at each sensor
+			received_samples += c.consume_timed([&](const uint8_t *data, size_t len, std::chrono::system_clock::time_point received) {
+				time = bt_time_us(received) / 1000;
 
-				for (auto s : samples)
+				// the sensor box answering our hello or time request, not samples
+				if (bt_is_control_message(data, len))
 				{
-					bool er{false};
-					if (samples_before_analysis == 0)
+					uint64_t t1, t2, t3;
+					uint8_t version;
+					uint16_t rate;
+					if (bt_parse_hello_ack(data, len, version, rate))
 					{
-						// do error checking calculions - if a sample is outside of normal range, increment error count and move on
-						// ranges are based on calculations on recorded data
-						if (s.spo2 > 14200 || s.spo2 < 13700)
-						{
-							// std::cout << "spo2 error was found in sensor " << source << " total errors from this sensor: " << errors[source] << std::endl;
-							errors[source] += 1;
-							er = true;
-						}
-						if (s.irLED > 14400 || s.irLED < 13660)
+						// sample times and fusion slots count in the box's sample period. Its sample times are whole
+						// ms, at rates above 1000 Hz a packet's start is only known to within a ms worth of samples
+						uint32_t period = std::max(1, 1000000 / rate);
+						sample_period_us = period;
 						{
-							// std::cout << "irled error was found in sensor " << source << " total errors from this sensor: " << errors[source] << std::endl;
-							errors[source] += 1;
-							er = true;
-						}
-						if (s.redLED > 14400 || s.redLED < 13660)
-						{
-							// std::cout << "redled error was found in sensor " << source << " total errors from this sensor: " << errors[source] << std::endl;
-							errors[source] += 1;
-							er = true;
+							std::lock_guard<std::mutex> lock(validation_guard);
+							Fusion_Config cfg = fusion.get_config();
+							cfg.index_slack = std::max((uint32_t)FUSION_INDEX_SLACK, (1000 + period - 1) / period);
+							fusion.configure(cfg);
 						}
+						protocol_version = version;
+						std::cout << "sensor box sends protocol version " << (int)version << " at " << rate << " Hz" << std::endl;
+						if (rate != BT_SAMPLE_RATE)
+							std::cout << "heart rate and SpO2 estimates are tuned for " << BT_SAMPLE_RATE << " Hz and will be off" << std::endl;
 					}
-					else
+					else if (bt_parse_time_response(data, len, t1, t2, t3))
 					{
-						// std::cout << "sba: " << samples_before_analysis << std::endl;
-						samples_before_analysis--;
+						std::lock_guard<std::mutex> lock(clock_guard);
+						clock_sync.add(t1, t2, t3, bt_time_us(received));
 					}
+					return;
+				}
 
-					// slowly roll back erroring sensors
-					if (errors[source] >= 10 && !er)
-						errors[source] -= 10;
+				Sample_Packet_Header header;
+				size_t sample_count = decode_bt_packet(data, len, samples, BT_MAX_SAMPLES_PER_PACKET, header);
+				int source = header.sensor & 0x0f;
 
-					// std::cout << "errors at " << source << " " << errors[source] << std::endl;
+				// version 2 packets are numbered per sensor, account for the ones lost on the way and drop the ones that arrived twice
+				if (header.version >= BT_PROTOCOL_V2)
+				{
+					std::lock_guard<std::mutex> lock(sequence_guard);
+					Sequence_Result r = sequence_trackers[source].track(header.sequence);
+					if (r == SEQ_DUPLICATE)
+						return;
+					if (r == SEQ_NEW || r == SEQ_RESYNC)
+					{
+						ack_sequence[source] = header.sequence;
+						ack_pending[source] = true;
+					}
+				}
 
-					// if a sensor is past the error threshold do not consider its samples
+				// every sample's time on our clock: from the sensor box's clock once it is known, else
+				// counted back from when the packet arrived, the newest sample taken just before
+				uint32_t period = sample_period_us;
+				{
+					std::lock_guard<std::mutex> lock(clock_guard);
+					bool remote = header.version >= BT_PROTOCOL_V2 && clock_sync.synced();
+					for (size_t i = 0; i < sample_count; i++)
+						samples[i].timestamp = remote
+												   ? clock_sync.to_local(header.base_timestamp * 1000 + i * period) / 1000
+												   : time - (sample_count - 1 - i) * period / 1000;
+				}
 
-					// reassign active sensor if errors are detected
-					if (!sensor_valid[active_sensor])
-					{
-						bool found{false};
-						for (int i = 0; i < 16; i++)
-						{
-							if (sensor_seen[i] && sensor_valid[i])
-							{
-								found = true;
-								active_sensor = i;
-								break;
-							}
-						}
+				if (!sensor_seen[source])
+				{
+					std::cout << "New connected sensor: " << source << std::endl;
+					sensor_seen[source] = true;
+				}
 
-						if (!found)
-						{
-							std::cerr << "No valid sensors attached (fatal)\n";
-							exit(1);
-						}
-						else
-						{
-							std::cout << "responding to invalid sensor: new primary sensor is " << active_sensor << std::endl;
-						}
-					}
+				// calculate spo2 for each sample from irled and redled. Every sensor's
+				// estimator sees all of its samples, even while the sensor is invalid
+				spo2_estimators[source].process(samples, sample_count);
 
-					if (errors[source] > error_threshold && sensor_valid[source])
-					{
-						std::cout << "sensor " << source << " errored out\n";
-						sensor_valid[source] = false;
-						continue;
-					}
+				// detect beats in the IR signal, the sensor box's bpm is kept while there is no heart rate the detector trusts
+				{
+					std::lock_guard<std::mutex> lock(heart_rate_guard);
+					heart_rate_detectors[source].process(samples, sample_count);
+				}
 
-					if (source != active_sensor)
-						continue;
+// quickly disable error checking
+#ifdef MITIGATE_SENSOR_MALFUNCTION
+				// mitigate sensor malfunction: score the packet against the sensor's own baseline,
+				// then hand it to the fusion stage, which leaves out flagged samples and invalid sensors
+				bool was_valid, is_valid;
+				{
+					std::lock_guard<std::mutex> lock(validation_guard);
+					was_valid = validators[source].valid();
+					validators[source].check(samples, sample_count, flags);
+					is_valid = validators[source].valid();
+					// version 2 packets say where they start on the sensor box's sample clock, which keeps the
+					// sensor in step with the others when a packet is lost
+					uint64_t first = (header.version >= BT_PROTOCOL_V2)
+										 ? (header.base_timestamp * 1000 + period / 2) / period
+										 : FUSION_NO_INDEX;
+					fusion.push(source, samples, sample_count, flags, validators[source].stats(), first);
+				}
 
-#endif
+				if (was_valid && !is_valid)
+					std::cout << "sensor " << source << " errored out\n";
+				else if (!was_valid && is_valid)
+					std::cout << "sensor " << source << " recovered\n";
+#else
+				for (size_t i = 0; i < sample_count; i++)
+				{
+					Sample &s = samples[i];
 
-					// for each sample, call all of the callback functions
-					uint16_t last_spo2{95};
-					for (auto s : samples)
-					{
-						// calculate spo2 for each sample based on irled and redled - https://github.com/oxullo/Arduino-MAX30100/blob/master/src/MAX30100_SpO2Calculator.cpp
-						const uint8_t spO2LUT[43] = {100, 100, 100, 100, 99, 99, 99, 99, 99, 99, 98, 98, 98, 98,
-													 98, 97, 97, 97, 97, 97, 97, 96, 96, 96, 96, 96, 96, 95, 95,
-													 95, 95, 95, 95, 94, 94, 94, 94, 94, 93, 93, 93, 93, 93};
+					// insert last received pilot state value
+					if (s.bpm > 70)
+						s.pilot_state = pilot_state;
+				}
 
-						float acSqRatio = 100.0 * log(s.redLED / received_samples) / log(s.irLED / received_samples);
-						uint8_t index = 0;
+				// Pass the whole packet to all of the callback functions at once.
+				dispatch(samples, sample_count);
+#endif
+			});
 
-						if (acSqRatio > 66)
-						{
-							index = (uint8_t)acSqRatio - 66;
-						}
-						else if (acSqRatio > 50)
-						{
-							index = (uint8_t)acSqRatio - 50;
-						}
+			// tell the sensor box how far each sensor got, it sizes its packets from the round trip
+			for (int j = 0; j < 16; j++)
+			{
+				if (!ack_pending[j])
+					continue;
+				uint8_t ack[BT_ACK_SIZE];
+				c.push(ack, bt_ack((uint8_t)j, ack_sequence[j], ack));
+				ack_pending[j] = false;
+			}
 
-						if (index > 42 || index < 0)
-							s.spo2 = last_spo2;
-						else
-							s.spo2 = spO2LUT[index];
-						last_spo2 = s.spo2;
+#ifdef MITIGATE_SENSOR_MALFUNCTION
+			// the fused stream keeps going while any sensor is valid, say so when none is
+			bool valid_now{false};
+			{
+				std::lock_guard<std::mutex> lock(validation_guard);
+				for (int j = 0; j < 16; j++)
+					valid_now |= sensor_seen[j] && validators[j].valid();
+			}
+			if (any_valid && !valid_now)
+				std::cerr << "No valid sensors attached, no fused samples until one recovers\n";
+			else if (!any_valid && valid_now)
+				std::cout << "valid sensor attached, fusion resumed\n";
+			any_valid = valid_now;
+
+			// pass on every fused sample the packets completed
+			size_t fused_count;
+			do
+			{
+				{
+					std::lock_guard<std::mutex> lock(validation_guard);
+					fused_count = fusion.fuse(fused, FUSION_WINDOW);
+				}
 
-						// insert last received pilot state value
-						if (s.bpm > 70)
-							s.pilot_state = pilot_state;
+				for (size_t i = 0; i < fused_count; i++)
+				{
+					Sample &s = fused[i];
 
-						s.timestamp = time;
-						// Pass a pointer to the latest data to all of the callback functions.
-						for (auto clb : callbacks)
-							clb(&s);
-					}
+					// insert last received pilot state value
+					if (s.bpm > 70)
+						s.pilot_state = pilot_state;
 				}
-			}
+
+				if (fused_count > 0)
+					dispatch(fused, fused_count);
+			} while (fused_count == FUSION_WINDOW);
+#endif
 		}
 	}
 }
@@ -210,6 +325,9 @@ BluetoothReceiver::~BluetoothReceiver()
 {
 	std::cout << "Killing bluetooth thread...\n";
 	quit_receive_thread = true;
+	reactor.quit();
+	if (reactor_thread.joinable())
+		reactor_thread.join();
 	c.quit();
 	callback_thread.join();
 }
@@ -223,10 +341,18 @@ void BluetoothReceiver::initializeConnection()
 	}
 
 	// run a thread that sits and receives packets until the application quits
-	if (c.open_con(bluetooth_address, 5) == 0)
+	if (c.open_con(listen_address, bluetooth_address, 5) == 0)
 	{
 		connection_initialized = true;
-		c.run();
+
+		// tell the sensor box the newest protocol version we decode, it keeps to version 1 if it does not understand
+		const uint8_t hello[2] = {BT_MSG_HELLO, BT_PROTOCOL_VERSION};
+		c.push(hello, sizeof(hello));
+
+		// pilot states queued while a write is in progress go out together
+		c.set_coalescing(BT_L2CAP_MTU, std::chrono::microseconds(0));
+		c.run_on(reactor);
+		reactor_thread = std::thread(&PHMS_Bluetooth::Reactor::run, &reactor);
 	}
 	else
 	{
@@ -251,4 +377,201 @@ void BluetoothReceiver::send_pilot_state(uint8_t state)
 void BluetoothReceiver::set_bt_address(const std::string &s)
 {
 	bluetooth_address = s;
-}
\ No newline at end of file
+}
+
+/**
+ * get_sequence_stats: Get the loss, reordering and duplicate counters of one sensor's version 2 packets
+ * @param sensor: Sensor source number (0-15)
+ */
+Sequence_Stats BluetoothReceiver::get_sequence_stats(int sensor)
+{
+	std::lock_guard<std::mutex> lock(sequence_guard);
+	return sequence_trackers[sensor & 0x0f].stats();
+}
+
+/**
+ * get_link_stats: Get the loss, reordering and duplicate counters of every sensor added up
+ */
+Sequence_Stats BluetoothReceiver::get_link_stats()
+{
+	Sequence_Stats total;
+	std::lock_guard<std::mutex> lock(sequence_guard);
+	for (auto &t : sequence_trackers)
+		total += t.stats();
+	return total;
+}
+
+/**
+ * print_link_stats: Print the sequence counters of every sensor that sent version 2 packets, the link's total and the receiver's own drops
+ */
+void BluetoothReceiver::print_link_stats()
+{
+	auto print = [](const char *name, const Sequence_Stats &st) {
+		printf("(BluetoothReceiver) %-9s received: %llu lost: %llu missing: %llu (%.3f%%) gaps: %llu reordered: %llu duplicates: %llu late: %llu resyncs: %llu\n",
+			   name, (unsigned long long)st.received, (unsigned long long)st.lost, (unsigned long long)st.missing, 100.0 * st.loss(),
+			   (unsigned long long)st.gaps, (unsigned long long)st.reordered, (unsigned long long)st.duplicates,
+			   (unsigned long long)st.late, (unsigned long long)st.resyncs);
+	};
+
+	for (int i = 0; i < 16; i++)
+	{
+		Sequence_Stats st = get_sequence_stats(i);
+		if (st.received == 0)
+			continue;
+		char name[16];
+		snprintf(name, sizeof(name), "sensor %d", i);
+		print(name, st);
+	}
+	print("link", get_link_stats());
+	printf("(BluetoothReceiver) receive ring overruns: %llu malformed: %llu\n", (unsigned long long)c.overruns(), (unsigned long long)c.malformed());
+
+	Clock_Sync_Stats cs = get_clock_stats();
+	if (cs.exchanges > 0)
+		printf("(BluetoothReceiver) sensor clock %s offset: %.0f us delay: %lld us drift: %.1f ppm exchanges: %llu rejected: %llu\n",
+			   cs.synced ? "synced  " : "syncing ", cs.offset_us, (long long)cs.delay_us, cs.drift_ppm,
+			   (unsigned long long)cs.exchanges, (unsigned long long)cs.rejected);
+}
+
+/**
+ * get_clock_stats: Get the estimate of the sensor box's clock against ours, sample times follow it once synced
+ */
+Clock_Sync_Stats BluetoothReceiver::get_clock_stats()
+{
+	std::lock_guard<std::mutex> lock(clock_guard);
+	return clock_sync.stats(bt_time_us(std::chrono::system_clock::now()));
+}
+
+/**
+ * get_protocol_version: Get the bluetooth protocol version the sensor box sends, BT_PROTOCOL_V1 until it answered the hello
+ */
+uint8_t BluetoothReceiver::get_protocol_version()
+{
+	return protocol_version;
+}
+
+/**
+ * get_sample_period_us: Get the time between the sensor box's samples, BT_SAMPLE_PERIOD_US unless its hello ack said otherwise
+ */
+uint32_t BluetoothReceiver::get_sample_period_us()
+{
+	return sample_period_us;
+}
+
+/**
+ * set_listen_address: Change where the sensor box's connection is accepted, bluetooth by default
+ * @param s: Transport address, ie: "unix:@phms-receiver" to run against bluetooth_sensor_data_send on one machine
+ */
+void BluetoothReceiver::set_listen_address(const std::string &s)
+{
+	listen_address = s;
+}
+
+/**
+ * set_validation_config: Change the thresholds used to decide if a sensor is malfunctioning
+ * @param config: New thresholds, applied to every sensor
+ */
+void BluetoothReceiver::set_validation_config(const Validation_Config &config)
+{
+	std::lock_guard<std::mutex> lock(validation_guard);
+	for (auto &v : validators)
+		v.configure(config);
+}
+
+/**
+ * get_validation_stats: Get the validation counters of one sensor
+ * @param sensor: Sensor source number (0-15)
+ */
+Validation_Stats BluetoothReceiver::get_validation_stats(int sensor)
+{
+	std::lock_guard<std::mutex> lock(validation_guard);
+	return validators[sensor & 0x0f].stats();
+}
+
+/**
+ * print_validation_stats: Print the validation counters of every sensor that sent data and the fusion counters
+ */
+void BluetoothReceiver::print_validation_stats()
+{
+	for (int i = 0; i < 16; i++)
+	{
+		Validation_Stats st = get_validation_stats(i);
+		if (st.samples == 0)
+			continue;
+		printf("(BluetoothReceiver) sensor %2d %s samples: %llu flagged: %llu (z: %llu step: %llu) score: %.2f invalidations: %llu\n",
+			   i, st.valid ? "valid  " : "invalid", (unsigned long long)st.samples, (unsigned long long)st.flagged,
+			   (unsigned long long)st.z_outliers, (unsigned long long)st.step_outliers, st.score, (unsigned long long)st.invalidations);
+	}
+
+	std::lock_guard<std::mutex> lock(validation_guard);
+	fusion.print_stats();
+}
+
+/**
+ * set_fusion_config: Change how the samples of every sensor are fused into one stream
+ * @param config: New fusion settings
+ */
+void BluetoothReceiver::set_fusion_config(const Fusion_Config &config)
+{
+	std::lock_guard<std::mutex> lock(validation_guard);
+	fusion.configure(config);
+}
+
+/**
+ * get_fusion_stats: Get the counters of the fusion stage
+ */
+Fusion_Stats BluetoothReceiver::get_fusion_stats()
+{
+	std::lock_guard<std::mutex> lock(validation_guard);
+	return fusion.stats();
+}
+
+/**
+ * get_heart_rate: Get the heart rate detected from one sensor's IR signal
+ * @param sensor: Sensor source number (0-15)
+ * @returns Beats per minute, 0 if no pulse was found or the signal is too noisy to trust
+ */
+uint16_t BluetoothReceiver::get_heart_rate(int sensor)
+{
+	std::lock_guard<std::mutex> lock(heart_rate_guard);
+	return heart_rate_detectors[sensor & 0x0f].bpm();
+}
+
+/**
+ * get_beat_intervals: Get the recent inter-beat intervals of one sensor, ie: for heart rate variability
+ * @param sensor: Sensor source number (0-15)
+ * @param dst: Destination for the intervals in milliseconds, oldest first
+ * @param max: Most intervals to copy
+ * @returns Number of intervals copied, at most HR_IBI_HISTORY
+ */
+size_t BluetoothReceiver::get_beat_intervals(int sensor, uint16_t *dst, size_t max)
+{
+	std::lock_guard<std::mutex> lock(heart_rate_guard);
+	return heart_rate_detectors[sensor & 0x0f].intervals(dst, max);
+}
+
+/**
+ * get_heart_rate_sensor: Pick the sensor to take the heart rate and beat intervals from:
+ * of the valid sensors that sent data and have a heart rate, the one whose beats stand
+ * highest above its noise
+ * @returns Sensor source number (0-15), -1 if no valid sensor has a heart rate
+ */
+int BluetoothReceiver::get_heart_rate_sensor()
+{
+	bool valid[16]{false};
+	{
+		std::lock_guard<std::mutex> lock(validation_guard);
+		for (int i = 0; i < 16; i++)
+			valid[i] = validators[i].stats().samples > 0 && validators[i].valid();
+	}
+
+	std::lock_guard<std::mutex> lock(heart_rate_guard);
+	int best{-1};
+	for (int i = 0; i < 16; i++)
+	{
+		if (!valid[i] || heart_rate_detectors[i].bpm() == 0)
+			continue;
+		if (best < 0 || heart_rate_detectors[i].snr() > heart_rate_detectors[best].snr())
+			best = i;
+	}
+	return best;
+}
@@ -10,6 +10,8 @@
 
 #include "./bluetooth/bluetooth_con.hpp"
 #include "./datasource.hpp"
+#include "./bt_sample_codec.hpp"
+#include "./bt_protocol.hpp"
 
 // how to identify a field within the bluetooth packet
 #define BYTE_IDENTIFIER_timestamp 0x01
@@ -71,6 +73,18 @@ std::vector<Sample> sample_buffer_from_file(const std::string filename)
     return ret;
 }
 
+// most samples a single bluetooth packet can carry after the source byte
+#define BT_MAX_SAMPLES_PER_PACKET ((MAX_PKT_SIZE - 1) / BT_SAMPLE_BYTES)
+
+// most samples a version 2 packet is sure to fit, whatever their values
+#define BT_V2_MAX_SAMPLES_PER_PACKET ((MAX_PKT_SIZE - BT_V2_MAX_HEADER - BT_V2_CHANNELS * 2) / (BT_V2_CHANNELS * BT_V2_MAX_VALUE_BYTES) + 1)
+static_assert(BT_V2_MAX_SAMPLES_PER_PACKET <= BT_MAX_SAMPLES_PER_PACKET, "version 2 packets must decode into version 1 sized buffers");
+
+// most samples a packet of either version carries and still fits one L2CAP write, what a sender's packets may grow to
+#define BT_MTU_SAMPLES_PER_PACKET ((BT_L2CAP_MTU - 1) / BT_SAMPLE_BYTES)
+#define BT_V2_MTU_SAMPLES_PER_PACKET ((BT_L2CAP_MTU - BT_V2_MAX_HEADER - BT_V2_CHANNELS * 2) / (BT_V2_CHANNELS * BT_V2_MAX_VALUE_BYTES) + 1)
+static_assert(bt_v2_max_size(BT_V2_MTU_SAMPLES_PER_PACKET) <= BT_L2CAP_MTU, "version 2 packets must fit the MTU whatever their values");
+
 // quick way to package together the two results
 struct Smp_with_Source
 {
@@ -83,36 +97,88 @@ inline uint16_t combine(uint8_t a, uint8_t b)
     return b + (a << 8);
 }
 
-// pull samples from bluetooth packet
-Smp_with_Source sample_buffer_from_bt_packet(PHMS_Bluetooth::Packet p)
+/**
+ * bt_time_us: Microseconds since the epoch, the unit of the times in BT_MSG_TIME_REQUEST messages
+ */
+inline uint64_t bt_time_us(std::chrono::system_clock::time_point t)
 {
-    Smp_with_Source ret;
-    const uint8_t *bytes = p.get();
-    ret.src = bytes[0];
+    return std::chrono::duration_cast<std::chrono::microseconds>(t.time_since_epoch()).count();
+}
 
-    int cur_byte{1};
+/**
+ * bt_packet_sample_count: Number of whole samples held in a bluetooth packet
+ * @param len Size of the packet in bytes, including the source byte
+ */
+inline size_t bt_packet_sample_count(size_t len)
+{
+    return (len > 0) ? (len - 1) / BT_SAMPLE_BYTES : 0;
+}
 
-    unsigned long time = p.time().time_since_epoch().count();
-    // useconds in 64 hz
-    constexpr unsigned long time_interval = 1000000 / 64;
-    int sample_count{1};
+/**
+ * decode_bt_samples: Decode sample values from the wire format. Only irLED, redLED,
+ * spo2 and bpm are sent, every other field of dst is reset.
+ * @param bytes First byte of the first sample (after the source byte)
+ * @param n Number of samples to decode
+ * @param dst Location to write n samples to
+ */
+inline void decode_bt_samples(const uint8_t *bytes, size_t n, Sample *dst)
+{
+    bt_decode_samples(bytes, n, dst);
+}
 
-    while (cur_byte != p.size())
-    {
-        Sample s;
-        s.irLED = combine(bytes[cur_byte], bytes[cur_byte + 1]);
-        s.redLED = combine(bytes[cur_byte + 2], bytes[cur_byte + 3]);
-        s.spo2 = combine(bytes[cur_byte + 4], bytes[cur_byte + 5]);
-        s.bpm = combine(bytes[cur_byte + 6], bytes[cur_byte  + 7]);
-        cur_byte += 8;
-
-        // time received and 1/64 of a second for each sample
-        s.timestamp = time + (sample_count * time_interval);
-
-        ret.samples.push_back(s);
-        
-        sample_count++;
-    }
+/**
+ * decode_bt_packet: Decode a bluetooth packet of either protocol version into a caller provided buffer without allocating.
+ * Trailing bytes of a version 1 packet that do not make up a whole sample are ignored.
+ * @param bytes Packet contents
+ * @param len Size of the packet in bytes
+ * @param dst Location to write the samples to
+ * @param max Most samples dst can hold
+ * @param header Set to the version, sensor and, for version 2, sequence number and timestamp of the packet
+ * @returns Number of samples written to dst
+ */
+inline size_t decode_bt_packet(const uint8_t *bytes, size_t len, Sample *dst, size_t max, Sample_Packet_Header &header)
+{
+    if (len > 0 && bytes[0] == BT_MSG_SAMPLES_V2)
+        return bt_decode_packet_v2(bytes, len, dst, max, header);
+
+    header = Sample_Packet_Header();
+    if (len == 0)
+        return 0;
+
+    size_t n = std::min(bt_packet_sample_count(len), max);
+    decode_bt_samples(bytes + 1, n, dst);
+    header.sensor = bytes[0];
+    header.count = n;
+    return n;
+}
+
+/**
+ * decode_bt_packet: Decode a bluetooth packet of either protocol version, see above.
+ * @param src Set to the sensor the packet came from
+ */
+inline size_t decode_bt_packet(const uint8_t *bytes, size_t len, Sample *dst, size_t max, uint8_t &src)
+{
+    if (len == 0)
+        return 0;
+
+    Sample_Packet_Header header;
+    size_t n = decode_bt_packet(bytes, len, dst, max, header);
+    src = header.sensor;
+    return n;
+}
+
+// pull samples from bluetooth packet, timestamped in ms since the epoch
+// counting back from when it was received, the newest sample taken just before
+Smp_with_Source sample_buffer_from_bt_packet(const PHMS_Bluetooth::Packet &p)
+{
+    Smp_with_Source ret;
+    ret.samples.resize(std::max(bt_packet_sample_count(p.size()), (size_t)BT_V2_MAX_SAMPLES_PER_PACKET));
+    ret.samples.resize(decode_bt_packet(p.get(), p.size(), ret.samples.data(), ret.samples.size(), ret.src));
+
+    uint64_t time = bt_time_us(p.time());
+    size_t n = ret.samples.size();
+    for (size_t i = 0; i < n; i++)
+        ret.samples[i].timestamp = (time - (n - 1 - i) * BT_SAMPLE_PERIOD_US) / 1000;
 
     return ret;
 }
@@ -133,22 +199,49 @@ void write_to_bytes(uint16_t t, std::vector<uint8_t> &v)
     v.push_back(data[0]);
 }
 
-// construct bluetooth packet from sample buffer
-PHMS_Bluetooth::Packet packet_from_Sample_buffer(uint8_t source_sensor, const std::vector<Sample> &samples)
+// construct bluetooth packet from samples, encoded straight into the packet's pooled buffer
+// at most BT_MAX_SAMPLES_PER_PACKET samples are sent
+PHMS_Bluetooth::Packet packet_from_Sample_buffer(uint8_t source_sensor, const Sample *samples, size_t n)
 {
+    n = std::min(n, (size_t)BT_MAX_SAMPLES_PER_PACKET);
+    PHMS_Bluetooth::Packet ret(1 + n * BT_SAMPLE_BYTES);
+
     // add sensor source on initialization
-    std::vector<uint8_t> bytes({source_sensor});
+    uint8_t *bytes = ret.data();
+    bytes[0] = source_sensor;
 
     // add sample data
-    for (auto s : samples)
-    {
-        write_to_bytes(s.irLED, bytes);
-        write_to_bytes(s.redLED, bytes);
-        write_to_bytes(s.spo2, bytes);
-        write_to_bytes(s.bpm, bytes);
-    }
+    bt_encode_samples(samples, n, bytes + 1);
+
+    return ret;
+}
+
+// construct bluetooth packet from sample buffer
+PHMS_Bluetooth::Packet packet_from_Sample_buffer(uint8_t source_sensor, const std::vector<Sample> &samples)
+{
+    return packet_from_Sample_buffer(source_sensor, samples.data(), samples.size());
+}
+
+// construct a version 2 bluetooth packet from samples, encoded straight into the packet's pooled buffer
+// at most BT_V2_MAX_SAMPLES_PER_PACKET samples are sent
+PHMS_Bluetooth::Packet packet_from_Sample_buffer_v2(uint8_t source_sensor, uint16_t sequence, uint64_t base_timestamp, const Sample *samples, size_t n)
+{
+    n = std::min(n, (size_t)BT_V2_MAX_SAMPLES_PER_PACKET);
 
-    return PHMS_Bluetooth::Packet(bytes.size(), &bytes.front());
+    Sample_Packet_Header header;
+    header.sensor = source_sensor;
+    header.sequence = sequence;
+    header.base_timestamp = base_timestamp;
+
+    PHMS_Bluetooth::Packet ret(bt_v2_max_size(n));
+    ret.resize(bt_encode_packet_v2(header, samples, n, ret.data(), ret.size()));
+    return ret;
+}
+
+// construct a version 2 bluetooth packet from sample buffer
+PHMS_Bluetooth::Packet packet_from_Sample_buffer_v2(uint8_t source_sensor, uint16_t sequence, uint64_t base_timestamp, const std::vector<Sample> &samples)
+{
+    return packet_from_Sample_buffer_v2(source_sensor, sequence, base_timestamp, samples.data(), samples.size());
 }
 
 // print all information from a sample
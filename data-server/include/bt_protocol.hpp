@@ -0,0 +1,423 @@
+#pragma once
+
+/* Version 2 of the bluetooth sample packet and the messages negotiating it.
+ *
+ * Version 1 packets are the sensor id followed by BT_SAMPLE_BYTES per sample
+ * (see bt_sample_codec.hpp). Version 2 packets start with BT_MSG_SAMPLES_V2:
+ *
+ *   byte  0     BT_MSG_SAMPLES_V2
+ *   byte  1     sensor id
+ *   bytes 2-3   sequence number of the packet from this sensor, big endian
+ *   varint      sensor side time of the first sample, ms
+ *   byte        sample count
+ *   byte        BT_V2_CONSTANT bit per channel whose value is the same in every sample
+ *   channels    irLED, redLED, spo2, bpm one after the other: the first value
+ *               as 2 bytes big endian, then unless the channel is constant the
+ *               difference to the previous value as a zigzag varint
+ *
+ * Samples change little from one to the next, so most differences take one
+ * or two bytes instead of two, and spo2 and bpm usually take two bytes for
+ * the whole packet.
+ *
+ * First bytes from BT_MSG_RESERVED up are control messages and never sensor
+ * ids, so both versions can arrive on the same link. The receiver sends
+ * BT_MSG_HELLO with the newest version it decodes when it connects; a sender
+ * that knows the message answers with BT_MSG_HELLO_ACK and the version it
+ * will send from then on. A sender that never hears BT_MSG_HELLO, or a
+ * receiver that never answers it, keeps to version 1. Version 2 senders add
+ * the rate they sample at to the ack, ie: for stress tests above
+ * BT_SAMPLE_RATE; without it the receiver assumes BT_SAMPLE_RATE.
+ *
+ * Once version 2 is agreed the receiver also measures the sender's clock:
+ * it sends BT_MSG_TIME_REQUEST with its time t1, the sender answers with
+ * BT_MSG_TIME_RESPONSE carrying t1, the time t2 the request arrived and the
+ * time t3 it answered, all in us on the clock the sample times are taken
+ * from. Senders before version 2 read any unknown byte as a pilot state, so
+ * they are never sent one. See clock_sync.hpp for what is made of the times.
+ *
+ * The receiver acks version 2 packets with BT_MSG_ACK and the newest
+ * sequence number it has from a sensor, at most once per sensor for every
+ * batch of packets it reads. Senders size their packets from the acks' round
+ * trip, see packet_sizer.hpp.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <cstring>
+
+#include "datasource.hpp"
+
+// first byte of messages that are not version 1 sample packets, sensor ids stay below it
+#define BT_MSG_RESERVED 0xF0
+// [BT_MSG_HELLO, newest protocol version the sender of the message decodes]
+#define BT_MSG_HELLO 0xF0
+// [BT_MSG_HELLO_ACK, protocol version the sender of the message sends from now on, (sample rate in Hz 2 bytes big endian)]
+#define BT_MSG_HELLO_ACK 0xF1
+// a version 2 sample packet
+#define BT_MSG_SAMPLES_V2 0xF2
+// [BT_MSG_TIME_REQUEST, t1 8 bytes big endian]
+#define BT_MSG_TIME_REQUEST 0xF3
+// [BT_MSG_TIME_RESPONSE, t1, t2, t3 8 bytes big endian each]
+#define BT_MSG_TIME_RESPONSE 0xF4
+// [BT_MSG_ACK, sensor id, newest sequence number received from it 2 bytes big endian]
+#define BT_MSG_ACK 0xF5
+
+#define BT_TIME_REQUEST_SIZE 9
+#define BT_TIME_RESPONSE_SIZE 25
+#define BT_ACK_SIZE 4
+#define BT_HELLO_ACK_SIZE 4
+
+// rate the sensor box samples at unless its hello ack says otherwise, consecutive samples in a packet are this far apart
+#define BT_SAMPLE_RATE 64
+#define BT_SAMPLE_PERIOD_US (1000000 / BT_SAMPLE_RATE)
+
+#define BT_PROTOCOL_V1 1
+#define BT_PROTOCOL_V2 2
+// newest version this build sends and decodes
+#define BT_PROTOCOL_VERSION BT_PROTOCOL_V2
+
+#define BT_V2_CHANNELS 4
+// largest version 2 header: marker, sensor, sequence, 10 byte varint, count, constant flags
+#define BT_V2_MAX_HEADER 16
+// a 16 bit difference zigzag encodes into at most 3 varint bytes
+#define BT_V2_MAX_VALUE_BYTES 3
+// flag of channel c in the constant flags byte
+#define BT_V2_CONSTANT(c) (1 << (c))
+
+/**
+ * bt_v2_max_size: Most bytes n samples take in a version 2 packet
+ */
+constexpr size_t bt_v2_max_size(size_t n)
+{
+	return BT_V2_MAX_HEADER + BT_V2_CHANNELS * (2 + (n > 0 ? n - 1 : 0) * BT_V2_MAX_VALUE_BYTES);
+}
+
+// the header of a sample packet of either version
+struct Sample_Packet_Header
+{
+	uint8_t version{BT_PROTOCOL_V1};
+	uint8_t sensor{0};
+	uint16_t sequence{0};		 // version 2 only
+	uint64_t base_timestamp{0}; // version 2 only, sensor side time of the first sample in ms
+	uint8_t count{0};
+};
+
+/**
+ * bt_is_control_message: Check if a message is a control message rather than a sample packet
+ */
+inline bool bt_is_control_message(const uint8_t *bytes, size_t len)
+{
+	return len > 0 && bytes[0] >= BT_MSG_RESERVED && bytes[0] != BT_MSG_SAMPLES_V2;
+}
+
+/**
+ * bt_negotiate_version: Version to send after the other side said which it decodes
+ * @param newest Newest version the other side decodes, from its BT_MSG_HELLO
+ */
+inline uint8_t bt_negotiate_version(uint8_t newest)
+{
+	return std::max((uint8_t)BT_PROTOCOL_V1, std::min(newest, (uint8_t)BT_PROTOCOL_VERSION));
+}
+
+inline uint32_t bt_zigzag(int32_t v)
+{
+	return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+inline int32_t bt_unzigzag(uint32_t v)
+{
+	return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+
+/**
+ * bt_put_varint: Write v 7 bits at a time, low bits first, the high bit of every byte but the last set.
+ * @returns Number of bytes written, at most 10
+ */
+inline size_t bt_put_varint(uint8_t *dst, uint64_t v)
+{
+	size_t n{0};
+	while (v >= 0x80)
+	{
+		dst[n++] = (uint8_t)v | 0x80;
+		v >>= 7;
+	}
+	dst[n++] = (uint8_t)v;
+	return n;
+}
+
+/**
+ * bt_get_varint: Read a varint written by bt_put_varint.
+ * @param p Position to read at, advanced past the varint
+ * @param end End of the readable bytes
+ * @param v Set to the value read
+ * @returns false if the varint runs past end or is longer than 10 bytes
+ */
+inline bool bt_get_varint(const uint8_t *&p, const uint8_t *end, uint64_t &v)
+{
+	v = 0;
+	for (int shift = 0; shift < 64 && p < end; shift += 7)
+	{
+		uint8_t b = *p++;
+		v |= (uint64_t)(b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return true;
+	}
+	return false;
+}
+
+/**
+ * bt_v2_channel: Internal function. Channel c of a sample, in the order they are encoded.
+ */
+inline uint16_t &bt_v2_channel(Sample &s, int c)
+{
+	switch (c)
+	{
+	case 0:
+		return s.irLED;
+	case 1:
+		return s.redLED;
+	case 2:
+		return s.spo2;
+	default:
+		return s.bpm;
+	}
+}
+
+inline uint16_t bt_v2_channel(const Sample &s, int c)
+{
+	return bt_v2_channel(const_cast<Sample &>(s), c);
+}
+
+/**
+ * bt_encode_packet_v2: Encode samples into a version 2 packet.
+ * @param header Sensor, sequence number and base timestamp of the packet
+ * @param samples Samples to encode
+ * @param n Number of samples, at most 255
+ * @param dst Location to write the packet to
+ * @param capacity Bytes dst can hold
+ * @returns Size of the packet, 0 if capacity is less than bt_v2_max_size(n)
+ */
+inline size_t bt_encode_packet_v2(const Sample_Packet_Header &header, const Sample *samples, size_t n, uint8_t *dst, size_t capacity)
+{
+	if (n > 0xff || capacity < bt_v2_max_size(n))
+		return 0;
+
+	uint8_t constant{0};
+	for (int c = 0; c < BT_V2_CHANNELS; c++)
+	{
+		size_t i{1};
+		while (i < n && bt_v2_channel(samples[i], c) == bt_v2_channel(samples[0], c))
+			i++;
+		if (i >= n)
+			constant |= BT_V2_CONSTANT(c);
+	}
+
+	uint8_t *p = dst;
+	*p++ = BT_MSG_SAMPLES_V2;
+	*p++ = header.sensor;
+	*p++ = header.sequence >> 8;
+	*p++ = header.sequence & 0xff;
+	p += bt_put_varint(p, header.base_timestamp);
+	*p++ = (uint8_t)n;
+	*p++ = constant;
+
+	if (n == 0)
+		return p - dst;
+
+	for (int c = 0; c < BT_V2_CHANNELS; c++)
+	{
+		uint16_t prev = bt_v2_channel(samples[0], c);
+		*p++ = prev >> 8;
+		*p++ = prev & 0xff;
+		if (constant & BT_V2_CONSTANT(c))
+			continue;
+
+		// differences wrap around at 16 bits, so each fits in BT_V2_MAX_VALUE_BYTES
+		for (size_t i = 1; i < n; i++)
+		{
+			uint16_t v = bt_v2_channel(samples[i], c);
+			p += bt_put_varint(p, bt_zigzag((int16_t)(uint16_t)(v - prev)));
+			prev = v;
+		}
+	}
+	return p - dst;
+}
+
+/**
+ * bt_decode_packet_v2: Decode a version 2 packet into a caller provided buffer without allocating.
+ * Fields that are not sent are reset.
+ * @param bytes Packet contents, starting with BT_MSG_SAMPLES_V2
+ * @param len Size of the packet in bytes
+ * @param dst Location to write the samples to
+ * @param max Most samples dst can hold, further samples are skipped
+ * @param header Set to the header of the packet
+ * @returns Number of samples written to dst, 0 if the packet is malformed
+ */
+inline size_t bt_decode_packet_v2(const uint8_t *bytes, size_t len, Sample *dst, size_t max, Sample_Packet_Header &header)
+{
+	const uint8_t *p = bytes, *end = bytes + len;
+	header = Sample_Packet_Header();
+
+	if (len < 4 || p[0] != BT_MSG_SAMPLES_V2)
+		return 0;
+	header.version = BT_PROTOCOL_V2;
+	header.sensor = p[1];
+	header.sequence = (uint16_t)((p[2] << 8) | p[3]);
+	p += 4;
+
+	if (!bt_get_varint(p, end, header.base_timestamp) || end - p < 2)
+		return 0;
+	size_t n = *p++;
+	uint8_t constant = *p++;
+	size_t kept = std::min(n, max);
+
+	for (size_t i = 0; i < kept; i++)
+	{
+		dst[i].timestamp = 0;
+		dst[i].pilot_state = 0;
+	}
+
+	for (int c = 0; c < BT_V2_CHANNELS && n > 0; c++)
+	{
+		if (end - p < 2)
+			return 0;
+		uint16_t v = (uint16_t)((p[0] << 8) | p[1]);
+		p += 2;
+
+		for (size_t i = 0; i < n; i++)
+		{
+			if (i > 0 && !(constant & BT_V2_CONSTANT(c)))
+			{
+				uint64_t zz;
+				if (!bt_get_varint(p, end, zz) || zz > 0xffff)
+					return 0;
+				v += (uint16_t)bt_unzigzag((uint32_t)zz);
+			}
+			if (i < kept)
+				bt_v2_channel(dst[i], c) = v;
+		}
+	}
+
+	header.count = (uint8_t)n;
+	return kept;
+}
+
+inline void bt_put_be64(uint8_t *dst, uint64_t v)
+{
+	for (int i = 7; i >= 0; i--, v >>= 8)
+		dst[i] = (uint8_t)v;
+}
+
+inline uint64_t bt_get_be64(const uint8_t *src)
+{
+	uint64_t v{0};
+	for (int i = 0; i < 8; i++)
+		v = (v << 8) | src[i];
+	return v;
+}
+
+/**
+ * bt_time_request: Write a BT_MSG_TIME_REQUEST
+ * @param t1 Time the request is sent, us
+ * @param dst At least BT_TIME_REQUEST_SIZE bytes
+ * @returns Bytes written
+ */
+inline size_t bt_time_request(uint64_t t1, uint8_t *dst)
+{
+	dst[0] = BT_MSG_TIME_REQUEST;
+	bt_put_be64(dst + 1, t1);
+	return BT_TIME_REQUEST_SIZE;
+}
+
+/**
+ * bt_time_response: Write the BT_MSG_TIME_RESPONSE to a request
+ * @param request The BT_MSG_TIME_REQUEST that arrived
+ * @param t2 Time the request arrived, us
+ * @param t3 Time the response is sent, us
+ * @param dst At least BT_TIME_RESPONSE_SIZE bytes
+ * @returns Bytes written, 0 if request is not a whole BT_MSG_TIME_REQUEST
+ */
+inline size_t bt_time_response(const uint8_t *request, size_t len, uint64_t t2, uint64_t t3, uint8_t *dst)
+{
+	if (len < BT_TIME_REQUEST_SIZE || request[0] != BT_MSG_TIME_REQUEST)
+		return 0;
+	dst[0] = BT_MSG_TIME_RESPONSE;
+	memcpy(dst + 1, request + 1, 8);
+	bt_put_be64(dst + 9, t2);
+	bt_put_be64(dst + 17, t3);
+	return BT_TIME_RESPONSE_SIZE;
+}
+
+/**
+ * bt_parse_time_response: Read the times from a BT_MSG_TIME_RESPONSE
+ * @returns false if the message is not a whole BT_MSG_TIME_RESPONSE
+ */
+inline bool bt_parse_time_response(const uint8_t *bytes, size_t len, uint64_t &t1, uint64_t &t2, uint64_t &t3)
+{
+	if (len < BT_TIME_RESPONSE_SIZE || bytes[0] != BT_MSG_TIME_RESPONSE)
+		return false;
+	t1 = bt_get_be64(bytes + 1);
+	t2 = bt_get_be64(bytes + 9);
+	t3 = bt_get_be64(bytes + 17);
+	return true;
+}
+
+/**
+ * bt_hello_ack: Write a BT_MSG_HELLO_ACK
+ * @param version Protocol version sent from now on
+ * @param sample_rate Samples per second sent, only version 2 receivers read it
+ * @param dst At least BT_HELLO_ACK_SIZE bytes
+ * @returns Bytes written
+ */
+inline size_t bt_hello_ack(uint8_t version, uint16_t sample_rate, uint8_t *dst)
+{
+	dst[0] = BT_MSG_HELLO_ACK;
+	dst[1] = version;
+	dst[2] = (uint8_t)(sample_rate >> 8);
+	dst[3] = (uint8_t)sample_rate;
+	return BT_HELLO_ACK_SIZE;
+}
+
+/**
+ * bt_parse_hello_ack: Read the protocol version and sample rate from a BT_MSG_HELLO_ACK
+ * @param sample_rate Set to BT_SAMPLE_RATE if the ack does not say
+ * @returns false if the message is not a BT_MSG_HELLO_ACK
+ */
+inline bool bt_parse_hello_ack(const uint8_t *bytes, size_t len, uint8_t &version, uint16_t &sample_rate)
+{
+	if (len < 2 || bytes[0] != BT_MSG_HELLO_ACK)
+		return false;
+	version = bytes[1];
+	sample_rate = (len >= BT_HELLO_ACK_SIZE) ? (uint16_t)((bytes[2] << 8) | bytes[3]) : 0;
+	if (sample_rate == 0)
+		sample_rate = BT_SAMPLE_RATE;
+	return true;
+}
+
+/**
+ * bt_ack: Write a BT_MSG_ACK
+ * @param dst At least BT_ACK_SIZE bytes
+ * @returns Bytes written
+ */
+inline size_t bt_ack(uint8_t sensor, uint16_t sequence, uint8_t *dst)
+{
+	dst[0] = BT_MSG_ACK;
+	dst[1] = sensor;
+	dst[2] = (uint8_t)(sequence >> 8);
+	dst[3] = (uint8_t)sequence;
+	return BT_ACK_SIZE;
+}
+
+/**
+ * bt_parse_ack: Read the sensor and sequence number from a BT_MSG_ACK
+ * @returns false if the message is not a whole BT_MSG_ACK
+ */
+inline bool bt_parse_ack(const uint8_t *bytes, size_t len, uint8_t &sensor, uint16_t &sequence)
+{
+	if (len < BT_ACK_SIZE || bytes[0] != BT_MSG_ACK)
+		return false;
+	sensor = bytes[1];
+	sequence = (uint16_t)((bytes[2] << 8) | bytes[3]);
+	return true;
+}
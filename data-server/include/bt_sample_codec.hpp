@@ -0,0 +1,345 @@
+#pragma once
+
+/* Encode and decode kernels for the sample wire format used in bluetooth
+ * packets: irLED, redLED, spo2 and bpm of each sample as big endian 16 bit
+ * values, 8 bytes per sample.
+ *
+ * The four fields sit next to each other in Sample, so converting a sample is
+ * one 16 bit byte swap of 8 bytes. The vector kernels swap 2 (SSE2, NEON) or
+ * 4 (AVX2) samples per instruction and move each sample's 8 bytes with a
+ * single load or store.
+ *
+ * bt_decode_samples() and bt_encode_samples() use the fastest kernel the CPU
+ * supports. The individual kernels are exposed for testing and benchmarks.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(__x86_64__)
+#define BT_CODEC_HAVE_SSE2 1
+#include <immintrin.h>
+#if defined(__GNUC__)
+// compiled with a target attribute and only used if the CPU supports it
+#define BT_CODEC_HAVE_AVX2 1
+#endif
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define BT_CODEC_HAVE_NEON 1
+#include <arm_neon.h>
+#endif
+
+#include "datasource.hpp"
+
+// the kernels copy the four fields as one 8 byte block starting at irLED
+static_assert(offsetof(Sample, redLED) == offsetof(Sample, irLED) + 2, "Sample fields must be contiguous");
+static_assert(offsetof(Sample, spo2) == offsetof(Sample, irLED) + 4, "Sample fields must be contiguous");
+static_assert(offsetof(Sample, bpm) == offsetof(Sample, irLED) + 6, "Sample fields must be contiguous");
+
+// bytes per sample on the wire
+#define BT_SAMPLE_BYTES 8
+
+enum Codec_Kernel
+{
+	CODEC_SCALAR,
+	CODEC_SSE2,
+	CODEC_AVX2,
+	CODEC_NEON
+};
+
+/**
+ * bt_codec_reset_unsent: Internal function. Clear the fields of a decoded sample that are not sent.
+ */
+inline void bt_codec_reset_unsent(Sample &s)
+{
+	s.timestamp = 0;
+	s.pilot_state = 0;
+}
+
+/**
+ * bt_decode_samples_scalar: Decode n samples one field at a time.
+ * @param src Wire bytes, 8 per sample
+ * @param n Number of samples
+ * @param dst Location to write n samples to. Fields that are not sent are reset.
+ */
+inline void bt_decode_samples_scalar(const uint8_t *src, size_t n, Sample *dst)
+{
+	for (size_t i = 0; i < n; i++, src += BT_SAMPLE_BYTES)
+	{
+		bt_codec_reset_unsent(dst[i]);
+		dst[i].irLED = (uint16_t)((src[0] << 8) | src[1]);
+		dst[i].redLED = (uint16_t)((src[2] << 8) | src[3]);
+		dst[i].spo2 = (uint16_t)((src[4] << 8) | src[5]);
+		dst[i].bpm = (uint16_t)((src[6] << 8) | src[7]);
+	}
+}
+
+/**
+ * bt_encode_samples_scalar: Encode n samples one field at a time.
+ * @param src Samples to encode
+ * @param n Number of samples
+ * @param dst Location to write 8 * n bytes to
+ */
+inline void bt_encode_samples_scalar(const Sample *src, size_t n, uint8_t *dst)
+{
+	for (size_t i = 0; i < n; i++, dst += BT_SAMPLE_BYTES)
+	{
+		dst[0] = src[i].irLED >> 8;
+		dst[1] = src[i].irLED & 0xff;
+		dst[2] = src[i].redLED >> 8;
+		dst[3] = src[i].redLED & 0xff;
+		dst[4] = src[i].spo2 >> 8;
+		dst[5] = src[i].spo2 & 0xff;
+		dst[6] = src[i].bpm >> 8;
+		dst[7] = src[i].bpm & 0xff;
+	}
+}
+
+#ifdef BT_CODEC_HAVE_SSE2
+/**
+ * bt_codec_bswap16_sse2: Internal function. Byte swap every 16 bit lane.
+ */
+inline __m128i bt_codec_bswap16_sse2(__m128i v)
+{
+	return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+/**
+ * bt_decode_samples_sse2: Decode n samples, two per iteration.
+ */
+inline void bt_decode_samples_sse2(const uint8_t *src, size_t n, Sample *dst)
+{
+	size_t i = 0;
+	for (; i + 2 <= n; i += 2, src += 2 * BT_SAMPLE_BYTES)
+	{
+		__m128i v = bt_codec_bswap16_sse2(_mm_loadu_si128(reinterpret_cast<const __m128i *>(src)));
+
+		bt_codec_reset_unsent(dst[i]);
+		bt_codec_reset_unsent(dst[i + 1]);
+		_mm_storel_epi64(reinterpret_cast<__m128i *>(&dst[i].irLED), v);
+		_mm_storel_epi64(reinterpret_cast<__m128i *>(&dst[i + 1].irLED), _mm_unpackhi_epi64(v, v));
+	}
+	bt_decode_samples_scalar(src, n - i, dst + i);
+}
+
+/**
+ * bt_encode_samples_sse2: Encode n samples, two per iteration.
+ */
+inline void bt_encode_samples_sse2(const Sample *src, size_t n, uint8_t *dst)
+{
+	size_t i = 0;
+	for (; i + 2 <= n; i += 2, dst += 2 * BT_SAMPLE_BYTES)
+	{
+		__m128i a = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(&src[i].irLED));
+		__m128i b = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(&src[i + 1].irLED));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(dst), bt_codec_bswap16_sse2(_mm_unpacklo_epi64(a, b)));
+	}
+	bt_encode_samples_scalar(src + i, n - i, dst);
+}
+#endif
+
+#ifdef BT_CODEC_HAVE_AVX2
+/**
+ * bt_decode_samples_avx2: Decode n samples, four per iteration.
+ */
+__attribute__((target("avx2"))) inline void bt_decode_samples_avx2(const uint8_t *src, size_t n, Sample *dst)
+{
+	const __m256i swap = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+										  1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4, src += 4 * BT_SAMPLE_BYTES)
+	{
+		__m256i v = _mm256_shuffle_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(src)), swap);
+		__m128i lo = _mm256_castsi256_si128(v);
+		__m128i hi = _mm256_extracti128_si256(v, 1);
+
+		for (int k = 0; k < 4; k++)
+			bt_codec_reset_unsent(dst[i + k]);
+		_mm_storel_epi64(reinterpret_cast<__m128i *>(&dst[i].irLED), lo);
+		_mm_storel_epi64(reinterpret_cast<__m128i *>(&dst[i + 1].irLED), _mm_unpackhi_epi64(lo, lo));
+		_mm_storel_epi64(reinterpret_cast<__m128i *>(&dst[i + 2].irLED), hi);
+		_mm_storel_epi64(reinterpret_cast<__m128i *>(&dst[i + 3].irLED), _mm_unpackhi_epi64(hi, hi));
+	}
+	bt_decode_samples_scalar(src, n - i, dst + i);
+}
+
+/**
+ * bt_encode_samples_avx2: Encode n samples, four per iteration.
+ */
+__attribute__((target("avx2"))) inline void bt_encode_samples_avx2(const Sample *src, size_t n, uint8_t *dst)
+{
+	const __m256i swap = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+										  1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4, dst += 4 * BT_SAMPLE_BYTES)
+	{
+		__m128i lo = _mm_unpacklo_epi64(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(&src[i].irLED)),
+										_mm_loadl_epi64(reinterpret_cast<const __m128i *>(&src[i + 1].irLED)));
+		__m128i hi = _mm_unpacklo_epi64(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(&src[i + 2].irLED)),
+										_mm_loadl_epi64(reinterpret_cast<const __m128i *>(&src[i + 3].irLED)));
+		__m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst), _mm256_shuffle_epi8(v, swap));
+	}
+	bt_encode_samples_scalar(src + i, n - i, dst);
+}
+#endif
+
+#ifdef BT_CODEC_HAVE_NEON
+/**
+ * bt_decode_samples_neon: Decode n samples, two per iteration.
+ */
+inline void bt_decode_samples_neon(const uint8_t *src, size_t n, Sample *dst)
+{
+	size_t i = 0;
+	for (; i + 2 <= n; i += 2, src += 2 * BT_SAMPLE_BYTES)
+	{
+		uint8x16_t v = vrev16q_u8(vld1q_u8(src));
+
+		bt_codec_reset_unsent(dst[i]);
+		bt_codec_reset_unsent(dst[i + 1]);
+		vst1_u8(reinterpret_cast<uint8_t *>(&dst[i].irLED), vget_low_u8(v));
+		vst1_u8(reinterpret_cast<uint8_t *>(&dst[i + 1].irLED), vget_high_u8(v));
+	}
+	bt_decode_samples_scalar(src, n - i, dst + i);
+}
+
+/**
+ * bt_encode_samples_neon: Encode n samples, two per iteration.
+ */
+inline void bt_encode_samples_neon(const Sample *src, size_t n, uint8_t *dst)
+{
+	size_t i = 0;
+	for (; i + 2 <= n; i += 2, dst += 2 * BT_SAMPLE_BYTES)
+	{
+		uint8x16_t v = vcombine_u8(vld1_u8(reinterpret_cast<const uint8_t *>(&src[i].irLED)),
+								   vld1_u8(reinterpret_cast<const uint8_t *>(&src[i + 1].irLED)));
+		vst1q_u8(dst, vrev16q_u8(v));
+	}
+	bt_encode_samples_scalar(src + i, n - i, dst);
+}
+#endif
+
+/**
+ * bt_codec_supported: Check if a kernel was compiled in and runs on this CPU.
+ */
+inline bool bt_codec_supported(Codec_Kernel k)
+{
+	switch (k)
+	{
+	case CODEC_SCALAR:
+		return true;
+#ifdef BT_CODEC_HAVE_SSE2
+	case CODEC_SSE2:
+		return true;
+#endif
+#ifdef BT_CODEC_HAVE_AVX2
+	case CODEC_AVX2:
+		return __builtin_cpu_supports("avx2");
+#endif
+#ifdef BT_CODEC_HAVE_NEON
+	case CODEC_NEON:
+		return true;
+#endif
+	default:
+		return false;
+	}
+}
+
+/**
+ * bt_codec_name: Printable name of a kernel
+ */
+inline const char *bt_codec_name(Codec_Kernel k)
+{
+	static const char *names[] = {"scalar", "sse2", "avx2", "neon"};
+	return names[k];
+}
+
+/**
+ * bt_codec_best: Fastest kernel supported by this CPU. Checked once.
+ */
+inline Codec_Kernel bt_codec_best()
+{
+	static const Codec_Kernel best = []() {
+		const Codec_Kernel order[] = {CODEC_AVX2, CODEC_NEON, CODEC_SSE2};
+		for (Codec_Kernel k : order)
+			if (bt_codec_supported(k))
+				return k;
+		return CODEC_SCALAR;
+	}();
+	return best;
+}
+
+/**
+ * bt_decode_samples_with: Decode n samples with a specific kernel.
+ * Falls back to the scalar kernel if k is not supported.
+ */
+inline void bt_decode_samples_with(Codec_Kernel k, const uint8_t *src, size_t n, Sample *dst)
+{
+	switch (bt_codec_supported(k) ? k : CODEC_SCALAR)
+	{
+#ifdef BT_CODEC_HAVE_AVX2
+	case CODEC_AVX2:
+		return bt_decode_samples_avx2(src, n, dst);
+#endif
+#ifdef BT_CODEC_HAVE_SSE2
+	case CODEC_SSE2:
+		return bt_decode_samples_sse2(src, n, dst);
+#endif
+#ifdef BT_CODEC_HAVE_NEON
+	case CODEC_NEON:
+		return bt_decode_samples_neon(src, n, dst);
+#endif
+	default:
+		return bt_decode_samples_scalar(src, n, dst);
+	}
+}
+
+/**
+ * bt_encode_samples_with: Encode n samples with a specific kernel.
+ * Falls back to the scalar kernel if k is not supported.
+ */
+inline void bt_encode_samples_with(Codec_Kernel k, const Sample *src, size_t n, uint8_t *dst)
+{
+	switch (bt_codec_supported(k) ? k : CODEC_SCALAR)
+	{
+#ifdef BT_CODEC_HAVE_AVX2
+	case CODEC_AVX2:
+		return bt_encode_samples_avx2(src, n, dst);
+#endif
+#ifdef BT_CODEC_HAVE_SSE2
+	case CODEC_SSE2:
+		return bt_encode_samples_sse2(src, n, dst);
+#endif
+#ifdef BT_CODEC_HAVE_NEON
+	case CODEC_NEON:
+		return bt_encode_samples_neon(src, n, dst);
+#endif
+	default:
+		return bt_encode_samples_scalar(src, n, dst);
+	}
+}
+
+/**
+ * bt_decode_samples: Decode n samples from wire bytes with the fastest kernel.
+ * Fields that are not sent (timestamp, pilot_state) are reset.
+ * @param src Wire bytes, 8 per sample
+ * @param n Number of samples
+ * @param dst Location to write n samples to
+ */
+inline void bt_decode_samples(const uint8_t *src, size_t n, Sample *dst)
+{
+	bt_decode_samples_with(bt_codec_best(), src, n, dst);
+}
+
+/**
+ * bt_encode_samples: Encode n samples to wire bytes with the fastest kernel.
+ * @param src Samples to encode
+ * @param n Number of samples
+ * @param dst Location to write 8 * n bytes to
+ */
+inline void bt_encode_samples(const Sample *src, size_t n, uint8_t *dst)
+{
+	bt_encode_samples_with(bt_codec_best(), src, n, dst);
+}
@@ -0,0 +1,219 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cmath>
+
+// exchanges the offset is filtered over, the one that took the least time is used
+#define CLOCK_SYNC_HISTORY 8
+
+// filtered offsets the drift is fitted over
+#define CLOCK_SYNC_DRIFT_POINTS 32
+
+// exchanges needed before remote times are converted
+#define CLOCK_SYNC_MIN_EXCHANGES 4
+
+// offsets this far apart in time give a drift worth using, us
+#define CLOCK_SYNC_MIN_DRIFT_SPAN 10000000
+
+// crystals are good to about 100 ppm, a fit beyond this is noise
+#define CLOCK_SYNC_MAX_DRIFT_PPM 500.0
+
+struct Clock_Sync_Stats
+{
+	uint64_t exchanges{0}; // responses accepted
+	uint64_t rejected{0};  // responses whose times did not add up
+	double offset_us{0};   // remote clock minus local clock, now
+	int64_t delay_us{0};   // round trip of the exchange the offset is taken from
+	double drift_ppm{0};   // how much faster the remote clock runs than the local one
+	bool synced{false};
+};
+
+/**
+ * Clock_Sync
+ * Estimates the offset and drift of a remote clock from NTP style exchanges:
+ * the local side notes t1 and sends a request, the remote side notes t2 when
+ * it arrives and t3 when it answers, and the local side notes t4 when the
+ * answer arrives. Then
+ *   offset = ((t2 - t1) + (t3 - t4)) / 2   (remote minus local)
+ *   delay  = (t4 - t1) - (t3 - t2)          (time spent on the link)
+ * An exchange's offset is off by at most half its delay, so of the last
+ * CLOCK_SYNC_HISTORY exchanges the one with the least delay is used, like
+ * NTP's clock filter. Every time that changes, its offset is kept as a point
+ * and a least squares line through the last CLOCK_SYNC_DRIFT_POINTS points
+ * gives the drift, so times between exchanges follow the remote clock's rate.
+ * All times are microseconds. Every exchange is O(CLOCK_SYNC_DRIFT_POINTS)
+ * and nothing is allocated.
+ */
+class Clock_Sync
+{
+private:
+	struct Exchange
+	{
+		int64_t local{0}; // middle of the exchange on the local clock
+		int64_t offset{0};
+		int64_t delay{0};
+	};
+
+	Exchange history[CLOCK_SYNC_HISTORY];
+	size_t history_count{0};
+	size_t history_pos{0};
+
+	Exchange points[CLOCK_SYNC_DRIFT_POINTS];
+	size_t point_count{0};
+	size_t point_pos{0};
+
+	// offset(t) = base_offset + drift * (t - base_local)
+	int64_t base_local{0};
+	double base_offset{0};
+	double drift{0};
+	int64_t best_delay{0};
+
+	uint64_t accepted{0};
+	uint64_t refused{0};
+
+	void fit();
+
+public:
+	bool add(int64_t t1, int64_t t2, int64_t t3, int64_t t4);
+	void reset();
+
+	bool synced() const { return accepted >= CLOCK_SYNC_MIN_EXCHANGES; }
+	double offset(int64_t local) const;
+	int64_t to_local(int64_t remote) const;
+	int64_t to_remote(int64_t local) const;
+	Clock_Sync_Stats stats(int64_t now) const;
+};
+
+/**
+ * add: Account for one request and response
+ * @param t1: Local time the request was sent
+ * @param t2: Remote time the request arrived
+ * @param t3: Remote time the response was sent
+ * @param t4: Local time the response arrived
+ * @returns false if the times do not add up and the exchange was ignored
+ */
+inline bool Clock_Sync::add(int64_t t1, int64_t t2, int64_t t3, int64_t t4)
+{
+	Exchange e;
+	e.delay = (t4 - t1) - (t3 - t2);
+	if (t4 < t1 || t3 < t2 || e.delay < 0)
+	{
+		refused++;
+		return false;
+	}
+	e.local = t1 + (t4 - t1) / 2;
+	e.offset = ((t2 - t1) + (t3 - t4)) / 2;
+
+	history[history_pos] = e;
+	history_pos = (history_pos + 1) % CLOCK_SYNC_HISTORY;
+	if (history_count < CLOCK_SYNC_HISTORY)
+		history_count++;
+	accepted++;
+
+	// the quickest recent exchange, the newest of equals
+	const Exchange *best = &history[0];
+	for (size_t i = 1; i < history_count; i++)
+		if (history[i].delay < best->delay || (history[i].delay == best->delay && history[i].local > best->local))
+			best = &history[i];
+
+	// a new best gives a new point on the offset line
+	const Exchange &last = points[(point_pos + CLOCK_SYNC_DRIFT_POINTS - 1) % CLOCK_SYNC_DRIFT_POINTS];
+	if (point_count == 0 || best->local != last.local)
+	{
+		points[point_pos] = *best;
+		point_pos = (point_pos + 1) % CLOCK_SYNC_DRIFT_POINTS;
+		if (point_count < CLOCK_SYNC_DRIFT_POINTS)
+			point_count++;
+		fit();
+	}
+	best_delay = best->delay;
+	return true;
+}
+
+/**
+ * fit: Internal function. Fit the offset line through the kept points.
+ * Until the points span CLOCK_SYNC_MIN_DRIFT_SPAN the newest offset is used as is.
+ */
+inline void Clock_Sync::fit()
+{
+	const Exchange &newest = points[(point_pos + CLOCK_SYNC_DRIFT_POINTS - 1) % CLOCK_SYNC_DRIFT_POINTS];
+	base_local = newest.local;
+	base_offset = newest.offset;
+	drift = 0;
+
+	int64_t oldest = newest.local;
+	for (size_t i = 0; i < point_count; i++)
+		if (points[i].local < oldest)
+			oldest = points[i].local;
+	if (point_count < 3 || newest.local - oldest < CLOCK_SYNC_MIN_DRIFT_SPAN)
+		return;
+
+	// relative to the newest point, so the sums keep their precision
+	double sx{0}, sy{0}, sxx{0}, sxy{0};
+	for (size_t i = 0; i < point_count; i++)
+	{
+		double x = (double)(points[i].local - newest.local);
+		double y = (double)(points[i].offset - newest.offset);
+		sx += x;
+		sy += y;
+		sxx += x * x;
+		sxy += x * y;
+	}
+	double n = (double)point_count;
+	double slope = (n * sxy - sx * sy) / (n * sxx - sx * sx);
+	double max = CLOCK_SYNC_MAX_DRIFT_PPM / 1e6;
+	drift = (slope > max) ? max : (slope < -max) ? -max : slope;
+
+	// the line goes through the mean of the points
+	base_offset = newest.offset + (sy - drift * sx) / n;
+}
+
+/**
+ * offset: Remote clock minus local clock at a local time
+ */
+inline double Clock_Sync::offset(int64_t local) const
+{
+	return base_offset + drift * (double)(local - base_local);
+}
+
+/**
+ * to_local: Convert a remote time to the local clock
+ */
+inline int64_t Clock_Sync::to_local(int64_t remote) const
+{
+	// remote = local + offset(local), solved for local
+	return base_local + (int64_t)std::llround(((double)(remote - base_local) - base_offset) / (1.0 + drift));
+}
+
+/**
+ * to_remote: Convert a local time to the remote clock
+ */
+inline int64_t Clock_Sync::to_remote(int64_t local) const
+{
+	return local + (int64_t)std::llround(offset(local));
+}
+
+/**
+ * stats: Get the estimate and counters
+ * @param now: Local time to give the offset at
+ */
+inline Clock_Sync_Stats Clock_Sync::stats(int64_t now) const
+{
+	Clock_Sync_Stats st;
+	st.exchanges = accepted;
+	st.rejected = refused;
+	st.offset_us = offset(now);
+	st.delay_us = best_delay;
+	st.drift_ppm = drift * 1e6;
+	st.synced = synced();
+	return st;
+}
+
+/**
+ * reset: Forget every exchange, ie: when the remote side connects again
+ */
+inline void Clock_Sync::reset()
+{
+	*this = Clock_Sync();
+}
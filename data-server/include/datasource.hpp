@@ -9,7 +9,18 @@
 #include <chrono>
 #include <forward_list>
 #include <functional>
-#include <queue>
+#include <memory>
+#include <string>
+
+#include "ds_spsc_queue.hpp"
+#include "ds_sample_pool.hpp"
+#include "ds_consumer_thread.hpp"
+
+// number of collected samples that can wait for processing before the collector starts dropping them
+#define SAMPLE_QUEUE_LENGTH 256
+
+// number of preallocated samples shared by the collection and processing threads
+#define SAMPLE_POOL_LENGTH 512
 
 // An enumeration of all data sources. Currently, only the MAX30100 is implemented.
 enum Source
@@ -62,6 +73,8 @@ struct Sample
 class Datasource
 {
 public:
+	virtual ~Datasource() {}
+
 	// Spawns two threads:
 	// 	1. A data collection thread that reads samples at a
 	// 	set rate and pushes them to this->unprocessedSamples
@@ -83,9 +96,69 @@ public:
 		this->callbacks.push_front(callbackFunction);
 	}
 
+	// Registers a batch callback function with this datasource.
+	// Samples that arrive together (ie: one bluetooth packet) are passed
+	// in a single call as a pointer to the first sample and a count.
+	void registerBatchCallback(std::function<void(const Sample *, size_t)> callbackFunction)
+	{
+		this->batchCallbacks.push_front(callbackFunction);
+	}
+
+	// Registers a batch callback function that runs on its own thread.
+	// Samples are copied into a bounded queue of queueLength samples and
+	// delivered from there, so a slow consumer does not delay the datasource.
+	// policy decides what happens when the consumer falls queueLength behind.
+	// The returned object reports the consumer's queue depth and lag.
+	Consumer_Thread<Sample> *registerAsyncBatchCallback(
+		const std::string &name,
+		std::function<void(const Sample *, size_t)> callbackFunction,
+		Overflow_Policy policy = OVERFLOW_DROP_OLDEST,
+		size_t queueLength = 1024)
+	{
+		this->consumers.emplace_front(new Consumer_Thread<Sample>(name, callbackFunction, policy, queueLength));
+		Consumer_Thread<Sample> *consumer = this->consumers.front().get();
+		this->registerBatchCallback([consumer](const Sample *s, size_t n) { consumer->push(s, n); });
+		return consumer;
+	}
+
+	// Print queue statistics for every consumer registered with registerAsyncBatchCallback
+	void printConsumerStats()
+	{
+		for (auto &c : this->consumers)
+			c->print_stats();
+	}
+
+	// Allocation counters for the sample pool. heap_allocations() should
+	// stay at zero once the datasource is running.
+	const Sample_Pool<Sample, SAMPLE_POOL_LENGTH> &getSamplePool() const
+	{
+		return this->samplePool;
+	}
+
 protected:
+	// Pass n samples to every batch callback once, then to every
+	// per-sample callback one sample at a time.
+	void dispatch(Sample *first, size_t n)
+	{
+		if (n == 0)
+			return;
+
+		for (auto &clb : this->batchCallbacks)
+			clb(first, n);
+
+		for (auto &clb : this->callbacks)
+			for (size_t i = 0; i < n; i++)
+				clb(first + i);
+	}
+
 	// std::forward_list<std::function<void(struct Sample*)>> callbacks;
 	std::forward_list<std::function<void(Sample *)>> callbacks;
-	std::queue<struct Sample *> unprocessedData;
+	std::forward_list<std::function<void(const Sample *, size_t)>> batchCallbacks;
+	// consumers with their own threads, stopped when the datasource is destroyed
+	std::forward_list<std::unique_ptr<Consumer_Thread<Sample>>> consumers;
+	// collection thread -> processing thread handoff
+	SPSC_Queue<struct Sample *, SAMPLE_QUEUE_LENGTH> unprocessedData;
+	// preallocated samples, acquired by the collection thread and released by the processing thread
+	Sample_Pool<Sample, SAMPLE_POOL_LENGTH> samplePool;
 };
 #endif
@@ -0,0 +1,282 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// What a Consumer_Thread does when its queue is full
+enum Overflow_Policy
+{
+	OVERFLOW_BLOCK,		  // the datasource waits for space, nothing is lost
+	OVERFLOW_DROP_OLDEST, // the oldest queued samples are overwritten
+	OVERFLOW_COALESCE	  // queued samples are discarded so the consumer jumps to the newest data
+};
+
+/**
+ * Consumer_Stats
+ * Snapshot of a Consumer_Thread's counters
+ */
+struct Consumer_Stats
+{
+	uint64_t enqueued{0};	// samples accepted from the datasource
+	uint64_t delivered{0};	// samples passed to the callback
+	uint64_t dropped{0};	// samples overwritten by OVERFLOW_DROP_OLDEST
+	uint64_t coalesced{0};	// samples discarded by OVERFLOW_COALESCE
+	uint64_t blocked{0};	// times the datasource had to wait under OVERFLOW_BLOCK
+	size_t depth{0};		// samples currently queued
+	size_t max_depth{0};	// most samples ever queued
+	uint64_t last_lag_us{0}; // queue time of the oldest sample in the last delivered batch
+	uint64_t max_lag_us{0};
+	uint64_t avg_lag_us{0};
+};
+
+/**
+ * Consumer_Thread
+ * Runs one datasource consumer on its own thread behind a bounded queue so a
+ * slow consumer cannot delay the datasource or any other consumer.
+ * @param SAMPLE_TYPE Type of sample being delivered
+ */
+template <typename SAMPLE_TYPE>
+class Consumer_Thread
+{
+private:
+	std::string consumer_name;
+	std::function<void(const SAMPLE_TYPE *, size_t)> callback;
+	Overflow_Policy policy;
+
+	// ring of queued samples and the time each was queued
+	std::vector<SAMPLE_TYPE> queue;
+	std::vector<std::chrono::steady_clock::time_point> queued_at;
+	size_t head{0};
+	size_t count{0};
+
+	// samples handed to the callback, only touched by the consumer thread
+	std::vector<SAMPLE_TYPE> batch;
+
+	std::mutex guard;
+	std::condition_variable not_empty;
+	std::condition_variable not_full;
+	bool is_quit{false};
+
+	Consumer_Stats counters;
+	uint64_t total_lag_us{0};
+	uint64_t batches{0};
+
+	std::thread worker;
+
+	void run();
+	void enqueue(const SAMPLE_TYPE *src, size_t n, std::chrono::steady_clock::time_point now);
+
+public:
+	Consumer_Thread(const std::string &name, std::function<void(const SAMPLE_TYPE *, size_t)> fn, Overflow_Policy p, size_t capacity);
+	~Consumer_Thread();
+
+	void push(const SAMPLE_TYPE *src, size_t n);
+	void quit();
+
+	const std::string &name() const { return consumer_name; }
+	Consumer_Stats stats();
+	void print_stats();
+};
+
+/**
+ * Consumer_Thread: Start a consumer thread
+ * @param name Name used when reporting statistics
+ * @param fn Batch callback run on the consumer thread
+ * @param p What to do when the queue is full
+ * @param capacity Number of samples the queue holds
+ */
+template <class SAMPLE_TYPE>
+Consumer_Thread<SAMPLE_TYPE>::Consumer_Thread(const std::string &name, std::function<void(const SAMPLE_TYPE *, size_t)> fn, Overflow_Policy p, size_t capacity)
+	: consumer_name(name), callback(fn), policy(p), queue(capacity), queued_at(capacity), batch(capacity)
+{
+	worker = std::thread(&Consumer_Thread::run, this);
+}
+
+template <class SAMPLE_TYPE>
+Consumer_Thread<SAMPLE_TYPE>::~Consumer_Thread()
+{
+	quit();
+}
+
+/**
+ * quit: Stop the consumer thread. Samples still queued are not delivered.
+ */
+template <class SAMPLE_TYPE>
+void Consumer_Thread<SAMPLE_TYPE>::quit()
+{
+	{
+		std::lock_guard<std::mutex> lock(guard);
+		is_quit = true;
+	}
+	not_empty.notify_all();
+	not_full.notify_all();
+
+	if (worker.joinable())
+		worker.join();
+}
+
+/**
+ * push: Queue samples for the consumer. Called from the datasource thread.
+ * Only blocks when the policy is OVERFLOW_BLOCK and the queue is full.
+ * @param src Pointer to the first sample
+ * @param n Number of samples
+ */
+template <class SAMPLE_TYPE>
+void Consumer_Thread<SAMPLE_TYPE>::push(const SAMPLE_TYPE *src, size_t n)
+{
+	const size_t capacity = queue.size();
+	auto now = std::chrono::steady_clock::now();
+
+	std::unique_lock<std::mutex> lock(guard);
+
+	if (policy == OVERFLOW_BLOCK)
+	{
+		// hand the samples over in pieces as space frees up
+		while (n > 0 && !is_quit)
+		{
+			if (count == capacity)
+			{
+				counters.blocked++;
+				not_full.wait(lock, [&]() { return count < capacity || is_quit; });
+				continue;
+			}
+
+			size_t k = std::min(n, capacity - count);
+			enqueue(src, k, now);
+			src += k;
+			n -= k;
+			not_empty.notify_one();
+		}
+		return;
+	}
+
+	// only the newest capacity samples can ever be kept
+	if (n > capacity)
+	{
+		size_t skipped = n - capacity;
+		if (policy == OVERFLOW_DROP_OLDEST)
+			counters.dropped += skipped;
+		else
+			counters.coalesced += skipped;
+		src += skipped;
+		n = capacity;
+	}
+
+	size_t overflow = (count + n > capacity) ? count + n - capacity : 0;
+	if (overflow > 0)
+	{
+		if (policy == OVERFLOW_DROP_OLDEST)
+		{
+			head = (head + overflow) % capacity;
+			count -= overflow;
+			counters.dropped += overflow;
+		}
+		else
+		{
+			// throw away everything queued, the consumer restarts from the newest batch
+			counters.coalesced += count;
+			head = 0;
+			count = 0;
+		}
+	}
+
+	enqueue(src, n, now);
+	lock.unlock();
+	not_empty.notify_one();
+}
+
+/**
+ * enqueue: Internal function. Copy samples into the ring, caller holds the lock and has made space.
+ */
+template <class SAMPLE_TYPE>
+void Consumer_Thread<SAMPLE_TYPE>::enqueue(const SAMPLE_TYPE *src, size_t n, std::chrono::steady_clock::time_point now)
+{
+	const size_t capacity = queue.size();
+	for (size_t i = 0; i < n; i++)
+	{
+		size_t slot = (head + count + i) % capacity;
+		queue[slot] = src[i];
+		queued_at[slot] = now;
+	}
+	count += n;
+
+	counters.enqueued += n;
+	if (count > counters.max_depth)
+		counters.max_depth = count;
+}
+
+/**
+ * run: Thread entry point. Deliver queued samples to the callback until quit() is called.
+ */
+template <class SAMPLE_TYPE>
+void Consumer_Thread<SAMPLE_TYPE>::run()
+{
+	const size_t capacity = queue.size();
+
+	while (true)
+	{
+		std::unique_lock<std::mutex> lock(guard);
+		not_empty.wait(lock, [&]() { return count > 0 || is_quit; });
+		if (is_quit)
+			return;
+
+		// take everything queued
+		size_t n = count;
+		auto oldest = queued_at[head];
+		for (size_t i = 0; i < n; i++)
+			batch[i] = queue[(head + i) % capacity];
+		head = (head + n) % capacity;
+		count = 0;
+		lock.unlock();
+		not_full.notify_one();
+
+		uint64_t lag = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - oldest).count();
+
+		callback(batch.data(), n);
+
+		lock.lock();
+		counters.delivered += n;
+		counters.last_lag_us = lag;
+		if (lag > counters.max_lag_us)
+			counters.max_lag_us = lag;
+		total_lag_us += lag;
+		batches++;
+	}
+}
+
+/**
+ * stats: Get a snapshot of this consumer's counters
+ * @returns Consumer_Stats
+ */
+template <class SAMPLE_TYPE>
+Consumer_Stats Consumer_Thread<SAMPLE_TYPE>::stats()
+{
+	std::lock_guard<std::mutex> lock(guard);
+	Consumer_Stats ret = counters;
+	ret.depth = count;
+	ret.avg_lag_us = batches ? total_lag_us / batches : 0;
+	return ret;
+}
+
+/**
+ * print_stats: Print this consumer's counters
+ */
+template <class SAMPLE_TYPE>
+void Consumer_Thread<SAMPLE_TYPE>::print_stats()
+{
+	Consumer_Stats s = stats();
+	printf("(Consumer %s) enqueued: %llu delivered: %llu dropped: %llu coalesced: %llu blocked: %llu depth: %zu (max %zu) lag us (last/avg/max): %llu/%llu/%llu\n",
+		   consumer_name.c_str(),
+		   (unsigned long long)s.enqueued, (unsigned long long)s.delivered,
+		   (unsigned long long)s.dropped, (unsigned long long)s.coalesced, (unsigned long long)s.blocked,
+		   s.depth, s.max_depth,
+		   (unsigned long long)s.last_lag_us, (unsigned long long)s.avg_lag_us, (unsigned long long)s.max_lag_us);
+}
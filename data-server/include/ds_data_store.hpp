@@ -54,9 +54,11 @@ private:
     uint32_t ece_bpm{0};
     uint32_t ece_po2{0};
 
+    Reader<SAMPLE_TYPE> &reader_of(const std::thread::id id);
     void apply_new_data(const std::thread::id id);
 
 public:
+    Data_Store();
     Data_Store(Datasource *ds);
     ~Data_Store();
 
@@ -72,9 +74,12 @@ public:
     uint32_t get_ece_bpm() const;
     uint32_t get_ece_po2() const;
 
-    void new_data(SAMPLE_TYPE *src, size_t len);
-    void new_data(SAMPLE_TYPE *s);
-    void new_data(SAMPLE_TYPE s);
+    int new_data(const SAMPLE_TYPE *src, size_t len);
+    int new_data(SAMPLE_TYPE *s);
+    int new_data(SAMPLE_TYPE s);
+
+    template <typename FILL>
+    int emplace_data(size_t len, FILL fill);
 
     void register_reader_thread();
 
@@ -85,19 +90,35 @@ public:
 
     int copy(SAMPLE_TYPE *s, size_t len);
 
+    typedef Looping_Buffer_View<SAMPLE_TYPE, BUFFER_LENGTH> View;
+    View view(size_t max = BUFFER_LENGTH / 2);
+    View latest(size_t len);
+
     int available_samples();
     int size();
 };
 
+/**
+ * Data_Store: Create a data store that is written to with new_data()
+ */
 template <typename SAMPLE_TYPE>
-Data_Store<SAMPLE_TYPE>::Data_Store(Datasource *ds)
+Data_Store<SAMPLE_TYPE>::Data_Store()
 {
     // reserve space for 16 potential reader threads
     read_buffers.reserve(16);
+}
+
+/**
+ * Data_Store: Create a data store that receives every sample from a datasource
+ * @param ds Datasource to listen to
+ */
+template <typename SAMPLE_TYPE>
+Data_Store<SAMPLE_TYPE>::Data_Store(Datasource *ds) : Data_Store()
+{
 
     // Listen to the datasource for new data asynchronously
-    // std::function<void(struct SAMPLE_TYPE*)> callback(std::bind(&Data_Store::new_data, this));
-    ds->registerCallback([&](Sample *s) { new_data(*s); });
+    // whole packets are written at once so the buffer is locked once per packet
+    ds->registerBatchCallback([&](const Sample *s, size_t n) { new_data(s, n); });
 }
 
 template <typename SAMPLE_TYPE>
@@ -207,7 +228,7 @@ uint32_t Data_Store<SAMPLE_TYPE>::get_ece_po2() const
  * @returns Number of SAMPLE_TYPE successfully added to the buffer
  */
 template <typename SAMPLE_TYPE>
-void Data_Store<SAMPLE_TYPE>::new_data(SAMPLE_TYPE *src, size_t len)
+int Data_Store<SAMPLE_TYPE>::new_data(const SAMPLE_TYPE *src, size_t len)
 {
     return samples.block_write(src, len);
 }
@@ -218,9 +239,9 @@ void Data_Store<SAMPLE_TYPE>::new_data(SAMPLE_TYPE *src, size_t len)
  * @returns Number of SAMPLE_TYPE successfully added to buffer
  */
 template <typename SAMPLE_TYPE>
-void Data_Store<SAMPLE_TYPE>::new_data(SAMPLE_TYPE s)
+int Data_Store<SAMPLE_TYPE>::new_data(SAMPLE_TYPE s)
 {
-    samples.block_write(&s, 1);
+    return samples.block_write(&s, 1);
 }
 
 /**
@@ -229,9 +250,22 @@ void Data_Store<SAMPLE_TYPE>::new_data(SAMPLE_TYPE s)
  * @returns Number of SAMPLE_TYPE successfully added to buffer
  */
 template <typename SAMPLE_TYPE>
-void Data_Store<SAMPLE_TYPE>::new_data(SAMPLE_TYPE *s)
+int Data_Store<SAMPLE_TYPE>::new_data(SAMPLE_TYPE *s)
 {
-    samples.block_write(s, 1);
+    return samples.block_write(s, 1);
+}
+
+/**
+ * emplace_data: Write SAMPLE_TYPEs straight into the data buffer (ie: decode a packet in place).
+ * @param len: Number of SAMPLE_TYPE to be added
+ * @param fill: Called as fill(SAMPLE_TYPE *dest, size_t offset, size_t n), see Looping_Buffer::block_emplace
+ * @returns Number of SAMPLE_TYPE successfully added to the buffer
+ */
+template <typename SAMPLE_TYPE>
+template <typename FILL>
+int Data_Store<SAMPLE_TYPE>::emplace_data(size_t len, FILL fill)
+{
+    return samples.block_emplace(len, fill);
 }
 
 /**
@@ -245,6 +279,19 @@ void Data_Store<SAMPLE_TYPE>::register_reader_thread()
     read_buffers.insert(std::make_pair(std::this_thread::get_id(), Reader<SAMPLE_TYPE>()));
 }
 
+/**
+ * reader_of: Internal function, look up a registered reader thread. The lookup is
+ * guarded since other threads may register at any time, the Reader itself stays put.
+ * @param id Thread id
+ * @returns The thread's Reader
+ */
+template <typename SAMPLE_TYPE>
+Reader<SAMPLE_TYPE> &Data_Store<SAMPLE_TYPE>::reader_of(const std::thread::id id)
+{
+    std::lock_guard<std::mutex> guard(map_guard);
+    return read_buffers.at(id);
+}
+
 /**
  * begin: Copy newest available samples into vector, return iterator.
  * @returns Vector iterator at beginning of new samples vector
@@ -253,7 +300,7 @@ template <typename SAMPLE_TYPE>
 typename std::vector<SAMPLE_TYPE>::iterator Data_Store<SAMPLE_TYPE>::begin()
 {
     apply_new_data(std::this_thread::get_id());
-    return read_buffers.at(std::this_thread::get_id()).sample_buffer.begin();
+    return reader_of(std::this_thread::get_id()).sample_buffer.begin();
 }
 
 /**
@@ -263,7 +310,7 @@ typename std::vector<SAMPLE_TYPE>::iterator Data_Store<SAMPLE_TYPE>::begin()
 template <typename SAMPLE_TYPE>
 typename std::vector<SAMPLE_TYPE>::iterator Data_Store<SAMPLE_TYPE>::end()
 {
-    return read_buffers.at(std::this_thread::get_id()).sample_buffer.end();
+    return reader_of(std::this_thread::get_id()).sample_buffer.end();
 }
 
 /**
@@ -274,19 +321,65 @@ template <typename SAMPLE_TYPE>
 const std::vector<SAMPLE_TYPE> &Data_Store<SAMPLE_TYPE>::vec()
 {
     apply_new_data(std::this_thread::get_id());
-    return read_buffers.at(std::this_thread::get_id()).sample_buffer;
+    return reader_of(std::this_thread::get_id()).sample_buffer;
 }
 
 /**
  * copy: Skip thread tracking, grab from oldest available Sample
  * @param s Location to copy samples to
  * @param len Number of samples to copy
- * @returns Number of samples successfully copied
+ * @returns Number of samples successfully copied, 0 if fewer have been received
  */
 template <typename SAMPLE_TYPE>
 int Data_Store<SAMPLE_TYPE>::copy(SAMPLE_TYPE *s, size_t len)
 {
-    return samples.copy_to(s, samples.samples_recv() - len, samples.samples_recv());
+    if (len == 0 || len > BUFFER_LENGTH)
+        return 0;
+
+    int read_count;
+    do
+    {
+        // one count for both ends, a write between two reads of it would shift the range
+        int recv = samples.samples_recv();
+        if (recv < (int)len)
+            return 0;
+        // nothing is read if the writer lapped the oldest sample first, the newest len are read instead
+        read_count = samples.block_read(recv - len, recv, s);
+    } while (read_count == 0);
+    return read_count;
+}
+
+/**
+ * view: Get the samples this thread has not read yet, where they lie in the
+ * buffer, without copying them. Calling thread must be registered as a reader.
+ * Use the samples, then check View::valid() before trusting what was made of them.
+ * @param max Most samples to view, a reader further behind skips to the newest max.
+ *            The writer reaches the oldest of them after BUFFER_LENGTH - max more samples.
+ * @returns View of the new samples, its from and to are their sequence range
+ */
+template <typename SAMPLE_TYPE>
+typename Data_Store<SAMPLE_TYPE>::View Data_Store<SAMPLE_TYPE>::view(size_t max)
+{
+    Reader<SAMPLE_TYPE> &reader = reader_of(std::this_thread::get_id());
+
+    uint32_t recv = samples.samples_recv();
+    uint32_t from = reader.count;
+    if (recv - from > max)
+        from = recv - max;
+    reader.count = recv;
+    return samples.view(from, recv);
+}
+
+/**
+ * latest: Skip thread tracking, view the newest samples without copying them
+ * @param len Number of samples to view
+ * @returns View of the samples, empty if fewer have been received
+ */
+template <typename SAMPLE_TYPE>
+typename Data_Store<SAMPLE_TYPE>::View Data_Store<SAMPLE_TYPE>::latest(size_t len)
+{
+    int recv = samples.samples_recv();
+    return samples.view(recv - len, recv);
 }
 
 /**
@@ -296,7 +389,7 @@ int Data_Store<SAMPLE_TYPE>::copy(SAMPLE_TYPE *s, size_t len)
 template <typename SAMPLE_TYPE>
 int Data_Store<SAMPLE_TYPE>::available_samples()
 {
-    return samples.samples_recv() - read_buffers.at(std::this_thread::get_id()).count;
+    return samples.samples_recv() - reader_of(std::this_thread::get_id()).count;
 }
 
 /**
@@ -306,16 +399,24 @@ int Data_Store<SAMPLE_TYPE>::available_samples()
 template <typename SAMPLE_TYPE>
 void Data_Store<SAMPLE_TYPE>::apply_new_data(const std::thread::id id)
 {
-    Reader<SAMPLE_TYPE> &reader = read_buffers.at(id);
+    Reader<SAMPLE_TYPE> &reader = reader_of(id);
 
     // copy directly into vector
     // this is probably a bad idea but I
     // could not think of a better way to do this
 
+    // the writer does not wait for readers, size the vector for the count copied up to.
+    // A reader further behind skips to the newest half of the buffer, like view()
+    uint32_t recv = samples.samples_recv();
+    if (recv - reader.count > BUFFER_LENGTH / 2)
+        reader.count = recv - BUFFER_LENGTH / 2;
     reader.sample_buffer.clear();
-    reader.sample_buffer.resize(available_samples());
+    reader.sample_buffer.resize(recv - reader.count);
 
-    reader.count += samples.copy_to(&reader.sample_buffer[0], reader.count, samples.samples_recv());
+    // nothing is read if the writer lapped the samples before they were copied
+    int read = samples.block_read(reader.count, recv, reader.sample_buffer.data());
+    reader.sample_buffer.resize(read);
+    reader.count += read;
     // add exceptions if missed data?
 }
 
@@ -1,12 +1,50 @@
 #pragma once
 
 #include <mutex>
+#include <atomic>
 #include <cstring>
+#include <algorithm>
 
 #include "datasource.hpp"
+
+template <typename TYPE, int LENGTH>
+class Looping_Buffer;
+
+/**
+ * Looping_Buffer_View
+ * Samples from to to of a Looping_Buffer, read where they lie in the buffer
+ * instead of copied out: one contiguous span, and a second one from the start
+ * of the buffer when they wrap around its end. The writer does not wait for
+ * views, so use the samples, then check valid(): if a write has reached them
+ * since the view was taken they may have changed while they were used.
+ */
+template <typename TYPE, int LENGTH>
+struct Looping_Buffer_View
+{
+	const TYPE *first{nullptr};
+	size_t first_len{0};
+	const TYPE *second{nullptr};
+	size_t second_len{0};
+	uint32_t from{0}; // sequence number of the first sample, ie: samples written before it
+	uint32_t to{0};	  // sequence number after the last sample
+	const Looping_Buffer<TYPE, LENGTH> *lb{nullptr};
+
+	size_t size() const { return to - from; }
+	bool empty() const { return from == to; }
+	const TYPE &operator[](size_t i) const { return (i < first_len) ? first[i] : second[i - first_len]; }
+	bool valid() const;
+};
+
 /**
  * Looping_Buffer
  * Constant buffer for reading and writing
+ * One writer at a time, any number of readers that never lock: the writer
+ * first claims the slots it is about to overwrite, then writes them, then
+ * publishes the new count with a release store. A reader copies what the
+ * count says is there and afterwards checks whether any write claimed one
+ * of the slots it copied in the meantime, like a seqlock per slot range. If
+ * one did the copy may be torn, block_read() copies again, try_read() gives up.
+ * Samples that were already overwritten when the read starts are not copied.
  * @param TYPE data type of buffer
  * @param LENGTH number of data samples to store in buffer
  */
@@ -15,8 +53,14 @@ class Looping_Buffer
 {
 private:
 	TYPE buffer[LENGTH];
-	std::mutex mut;	   // control access to the buffer
-	uint32_t count{0}; // count the number of received samples
+	std::mutex mut;						 // one writer at a time, readers never take it
+	std::atomic<uint32_t> count{0};		 // count the number of received samples, published after they are written
+	std::atomic<uint32_t> claimed{0};	 // end of the samples being written, set before they are
+	std::atomic<uint64_t> torn_count{0}; // reads that overlapped a write or were lapped, and were copied again or given up
+
+	int read_once(TYPE *dest, int from, int to, bool &torn);
+
+	friend struct Looping_Buffer_View<TYPE, LENGTH>;
 
 public:
 	int copy_from(const TYPE *src, size_t len);
@@ -25,13 +69,18 @@ public:
 
 	int block_read(int from, int to, TYPE *dest);
 	int try_read(int from, int to, TYPE *dest);
+	Looping_Buffer_View<TYPE, LENGTH> view(int from, int to) const;
 
 	int block_write(const TYPE *src, size_t len);
 	int try_write(const TYPE *src, size_t len);
 
+	template <typename FILL>
+	int block_emplace(size_t len, FILL fill);
+
 	void print_state();
 
 	int samples_recv();
+	uint64_t torn_reads() const { return torn_count.load(std::memory_order_relaxed); }
 };
 
 template <class TYPE, int LENGTH>
@@ -41,42 +90,118 @@ Looping_Buffer<TYPE, LENGTH>::Looping_Buffer()
 }
 
 /**
- * block_read: Unlock buffer and copy data from the buffer. 
- * Block if buffer is locked.
+ * valid: Check no write has reached the view's samples since it was taken
+ * @returns false if the samples may have changed while they were used
+ */
+template <typename TYPE, int LENGTH>
+bool Looping_Buffer_View<TYPE, LENGTH>::valid() const
+{
+	if (empty())
+		return true;
+	// orders the reads of the samples before the claim is read, like read_once()
+	std::atomic_thread_fence(std::memory_order_acquire);
+	return lb->claimed.load(std::memory_order_relaxed) - from <= (uint32_t)LENGTH;
+}
+
+/**
+ * view: Get samples from the buffer where they lie, without copying or locking.
+ * @param from Beginning sample
+ * @param to Ending sample
+ * @returns View of the samples, empty if they have not been written or were overwritten already
+ */
+template <class TYPE, int LENGTH>
+Looping_Buffer_View<TYPE, LENGTH> Looping_Buffer<TYPE, LENGTH>::view(int from, int to) const
+{
+	Looping_Buffer_View<TYPE, LENGTH> v;
+	v.lb = this;
+
+	int published = (int)count.load(std::memory_order_acquire);
+	int len = to - from;
+	if (from < 0 || len <= 0 || len > LENGTH || to > published)
+		return v;
+	v.from = from;
+	v.to = to;
+	if (!v.valid())
+	{
+		v.from = v.to = 0;
+		return v;
+	}
+
+	v.first = buffer + from % LENGTH;
+	v.first_len = std::min(len, LENGTH - from % LENGTH);
+	if (v.first_len < (size_t)len)
+	{
+		v.second = buffer;
+		v.second_len = len - v.first_len;
+	}
+	return v;
+}
+
+/**
+ * block_read: Copy data from the buffer without locking it.
+ * Copy again until no write overlapped the copy.
  * @param from Beginning sample
  * @param to Ending sample
  * @param dest Location to copy samples to
- * @returns Number of samples successfully read
+ * @returns Number of samples successfully read, 0 if from was overwritten already
  */
 template <class TYPE, int LENGTH>
 int Looping_Buffer<TYPE, LENGTH>::block_read(int from, int to, TYPE *dest)
 {
-	int read_count{0};
-	mut.lock();
-	// copy data
-	read_count = copy_to(dest, from, to);
-	mut.unlock();
-	return read_count;
+	bool torn;
+	int read_count;
+	do
+		read_count = read_once(dest, from, to, torn);
+	while (torn && read_count > 0);
+	return torn ? 0 : read_count;
 }
 
 /**
- * try_read: attempt to unlock the buffer and copy data from 
- * the buffer. Return if unable to lock.
+ * try_read: Copy data from the buffer without locking it.
+ * Return if a write overlapped the copy.
  * @param from Beginning sample
  * @param to Ending sample
  * @param dest Location to copy samples to
- * @returns Number of samples successfully read
+ * @returns Number of samples successfully read, 0 if the copy was torn
  */
 template <class TYPE, int LENGTH>
 int Looping_Buffer<TYPE, LENGTH>::try_read(int from, int to, TYPE *dest)
 {
-	int read_count{0};
-	if (mut.try_lock())
+	bool torn;
+	int read_count = read_once(dest, from, to, torn);
+	return torn ? 0 : read_count;
+}
+
+/**
+ * read_once: Internal function. Copy data, then check whether a write claimed any of the copied slots meanwhile.
+ * @param torn Set if it did and dest may hold a mix of old and new samples, or if from was
+ *             overwritten before the copy started
+ * @returns Number of samples copied, 0 if from was overwritten before the copy started
+ */
+template <class TYPE, int LENGTH>
+int Looping_Buffer<TYPE, LENGTH>::read_once(TYPE *dest, int from, int to, bool &torn)
+{
+	torn = false;
+	uint32_t published = count.load(std::memory_order_acquire);
+
+	// writes that completed since the caller chose from may have lapped it, copying again cannot help
+	if (to > from && published - (uint32_t)from > (uint32_t)LENGTH)
 	{
-		// copy data
-		read_count = copy_to(dest, from, to);
-		mut.unlock();
+		torn = true;
+		torn_count.fetch_add(1, std::memory_order_relaxed);
+		return 0;
 	}
+
+	int read_count = copy_to(dest, from, to);
+	if (read_count == 0)
+		return 0;
+
+	// orders the copy before the claim is read, pairs with the fence in the writer.
+	// The copied slots hold samples from on, a write has reached them once it claims sample from + LENGTH
+	std::atomic_thread_fence(std::memory_order_acquire);
+	torn = claimed.load(std::memory_order_relaxed) - (uint32_t)from > (uint32_t)LENGTH;
+	if (torn)
+		torn_count.fetch_add(1, std::memory_order_relaxed);
 	return read_count;
 }
 
@@ -90,11 +215,18 @@ template <class TYPE, int LENGTH>
 int Looping_Buffer<TYPE, LENGTH>::block_write(const TYPE *src, size_t len)
 {
 	int written_count{0};
+	if (len > LENGTH)
+		return 0;
+
 	mut.lock();
+	uint32_t c = count.load(std::memory_order_relaxed);
+	claimed.store(c + len, std::memory_order_relaxed);
+	// readers that see any of the new data see the claim
+	std::atomic_thread_fence(std::memory_order_release);
 	// copy data
 	written_count = copy_from(src, len);
+	count.store(c + written_count, std::memory_order_release);
 	mut.unlock();
-	count += written_count;
 	return written_count;
 }
 
@@ -108,16 +240,57 @@ template <class TYPE, int LENGTH>
 int Looping_Buffer<TYPE, LENGTH>::try_write(const TYPE *src, size_t len)
 {
 	int written_count{0};
+	if (len > LENGTH)
+		return 0;
+
 	if (mut.try_lock())
 	{
+		uint32_t c = count.load(std::memory_order_relaxed);
+		claimed.store(c + len, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
 		// copy data
 		written_count = copy_from(src, len);
+		count.store(c + written_count, std::memory_order_release);
 		mut.unlock();
-		count += written_count;
 	}
 	return written_count;
 }
 
+/**
+ * block_emplace: Let fill write len items straight into the buffer's write slots,
+ * without copying them from an intermediate buffer. Block if buffer is unavailable.
+ * fill(TYPE *dest, size_t offset, size_t n) is called once, or twice when the
+ * slots wrap around the end of the buffer, and must write items offset to offset + n.
+ * @param len how many items to write
+ * @param fill function writing the items
+ * @returns Number of items written
+ */
+template <class TYPE, int LENGTH>
+template <typename FILL>
+int Looping_Buffer<TYPE, LENGTH>::block_emplace(size_t len, FILL fill)
+{
+	// do not write more than LENGTH items:
+	if (len > LENGTH)
+		return 0;
+
+	mut.lock();
+	uint32_t c = count.load(std::memory_order_relaxed);
+	claimed.store(c + len, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	size_t sec_0_len = LENGTH - c % LENGTH;
+	if (sec_0_len > len)
+		sec_0_len = len;
+
+	fill(buffer + c % LENGTH, 0, sec_0_len);
+	if (sec_0_len < len)
+		fill(buffer, sec_0_len, len - sec_0_len);
+
+	count.store(c + len, std::memory_order_release);
+	mut.unlock();
+	return len;
+}
+
 /**
  * print_state: print the current contents and position of looping buffer
  */
@@ -127,10 +300,11 @@ void Looping_Buffer<TYPE, LENGTH>::print_state()
 	// assumes that TYPE is an integral type
 	printf("------------ print_state() ------------\n");
 	mut.lock();
+	uint32_t c = count.load(std::memory_order_relaxed);
 	for (int i = 0; i < LENGTH; i++)
 	{
-		if (i == count % LENGTH)
-			printf("|> %i (%i)\n", buffer[i], count);
+		if (i == c % LENGTH)
+			printf("|> %i (%i)\n", buffer[i], c);
 		else
 			printf("|  %i\n", buffer[i]);
 	}
@@ -139,7 +313,7 @@ void Looping_Buffer<TYPE, LENGTH>::print_state()
 }
 
 /**
- * copy_from: Internal copying function. Copies len samples from buffer to src.
+ * copy_from: Internal copying function. Copies len samples from buffer to src. The writer's lock must be held.
  * @param src data source
  * @param len how many bytes to copy
  * @returns Number of samples successfully read
@@ -154,16 +328,18 @@ int Looping_Buffer<TYPE, LENGTH>::copy_from(const TYPE *src, size_t len)
 		return 0;
 	}
 
+	uint32_t c = count.load(std::memory_order_relaxed);
+
 	// detect when copy needs to be done twice
-	if (len + count % LENGTH > LENGTH)
+	if (len + c % LENGTH > LENGTH)
 	{
 		// split into two memcpy operations
 		// define section beginnings
-		TYPE *sec_0 = buffer + count % LENGTH;
+		TYPE *sec_0 = buffer + c % LENGTH;
 		TYPE *sec_1 = buffer;
 
 		// define section lengths
-		int sec_0_len = LENGTH - count % LENGTH;
+		int sec_0_len = LENGTH - c % LENGTH;
 		int sec_1_len = len - sec_0_len;
 
 		// copy data
@@ -176,7 +352,7 @@ int Looping_Buffer<TYPE, LENGTH>::copy_from(const TYPE *src, size_t len)
 	else
 	{
 		// can be read into contiguous memory
-		memcpy(buffer + count % LENGTH, src, len * sizeof(TYPE));
+		memcpy(buffer + c % LENGTH, src, len * sizeof(TYPE));
 		items_copied += len;
 	}
 	return items_copied;
@@ -184,6 +360,7 @@ int Looping_Buffer<TYPE, LENGTH>::copy_from(const TYPE *src, size_t len)
 
 /**
  * copy_to: Internal copying function. Copies len samples from dest to buffer.
+ * Does not check for writes overlapping the copy, block_read() and try_read() do.
  * @param dest data source
  * @param len how many bytes to copy
  * @returns Number of samples successfully read
@@ -196,7 +373,8 @@ int Looping_Buffer<TYPE, LENGTH>::copy_to(TYPE *dest, int from, int to)
 	if (len <= 0)
 		return 0;
 
-	if (to > count || from > count)
+	int published = (int)count.load(std::memory_order_acquire);
+	if (to > published || from > published)
 		return 0;
 
 	int items_copied{0};
@@ -239,5 +417,5 @@ int Looping_Buffer<TYPE, LENGTH>::copy_to(TYPE *dest, int from, int to)
 template <class TYPE, int LENGTH>
 int Looping_Buffer<TYPE, LENGTH>::samples_recv()
 {
-	return count;
+	return count.load(std::memory_order_acquire);
 }
\ No newline at end of file
@@ -0,0 +1,509 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+
+#include "datasource.hpp"
+#include "ds_spsc_queue.hpp"
+#include "ds_sample_pool.hpp"
+
+// samples carried by one Sample_Batch, enough for a full bluetooth packet
+#define PIPELINE_BATCH_LENGTH 128
+
+// items that can be in flight in a pipeline at once, must be a power of two
+#define PIPELINE_POOL_LENGTH 128
+
+// most stages a pipeline can hold
+#define PIPELINE_MAX_STAGES 8
+
+// longest a stage thread waits for an item before it checks for quit and its flush timer
+#define PIPELINE_WAIT_MS 100
+
+// how long emplace_wait() sleeps between checks for a free item
+#define PIPELINE_RETRY_US 200
+
+// how long a datasource callback waits for a free item before the batch is dropped,
+// and how often drops are reported
+#define PIPELINE_PUSH_TIMEOUT_MS 50
+#define PIPELINE_DROP_REPORT_MS 1000
+
+/**
+ * Sample_Batch
+ * Unit of work passed between pipeline stages: the samples of one packet.
+ */
+struct Sample_Batch
+{
+	uint8_t source{0}; // set by whoever fills the batch, 0 for a datasource's batches, which are its fused stream
+	uint32_t count{0};
+	Sample samples[PIPELINE_BATCH_LENGTH];
+};
+
+/**
+ * Stage_Stats
+ * Snapshot of a pipeline stage's counters
+ */
+struct Stage_Stats
+{
+	std::string name;
+	int cpu{-1};
+	uint64_t items{0};	   // items the stage function ran on
+	uint64_t filtered{0};  // items the stage function rejected
+	uint64_t busy_ns{0};   // total time spent in the stage function
+	uint64_t max_ns{0};	   // longest single call of the stage function
+	size_t queued{0};	   // items waiting in front of the stage
+};
+
+/**
+ * Pipeline
+ * Chain of stages, each running on its own thread (optionally pinned to a CPU
+ * core) and connected by lock free SPSC queues. Items live in a preallocated
+ * pool and only pointers move between stages, so nothing is copied or
+ * allocated after start().
+ * A stage function returns false to filter an item out, later stages then
+ * skip it. Stages run in the order they were added. A sink can also be given
+ * a flush function, run on its thread on a timer whether or not items arrive
+ * and once more when the pipeline stops. on_start() gives a stage a function
+ * run on its thread before anything else, ie: to register it as a reader.
+ * Stages of one pipeline share one item type. connect() chains pipelines of
+ * different item types: its stage converts each item into the next pipeline
+ * and waits while that pipeline is full, so a slow stage holds up the ones
+ * before it instead of losing items.
+ * @param ITEM Type of item flowing through the pipeline
+ */
+template <typename ITEM>
+class Pipeline
+{
+private:
+	struct Slot
+	{
+		ITEM item;
+		bool filtered{false};
+	};
+
+	struct Stage
+	{
+		std::string name;
+		std::function<bool(ITEM &)> fn;
+		int cpu{-1};
+
+		std::function<void()> init;
+		std::function<void()> flush;
+		std::chrono::milliseconds flush_period{0};
+
+		// every item in flight fits in one queue, so pushes between stages never fail
+		SPSC_Queue<Slot *, PIPELINE_POOL_LENGTH> in;
+
+		std::atomic<uint64_t> items{0};
+		std::atomic<uint64_t> filtered{0};
+		std::atomic<uint64_t> busy_ns{0};
+		std::atomic<uint64_t> max_ns{0};
+
+		std::thread worker;
+	};
+
+	// acquired by the thread calling push(), released by the last stage
+	Sample_Pool<Slot, PIPELINE_POOL_LENGTH> pool;
+
+	// held inline so the cache line alignment of the queues is kept
+	Stage stages[PIPELINE_MAX_STAGES];
+	size_t stage_count{0};
+
+	std::atomic<bool> is_quit{false};
+	bool running{false};
+
+	std::atomic<uint64_t> pushed{0};
+	std::atomic<uint64_t> overruns{0};
+
+	void run_stage(size_t index);
+
+public:
+	~Pipeline();
+
+	void add_stage(const std::string &name, std::function<bool(ITEM &)> fn, int cpu = -1);
+	void add_sink(const std::string &name, std::function<void(const ITEM &)> fn, int cpu = -1);
+	void add_sink(const std::string &name, std::function<void(const ITEM &)> fn,
+				  std::function<void()> flush, std::chrono::milliseconds period, int cpu = -1);
+	bool on_start(const std::string &name, std::function<void()> init);
+
+	void start();
+	void stop();
+
+	template <typename FILL>
+	bool emplace(FILL fill);
+	template <typename FILL>
+	bool emplace_wait(FILL fill, std::chrono::microseconds timeout);
+	bool push(const ITEM &item);
+
+	std::vector<Stage_Stats> stats();
+	uint64_t total_pushed() const { return pushed.load(); }
+	uint64_t total_overruns() const { return overruns.load(); }
+	void print_stats();
+};
+
+template <class ITEM>
+Pipeline<ITEM>::~Pipeline()
+{
+	stop();
+}
+
+/**
+ * add_stage: Append a stage to the pipeline. Must be called before start().
+ * @param name Name used when reporting statistics
+ * @param fn Stage function, may modify the item. Return false to drop the item.
+ * @param cpu CPU core to pin the stage thread to, -1 to let the scheduler decide
+ */
+template <class ITEM>
+void Pipeline<ITEM>::add_stage(const std::string &name, std::function<bool(ITEM &)> fn, int cpu)
+{
+	if (running)
+		return;
+
+	if (stage_count == PIPELINE_MAX_STAGES)
+	{
+		fprintf(stderr, "(Pipeline) cannot add stage %s, at most %d stages are supported\n", name.c_str(), PIPELINE_MAX_STAGES);
+		return;
+	}
+
+	Stage &stage = stages[stage_count++];
+	stage.name = name;
+	stage.fn = fn;
+	stage.cpu = cpu;
+}
+
+/**
+ * add_sink: Append a stage that only reads items. Must be called before start().
+ * @param name Name used when reporting statistics
+ * @param fn Sink function
+ * @param cpu CPU core to pin the stage thread to, -1 to let the scheduler decide
+ */
+template <class ITEM>
+void Pipeline<ITEM>::add_sink(const std::string &name, std::function<void(const ITEM &)> fn, int cpu)
+{
+	add_stage(name, [fn](ITEM &item) { fn(item); return true; }, cpu);
+}
+
+/**
+ * add_sink: Append a stage that only reads items and also flushes on a timer,
+ * ie: to write out what it collected when no more items come. Must be called before start().
+ * @param name Name used when reporting statistics
+ * @param fn Sink function
+ * @param flush Called on the stage thread every period and once more when the pipeline stops
+ * @param period Time between flushes
+ * @param cpu CPU core to pin the stage thread to, -1 to let the scheduler decide
+ */
+template <class ITEM>
+void Pipeline<ITEM>::add_sink(const std::string &name, std::function<void(const ITEM &)> fn,
+							  std::function<void()> flush, std::chrono::milliseconds period, int cpu)
+{
+	size_t index = stage_count;
+	add_sink(name, fn, cpu);
+	if (stage_count == index + 1)
+	{
+		stages[index].flush = flush;
+		stages[index].flush_period = period;
+	}
+}
+
+/**
+ * on_start: Run a function on a stage's thread once it starts, before its first item or flush.
+ * Must be called before start().
+ * @param name Name the stage was added with
+ * @param init Function to run
+ * @returns False if no stage has that name
+ */
+template <class ITEM>
+bool Pipeline<ITEM>::on_start(const std::string &name, std::function<void()> init)
+{
+	if (running)
+		return false;
+
+	for (size_t i = 0; i < stage_count; i++)
+	{
+		if (stages[i].name == name)
+		{
+			stages[i].init = init;
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * start: Spawn one thread per stage.
+ */
+template <class ITEM>
+void Pipeline<ITEM>::start()
+{
+	if (running || stage_count == 0)
+		return;
+
+	running = true;
+	is_quit = false;
+	for (size_t i = 0; i < stage_count; i++)
+	{
+		stages[i].worker = std::thread(&Pipeline::run_stage, this, i);
+
+		if (stages[i].cpu >= 0)
+		{
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(stages[i].cpu, &set);
+			if (pthread_setaffinity_np(stages[i].worker.native_handle(), sizeof(cpu_set_t), &set) != 0)
+				fprintf(stderr, "(Pipeline) could not pin stage %s to cpu %d\n", stages[i].name.c_str(), stages[i].cpu);
+		}
+	}
+}
+
+/**
+ * stop: Stop and join all stage threads, in pipeline order. Items still in flight are
+ * discarded, sinks with a flush function flush one last time.
+ */
+template <class ITEM>
+void Pipeline<ITEM>::stop()
+{
+	if (!running)
+		return;
+
+	is_quit = true;
+	for (size_t i = 0; i < stage_count; i++)
+	{
+		stages[i].in.notify();
+		stages[i].worker.join();
+	}
+	running = false;
+}
+
+/**
+ * emplace: Fill the next free item in place and send it down the pipeline.
+ * Only one thread may push into a pipeline.
+ * @param fill Function called with a reference to the item to fill
+ * @returns False if too many items are in flight and the item was not sent
+ */
+template <class ITEM>
+template <typename FILL>
+bool Pipeline<ITEM>::emplace(FILL fill)
+{
+	if (stage_count == 0 || pool.available() == 0)
+	{
+		overruns++;
+		return false;
+	}
+
+	Slot *slot = pool.acquire();
+	slot->filtered = false;
+	fill(slot->item);
+
+	stages[0].in.push(slot);
+	pushed++;
+	return true;
+}
+
+/**
+ * emplace_wait: Like emplace(), but waits for an item to come free while too many are in flight.
+ * Only one thread may push into a pipeline.
+ * @param fill Function called with a reference to the item to fill
+ * @param timeout Longest time to wait
+ * @returns False if no item came free in time or the pipeline stopped, the item was not sent
+ */
+template <class ITEM>
+template <typename FILL>
+bool Pipeline<ITEM>::emplace_wait(FILL fill, std::chrono::microseconds timeout)
+{
+	auto deadline = std::chrono::steady_clock::now() + timeout;
+	while (stage_count > 0 && !is_quit && pool.available() == 0 && std::chrono::steady_clock::now() < deadline)
+		std::this_thread::sleep_for(std::chrono::microseconds(PIPELINE_RETRY_US));
+	return emplace(fill);
+}
+
+/**
+ * push: Copy an item into the pipeline. Only one thread may push into a pipeline.
+ * @param item Item to send
+ * @returns False if too many items are in flight and the item was not sent
+ */
+template <class ITEM>
+bool Pipeline<ITEM>::push(const ITEM &item)
+{
+	return emplace([&](ITEM &dest) { dest = item; });
+}
+
+/**
+ * run_stage: Internal function, stage thread entry point.
+ * Runs the stage function on each item and hands it to the next stage.
+ * @param index Position of the stage in the pipeline
+ */
+template <class ITEM>
+void Pipeline<ITEM>::run_stage(size_t index)
+{
+	Stage &stage = stages[index];
+	Stage *next = (index + 1 < stage_count) ? &stages[index + 1] : nullptr;
+
+	if (stage.init)
+		stage.init();
+
+	std::chrono::milliseconds wait(PIPELINE_WAIT_MS);
+	if (stage.flush && stage.flush_period < wait)
+		wait = stage.flush_period;
+	auto last_flush = std::chrono::steady_clock::now();
+
+	while (!is_quit)
+	{
+		if (stage.flush && std::chrono::steady_clock::now() - last_flush >= stage.flush_period)
+		{
+			stage.flush();
+			last_flush = std::chrono::steady_clock::now();
+		}
+
+		Slot *slot;
+		if (!stage.in.wait_pop(slot, wait))
+			continue;
+
+		if (!slot->filtered)
+		{
+			auto start = std::chrono::steady_clock::now();
+			bool keep = stage.fn(slot->item);
+			uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+			stage.items.fetch_add(1, std::memory_order_relaxed);
+			stage.busy_ns.fetch_add(ns, std::memory_order_relaxed);
+			if (ns > stage.max_ns.load(std::memory_order_relaxed))
+				stage.max_ns.store(ns, std::memory_order_relaxed);
+
+			if (!keep)
+			{
+				stage.filtered.fetch_add(1, std::memory_order_relaxed);
+				slot->filtered = true;
+			}
+		}
+
+		// filtered items still travel to the end so that only the last stage returns slots to the pool
+		if (next != nullptr)
+			next->in.push(slot);
+		else
+			pool.release(slot);
+	}
+
+	if (stage.flush)
+		stage.flush();
+}
+
+/**
+ * stats: Get a snapshot of every stage's counters
+ * @returns One Stage_Stats per stage, in pipeline order
+ */
+template <class ITEM>
+std::vector<Stage_Stats> Pipeline<ITEM>::stats()
+{
+	std::vector<Stage_Stats> ret;
+	for (size_t i = 0; i < stage_count; i++)
+	{
+		Stage_Stats st;
+		st.name = stages[i].name;
+		st.cpu = stages[i].cpu;
+		st.items = stages[i].items.load();
+		st.filtered = stages[i].filtered.load();
+		st.busy_ns = stages[i].busy_ns.load();
+		st.max_ns = stages[i].max_ns.load();
+		st.queued = stages[i].in.size();
+		ret.push_back(st);
+	}
+	return ret;
+}
+
+/**
+ * print_stats: Print throughput and latency of every stage
+ */
+template <class ITEM>
+void Pipeline<ITEM>::print_stats()
+{
+	printf("(Pipeline) pushed: %llu overruns: %llu\n", (unsigned long long)pushed.load(), (unsigned long long)overruns.load());
+	for (auto &st : stats())
+	{
+		printf("(Pipeline) stage %-12s cpu: %2d items: %llu filtered: %llu queued: %zu avg ns: %llu max ns: %llu\n",
+			   st.name.c_str(), st.cpu,
+			   (unsigned long long)st.items, (unsigned long long)st.filtered, st.queued,
+			   (unsigned long long)(st.items ? st.busy_ns / st.items : 0), (unsigned long long)st.max_ns);
+	}
+}
+
+/**
+ * Drop_Report
+ * Counts items that could not be sent down a pipeline and reports them, at most
+ * once per PIPELINE_DROP_REPORT_MS so a stalled pipeline does not flood the log
+ */
+struct Drop_Report
+{
+	std::string what;
+	uint64_t dropped{0};
+	std::chrono::steady_clock::time_point last{};
+
+	Drop_Report(const std::string &what) : what(what) {}
+
+	void add()
+	{
+		dropped++;
+		auto now = std::chrono::steady_clock::now();
+		if (now - last < std::chrono::milliseconds(PIPELINE_DROP_REPORT_MS))
+			return;
+		fprintf(stderr, "(Pipeline) %llu %s dropped, the stages are not keeping up\n", (unsigned long long)dropped, what.c_str());
+		dropped = 0;
+		last = now;
+	}
+};
+
+/**
+ * connect: Chain two pipelines. A stage appended to from converts each item into an item of to,
+ * waiting while to is full. Items from filters out never reach to. Start to before from and
+ * stop from before to.
+ * @param from Pipeline whose items are converted, the new stage is its only producer into to
+ * @param name Name of the converting stage
+ * @param to Pipeline the converted items are sent down
+ * @param convert Function filling an item of to from an item of from, convert(const FROM &, TO &)
+ * @param cpu CPU core to pin the converting stage to, -1 to let the scheduler decide
+ */
+template <typename FROM, typename TO, typename CONVERT>
+void connect(Pipeline<FROM> &from, const std::string &name, Pipeline<TO> &to, CONVERT convert, int cpu = -1)
+{
+	Drop_Report drops("items from stage " + name);
+	from.add_sink(name, [&to, convert, drops](const FROM &item) mutable {
+		if (!to.emplace_wait([&](TO &dest) { convert(item, dest); }, std::chrono::milliseconds(PIPELINE_PUSH_TIMEOUT_MS)))
+			drops.add();
+	}, cpu);
+}
+
+/**
+ * attach_datasource: Feed a Sample_Batch pipeline from a datasource's batch callback.
+ * Batches longer than PIPELINE_BATCH_LENGTH are split. While the pipeline is full the
+ * callback waits up to PIPELINE_PUSH_TIMEOUT_MS per batch, then the batch is dropped,
+ * counted as an overrun and reported.
+ * @param pipeline Pipeline to feed
+ * @param ds Datasource to listen to
+ */
+inline void attach_datasource(Pipeline<Sample_Batch> &pipeline, Datasource *ds)
+{
+	Drop_Report drops("datasource batches");
+	ds->registerBatchCallback([&pipeline, drops](const Sample *s, size_t n) mutable {
+		while (n > 0)
+		{
+			size_t k = (n > PIPELINE_BATCH_LENGTH) ? PIPELINE_BATCH_LENGTH : n;
+			bool sent = pipeline.emplace_wait([&](Sample_Batch &b) {
+				b.source = 0;
+				b.count = k;
+				memcpy(b.samples, s, k * sizeof(Sample));
+			}, std::chrono::milliseconds(PIPELINE_PUSH_TIMEOUT_MS));
+			if (!sent)
+				drops.add();
+			s += k;
+			n -= k;
+		}
+	});
+}
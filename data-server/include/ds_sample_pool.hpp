@@ -0,0 +1,141 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#include "ds_spsc_queue.hpp"
+
+/**
+ * Sample_Pool
+ * Fixed set of preallocated SAMPLE_TYPE slots recycled through a free list so
+ * that samples can be passed between threads without new/delete on every sample.
+ * One thread acquires slots and one thread releases them (they may be the same
+ * thread), matching the collection/processing threads of a Datasource.
+ * If every slot is in use acquire() falls back to the heap and counts it, so
+ * heap_allocations() staying at zero shows the pool is sized correctly.
+ * @param SAMPLE_TYPE type of sample held in each slot
+ * @param LENGTH number of slots, must be a power of two
+ */
+template <typename SAMPLE_TYPE, int LENGTH>
+class Sample_Pool
+{
+private:
+	SAMPLE_TYPE slots[LENGTH];
+
+	// pointers to unused slots, pushed by the releasing thread and popped by the acquiring thread
+	SPSC_Queue<SAMPLE_TYPE *, LENGTH> free_list;
+
+	std::atomic<uint64_t> acquire_count{0};
+	std::atomic<uint64_t> release_count{0};
+	std::atomic<uint64_t> heap_allocation_count{0};
+
+	bool owns(const SAMPLE_TYPE *s) const;
+
+public:
+	Sample_Pool();
+
+	SAMPLE_TYPE *acquire();
+	void release(SAMPLE_TYPE *s);
+
+	size_t available() const;
+	uint64_t allocations() const;
+	uint64_t releases() const;
+	uint64_t heap_allocations() const;
+};
+
+template <class SAMPLE_TYPE, int LENGTH>
+Sample_Pool<SAMPLE_TYPE, LENGTH>::Sample_Pool()
+{
+	for (int i = 0; i < LENGTH; i++)
+		free_list.push(&slots[i]);
+}
+
+/**
+ * acquire: Take an unused sample slot, reset to its default value.
+ * Falls back to the heap if the pool is exhausted.
+ * @returns Pointer to a sample to be handed back with release()
+ */
+template <class SAMPLE_TYPE, int LENGTH>
+SAMPLE_TYPE *Sample_Pool<SAMPLE_TYPE, LENGTH>::acquire()
+{
+	acquire_count.fetch_add(1, std::memory_order_relaxed);
+
+	SAMPLE_TYPE *s{nullptr};
+	if (!free_list.pop(s))
+	{
+		heap_allocation_count.fetch_add(1, std::memory_order_relaxed);
+		return new SAMPLE_TYPE();
+	}
+
+	*s = SAMPLE_TYPE();
+	return s;
+}
+
+/**
+ * release: Return a sample obtained from acquire() to the pool.
+ * @param s Sample to return
+ */
+template <class SAMPLE_TYPE, int LENGTH>
+void Sample_Pool<SAMPLE_TYPE, LENGTH>::release(SAMPLE_TYPE *s)
+{
+	if (s == nullptr)
+		return;
+
+	release_count.fetch_add(1, std::memory_order_relaxed);
+
+	if (owns(s))
+		free_list.push(s);
+	else
+		delete s;
+}
+
+/**
+ * owns: Internal function. Check if a sample lives inside the pool.
+ * @param s Sample to check
+ * @returns True if s is one of the pool's slots
+ */
+template <class SAMPLE_TYPE, int LENGTH>
+bool Sample_Pool<SAMPLE_TYPE, LENGTH>::owns(const SAMPLE_TYPE *s) const
+{
+	return s >= slots && s < slots + LENGTH;
+}
+
+/**
+ * available: Get the number of unused slots.
+ * @returns Slots that can be acquired without touching the heap
+ */
+template <class SAMPLE_TYPE, int LENGTH>
+size_t Sample_Pool<SAMPLE_TYPE, LENGTH>::available() const
+{
+	return free_list.size();
+}
+
+/**
+ * allocations: Get the total number of acquire() calls.
+ * @returns Total samples handed out
+ */
+template <class SAMPLE_TYPE, int LENGTH>
+uint64_t Sample_Pool<SAMPLE_TYPE, LENGTH>::allocations() const
+{
+	return acquire_count.load(std::memory_order_relaxed);
+}
+
+/**
+ * releases: Get the total number of release() calls.
+ * @returns Total samples handed back
+ */
+template <class SAMPLE_TYPE, int LENGTH>
+uint64_t Sample_Pool<SAMPLE_TYPE, LENGTH>::releases() const
+{
+	return release_count.load(std::memory_order_relaxed);
+}
+
+/**
+ * heap_allocations: Get the number of acquire() calls that had to use the heap.
+ * @returns Total heap allocations, zero in steady state
+ */
+template <class SAMPLE_TYPE, int LENGTH>
+uint64_t Sample_Pool<SAMPLE_TYPE, LENGTH>::heap_allocations() const
+{
+	return heap_allocation_count.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,204 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+// size of a cache line on the Pi (Cortex-A53/A72) and on x86
+#define CACHE_LINE_SIZE 64
+
+/**
+ * SPSC_Queue
+ * Bounded lock free queue for handing items from exactly one producer thread
+ * to exactly one consumer thread. The read and write positions live on their
+ * own cache lines so the two threads do not fight over the same line.
+ * The consumer can block in wait_pop() until the producer pushes something.
+ * @param TYPE data type held in the queue
+ * @param LENGTH number of slots, must be a power of two
+ */
+template <typename TYPE, int LENGTH>
+class SPSC_Queue
+{
+	static_assert(LENGTH > 0 && (LENGTH & (LENGTH - 1)) == 0, "SPSC_Queue LENGTH must be a power of two");
+
+private:
+	// consumer owned
+	alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> head{0};
+	std::atomic<uint64_t> popped{0};
+
+	// producer owned
+	alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> tail{0};
+	std::atomic<uint64_t> pushed{0};
+	std::atomic<uint64_t> overrun_count{0};
+
+	// only touched when the consumer goes to sleep
+	alignas(CACHE_LINE_SIZE) std::atomic<bool> consumer_waiting{false};
+	std::mutex wait_guard;
+	std::condition_variable wait_cv;
+
+	alignas(CACHE_LINE_SIZE) TYPE buffer[LENGTH];
+
+	void wake_consumer();
+
+public:
+	bool push(const TYPE &item);
+	bool pop(TYPE &item);
+
+	template <typename Rep, typename Period>
+	bool wait_pop(TYPE &item, const std::chrono::duration<Rep, Period> &timeout);
+
+	void notify();
+
+	size_t size() const;
+	bool empty() const;
+	constexpr int capacity() const { return LENGTH; }
+
+	uint64_t total_pushed() const;
+	uint64_t total_popped() const;
+	uint64_t overruns() const;
+};
+
+/**
+ * push: Add an item to the queue. Producer thread only.
+ * If the queue is full the item is not added and the overrun counter is incremented.
+ * @param item Item to add
+ * @returns True if the item was added, false if the queue was full
+ */
+template <class TYPE, int LENGTH>
+bool SPSC_Queue<TYPE, LENGTH>::push(const TYPE &item)
+{
+	const uint32_t t = tail.load(std::memory_order_relaxed);
+	if (t - head.load(std::memory_order_acquire) == LENGTH)
+	{
+		overrun_count.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+
+	buffer[t & (LENGTH - 1)] = item;
+	tail.store(t + 1, std::memory_order_release);
+	pushed.fetch_add(1, std::memory_order_relaxed);
+
+	wake_consumer();
+	return true;
+}
+
+/**
+ * pop: Remove the oldest item from the queue without blocking. Consumer thread only.
+ * @param item Location to move the item to
+ * @returns True if an item was removed, false if the queue was empty
+ */
+template <class TYPE, int LENGTH>
+bool SPSC_Queue<TYPE, LENGTH>::pop(TYPE &item)
+{
+	const uint32_t h = head.load(std::memory_order_relaxed);
+	if (h == tail.load(std::memory_order_acquire))
+		return false;
+
+	item = buffer[h & (LENGTH - 1)];
+	head.store(h + 1, std::memory_order_release);
+	popped.fetch_add(1, std::memory_order_relaxed);
+	return true;
+}
+
+/**
+ * wait_pop: Remove the oldest item from the queue, sleeping until one is available. Consumer thread only.
+ * @param item Location to move the item to
+ * @param timeout Longest time to sleep for
+ * @returns True if an item was removed, false if the timeout expired or notify() was called
+ */
+template <class TYPE, int LENGTH>
+template <typename Rep, typename Period>
+bool SPSC_Queue<TYPE, LENGTH>::wait_pop(TYPE &item, const std::chrono::duration<Rep, Period> &timeout)
+{
+	if (pop(item))
+		return true;
+
+	std::unique_lock<std::mutex> lock(wait_guard);
+	consumer_waiting.store(true, std::memory_order_relaxed);
+
+	// pairs with the fence in wake_consumer() - either the producer sees
+	// consumer_waiting or we see the new tail, never neither
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	if (empty())
+		wait_cv.wait_for(lock, timeout);
+
+	consumer_waiting.store(false, std::memory_order_relaxed);
+	lock.unlock();
+
+	return pop(item);
+}
+
+/**
+ * notify: Wake the consumer if it is sleeping in wait_pop(). Used when shutting down.
+ */
+template <class TYPE, int LENGTH>
+void SPSC_Queue<TYPE, LENGTH>::notify()
+{
+	std::lock_guard<std::mutex> lock(wait_guard);
+	wait_cv.notify_one();
+}
+
+/**
+ * wake_consumer: Internal function. Signal the consumer only if it is asleep,
+ * so a busy consumer costs the producer no system calls.
+ */
+template <class TYPE, int LENGTH>
+void SPSC_Queue<TYPE, LENGTH>::wake_consumer()
+{
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (consumer_waiting.load(std::memory_order_relaxed))
+		notify();
+}
+
+/**
+ * size: Get the number of items currently in the queue.
+ * @returns Number of queued items
+ */
+template <class TYPE, int LENGTH>
+size_t SPSC_Queue<TYPE, LENGTH>::size() const
+{
+	return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+}
+
+/**
+ * empty: Check if the queue holds no items.
+ * @returns True if the queue is empty
+ */
+template <class TYPE, int LENGTH>
+bool SPSC_Queue<TYPE, LENGTH>::empty() const
+{
+	return size() == 0;
+}
+
+/**
+ * total_pushed: Get the number of items added since creation.
+ * @returns Total items pushed
+ */
+template <class TYPE, int LENGTH>
+uint64_t SPSC_Queue<TYPE, LENGTH>::total_pushed() const
+{
+	return pushed.load(std::memory_order_relaxed);
+}
+
+/**
+ * total_popped: Get the number of items removed since creation.
+ * @returns Total items popped
+ */
+template <class TYPE, int LENGTH>
+uint64_t SPSC_Queue<TYPE, LENGTH>::total_popped() const
+{
+	return popped.load(std::memory_order_relaxed);
+}
+
+/**
+ * overruns: Get the number of pushes rejected because the queue was full.
+ * @returns Total overruns
+ */
+template <class TYPE, int LENGTH>
+uint64_t SPSC_Queue<TYPE, LENGTH>::overruns() const
+{
+	return overrun_count.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,412 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+#include "datasource.hpp"
+
+// rate the sensor box samples at (SAMPLE_RATE in bluetooth_sensor_data_send.cpp)
+#define HR_SAMPLE_RATE 64
+
+// pass band of the pulse filter, 30 to 240 bpm
+#define HR_LOW_CUTOFF 0.5f
+#define HR_HIGH_CUTOFF 4.0f
+
+// beats closer together than this are one beat (200 bpm)
+#define HR_REFRACTORY_MS 300
+
+// intervals outside this range are missed or extra beats, not heart rates
+#define HR_MIN_IBI_MS 300
+#define HR_MAX_IBI_MS 2000
+
+// a local maximum is a beat if it is above this fraction of the recent peak height
+#define HR_THRESHOLD 0.5f
+
+// seconds over which the recent peak height decays, so a weaker pulse is found again
+#define HR_ENVELOPE_SECONDS 2.0f
+
+// inter-beat intervals kept, the heart rate is taken from their median
+#define HR_IBI_HISTORY 8
+
+// intervals needed before a heart rate is reported
+#define HR_MIN_INTERVALS 3
+
+// a beat sooner than this fraction of the median interval is noise, unless it keeps happening
+#define HR_EARLY_FRACTION 0.6f
+#define HR_MAX_EARLY_BEATS 4
+
+// readings further than this fraction from the DC level are glitches and replaced
+#define HR_MAX_DEVIATION 0.05f
+
+// a heart rate is only reported while the beats stand this many times higher than the
+// other maxima of the filtered signal (the noise floor)...
+#define HR_MIN_SNR 1.75f
+// ...and the intervals deviate from their median by at most this fraction on average,
+// for this many beats in a row
+#define HR_MAX_IBI_SPREAD 0.1f
+#define HR_MIN_GOOD_BEATS 2
+
+// weight of a new height in the running beat and noise floor heights
+#define HR_BEAT_HEIGHT_WEIGHT 0.25f
+#define HR_NOISE_HEIGHT_WEIGHT 0.125f
+
+/**
+ * Heart_Rate_Detector
+ * Streaming heart rate for one sensor from its IR LED readings.
+ * Each reading goes through a glitch gate (a reading far from the slowly
+ * tracked DC level is replaced by the last good one, and a second of them
+ * in a row means the level really moved), then a band-pass filter made of
+ * a high-pass and a low-pass biquad, keeping 0.5 to 4 Hz.
+ * Beats are the local maxima of the filtered signal above HR_THRESHOLD times
+ * an envelope that follows the peaks and decays over HR_ENVELOPE_SECONDS.
+ * Within HR_REFRACTORY_MS only the highest maximum counts, so a beat is
+ * reported that long after it happened. Peaks are placed between samples by
+ * parabolic interpolation.
+ * The interval between beats is kept for the last HR_IBI_HISTORY beats and
+ * the heart rate is 60000 / their median, which ignores the odd missed
+ * beat. A peak much sooner than the median interval is skipped as noise,
+ * unless HR_MAX_EARLY_BEATS of them come with no normal gap in between,
+ * which means the rate went up. No beat for twice HR_MAX_IBI_MS means the pulse was lost and
+ * the heart rate goes back to 0.
+ * Noise and motion also make beats, at a rate of their own, so a heart rate
+ * is only reported while the signal looks like a pulse: the running height
+ * of the beats must be HR_MIN_SNR times the running height of the maxima
+ * that were not beats, and the intervals must agree with their median to
+ * within HR_MAX_IBI_SPREAD, for HR_MIN_GOOD_BEATS beats in a row. Otherwise
+ * bpm() is 0.
+ * Every update is O(1) and the detector never allocates.
+ */
+class Heart_Rate_Detector
+{
+private:
+	struct Biquad
+	{
+		float b0{0}, b1{0}, b2{0}, a1{0}, a2{0};
+		float z1{0}, z2{0};
+
+		float filter(float x);
+	};
+
+	float rate;
+	Biquad high_pass;
+	Biquad low_pass;
+
+	// glitch gate
+	float dc{0};
+	float origin{0};
+	float held{0};
+	uint32_t reject_run{0};
+	bool started{false};
+
+	// beat detection
+	uint64_t sample_pos{0};
+	float y1{0}, y2{0};
+	float envelope{0};
+	float envelope_decay;
+	uint32_t refractory;	 // HR_REFRACTORY_MS in samples
+	uint32_t lost_after;	 // samples without a beat before the pulse counts as lost
+	bool have_candidate{false};
+	uint64_t candidate_pos{0};
+	float candidate_offset{0}; // peak position between samples, -0.5 to 0.5
+	float candidate_height{0};
+	bool have_beat{false};
+	uint64_t last_beat_pos{0};
+	float last_beat_offset{0};
+	uint64_t last_peak_pos{0};	// last candidate, beat or not
+	float last_peak_offset{0};
+
+	// results
+	uint16_t ibi[HR_IBI_HISTORY]{0};
+	size_t ibi_pos{0};
+	size_t ibi_count{0};
+	float median_ms{0};
+	uint32_t early_run{0};
+	uint16_t last_bpm{0};
+	float spread{0};
+	float beat_height{0};
+	float noise_height{0};
+	uint32_t good_run{0};
+	uint64_t beat_count{0};
+	uint64_t early_beats{0};
+	uint64_t glitches{0};
+
+	void design();
+	void restart(float x);
+	bool commit_beat();
+	void add_noise(float height) { noise_height += (height - noise_height) * HR_NOISE_HEIGHT_WEIGHT; }
+
+public:
+	Heart_Rate_Detector(float sample_rate = HR_SAMPLE_RATE);
+
+	bool update(uint16_t ir_led);
+	void process(Sample *s, size_t n);
+	void reset();
+
+	uint16_t bpm() const { return (good_run >= HR_MIN_GOOD_BEATS) ? last_bpm : 0; }
+	float snr() const { return (noise_height > 0) ? beat_height / noise_height : 0; }
+	float ibi_spread() const { return spread; }
+	uint16_t last_ibi() const { return ibi_count ? ibi[(ibi_pos + HR_IBI_HISTORY - 1) % HR_IBI_HISTORY] : 0; }
+	size_t intervals(uint16_t *dst, size_t max) const;
+	uint64_t beats() const { return beat_count; }
+	uint64_t skipped() const { return early_beats; }
+	uint64_t rejected() const { return glitches; }
+};
+
+/**
+ * filter: Internal function. One step of a biquad in transposed direct form II.
+ */
+inline float Heart_Rate_Detector::Biquad::filter(float x)
+{
+	float y = b0 * x + z1;
+	z1 = b1 * x - a1 * y + z2;
+	z2 = b2 * x - a2 * y;
+	return y;
+}
+
+/**
+ * Heart_Rate_Detector
+ * @param sample_rate Readings per second
+ */
+inline Heart_Rate_Detector::Heart_Rate_Detector(float sample_rate) : rate(sample_rate)
+{
+	design();
+}
+
+/**
+ * design: Internal function. Butterworth (Q = 1/sqrt(2)) coefficients from the
+ * audio EQ cookbook for the two cutoffs at this sample rate.
+ */
+inline void Heart_Rate_Detector::design()
+{
+	const float q = 0.70710678f;
+	float w = 2.0f * (float)M_PI * HR_LOW_CUTOFF / rate;
+	float alpha = std::sin(w) / (2.0f * q);
+	float a0 = 1.0f + alpha;
+	high_pass.b0 = (1.0f + std::cos(w)) / 2.0f / a0;
+	high_pass.b1 = -(1.0f + std::cos(w)) / a0;
+	high_pass.b2 = high_pass.b0;
+	high_pass.a1 = -2.0f * std::cos(w) / a0;
+	high_pass.a2 = (1.0f - alpha) / a0;
+
+	w = 2.0f * (float)M_PI * HR_HIGH_CUTOFF / rate;
+	alpha = std::sin(w) / (2.0f * q);
+	a0 = 1.0f + alpha;
+	low_pass.b0 = (1.0f - std::cos(w)) / 2.0f / a0;
+	low_pass.b1 = (1.0f - std::cos(w)) / a0;
+	low_pass.b2 = low_pass.b0;
+	low_pass.a1 = -2.0f * std::cos(w) / a0;
+	low_pass.a2 = (1.0f - alpha) / a0;
+
+	envelope_decay = std::exp(-1.0f / (HR_ENVELOPE_SECONDS * rate));
+	refractory = (uint32_t)(HR_REFRACTORY_MS * rate / 1000.0f + 0.5f);
+	lost_after = (uint32_t)(2 * HR_MAX_IBI_MS * rate / 1000.0f + 0.5f);
+}
+
+/**
+ * restart: Internal function. Settle the filters on a new level x. Beat history is kept.
+ */
+inline void Heart_Rate_Detector::restart(float x)
+{
+	dc = origin = held = x;
+	high_pass.z1 = high_pass.z2 = 0;
+	low_pass.z1 = low_pass.z2 = 0;
+	y1 = y2 = 0;
+	envelope = 0;
+	have_candidate = false;
+	reject_run = 0;
+	started = true;
+}
+
+/**
+ * commit_beat: Internal function. The candidate peak is a beat, record its interval.
+ * @returns False if the peak came too early to be a beat
+ */
+inline bool Heart_Rate_Detector::commit_beat()
+{
+	have_candidate = false;
+
+	if (have_beat)
+	{
+		float samples = (candidate_pos - last_beat_pos) + (candidate_offset - last_beat_offset);
+		uint32_t ms = (uint32_t)(samples * 1000.0f / rate + 0.5f);
+		float since_peak = (candidate_pos - last_peak_pos) + (candidate_offset - last_peak_offset);
+		bool early_peak = since_peak * 1000.0f / rate < HR_EARLY_FRACTION * median_ms;
+		last_peak_pos = candidate_pos;
+		last_peak_offset = candidate_offset;
+
+		// a noise peak between two beats: skip it and measure the next beat from the last real one.
+		// Early peaks that keep coming without a normal gap between them mean the rate went up,
+		// start over from here
+		if (ibi_count >= HR_MIN_INTERVALS && ms < HR_EARLY_FRACTION * median_ms)
+		{
+			add_noise(candidate_height);
+			early_beats++;
+			if (++early_run < HR_MAX_EARLY_BEATS)
+				return false;
+			early_run = 0;
+			ibi_count = 0;
+			ms = 0;
+		}
+		else if (!early_peak)
+		{
+			early_run = 0;
+		}
+
+		if (ms >= HR_MIN_IBI_MS && ms <= HR_MAX_IBI_MS)
+		{
+			ibi[ibi_pos] = (uint16_t)ms;
+			ibi_pos = (ibi_pos + 1) % HR_IBI_HISTORY;
+			if (ibi_count < HR_IBI_HISTORY)
+				ibi_count++;
+
+			if (ibi_count >= HR_MIN_INTERVALS)
+			{
+				// median of at most HR_IBI_HISTORY intervals: insertion sort a copy
+				uint16_t sorted[HR_IBI_HISTORY];
+				for (size_t i = 0; i < ibi_count; i++)
+				{
+					size_t j = i;
+					for (; j > 0 && sorted[j - 1] > ibi[i]; j--)
+						sorted[j] = sorted[j - 1];
+					sorted[j] = ibi[i];
+				}
+				median_ms = (ibi_count % 2) ? sorted[ibi_count / 2]
+											: (sorted[ibi_count / 2 - 1] + sorted[ibi_count / 2]) / 2.0f;
+				last_bpm = (uint16_t)(60000.0f / median_ms + 0.5f);
+
+				float deviation{0};
+				for (size_t i = 0; i < ibi_count; i++)
+					deviation += std::fabs(ibi[i] - median_ms);
+				spread = deviation / ibi_count / median_ms;
+			}
+		}
+	}
+
+	beat_height += (candidate_height - beat_height) * HR_BEAT_HEIGHT_WEIGHT;
+	bool good = ibi_count >= HR_MIN_INTERVALS && spread <= HR_MAX_IBI_SPREAD && beat_height > HR_MIN_SNR * noise_height;
+	good_run = good ? good_run + 1 : 0;
+
+	beat_count++;
+	have_beat = true;
+	last_beat_pos = last_peak_pos = candidate_pos;
+	last_beat_offset = last_peak_offset = candidate_offset;
+	return true;
+}
+
+/**
+ * update: Add one reading.
+ * @param ir_led IR LED reading
+ * @returns True if a beat was confirmed by this reading
+ */
+inline bool Heart_Rate_Detector::update(uint16_t ir_led)
+{
+	float x = ir_led;
+	if (!started)
+		restart(x);
+
+	// glitch gate: hold the last good reading, follow a level that stays moved for a second
+	if (std::fabs(x - dc) > HR_MAX_DEVIATION * dc)
+	{
+		glitches++;
+		if (++reject_run < rate)
+			x = held;
+		else
+			restart(x);
+	}
+	else
+	{
+		reject_run = 0;
+		held = x;
+		dc += (x - dc) / rate;
+	}
+
+	float y = low_pass.filter(high_pass.filter(x - origin));
+	uint64_t pos = sample_pos++;
+
+	// envelope of the recent peaks
+	envelope *= envelope_decay;
+	if (y > envelope)
+		envelope = y;
+
+	bool beat{false};
+
+	// a candidate with no higher maximum within the refractory period is a beat
+	if (have_candidate && pos - candidate_pos >= refractory)
+		beat = commit_beat();
+
+	// y1 is a local maximum, the candidate beat if it is above the threshold and the highest within
+	// the refractory period. Every other maximum, and a candidate beaten by a higher one, is noise
+	if (y1 > y2 && y1 >= y && y1 > 0)
+	{
+		if (y1 <= HR_THRESHOLD * envelope || (have_candidate && y1 <= candidate_height))
+		{
+			add_noise(y1);
+		}
+		else
+		{
+			if (have_candidate)
+				add_noise(candidate_height);
+			// the vertex of a parabola through the three samples places the peak between samples,
+			// one sample is 5% of an interval at 180 bpm
+			float curve = y2 - 2 * y1 + y;
+			have_candidate = true;
+			candidate_pos = pos - 1;
+			candidate_offset = (curve < 0) ? 0.5f * (y2 - y) / curve : 0.0f;
+			candidate_height = y1;
+		}
+	}
+	y2 = y1;
+	y1 = y;
+
+	// pulse lost
+	if (have_beat && pos - last_beat_pos > lost_after)
+	{
+		have_beat = false;
+		ibi_count = 0;
+		early_run = 0;
+		last_bpm = 0;
+		good_run = 0;
+	}
+
+	return beat;
+}
+
+/**
+ * process: Fill in the bpm field of a batch of samples from one sensor. Samples
+ * keep the bpm they came with while the detector has no heart rate it trusts.
+ * @param s First sample
+ * @param n Number of samples
+ */
+inline void Heart_Rate_Detector::process(Sample *s, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+	{
+		update(s[i].irLED);
+		if (bpm() != 0)
+			s[i].bpm = bpm();
+	}
+}
+
+/**
+ * intervals: Copy the recent inter-beat intervals, oldest first.
+ * @param dst Destination for the intervals in milliseconds
+ * @param max Most intervals to copy
+ * @returns Number of intervals copied, at most HR_IBI_HISTORY
+ */
+inline size_t Heart_Rate_Detector::intervals(uint16_t *dst, size_t max) const
+{
+	size_t count = (ibi_count < max) ? ibi_count : max;
+	size_t first = (ibi_pos + HR_IBI_HISTORY - count) % HR_IBI_HISTORY;
+	for (size_t i = 0; i < count; i++)
+		dst[i] = ibi[(first + i) % HR_IBI_HISTORY];
+	return count;
+}
+
+/**
+ * reset: Forget all readings and beats, ie: after a sensor reconnects.
+ */
+inline void Heart_Rate_Detector::reset()
+{
+	*this = Heart_Rate_Detector(rate);
+}
@@ -0,0 +1,162 @@
+#ifndef I2C_DEVICE_HPP
+#define I2C_DEVICE_HPP
+/* This file defines an interface for talking to a device on the I2C bus.
+ * Sensor datasources use it instead of calling wiringPi directly, so they
+ * can be run against the fake devices below on machines without an I2C bus.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+
+class I2C_Device
+{
+public:
+	virtual ~I2C_Device() {}
+
+	// Read one 8 bit register. Returns the value, or -1 on error.
+	virtual int readReg8(int reg) = 0;
+
+	// Write one 8 bit register. Returns 0 on success.
+	virtual int writeReg8(int reg, int value) = 0;
+
+	// Read len bytes in a single transfer starting at reg.
+	// Returns the number of bytes read, or -1 on error.
+	virtual int readBlock(int reg, uint8_t *dest, size_t len) = 0;
+};
+
+/* An in-process MAX30100. The FIFO fills at the configured sample rate while
+ * time passes, as the datasheet describes: reading FIFO_DATA pops 4 bytes
+ * (IR then RED, big endian) per sample and advances FIFO_RD_PTR. Samples
+ * that arrive while the FIFO is full are not stored, the 16 held ones are
+ * kept, and are counted in OVF_COUNTER, which saturates at 15 and clears
+ * when a sample is popped. A full FIFO has FIFO_WR_PTR == FIFO_RD_PTR, like
+ * an empty one. Sample values come from a generator function.
+ */
+class Fake_Max30100 : public I2C_Device
+{
+public:
+	static const int FIFO_WR_PTR = 0x02;
+	static const int OVF_COUNTER = 0x03;
+	static const int FIFO_RD_PTR = 0x04;
+	static const int FIFO_DATA = 0x05;
+	static const int MODE_CONFIG = 0x06;
+	static const int FIFO_DEPTH = 16;
+
+	// generator is called with the sample number and fills in ir and red
+	Fake_Max30100(int sampleRate, std::function<void(uint64_t, uint16_t &, uint16_t &)> generator)
+		: sampleRate(sampleRate), generator(generator)
+	{
+		this->start = std::chrono::steady_clock::now();
+	}
+
+	int readReg8(int reg)
+	{
+		std::lock_guard<std::mutex> lock(this->guard);
+		this->transactions++;
+		this->update();
+		return this->registers[reg & 0xff];
+	}
+
+	int writeReg8(int reg, int value)
+	{
+		std::lock_guard<std::mutex> lock(this->guard);
+		this->transactions++;
+		this->update();
+		this->registers[reg & 0xff] = (uint8_t)value;
+		if (reg == OVF_COUNTER || reg == FIFO_RD_PTR || reg == FIFO_WR_PTR)
+			this->registers[reg] &= 0x0f;
+		return 0;
+	}
+
+	int readBlock(int reg, uint8_t *dest, size_t len)
+	{
+		std::lock_guard<std::mutex> lock(this->guard);
+		this->transactions++;
+		this->update();
+
+		// FIFO_DATA does not auto-increment, it streams out samples
+		if (reg == FIFO_DATA)
+		{
+			for (size_t i = 0; i < len; i++)
+				dest[i] = this->popFifoByte();
+			return (int)len;
+		}
+
+		for (size_t i = 0; i < len; i++)
+			dest[i] = this->registers[(reg + i) & 0xff];
+		return (int)len;
+	}
+
+	// Number of bus transactions since creation
+	uint64_t getTransactions() const { return this->transactions; }
+
+	// Samples lost because the FIFO was full
+	uint64_t getLostSamples() const { return this->lost; }
+
+private:
+	int sampleRate;
+	std::function<void(uint64_t, uint16_t &, uint16_t &)> generator;
+	std::chrono::steady_clock::time_point start;
+
+	std::mutex guard;
+	uint8_t registers[256]{0};
+	uint8_t fifo[FIFO_DEPTH][4];
+	int fifoCount{0};
+	int byteInSample{0};
+
+	uint64_t produced{0};
+	std::atomic<uint64_t> transactions{0};
+	std::atomic<uint64_t> lost{0};
+
+	// add every sample the sensor would have taken since the last access
+	void update()
+	{
+		uint64_t elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - this->start).count();
+		uint64_t due = elapsed * this->sampleRate / 1000000;
+
+		while (this->produced < due)
+		{
+			uint16_t ir{0}, red{0};
+			this->generator(this->produced, ir, red);
+			this->produced++;
+
+			if (this->fifoCount == FIFO_DEPTH)
+			{
+				// the new sample is lost and counted, the FIFO keeps the ones it holds
+				this->lost++;
+				if (this->registers[OVF_COUNTER] < 0x0f)
+					this->registers[OVF_COUNTER]++;
+				continue;
+			}
+
+			uint8_t *slot = this->fifo[this->registers[FIFO_WR_PTR]];
+			slot[0] = ir >> 8;
+			slot[1] = ir & 0xff;
+			slot[2] = red >> 8;
+			slot[3] = red & 0xff;
+			this->registers[FIFO_WR_PTR] = (this->registers[FIFO_WR_PTR] + 1) & 0x0f;
+			this->fifoCount++;
+		}
+	}
+
+	uint8_t popFifoByte()
+	{
+		if (this->fifoCount == 0)
+			return 0;
+
+		uint8_t b = this->fifo[this->registers[FIFO_RD_PTR]][this->byteInSample++];
+		if (this->byteInSample == 4)
+		{
+			this->byteInSample = 0;
+			this->registers[FIFO_RD_PTR] = (this->registers[FIFO_RD_PTR] + 1) & 0x0f;
+			this->registers[OVF_COUNTER] = 0;
+			this->fifoCount--;
+		}
+		return b;
+	}
+};
+#endif
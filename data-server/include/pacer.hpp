@@ -0,0 +1,137 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cerrno>
+#include <time.h>
+
+#define PACER_NS_PER_S 1000000000ULL
+
+// how far behind the pacer may fall before the missed periods are given up, s
+#define PACER_DEFAULT_MAX_BEHIND_S 1
+
+struct Pacer_Stats
+{
+	uint64_t periods{0};   // periods waited for, skipped ones included
+	uint64_t waits{0};
+	uint64_t missed{0};    // waits whose deadline had passed before they began
+	uint64_t skipped{0};   // periods given up after falling more than max behind
+	int64_t max_late_ns{0}; // latest wake up after a deadline, waits that slept
+	double mean_late_ns{0};
+};
+
+/**
+ * Pacer
+ * Holds a loop to an exact rate with absolute deadlines: period k ends at
+ * start + k / rate seconds, computed from k each time, so neither rounding
+ * nor the loop's own work adds up from one period to the next. The loop
+ * sleeps with clock_nanosleep(TIMER_ABSTIME) on CLOCK_MONOTONIC until the
+ * deadline of the periods it waits for, however many that is. A deadline
+ * that has passed already counts as missed and is not slept for, so the
+ * loop catches up, until it is more than max_behind seconds behind: then
+ * the periods up to now are skipped rather than run back to back.
+ * The rate is rate_num / rate_den per second, ie: 64 / 1 for 64 Hz.
+ */
+class Pacer
+{
+private:
+	uint64_t rate_num;
+	uint64_t rate_den;
+	uint64_t max_behind;
+
+	uint64_t start_ns{0};
+	uint64_t period{0};
+
+	Pacer_Stats counters;
+	uint64_t late_total{0};
+	uint64_t slept{0};
+
+	static uint64_t now_ns();
+
+public:
+	Pacer(uint64_t num, uint64_t den = 1, uint64_t max_behind_s = PACER_DEFAULT_MAX_BEHIND_S);
+
+	void start();
+	bool wait(uint64_t periods = 1);
+
+	uint64_t deadline(uint64_t k) const;
+	uint64_t periods() const { return period; }
+	const Pacer_Stats &stats() const { return counters; }
+};
+
+inline Pacer::Pacer(uint64_t num, uint64_t den, uint64_t max_behind_s)
+	: rate_num(num ? num : 1), rate_den(den ? den : 1), max_behind(max_behind_s * PACER_NS_PER_S)
+{
+	start();
+}
+
+inline uint64_t Pacer::now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * PACER_NS_PER_S + ts.tv_nsec;
+}
+
+/**
+ * start: Start counting periods from now, the counters are kept
+ */
+inline void Pacer::start()
+{
+	start_ns = now_ns();
+	period = 0;
+}
+
+/**
+ * deadline: Time the end of period k is due, ns on CLOCK_MONOTONIC.
+ * Whole seconds and the remainder are converted apart, so k * 1e9 never overflows.
+ */
+inline uint64_t Pacer::deadline(uint64_t k) const
+{
+	uint64_t total = k * rate_den;
+	return start_ns + (total / rate_num) * PACER_NS_PER_S + (total % rate_num) * PACER_NS_PER_S / rate_num;
+}
+
+/**
+ * wait: Sleep until the end of the next periods
+ * @param periods: Periods to wait for, ie: the number of samples a packet holds
+ * @returns false if the deadline had passed already
+ */
+inline bool Pacer::wait(uint64_t periods)
+{
+	period += periods;
+	counters.periods += periods;
+	counters.waits++;
+
+	uint64_t due = deadline(period);
+	uint64_t now = now_ns();
+	if (now >= due)
+	{
+		counters.missed++;
+
+		// too far behind to catch up, carry on from the period now is in
+		if (now - due > max_behind)
+		{
+			uint64_t elapsed = now - start_ns;
+			uint64_t current = (elapsed / PACER_NS_PER_S) * rate_num / rate_den + (elapsed % PACER_NS_PER_S) * rate_num / (rate_den * PACER_NS_PER_S);
+			uint64_t behind = (current > period) ? current - period : 0;
+			period += behind;
+			counters.periods += behind;
+			counters.skipped += behind;
+		}
+		return false;
+	}
+
+	struct timespec ts;
+	ts.tv_sec = due / PACER_NS_PER_S;
+	ts.tv_nsec = due % PACER_NS_PER_S;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR)
+		;
+
+	int64_t late = (int64_t)(now_ns() - due);
+	if (late > counters.max_late_ns)
+		counters.max_late_ns = late;
+	late_total += late;
+	slept++;
+	counters.mean_late_ns = (double)late_total / slept;
+	return true;
+}
@@ -0,0 +1,249 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+
+#include "bt_protocol.hpp"
+
+// send times remembered for round trip measurement, one per sequence number modulo this
+#define SIZER_SEND_HISTORY 64
+
+// round trips of packets sent into an empty queue the link's base round trip is the least of
+#define SIZER_RTT_HISTORY 16
+
+// round trips this much above the base one mean packets wait in a queue on the way, us
+#define SIZER_QUEUEING_US 10000
+
+struct Sizer_Config
+{
+	// longest a sample should take from being taken to arriving, us
+	int64_t latency_budget_us{250000};
+	size_t min_samples{1};
+	size_t max_samples{BT_SAMPLE_RATE};
+	// packets waiting in the Client's queue that mean the link is not keeping up
+	size_t congested_queue{2};
+	int64_t sample_period_us{BT_SAMPLE_PERIOD_US};
+};
+
+struct Sizer_Stats
+{
+	size_t samples{0};      // samples per packet now
+	size_t limit{0};        // most samples per packet the latency budget allows now
+	double srtt_us{0};      // smoothed round trip from sending a packet to its ack arriving
+	int64_t min_rtt_us{0};  // least recent round trip, the link without queueing
+	uint16_t in_flight{0};  // packets sent and not acked yet
+	uint64_t acks{0};
+	uint64_t grown{0};      // times packets were made larger because the link was congested
+	uint64_t shrunk{0};     // times packets were made smaller because the link was idle
+	int64_t latency_us{0};  // estimated time the oldest sample of a packet takes to arrive, queueing included
+};
+
+/**
+ * Packet_Sizer
+ * Picks the number of samples per packet from link feedback. Every packet
+ * costs a header and, on bluetooth, a slot of airtime however small it is,
+ * so more samples per packet carry more samples per unit of airtime, while
+ * fewer get each sample there sooner. The sizer sends small packets while
+ * the link is idle and doubles them when it is congested: packets waiting in
+ * the Client's queue, writes stalling, or acks coming back later than the
+ * link's base round trip. Packets shrink again one step at a time once the
+ * link is idle, as long as the smaller packets would still leave the link
+ * idle half the time by the base round trip, which is mostly the airtime of
+ * one packet. They never grow past what keeps the oldest sample of a packet
+ * within the latency budget: (samples - 1) sample periods waiting for the
+ * packet to fill, plus half the base round trip on the way.
+ * Round trips are measured from the receiver's BT_MSG_ACK of the sequence
+ * numbers of one sensor's packets. Only packets sent while the Client's
+ * queue was empty count towards the base round trip, so a link that stays
+ * congested does not raise it. Without acks (version 1) only the queue
+ * and stalls are used. A size holds for at least two round trips, or two
+ * packets, so it shows in the feedback before it changes again.
+ * All times are microseconds on one clock.
+ */
+class Packet_Sizer
+{
+private:
+	Sizer_Config config;
+	size_t size;
+
+	int64_t sent_time[SIZER_SEND_HISTORY];
+	uint16_t sent_seq[SIZER_SEND_HISTORY];
+	bool sent_valid[SIZER_SEND_HISTORY]{};
+	bool sent_unqueued[SIZER_SEND_HISTORY]{};
+	bool queue_empty{true};
+	uint16_t newest_sent{0};
+	bool any_sent{false};
+
+	uint16_t newest_acked{0};
+	bool any_acked{false};
+
+	int64_t rtt[SIZER_RTT_HISTORY];
+	size_t rtt_count{0};
+	size_t rtt_pos{0};
+	uint64_t rtt_samples{0};
+	double srtt{0};
+	int64_t min_rtt{0};
+
+	uint64_t last_stalls{0};
+	int64_t next_change{0};
+
+	uint64_t ack_count{0};
+	uint64_t grown{0};
+	uint64_t shrunk{0};
+
+	size_t limit() const;
+	uint16_t in_flight() const;
+
+public:
+	Packet_Sizer(const Sizer_Config &c = Sizer_Config(), size_t initial = 5);
+
+	void configure(const Sizer_Config &c);
+
+	void on_sent(uint16_t seq, int64_t now);
+	void on_ack(uint16_t seq, int64_t now);
+	size_t next_size(int64_t now, size_t queue_depth, uint64_t stalls);
+
+	size_t samples() const { return size; }
+	Sizer_Stats stats() const;
+};
+
+inline Packet_Sizer::Packet_Sizer(const Sizer_Config &c, size_t initial) : config(c), size(initial)
+{
+	size = std::max(config.min_samples, std::min(size, limit()));
+}
+
+/**
+ * configure: Change the latency budget and limits, the size is brought within them
+ */
+inline void Packet_Sizer::configure(const Sizer_Config &c)
+{
+	config = c;
+	size = std::max(config.min_samples, std::min(size, limit()));
+}
+
+/**
+ * on_sent: Note the time a packet left, for the round trip of its ack
+ * @param seq: Sequence number of the packet
+ * @param now: Time it was pushed to the Client
+ */
+inline void Packet_Sizer::on_sent(uint16_t seq, int64_t now)
+{
+	size_t i = seq % SIZER_SEND_HISTORY;
+	sent_time[i] = now;
+	sent_seq[i] = seq;
+	sent_valid[i] = true;
+	sent_unqueued[i] = queue_empty;
+	newest_sent = seq;
+	any_sent = true;
+}
+
+/**
+ * on_ack: Account for a BT_MSG_ACK
+ * @param seq: Newest sequence number the receiver has
+ * @param now: Time the ack arrived
+ */
+inline void Packet_Sizer::on_ack(uint16_t seq, int64_t now)
+{
+	// acks can only move forward, an older one says nothing new
+	if (any_acked && (int16_t)(uint16_t)(seq - newest_acked) <= 0)
+		return;
+	newest_acked = seq;
+	any_acked = true;
+	ack_count++;
+
+	size_t i = seq % SIZER_SEND_HISTORY;
+	if (!sent_valid[i] || sent_seq[i] != seq || now < sent_time[i])
+		return;
+	int64_t r = now - sent_time[i];
+	sent_valid[i] = false;
+
+	srtt = (rtt_samples == 0) ? r : srtt + (r - srtt) / 8;
+	rtt_samples++;
+	if (!sent_unqueued[i])
+		return;
+	rtt[rtt_pos] = r;
+	rtt_pos = (rtt_pos + 1) % SIZER_RTT_HISTORY;
+	if (rtt_count < SIZER_RTT_HISTORY)
+		rtt_count++;
+	min_rtt = *std::min_element(rtt, rtt + rtt_count);
+}
+
+/**
+ * limit: Internal function. Most samples per packet within the latency budget.
+ */
+inline size_t Packet_Sizer::limit() const
+{
+	int64_t spare = config.latency_budget_us - min_rtt / 2;
+	size_t n = (spare > 0) ? (size_t)(spare / config.sample_period_us) + 1 : 1;
+	return std::max(config.min_samples, std::min(n, config.max_samples));
+}
+
+/**
+ * in_flight: Internal function. Packets sent after the newest acked one.
+ */
+inline uint16_t Packet_Sizer::in_flight() const
+{
+	return (any_sent && any_acked) ? (uint16_t)(newest_sent - newest_acked) : 0;
+}
+
+/**
+ * next_size: Pick the number of samples for the next packet
+ * @param now: Current time
+ * @param queue_depth: Packets waiting in the Client's queue
+ * @param stalls: The Client's count of writes the socket did not take at once
+ * @returns Samples to put in the next packet
+ */
+inline size_t Packet_Sizer::next_size(int64_t now, size_t queue_depth, uint64_t stalls)
+{
+	bool stalled = stalls != last_stalls;
+	last_stalls = stalls;
+	queue_empty = queue_depth == 0;
+
+	// acks later than the base round trip by more than a packet's worth of samples wait in a queue somewhere
+	int64_t queueing = (rtt_count > 0) ? (int64_t)srtt - min_rtt : 0;
+	int64_t slack = std::max((int64_t)SIZER_QUEUEING_US, (int64_t)size * config.sample_period_us);
+	bool congested = stalled || queue_depth >= config.congested_queue || queueing > slack;
+	bool idle = !stalled && queue_depth == 0 && queueing <= slack / 2 && in_flight() <= 2;
+
+	size_t n = size;
+	if (now >= next_change)
+	{
+		size_t smaller = size - std::min(size - config.min_samples, std::max((size_t)1, size / 4));
+		if (congested)
+			n = size * 2;
+		else if (idle && (int64_t)smaller * config.sample_period_us >= 2 * min_rtt)
+			n = smaller;
+	}
+
+	// the budget holds at once, however the link is doing
+	n = std::max(config.min_samples, std::min(n, limit()));
+	if (n != size)
+	{
+		if (n > size)
+			grown++;
+		else
+			shrunk++;
+		size = n;
+		next_change = now + std::max((int64_t)(2 * srtt), 2 * (int64_t)size * config.sample_period_us);
+	}
+	return size;
+}
+
+/**
+ * stats: Get the size, round trips and counters
+ */
+inline Sizer_Stats Packet_Sizer::stats() const
+{
+	Sizer_Stats st;
+	st.samples = size;
+	st.limit = limit();
+	st.srtt_us = srtt;
+	st.min_rtt_us = min_rtt;
+	st.in_flight = in_flight();
+	st.acks = ack_count;
+	st.grown = grown;
+	st.shrunk = shrunk;
+	st.latency_us = (int64_t)(size - 1) * config.sample_period_us + (int64_t)(srtt / 2);
+	return st;
+}
@@ -0,0 +1,428 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+
+#include "datasource.hpp"
+#include "sensor_validator.hpp"
+
+// most sensor sources that can be fused (the bluetooth source field is 4 bits)
+#define FUSION_MAX_SENSORS 16
+
+// samples buffered per sensor while waiting for the others to catch up, power of two
+#define FUSION_WINDOW 256
+
+// push() argument for packets that do not say which sample they start with (protocol version 1)
+#define FUSION_NO_INDEX UINT64_MAX
+
+// sensor side times are whole ms and move with when the sender woke up, so by default a packet
+// starting this many samples from where the last one ended still follows straight on from it
+#define FUSION_INDEX_SLACK 1
+
+enum Fusion_Method
+{
+	FUSE_WEIGHTED_MEDIAN,	// robust: a single sensor reading far off cannot move the output
+	FUSE_INVERSE_VARIANCE	// lowest noise when every contribution is good
+};
+
+/**
+ * Fusion_Config
+ * Settings of Sensor_Fusion
+ */
+struct Fusion_Config
+{
+	Fusion_Method method{FUSE_WEIGHTED_MEDIAN};
+	uint32_t max_lag{64};	 // samples a sensor may fall behind the newest one before it is no longer waited for
+	float min_quality{0.05f}; // lower bound on a valid sensor's quality weight
+	uint32_t index_slack{FUSION_INDEX_SLACK}; // samples a packet may start off from where the last one ended and still follow on
+};
+
+/**
+ * Fusion_Stats
+ * Counters of one Sensor_Fusion
+ */
+struct Fusion_Stats
+{
+	uint64_t slots{0};							  // fused samples produced
+	uint64_t held{0};							  // slots with no usable reading, nothing was output for them
+	uint64_t lost{0};							  // slots left empty for samples a sensor never delivered in time
+	uint64_t flagged_skipped{0};				  // readings left out because the validator flagged them
+	uint64_t invalid_skipped{0};				  // readings left out because their sensor was invalid
+	uint64_t realignments{0};					  // times a sensor was (re)aligned with the others
+	uint64_t contributions[FUSION_MAX_SENSORS]{0}; // readings used from each sensor
+};
+
+/**
+ * Sensor_Fusion
+ * Combines the samples of every sensor into one stream. Sensors sample at the
+ * same rate, so each sensor's n-th sample after it was aligned goes into the
+ * output slot (alignment slot + n). When a sensor first shows up, its packet
+ * is lined up to end with the newest sample of the others, and it is lined up
+ * again the same way if it falls more than max_lag samples behind (a stalled
+ * link). Packets that say which sample they start with (the sensor box's
+ * sample clock) keep their sensor in step across lost packets: the slots of
+ * the missing samples are left empty and later samples go where they belong.
+ * A late sensor, or a lost sample that may still arrive out of order, is
+ * waited for up to max_lag samples, after that slots are fused without it.
+ *
+ * Every slot is fused from the readings of valid sensors that the validator
+ * did not flag. IR and red are combined as deviations from each sensor's own
+ * baseline, so sensors sitting at different light levels agree, and the output
+ * level is the average baseline of every valid sensor. SpO2 and BPM are combined directly, ignoring
+ * sensors that report 0 (no estimate yet). Sensors are weighted by quality,
+ * 1 - their validator's error score, and for FUSE_INVERSE_VARIANCE also by
+ * the inverse of their channel variance. A slot with no usable reading
+ * produces no output, so every fused sample holds live readings.
+ *
+ * Memory is constant and work is O(sensors) per output sample.
+ */
+class Sensor_Fusion
+{
+private:
+	struct Reading
+	{
+		Sample s;
+		uint8_t flagged;
+		bool lost; // the sensor never delivered this slot's sample
+	};
+
+	struct Sensor
+	{
+		bool active{false};
+		bool valid{false};
+		uint64_t start{0}; // first slot filled since the sensor was aligned
+		uint64_t head{0};  // next slot the sensor fills
+		bool indexed{false};
+		uint64_t next_index{0}; // sensor side number of the sample expected next, when indexed
+		float quality{0};
+		float baseline[2]{0};
+		float variance[2]{1, 1};
+		Reading ring[FUSION_WINDOW];
+	};
+
+	Fusion_Config config;
+	Sensor sensors[FUSION_MAX_SENSORS];
+	uint64_t next_slot{0}; // next slot to fuse
+	uint64_t frontier{0};  // newest slot filled by any sensor
+	Fusion_Stats counters;
+
+	bool waiting(const Sensor &s) const;
+	bool fuse_slot(uint64_t slot, Sample &out);
+	static float combine(const float *x, const float *w, size_t n, Fusion_Method method);
+
+public:
+	Sensor_Fusion() {}
+	Sensor_Fusion(const Fusion_Config &cfg) : config(cfg) {}
+
+	void push(int sensor, const Sample *s, size_t n, const uint8_t *flags, const Validation_Stats &st, uint64_t first = FUSION_NO_INDEX);
+	size_t fuse(Sample *out, size_t max);
+	void remove(int sensor);
+
+	void configure(const Fusion_Config &cfg) { config = cfg; }
+	const Fusion_Config &get_config() const { return config; }
+
+	size_t pending() const { return frontier - next_slot; }
+	const Fusion_Stats &stats() const { return counters; }
+	void print_stats() const;
+	void reset();
+};
+
+/**
+ * push: Add a batch of samples from one sensor.
+ * @param sensor Sensor source number (0-15)
+ * @param s First sample
+ * @param n Number of samples
+ * @param flags Per sample flags from Sensor_Validator::check, or nullptr if no sample was flagged
+ * @param st The sensor's validator statistics after checking these samples
+ * @param first Sensor side number of the first sample, counted in sample periods, or FUSION_NO_INDEX
+ */
+inline void Sensor_Fusion::push(int sensor, const Sample *s, size_t n, const uint8_t *flags, const Validation_Stats &st, uint64_t first)
+{
+	Sensor &sen = sensors[sensor & (FUSION_MAX_SENSORS - 1)];
+
+	// keep the sensor in step across lost packets: leave the slots of the samples that never came empty,
+	// and fill them in if the samples turn up late, before their slots were fused. Samples already in
+	// place are skipped. A gap longer than the window is lined up afresh
+	bool realign = !sen.active;
+	if (sen.active && sen.indexed && first != FUSION_NO_INDEX)
+	{
+		if (first + config.index_slack >= sen.next_index && first <= sen.next_index + config.index_slack)
+			first = sen.next_index;
+
+		if (first < sen.next_index)
+		{
+			size_t skip = (sen.next_index - first < n) ? (size_t)(sen.next_index - first) : n;
+			for (size_t i = 0; i < skip; i++)
+			{
+				uint64_t back = sen.next_index - (first + i);
+				if (back > sen.head)
+					continue;
+				uint64_t slot = sen.head - back;
+				Reading &r = sen.ring[slot & (FUSION_WINDOW - 1)];
+				if (slot < sen.start || slot < next_slot || back > FUSION_WINDOW || !r.lost)
+					continue;
+				r.s = s[i];
+				r.flagged = (flags != nullptr) ? flags[i] : 0;
+				r.lost = false;
+				counters.lost--;
+			}
+			s += skip;
+			flags = (flags != nullptr) ? flags + skip : nullptr;
+			n -= skip;
+			first += skip;
+		}
+		else if (first - sen.next_index < FUSION_WINDOW)
+		{
+			uint64_t gap = first - sen.next_index;
+			for (uint64_t i = 0; i < gap; i++)
+				sen.ring[(sen.head + i) & (FUSION_WINDOW - 1)].lost = true;
+			sen.head += gap;
+			counters.lost += gap;
+		}
+		else
+		{
+			realign = true;
+		}
+	}
+	// a packet that only filled in late samples leaves the next index where it was
+	if (first == FUSION_NO_INDEX || !sen.indexed || realign || first + n > sen.next_index)
+		sen.next_index = first + n;
+	sen.indexed = first != FUSION_NO_INDEX;
+
+	// line up new and badly lagging sensors so these samples end with the newest data
+	if (realign || sen.head + config.max_lag < frontier)
+	{
+		uint64_t slot = (frontier > n) ? frontier - n : 0;
+		sen.active = true;
+		sen.start = sen.head = (slot > next_slot) ? slot : next_slot;
+		counters.realignments++;
+	}
+
+	sen.valid = st.valid;
+	float q = 1.0f - st.score;
+	sen.quality = (q < config.min_quality) ? config.min_quality : q;
+	for (int c = 0; c < 2; c++)
+	{
+		// channels the validator does not track are fused as raw values
+		bool tracked = st.std[c] > 0;
+		sen.baseline[c] = tracked ? st.mean[c] : 0.0f;
+		sen.variance[c] = tracked ? st.std[c] * st.std[c] : 1.0f;
+	}
+
+	for (size_t i = 0; i < n; i++)
+	{
+		Reading &r = sen.ring[(sen.head + i) & (FUSION_WINDOW - 1)];
+		r.s = s[i];
+		r.flagged = (flags != nullptr) ? flags[i] : 0;
+		r.lost = false;
+	}
+	sen.head += n;
+
+	if (sen.head > frontier)
+		frontier = sen.head;
+}
+
+/**
+ * waiting: Internal function. True if the next slot should wait for more samples from this sensor,
+ * or for its lost sample in case that packet arrives out of order.
+ */
+inline bool Sensor_Fusion::waiting(const Sensor &s) const
+{
+	if (!s.active)
+		return false;
+	if (s.head <= next_slot)
+		return s.head + config.max_lag >= frontier;
+	return next_slot >= s.start && s.ring[next_slot & (FUSION_WINDOW - 1)].lost && next_slot + config.max_lag >= frontier;
+}
+
+/**
+ * fuse: Produce the fused samples of every slot that all live sensors have filled.
+ * Slots without a usable reading are passed over, see fuse_slot.
+ * @param out Destination for the fused samples
+ * @param max Most samples to write to out
+ * @returns Number of samples written
+ */
+inline size_t Sensor_Fusion::fuse(Sample *out, size_t max)
+{
+	// slots older than the window were overwritten before anyone fused them
+	if (frontier > FUSION_WINDOW && next_slot < frontier - FUSION_WINDOW)
+		next_slot = frontier - FUSION_WINDOW;
+
+	size_t n{0};
+	while (n < max && next_slot < frontier)
+	{
+		for (const Sensor &s : sensors)
+			if (waiting(s))
+				return n;
+
+		if (fuse_slot(next_slot++, out[n]))
+			n++;
+	}
+	return n;
+}
+
+/**
+ * combine: Internal function. Weighted median or weighted mean of n values.
+ */
+inline float Sensor_Fusion::combine(const float *x, const float *w, size_t n, Fusion_Method method)
+{
+	float total{0};
+	for (size_t i = 0; i < n; i++)
+		total += w[i];
+
+	if (method == FUSE_INVERSE_VARIANCE)
+	{
+		float sum{0};
+		for (size_t i = 0; i < n; i++)
+			sum += w[i] * x[i];
+		return sum / total;
+	}
+
+	// at most FUSION_MAX_SENSORS values: insertion sort, then walk to half the weight
+	float xs[FUSION_MAX_SENSORS];
+	float ws[FUSION_MAX_SENSORS];
+	for (size_t i = 0; i < n; i++)
+	{
+		size_t j = i;
+		for (; j > 0 && xs[j - 1] > x[i]; j--)
+		{
+			xs[j] = xs[j - 1];
+			ws[j] = ws[j - 1];
+		}
+		xs[j] = x[i];
+		ws[j] = w[i];
+	}
+
+	float acc{0};
+	for (size_t i = 0; i < n; i++)
+	{
+		acc += ws[i];
+		if (acc * 2 == total && i + 1 < n)
+			return (xs[i] + xs[i + 1]) / 2;
+		if (acc * 2 > total)
+			return xs[i];
+	}
+	return xs[n - 1];
+}
+
+// round and clamp a fused value to the range of a sample field
+static inline uint16_t fusion_field(float v)
+{
+	return (v <= 0.0f) ? 0 : (v >= 65535.0f) ? 65535 : (uint16_t)(v + 0.5f);
+}
+
+/**
+ * fuse_slot: Internal function. Combine every usable reading of one slot.
+ * @returns False if no sensor had a usable reading, out is left untouched
+ */
+inline bool Sensor_Fusion::fuse_slot(uint64_t slot, Sample &out)
+{
+	float dev[2][FUSION_MAX_SENSORS];
+	float dev_w[2][FUSION_MAX_SENSORS];
+	float base[2]{0};
+	size_t base_n{0};
+	float vital[2][FUSION_MAX_SENSORS];
+	float vital_w[2][FUSION_MAX_SENSORS];
+	size_t vital_n[2]{0};
+	size_t n{0};
+
+	Sample fused;
+
+	for (int i = 0; i < FUSION_MAX_SENSORS; i++)
+	{
+		const Sensor &sen = sensors[i];
+		if (!sen.active || slot < sen.start || slot >= sen.head || sen.head - slot > FUSION_WINDOW)
+			continue;
+
+		const Reading &r = sen.ring[slot & (FUSION_WINDOW - 1)];
+		if (!r.lost && r.s.timestamp > fused.timestamp)
+			fused.timestamp = r.s.timestamp;
+		if (!r.lost && r.s.pilot_state > fused.pilot_state)
+			fused.pilot_state = r.s.pilot_state;
+
+		if (!sen.valid)
+		{
+			counters.invalid_skipped++;
+			continue;
+		}
+
+		// the output level is the plain average of every valid sensor's level, so it does
+		// not move when one reading is skipped or lost, or when a quality score changes
+		for (int c = 0; c < 2; c++)
+			base[c] += sen.baseline[c];
+		base_n++;
+
+		if (r.lost)
+			continue;
+		if (r.flagged)
+		{
+			counters.flagged_skipped++;
+			continue;
+		}
+		counters.contributions[i]++;
+
+		uint16_t led[2]{r.s.irLED, r.s.redLED};
+		for (int c = 0; c < 2; c++)
+		{
+			dev[c][n] = led[c] - sen.baseline[c];
+			dev_w[c][n] = (config.method == FUSE_INVERSE_VARIANCE) ? sen.quality / sen.variance[c] : sen.quality;
+		}
+		n++;
+
+		uint16_t v[2]{r.s.spo2, r.s.bpm};
+		for (int c = 0; c < 2; c++)
+		{
+			if (v[c] == 0)
+				continue;
+			vital[c][vital_n[c]] = v[c];
+			vital_w[c][vital_n[c]] = sen.quality;
+			vital_n[c]++;
+		}
+	}
+
+	// repeating the previous output would pass it off as a live reading
+	if (n == 0)
+	{
+		counters.held++;
+		return false;
+	}
+
+	counters.slots++;
+	fused.irLED = fusion_field(base[0] / base_n + combine(dev[0], dev_w[0], n, config.method));
+	fused.redLED = fusion_field(base[1] / base_n + combine(dev[1], dev_w[1], n, config.method));
+	// 0 means no estimate, as it does for every sensor, so a stale value never passes for a live one
+	fused.spo2 = (vital_n[0] > 0) ? fusion_field(combine(vital[0], vital_w[0], vital_n[0], config.method)) : 0;
+	fused.bpm = (vital_n[1] > 0) ? fusion_field(combine(vital[1], vital_w[1], vital_n[1], config.method)) : 0;
+
+	out = fused;
+	return true;
+}
+
+/**
+ * remove: Stop waiting for a sensor, ie: after it disconnects. Its buffered samples are dropped.
+ * @param sensor Sensor source number (0-15)
+ */
+inline void Sensor_Fusion::remove(int sensor)
+{
+	sensors[sensor & (FUSION_MAX_SENSORS - 1)].active = false;
+}
+
+/**
+ * print_stats: Print the fusion counters
+ */
+inline void Sensor_Fusion::print_stats() const
+{
+	printf("(Sensor_Fusion) slots: %llu held: %llu lost: %llu flagged skipped: %llu invalid skipped: %llu realignments: %llu\n",
+		   (unsigned long long)counters.slots, (unsigned long long)counters.held, (unsigned long long)counters.lost,
+		   (unsigned long long)counters.flagged_skipped, (unsigned long long)counters.invalid_skipped,
+		   (unsigned long long)counters.realignments);
+}
+
+/**
+ * reset: Forget every sensor and counter. The configuration is kept.
+ */
+inline void Sensor_Fusion::reset()
+{
+	*this = Sensor_Fusion(config);
+}
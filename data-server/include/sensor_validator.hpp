@@ -0,0 +1,374 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+
+#include "datasource.hpp"
+
+// channels a Sensor_Validator can check
+#define VALIDATE_IR 0x01
+#define VALIDATE_RED 0x02
+#define VALIDATE_SPO2 0x04
+#define VALIDATOR_CHANNELS 3
+
+// most samples scored in one pass, longer batches are split
+#define VALIDATOR_MAX_BATCH 256
+
+// most samples that can be used to learn the baseline
+#define VALIDATOR_MAX_WARMUP 256
+
+/**
+ * Validation_Config
+ * Thresholds used by Sensor_Validator. The defaults were tuned on the recorded
+ * jack_*.csv data, where about a quarter of the readings of a working sensor
+ * are glitches: a working sensor stays valid and a sensor reporting random
+ * values is caught within a couple of packets.
+ */
+struct Validation_Config
+{
+	uint8_t channels{VALIDATE_IR | VALIDATE_RED}; // VALIDATE_* flags of channels to check
+	uint32_t warmup{128};		 // samples used to learn a baseline before scoring starts, at most VALIDATOR_MAX_WARMUP
+	float ewma_alpha{0.01f};	 // weight of each new sample in the running mean and variance
+	float z_threshold{5.0f};	 // samples further than this many standard deviations from the mean are outliers
+	float step_threshold{8.0f};	 // jumps larger than this many average jumps are outliers
+	float min_std{4.0f};		 // lower bound on the standard deviation and average jump, for very quiet channels
+	float score_alpha{0.01f};	 // weight of each new sample in the error score
+	float invalid_score{0.7f};	 // error score (fraction of recent samples flagged) that invalidates a sensor
+	float recover_score{0.5f};	 // error score below which an invalid sensor is valid again
+};
+
+/**
+ * Validation_Stats
+ * Counters of one Sensor_Validator
+ */
+struct Validation_Stats
+{
+	uint64_t samples{0};		  // samples checked
+	uint64_t flagged{0};		  // samples with at least one outlier channel
+	uint64_t z_outliers{0};		  // channel values too far from the running mean
+	uint64_t step_outliers{0};	  // channel values too far from the previous value
+	uint64_t invalidations{0};	  // times the sensor went from valid to invalid
+	float score{0};				  // running fraction of flagged samples
+	bool valid{true};
+	float mean[VALIDATOR_CHANNELS]{0};			// current baseline (exponentially weighted)
+	float std[VALIDATOR_CHANNELS]{0};
+	float lifetime_mean[VALIDATOR_CHANNELS]{0}; // every accepted value since the last reset (Welford)
+	float lifetime_std[VALIDATOR_CHANNELS]{0};
+};
+
+/**
+ * Sensor_Validator
+ * Streaming validation of one sensor's samples. A sample is flagged when a
+ * checked channel is more than z_threshold standard deviations from its
+ * baseline or jumps away from it by more than step_threshold times the
+ * average jump. The
+ * fraction of flagged samples is tracked as an exponentially weighted score
+ * that invalidates the sensor above invalid_score and restores it below
+ * recover_score.
+ *
+ * The baseline of each channel starts from the median and median absolute
+ * deviation of the first warmup samples, so the glitches of a working sensor
+ * do not skew it, and then follows the signal as an exponentially weighted
+ * mean and variance. Outlying values are left out of every update. A packet
+ * that is almost entirely off the baseline but moves smoothly is a real
+ * level change (ie: the sensor was moved), and is used to follow it.
+ * Lifetime statistics of accepted values are kept with Welford's algorithm.
+ *
+ * Packets are checked in two passes per channel: scoring every sample against
+ * the statistics from before the packet (independent per sample, so the
+ * compiler vectorizes it), then folding the accepted values into the
+ * statistics at once. Work is O(1) per sample and memory is constant.
+ */
+class Sensor_Validator
+{
+private:
+	struct Channel
+	{
+		// current baseline
+		double mean{0};
+		double var{0};
+		double mean_step{0};
+		float last{0};
+		bool primed{false};
+
+		// lifetime statistics of accepted values
+		uint64_t count{0};
+		double lifetime_mean{0};
+		double lifetime_m2{0};
+
+		// values and jumps seen while learning the baseline
+		float warm[VALIDATOR_MAX_WARMUP];
+		float warm_step[VALIDATOR_MAX_WARMUP];
+		size_t warm_count{0};
+
+		void learn(const float *x, const float *prev, size_t n, size_t warmup, float min_std);
+		void merge(size_t n, double batch_mean, double batch_m2);
+	};
+
+	Validation_Config config;
+	Channel channel[VALIDATOR_CHANNELS];
+	Validation_Stats counters;
+
+	static uint16_t field(const Sample &s, int c);
+	bool learning() const;
+	void check_channel(int c, const Sample *s, size_t n, uint8_t *bad);
+
+public:
+	Sensor_Validator() {}
+	Sensor_Validator(const Validation_Config &cfg) : config(cfg) {}
+
+	size_t check(const Sample *s, size_t n, uint8_t *flags = nullptr);
+
+	void configure(const Validation_Config &cfg) { config = cfg; }
+	const Validation_Config &get_config() const { return config; }
+
+	bool valid() const { return counters.valid; }
+	float score() const { return counters.score; }
+	Validation_Stats stats() const;
+	void reset();
+};
+
+/**
+ * field: Internal function. Value of channel c of a sample.
+ */
+inline uint16_t Sensor_Validator::field(const Sample &s, int c)
+{
+	return (c == 0) ? s.irLED : (c == 1) ? s.redLED : s.spo2;
+}
+
+/**
+ * learning: Internal function. True while the baselines are being learned.
+ */
+inline bool Sensor_Validator::learning() const
+{
+	size_t warmup = (config.warmup < VALIDATOR_MAX_WARMUP) ? config.warmup : VALIDATOR_MAX_WARMUP;
+	return counters.samples < warmup;
+}
+
+/**
+ * learn: Internal function. Collect values while learning, then set the baseline
+ * from their median and median absolute deviation.
+ */
+inline void Sensor_Validator::Channel::learn(const float *x, const float *prev, size_t n, size_t warmup, float min_std)
+{
+	if (warmup > VALIDATOR_MAX_WARMUP)
+		warmup = VALIDATOR_MAX_WARMUP;
+
+	for (size_t i = 0; i < n && warm_count < warmup; i++, warm_count++)
+	{
+		warm[warm_count] = x[i];
+		warm_step[warm_count] = std::fabs(x[i] - prev[i]);
+	}
+	if (warm_count < warmup)
+		return;
+
+	float *mid = warm + warm_count / 2;
+	std::nth_element(warm, mid, warm + warm_count);
+	mean = *mid;
+
+	for (size_t i = 0; i < warm_count; i++)
+		warm[i] = std::fabs(warm[i] - (float)mean);
+	std::nth_element(warm, mid, warm + warm_count);
+
+	// 1.4826 * MAD estimates the standard deviation of normally distributed values
+	double std = 1.4826 * *mid;
+	if (std < min_std)
+		std = min_std;
+	var = std * std;
+
+	mid = warm_step + warm_count / 2;
+	std::nth_element(warm_step, mid, warm_step + warm_count);
+	mean_step = *mid;
+}
+
+/**
+ * merge: Internal function. Fold the accepted values of a batch into the lifetime statistics.
+ */
+inline void Sensor_Validator::Channel::merge(size_t n, double batch_mean, double batch_m2)
+{
+	// Chan et al. parallel form of Welford's update
+	double total = count + n;
+	double delta = batch_mean - lifetime_mean;
+	lifetime_m2 += batch_m2 + delta * delta * count * n / total;
+	lifetime_mean += delta * n / total;
+	count += n;
+}
+
+/**
+ * check_channel: Internal function. Score one channel of a batch and fold it into the statistics.
+ * @param c Channel index
+ * @param s First sample
+ * @param n Number of samples, 1 to VALIDATOR_MAX_BATCH
+ * @param bad Set to 1 for each sample whose channel is an outlier
+ */
+inline void Sensor_Validator::check_channel(int c, const Sample *s, size_t n, uint8_t *bad)
+{
+	Channel &ch = channel[c];
+	float x[VALIDATOR_MAX_BATCH];
+	float prev[VALIDATOR_MAX_BATCH];
+	float step[VALIDATOR_MAX_BATCH];
+	uint8_t z_bad[VALIDATOR_MAX_BATCH];
+	uint8_t step_bad[VALIDATOR_MAX_BATCH];
+	float use[VALIDATOR_MAX_BATCH];
+
+	// check() never passes an empty batch, the first sample is read on its own so that shows
+	x[0] = field(s[0], c);
+	for (size_t i = 1; i < n; i++)
+		x[i] = field(s[i], c);
+	if (!ch.primed)
+	{
+		ch.last = x[0];
+		ch.primed = true;
+	}
+	prev[0] = ch.last;
+	for (size_t i = 1; i < n; i++)
+		prev[i] = x[i - 1];
+	ch.last = x[n - 1];
+
+	if (learning())
+	{
+		ch.learn(x, prev, n, config.warmup, config.min_std);
+		return;
+	}
+
+	float mean = ch.mean;
+	float std = std::sqrt(ch.var);
+	if (std < config.min_std)
+		std = config.min_std;
+	float avg_step = (ch.mean_step > config.min_std) ? ch.mean_step : config.min_std;
+	float z_limit = config.z_threshold * std;
+	float step_limit = config.step_threshold * avg_step;
+
+	// pass 1: score each sample against the statistics from before the batch
+	uint32_t z_count{0}, step_count{0}, jump_count{0};
+	for (size_t i = 0; i < n; i++)
+	{
+		step[i] = std::fabs(x[i] - prev[i]);
+		z_bad[i] = std::fabs(x[i] - mean) > z_limit;
+		uint8_t jump = step[i] > step_limit;
+		// jumping back towards the baseline after a glitch is not an outlier
+		step_bad[i] = jump && std::fabs(x[i] - mean) > std::fabs(prev[i] - mean);
+		z_count += z_bad[i];
+		step_count += step_bad[i];
+		jump_count += jump;
+		bad[i] |= z_bad[i] | step_bad[i];
+	}
+	counters.z_outliers += z_count;
+	counters.step_outliers += step_count;
+
+	// a smooth signal away from the baseline means the level moved, follow it.
+	// Jumps in either direction count here, random values jump towards the baseline as often as away
+	bool level_moved = (z_count * 10 >= n * 9) && (jump_count * 10 <= n);
+	for (size_t i = 0; i < n; i++)
+		use[i] = (step_bad[i] || (z_bad[i] && !level_moved)) ? 0.0f : 1.0f;
+
+	// pass 2: fold the accepted values into the statistics
+	float used{0}, sum{0}, sum_step{0};
+	for (size_t i = 0; i < n; i++)
+	{
+		used += use[i];
+		sum += use[i] * x[i];
+		sum_step += use[i] * step[i];
+	}
+	// a packet that is mostly outliers says nothing about the baseline. Learning from
+	// the few values that happen to land near it would only widen it, step by step
+	if (used == 0 || (!level_moved && used * 2 < n))
+		return;
+
+	float batch_mean = sum / used;
+	float batch_m2{0};
+	for (size_t i = 0; i < n; i++)
+		batch_m2 += use[i] * (x[i] - batch_mean) * (x[i] - batch_mean);
+
+	// used exponentially weighted updates at once
+	double w = 1.0 - std::pow(1.0 - config.ewma_alpha, (double)used);
+	double delta = batch_mean - ch.mean;
+	ch.mean += w * delta;
+	ch.var = (1.0 - w) * (ch.var + w * delta * delta) + w * batch_m2 / used;
+	ch.mean_step += w * (sum_step / used - ch.mean_step);
+
+	ch.merge((size_t)used, batch_mean, batch_m2);
+}
+
+/**
+ * check: Validate a batch of samples from this sensor.
+ * @param s First sample
+ * @param n Number of samples
+ * @param flags Optional, set to 1 for each flagged sample and 0 otherwise
+ * @returns Number of flagged samples
+ */
+inline size_t Sensor_Validator::check(const Sample *s, size_t n, uint8_t *flags)
+{
+	size_t flagged{0};
+	while (n > 0)
+	{
+		size_t k = (n > VALIDATOR_MAX_BATCH) ? VALIDATOR_MAX_BATCH : n;
+		bool was_learning = learning();
+
+		uint8_t bad[VALIDATOR_MAX_BATCH]{0};
+		for (int c = 0; c < VALIDATOR_CHANNELS; c++)
+			if (config.channels & (1 << c))
+				check_channel(c, s, k, bad);
+
+		size_t batch_flagged{0};
+		for (size_t i = 0; i < k; i++)
+			batch_flagged += bad[i];
+		if (flags != nullptr)
+		{
+			for (size_t i = 0; i < k; i++)
+				flags[i] = bad[i];
+			flags += k;
+		}
+
+		counters.samples += k;
+		if (!was_learning)
+		{
+			counters.flagged += batch_flagged;
+			flagged += batch_flagged;
+
+			float w = 1.0f - std::pow(1.0f - config.score_alpha, (float)k);
+			counters.score += w * ((float)batch_flagged / k - counters.score);
+
+			if (counters.valid && counters.score > config.invalid_score)
+			{
+				counters.valid = false;
+				counters.invalidations++;
+			}
+			else if (!counters.valid && counters.score < config.recover_score)
+			{
+				counters.valid = true;
+			}
+		}
+
+		s += k;
+		n -= k;
+	}
+	return flagged;
+}
+
+/**
+ * stats: Get a snapshot of the counters and channel statistics
+ */
+inline Validation_Stats Sensor_Validator::stats() const
+{
+	Validation_Stats st = counters;
+	for (int c = 0; c < VALIDATOR_CHANNELS; c++)
+	{
+		st.mean[c] = channel[c].mean;
+		st.std[c] = std::sqrt(channel[c].var);
+		st.lifetime_mean[c] = channel[c].lifetime_mean;
+		st.lifetime_std[c] = channel[c].count > 1 ? std::sqrt(channel[c].lifetime_m2 / (channel[c].count - 1)) : 0;
+	}
+	return st;
+}
+
+/**
+ * reset: Forget the baseline and counters, ie: after a sensor is replaced. The configuration is kept.
+ */
+inline void Sensor_Validator::reset()
+{
+	*this = Sensor_Validator(config);
+}
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+
+// sequence numbers remembered behind the newest one, one bit each
+#define SEQ_WINDOW 64
+
+// a jump further than this either way means the sender started counting again
+#define SEQ_RESYNC_DISTANCE 1024
+
+// what a sequence number turned out to be
+enum Sequence_Result
+{
+	SEQ_NEW,		// newer than any before, packets skipped on the way are missing
+	SEQ_REORDERED, // a missing packet arriving after newer ones
+	SEQ_DUPLICATE, // seen before, drop it
+	SEQ_LATE,		// older than the window, already counted as lost
+	SEQ_RESYNC		// too far from the others, counting starts again from it
+};
+
+struct Sequence_Stats
+{
+	uint64_t received{0};	// packets tracked, duplicates included
+	uint64_t gaps{0};		// times packets were skipped
+	uint64_t missing{0};	// packets skipped that may still arrive within the window
+	uint64_t lost{0};		// packets that left the window without arriving
+	uint64_t reordered{0}; // packets that arrived after newer ones
+	uint64_t duplicates{0};
+	uint64_t late{0};		// packets that arrived after they were counted as lost
+	uint64_t resyncs{0};	// times the sender started counting again
+
+	Sequence_Stats &operator+=(const Sequence_Stats &o);
+	// fraction of the packets sent that never arrived, counting the missing ones
+	double loss() const;
+};
+
+/**
+ * Sequence_Tracker
+ * Accounts for the 16 bit sequence numbers of one sensor's packets. The
+ * newest number seen and a SEQ_WINDOW bit mask of the numbers before it are
+ * kept: bit i is set once newest - i arrived. Moving the window forward
+ * counts the cleared bits shifted out as lost, a number arriving into a
+ * cleared bit was reordered, into a set bit it is a duplicate. Numbers are
+ * compared modulo 2^16, so counting wraps around freely.
+ * Every packet is O(1): a compare, a shift and a popcount.
+ */
+class Sequence_Tracker
+{
+private:
+	uint16_t newest{0};
+	uint64_t window{0};
+	bool started{false};
+	Sequence_Stats counters;
+
+	void restart(uint16_t seq);
+
+public:
+	Sequence_Result track(uint16_t seq);
+	void reset();
+
+	const Sequence_Stats &stats() const { return counters; }
+};
+
+inline Sequence_Stats &Sequence_Stats::operator+=(const Sequence_Stats &o)
+{
+	received += o.received;
+	gaps += o.gaps;
+	missing += o.missing;
+	lost += o.lost;
+	reordered += o.reordered;
+	duplicates += o.duplicates;
+	late += o.late;
+	resyncs += o.resyncs;
+	return *this;
+}
+
+inline double Sequence_Stats::loss() const
+{
+	uint64_t sent = received - duplicates - late + missing + lost;
+	return sent ? (double)(missing + lost) / sent : 0.0;
+}
+
+/**
+ * restart: Internal function. Start counting from seq, as if everything before it arrived.
+ */
+inline void Sequence_Tracker::restart(uint16_t seq)
+{
+	newest = seq;
+	window = ~0ULL;
+	started = true;
+	counters.missing = 0;
+}
+
+/**
+ * track: Account for the sequence number of a packet that arrived
+ * @param seq: Sequence number from the packet header
+ * @returns What the packet is, SEQ_DUPLICATE packets should be dropped
+ */
+inline Sequence_Result Sequence_Tracker::track(uint16_t seq)
+{
+	counters.received++;
+	if (!started)
+	{
+		restart(seq);
+		return SEQ_NEW;
+	}
+
+	int32_t d = (int16_t)(uint16_t)(seq - newest);
+	if (d > SEQ_RESYNC_DISTANCE || d < -SEQ_RESYNC_DISTANCE)
+	{
+		// the packets still missing will never be told apart from the new ones
+		counters.lost += counters.missing;
+		counters.resyncs++;
+		restart(seq);
+		return SEQ_RESYNC;
+	}
+
+	if (d > 0)
+	{
+		if (d > 1)
+			counters.gaps++;
+
+		// cleared bits shifted out of the window never arrived
+		uint64_t out = (d >= SEQ_WINDOW) ? window : window >> (SEQ_WINDOW - d);
+		uint64_t out_count = (d >= SEQ_WINDOW) ? SEQ_WINDOW : d;
+		uint64_t out_missing = out_count - __builtin_popcountll(out);
+		counters.lost += out_missing;
+		counters.missing -= out_missing;
+
+		// and those skipped past the window with them
+		if (d > SEQ_WINDOW)
+			counters.lost += d - SEQ_WINDOW;
+
+		// the skipped numbers still in the window may arrive yet
+		counters.missing += std::min(d, SEQ_WINDOW) - 1;
+
+		window = ((d >= SEQ_WINDOW) ? 0 : window << d) | 1;
+		newest = seq;
+		return SEQ_NEW;
+	}
+
+	if (d <= -SEQ_WINDOW)
+	{
+		counters.late++;
+		return SEQ_LATE;
+	}
+
+	uint64_t bit = 1ULL << -d;
+	if (window & bit)
+	{
+		counters.duplicates++;
+		return SEQ_DUPLICATE;
+	}
+
+	window |= bit;
+	counters.missing--;
+	counters.reordered++;
+	return SEQ_REORDERED;
+}
+
+/**
+ * reset: Forget the sequence numbers and counters, ie: when the sender connects again
+ */
+inline void Sequence_Tracker::reset()
+{
+	*this = Sequence_Tracker();
+}
@@ -0,0 +1,214 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+
+#include "datasource.hpp"
+
+// samples the AC RMS is taken over, about one beat at the 64 Hz packet rate
+#define SPO2_WINDOW_LENGTH 64
+
+// pole of the DC removal filters, closer to 1 keeps more of the slow pulse wave
+#define SPO2_DC_ALPHA 0.95f
+
+// readings further than this fraction from the DC level are glitches and skipped
+#define SPO2_MAX_DEVIATION 0.1f
+
+// ratio of ratios lookup entries, indexed by R * 100
+#define SPO2_LUT_SIZE 256
+
+// R the 110 - 25 R calibration holds for, SpO2 100 % down to 85 %
+#define SPO2_MIN_RATIO 0.4f
+#define SPO2_MAX_RATIO 1.0f
+
+// least AC RMS to DC ratio of either channel that is a pulse rather than noise
+#define SPO2_MIN_PERFUSION 0.0005f
+
+// samples the last plausible estimate is held for before it is given up, 5 s at 64 Hz
+#define SPO2_HOLD_LENGTH 320
+
+/**
+ * SpO2_Estimator
+ * Streaming blood oxygen estimate for one sensor from its red and IR LED readings.
+ * Each channel goes through a DC removal filter, the AC part is tracked as a
+ * running RMS over the last SPO2_WINDOW_LENGTH samples and the DC part is taken
+ * from the filter state. The ratio of ratios
+ *     R = (AC_red / DC_red) / (AC_ir / DC_ir)
+ * is mapped to SpO2 through a lookup table built from the usual empirical
+ * calibration SpO2 = 110 - 25 R.
+ * The calibration only holds for R between SPO2_MIN_RATIO and SPO2_MAX_RATIO,
+ * and only for a real pulse: an AC part of at least SPO2_MIN_PERFUSION of the
+ * DC level on both channels. Other windows give no estimate, the last
+ * plausible one is held for SPO2_HOLD_LENGTH samples and then reported as 0,
+ * no reading, so noise never shows up as a low SpO2.
+ * Readings that jump far away from the DC level (loose sensor, bad read) would
+ * swamp the RMS for a whole window, so they are skipped and counted instead.
+ * A full window of skipped readings means the level really moved (ie: the
+ * sensor was repositioned) and the estimator starts over from there.
+ * Every update is O(1) and the estimator never allocates.
+ */
+class SpO2_Estimator
+{
+private:
+	struct Channel
+	{
+		float w{0};	  // DC removal filter state
+		float dc{0};  // DC level of the last sample
+		float sq[SPO2_WINDOW_LENGTH]{0};
+		double sum_sq{0};
+
+		float filter(uint16_t x, bool first);
+	};
+
+	Channel ir;
+	Channel red;
+	size_t pos{0};
+	size_t filled{0};
+	float last_ratio{0};
+	float last_perfusion{0};
+	uint16_t last_spo2{0};
+	uint64_t glitches{0};
+	size_t glitch_run{0};
+	uint64_t implausible{0};
+	size_t hold_run{0};
+
+	static const uint8_t *lut();
+
+public:
+	uint16_t update(uint16_t ir_led, uint16_t red_led);
+	void process(Sample *s, size_t n);
+	void reset();
+
+	bool ready() const { return filled == SPO2_WINDOW_LENGTH; }
+	float ratio() const { return last_ratio; }
+	float perfusion() const { return last_perfusion; }
+	uint16_t value() const { return last_spo2; }
+	uint64_t rejected() const { return glitches; }
+	uint64_t held() const { return implausible; }
+};
+
+/**
+ * filter: Internal function. Run one reading through the DC removal filter.
+ * @param x Raw reading
+ * @param first True for the first reading, the filter then starts settled at x
+ * @returns AC part of the reading
+ */
+inline float SpO2_Estimator::Channel::filter(uint16_t x, bool first)
+{
+	if (first)
+		w = x / (1.0f - SPO2_DC_ALPHA);
+
+	float prev = w;
+	w = x + SPO2_DC_ALPHA * prev;
+	dc = w * (1.0f - SPO2_DC_ALPHA);
+	return w - prev;
+}
+
+/**
+ * lut: Internal function. SpO2 percentage for each R * 100, built once.
+ */
+inline const uint8_t *SpO2_Estimator::lut()
+{
+	static uint8_t table[SPO2_LUT_SIZE];
+	static bool built = []() {
+		for (int i = 0; i < SPO2_LUT_SIZE; i++)
+		{
+			float spo2 = 110.0f - 25.0f * i / 100.0f;
+			table[i] = (uint8_t)(spo2 > 100.0f ? 100.0f : (spo2 < 0.0f ? 0.0f : spo2 + 0.5f));
+		}
+		return true;
+	}();
+	(void)built;
+	return table;
+}
+
+/**
+ * update: Add one reading and get the current estimate.
+ * @param ir_led IR LED reading
+ * @param red_led Red LED reading
+ * @returns SpO2 in percent, 0 until a full window has been seen and while there is no plausible estimate
+ */
+inline uint16_t SpO2_Estimator::update(uint16_t ir_led, uint16_t red_led)
+{
+	bool first = (filled == 0 && pos == 0);
+	if (!first && (std::fabs(ir_led - ir.dc) > SPO2_MAX_DEVIATION * ir.dc ||
+				   std::fabs(red_led - red.dc) > SPO2_MAX_DEVIATION * red.dc))
+	{
+		glitches++;
+		if (++glitch_run < SPO2_WINDOW_LENGTH)
+			return last_spo2;
+
+		// settle on the new level, keeping the counters
+		uint64_t g = glitches;
+		reset();
+		glitches = g;
+		first = true;
+	}
+	glitch_run = 0;
+
+	float ac_ir = ir.filter(ir_led, first);
+	float ac_red = red.filter(red_led, first);
+
+	// slide the window: drop the oldest square, add the newest
+	float sq_ir = ac_ir * ac_ir;
+	float sq_red = ac_red * ac_red;
+	ir.sum_sq += (double)sq_ir - ir.sq[pos];
+	red.sum_sq += (double)sq_red - red.sq[pos];
+	ir.sq[pos] = sq_ir;
+	red.sq[pos] = sq_red;
+	pos = (pos + 1) % SPO2_WINDOW_LENGTH;
+
+	if (filled < SPO2_WINDOW_LENGTH)
+	{
+		filled++;
+		if (filled < SPO2_WINDOW_LENGTH)
+			return last_spo2;
+	}
+
+	// no pulse or no light, keep the last estimate
+	if (ir.sum_sq <= 0 || red.sum_sq <= 0 || ir.dc <= 0 || red.dc <= 0)
+		return last_spo2;
+
+	// the window lengths cancel, so the RMS ratio is the root of the sum ratio
+	last_ratio = std::sqrt((float)(red.sum_sq / ir.sum_sq)) * ir.dc / red.dc;
+	float perfusion_ir = std::sqrt((float)(ir.sum_sq / SPO2_WINDOW_LENGTH)) / ir.dc;
+	float perfusion_red = std::sqrt((float)(red.sum_sq / SPO2_WINDOW_LENGTH)) / red.dc;
+	last_perfusion = std::min(perfusion_ir, perfusion_red);
+
+	// outside the calibration or no pulse: hold the last plausible estimate for a while, then report none
+	if (last_ratio < SPO2_MIN_RATIO || last_ratio > SPO2_MAX_RATIO || last_perfusion < SPO2_MIN_PERFUSION)
+	{
+		implausible++;
+		if (++hold_run > SPO2_HOLD_LENGTH)
+			last_spo2 = 0;
+		return last_spo2;
+	}
+	hold_run = 0;
+
+	int index = (int)(last_ratio * 100.0f + 0.5f);
+	if (index >= SPO2_LUT_SIZE)
+		index = SPO2_LUT_SIZE - 1;
+	last_spo2 = lut()[index];
+	return last_spo2;
+}
+
+/**
+ * process: Fill in the spo2 field of a batch of samples from one sensor.
+ * @param s First sample
+ * @param n Number of samples
+ */
+inline void SpO2_Estimator::process(Sample *s, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		s[i].spo2 = update(s[i].irLED, s[i].redLED);
+}
+
+/**
+ * reset: Forget all readings, ie: after a sensor reconnects.
+ */
+inline void SpO2_Estimator::reset()
+{
+	*this = SpO2_Estimator();
+}
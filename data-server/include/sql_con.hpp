@@ -4,6 +4,7 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <functional>
 
 /**
  * SQL_Connection
@@ -26,7 +27,9 @@ public:
 	~SQL_Connection();
 
 	int insert_samples(const std::vector<Sample> &v);
-	int insert_sample(Sample *s);
+	int insert_samples(const Sample *s, size_t len);
+	int insert_samples(const Sample *s0, size_t len0, const Sample *s1, size_t len1, const std::function<bool()> &keep);
+	int insert_sample(const Sample *s);
 	int select_all_samples();
 };
 
@@ -49,13 +52,13 @@ SQL_Connection::SQL_Connection()
 	sqlite3_prepare_v2(
 		this->db,
 		"INSERT INTO Samples (ID, Timestamp, R_LED, IR_LED, Temperature, BPM, SpO2, PilotState) VALUES (NULL, ?, ?, ?, ?, ?, ?, ?)",
-		65536, // Each of these queries can be a maximum of 64KB in length
+		-1, // Read up to the terminating nul, a fixed length reads past the end of the query
 		&this->insertSample,
 		NULL);
 	sqlite3_prepare_v2(
 		this->db,
 		"SELECT * FROM Samples;",
-		65536, // Each of these queries can be a maximum of 64KB in length
+		-1, // Read up to the terminating nul, a fixed length reads past the end of the query
 		&this->selectAllSamples,
 		NULL);
 };
@@ -91,18 +94,75 @@ int SQL_Connection::query_execute(const char *c)
  */
 int SQL_Connection::insert_samples(const std::vector<Sample> &v)
 {
-	// construct sql statement
-	// loop through each Sample in v and insert into statement
-	std::string cmd_insert = "INSERT INTO Samples(ID, Timestamp, R_LED, IR_LED, Temperature, BPM, SpO2, PilotState) VALUES ";
-	for (auto vi = v.begin(); vi != v.end(); vi++)
+	if (v.empty())
+		return 0;
+	return insert_samples(&v.front(), v.size());
+}
+
+/**
+ * insert_samples: insert a contiguous block of po2/optical samples into the database
+ * @param s Pointer to the first Sample
+ * @param len Number of Samples to insert
+ * @returns zero on success, nonzero on error
+ */
+int SQL_Connection::insert_samples(const Sample *s, size_t len)
+{
+	if (len == 0)
+		return 0;
+
+	// run the whole block as one transaction using the prepared insert statement,
+	// sqlite then commits once per block instead of once per sample
+	int res = query_execute("BEGIN TRANSACTION;");
+	if (res != SQLITE_OK)
+		return res;
+
+	for (size_t i = 0; i < len; i++)
+	{
+		if (insert_sample(s + i) != SQLITE_DONE)
+		{
+			query_execute("ROLLBACK;");
+			return SQLITE_ERROR;
+		}
+	}
+
+	return query_execute("COMMIT;");
+}
+
+/**
+ * insert_samples: insert two blocks of po2/optical samples in one transaction, ie: the two spans of a
+ * Data_Store view, and commit it only if keep() still returns true once they are all inserted
+ * @param s0 Pointer to the first Sample of the first block
+ * @param len0 Number of Samples in the first block
+ * @param s1 Pointer to the first Sample of the second block
+ * @param len1 Number of Samples in the second block
+ * @param keep Called before committing, ie: View::valid(), false rolls the transaction back
+ * @returns zero on success, SQLITE_ABORT if keep() returned false, other nonzero on error
+ */
+int SQL_Connection::insert_samples(const Sample *s0, size_t len0, const Sample *s1, size_t len1, const std::function<bool()> &keep)
+{
+	if (len0 + len1 == 0)
+		return 0;
+
+	int res = query_execute("BEGIN TRANSACTION;");
+	if (res != SQLITE_OK)
+		return res;
+
+	for (size_t i = 0; i < len0 + len1; i++)
 	{
-		cmd_insert += "(NULL, " + std::to_string(vi->timestamp) + ',' + std::to_string(vi->redLED) + ',' + std::to_string(vi->irLED) + ',' + std::to_string(0) + ',' + std::to_string(vi->bpm) + ',' + std::to_string(vi->spo2) + ',' + std::to_string(vi->pilot_state) + ")";
+		if (insert_sample((i < len0) ? s0 + i : s1 + (i - len0)) != SQLITE_DONE)
+		{
+			query_execute("ROLLBACK;");
+			return SQLITE_ERROR;
+		}
+	}
 
-		if (vi + 1 != v.end())
-			cmd_insert += ',';
+	// the samples may have changed under the inserts, none of them are stored then
+	if (!keep())
+	{
+		query_execute("ROLLBACK;");
+		return SQLITE_ABORT;
 	}
-	cmd_insert += ';';
-	return query_execute(cmd_insert.c_str());
+	return query_execute("COMMIT;");
 }
 
 /**
@@ -110,7 +170,7 @@ int SQL_Connection::insert_samples(const std::vector<Sample> &v)
  * @param s One Sample struct
  * @returns zero on success, nonzero on error
  */
-int SQL_Connection::insert_sample(Sample *s)
+int SQL_Connection::insert_sample(const Sample *s)
 {
 	// Bind the timestamp - long is a 32 bit integer, so 64 should be enough
 	sqlite3_bind_int64(this->insertSample, 1, s->timestamp);
@@ -151,6 +211,7 @@ int SQL_Connection::select_all_samples()
 SQL_Connection::~SQL_Connection()
 {
 	sqlite3_finalize(this->insertSample); // Frees memory associated with the prepared statement
+	sqlite3_finalize(this->selectAllSamples);
 	sqlite3_close(this->db);
 }
 #endif
@@ -1,5 +1,19 @@
 #include "../include/bluetooth_sensor_data_recv.hpp"
 #include "../include/sql_con.hpp"
+#include "../include/ds_pipeline.hpp"
+
+// What the classifier decides on, taken from one batch of samples
+struct Pilot_Features
+{
+    unsigned long timestamp{0}; // time of the newest sample in the batch
+    uint32_t samples{0};
+    float bpm{0};  // average of the samples with a heart rate, 0 if none had one
+    float spo2{0}; // average of the samples with an spo2 estimate, 0 if none had one
+    int sensor{-1}; // sensor heart_rate and intervals were taken from, -1 if no valid sensor had a pulse to trust
+    uint16_t heart_rate{0}; // detected from that sensor's IR signal, 0 if there is none
+    uint16_t intervals[HR_IBI_HISTORY]{0}; // recent inter-beat intervals in ms, oldest first
+    size_t interval_count{0};
+};
 
 class Classifier {
     private:
@@ -9,14 +23,64 @@ class Classifier {
     public:
         Classifier (BluetoothReceiver &bluetooth, SQL_Connection &db) : bluetooth(bluetooth), database(db) {}
 
-        void run();
+        void features(const Sample_Batch &batch, Pilot_Features &f);
+        bool classify(Pilot_Features &f);
 };
 
 
-void Classifier::run()
+/**
+ * features: Feature stage, summarise a batch of samples for classify()
+ * @param batch Samples from the datasource
+ * @param f Features to fill in
+ */
+void Classifier::features(const Sample_Batch &batch, Pilot_Features &f)
+{
+    f = Pilot_Features();
+    f.samples = batch.count;
+
+    uint32_t bpm_count{0}, spo2_count{0};
+    for (uint32_t i = 0; i < batch.count; i++)
+    {
+        const Sample &s = batch.samples[i];
+        if (s.timestamp > f.timestamp)
+            f.timestamp = s.timestamp;
+        if (s.bpm != 0)
+        {
+            f.bpm += s.bpm;
+            bpm_count++;
+        }
+        if (s.spo2 != 0)
+        {
+            f.spo2 += s.spo2;
+            spo2_count++;
+        }
+    }
+    if (bpm_count > 0)
+        f.bpm /= bpm_count;
+    if (spo2_count > 0)
+        f.spo2 /= spo2_count;
+
+    // the batch is the fused stream, the detectors run per sensor
+    f.sensor = bluetooth.get_heart_rate_sensor();
+    if (f.sensor < 0)
+        return;
+    f.heart_rate = bluetooth.get_heart_rate(f.sensor);
+    f.interval_count = bluetooth.get_beat_intervals(f.sensor, f.intervals, HR_IBI_HISTORY);
+}
+
+/**
+ * classify: Classify stage, runs on the pipeline's thread for every batch of features
+ * @param f Features of the newest batch of samples
+ * @returns False to drop the features before any later stage
+ */
+bool Classifier::classify(Pilot_Features &f)
 {
-    // Write a loop that
-    //  1. Queries the db for samples (sample type is defined in include/datasource.hpp) (you can use db.query_execute that's defined in include/sql_con.hpp)
+    // Write the model here:
+    //  1. f holds the newest batch's features. Keep what the model needs across batches in members,
+    //     this is the only thread that calls classify(). Older samples can be queried from the db
+    //     (you can use database.query_execute that's defined in include/sql_con.hpp)
     //  2. evaluate your model and determine a classification
     //  3. call bluetooth.send_pilot_state() with a 1 (stressed) or a 0 (unstressed). 2 denotes that the pilot has been stressed for over a minute
-}
\ No newline at end of file
+    (void)f;
+    return true;
+}
@@ -10,13 +10,23 @@
 #include "ds_data_store.hpp"
 #include "sql_con.hpp"
 #include "classifier.cpp"
+#include "ds_pipeline.hpp"
+
+// CPU cores the pipeline stages are pinned to (-1 leaves it to the scheduler)
+#define STORE_STAGE_CPU 1
+#define DATABASE_STAGE_CPU 2
+#define FEATURE_STAGE_CPU 3
+#define CLASSIFY_STAGE_CPU 3
+
+// how often buffered samples are written to the database
+#define DB_FLUSH_INTERVAL_MS 500
 
 int main(int argc, char *argv[])
 {
 	// argument checking
-	if(argc != 2)
+	if(argc != 2 && argc != 3)
 	{
-		std::cout << "usage : " << argv[0] << " [Hardware device Bluetooth address]\n";
+		std::cout << "usage : " << argv[0] << " [Hardware device Bluetooth address] [listen address (optional, ie: unix:@phms-receiver)]\n";
 		return 1;
 	}
 
@@ -25,37 +35,68 @@ int main(int argc, char *argv[])
 
 	// set the bluetooth address before initializing the connection - should be passed by command line argument
 	datasource.set_bt_address(argv[1]);
+	if (argc == 3)
+		datasource.set_listen_address(argv[2]);
 
-	std::cout << "Registering data store callback...\n";
-	Data_Store<Sample> *ds = new Data_Store<Sample>(&datasource);
+	std::cout << "Creating data store...\n";
+	Data_Store<Sample> *ds = new Data_Store<Sample>();
 
 	std::cout << "Registering WebSocket callback...\n";
-	std::thread *server = new std::thread(&startServer, &datasource);
+	std::thread *server = new std::thread(&startServer, ds);
 
 	std::cout << "Starting DB thread...";
 	SQL_Connection *db = new SQL_Connection();
 
+	// Samples from the datasource flow through these stages in order, each
+	// stage on its own thread. New processing stages are added here. The
+	// datasource decodes, validates and fuses the sensors' samples itself,
+	// it keeps the per sensor state of the link.
+	std::cout << "Building processing pipeline...\n";
+	// declared in reverse pipeline order, so each pipeline stops before the one it feeds
+	Classifier classifier(datasource, *db);
+	Pipeline<Pilot_Features> classification;
+	Pipeline<Sample_Batch> pipeline;
+
+	pipeline.add_sink("store", [ds](const Sample_Batch &b) {
+		ds->new_data(b.samples, b.count);
+	}, STORE_STAGE_CPU);
+
+	// Insert samples into the sqlite database in batches, twice per second and once more when
+	// the pipeline stops. They are inserted straight from the data store, so the flushes keep
+	// going when no more batches come and the last samples are written too.
+	pipeline.add_sink("database", [](const Sample_Batch &) {}, [&]() {
+		// both spans in one transaction, rolled back if the writer reached them before it commits
+		Data_Store<Sample>::View v = ds->view();
+		if (v.empty())
+			return;
+		if (db->insert_samples(v.first, v.first_len, v.second, v.second_len, [&v]() { return v.valid(); }) == SQLITE_ABORT)
+			std::cout << "Database flush fell behind, samples " << v.from << " to " << v.to << " were overwritten while they were inserted and were not stored\n";
+	}, std::chrono::milliseconds(DB_FLUSH_INTERVAL_MS), DATABASE_STAGE_CPU);
+	pipeline.on_start("database", [ds]() { ds->register_reader_thread(); });
+
+	// every batch is summarised and classified in a pipeline of its own, so the classifier runs as a stage
+	connect(pipeline, "feature", classification, [&classifier](const Sample_Batch &b, Pilot_Features &f) {
+		classifier.features(b, f);
+	}, FEATURE_STAGE_CPU);
+	classification.add_stage("classify", [&classifier](Pilot_Features &f) {
+		return classifier.classify(f);
+	}, CLASSIFY_STAGE_CPU);
+
+	attach_datasource(pipeline, &datasource);
+	classification.start();
+	pipeline.start();
+
 	std::cout << "Reading from datasource. \n";
 	datasource.initializeConnection();
 
-	// start classifier
-	std::cout << "Starting data classifier thread\n";
-	Classifier classifier(datasource, *db);
-	std::thread classifier_thread(&Classifier::run, &classifier);
-
 	// This job runs indefinitely.
-	// It inserts samples into the sqlite database in batches.
-	ds->register_reader_thread(); // How data_store tracks which samples have not been read yet
-
-	// fake pilot state to send
+	// Report how each stage is keeping up, and what the link lost, once a minute.
 	while (true)
 	{
-		// Flush buffered samples to db twice per second
-		std::this_thread::sleep_for(std::chrono::milliseconds(500));
-		auto vec = ds->vec();
-		if (vec.size() > 0)
-			db->insert_samples(vec);
-		// printf("flushed to database\n");
+		std::this_thread::sleep_for(std::chrono::seconds(60));
+		pipeline.print_stats();
+		classification.print_stats();
+		datasource.print_link_stats();
 	}
 
 	return 0;
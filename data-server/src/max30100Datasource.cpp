@@ -4,75 +4,194 @@
 /* This file implements the "datasource" interface/abstract class. This
  * collects and processes raw sample data from the MAX 30100 sensor over an
  * I2C connection.
+ *
+ * Define MAX30100_NO_WIRINGPI to build without wiringPi. The datasource then
+ * has to be given an I2C_Device (ie: Fake_Max30100) to read from.
  */
 
 // Import libraries
+#include <atomic>
 #include <chrono>
 #include <functional>
 #include <iostream>
+#include <memory>
 #include <thread>
+#include <unistd.h>
+#ifndef MAX30100_NO_WIRINGPI
 #include <wiringPiI2C.h>
+#endif
 
 // Import datasource class definition
 #include "datasource.hpp"
+#include "i2c_device.hpp"
 
-class Max30100: public Datasource {
+#ifndef MAX30100_NO_WIRINGPI
+// I2C_Device backed by wiringPi. Block reads go straight to the i2c-dev
+// file descriptor that wiringPi opened.
+class WiringPi_I2C_Device: public I2C_Device {
 	private:
 		int fd;
+
+	public:
+		WiringPi_I2C_Device(int address) {
+			this->fd = wiringPiI2CSetup(address);
+			if (this->fd < 0) throw this->fd;
+		};
+
+		~WiringPi_I2C_Device() {
+			close(this->fd);
+		};
+
+		int readReg8(int reg) {
+			return wiringPiI2CReadReg8(this->fd, reg);
+		};
+
+		int writeReg8(int reg, int value) {
+			return wiringPiI2CWriteReg8(this->fd, reg, value);
+		};
+
+		int readBlock(int reg, uint8_t* dest, size_t len) {
+			uint8_t r = (uint8_t) reg;
+			if (write(this->fd, &r, 1) != 1) return -1;
+			return read(this->fd, dest, len);
+		};
+};
+#endif
+
+class Max30100: public Datasource {
+	private:
 		static const int DEVICE_ID = 1;
 		static const int DEVICE_ADDRESS = 0x57;
+		static const int FIFO_WR_PTR_REG = 0x02;
+		static const int OVF_COUNTER_REG = 0x03;
+		static const int FIFO_RD_PTR_REG = 0x04;
+		static const int FIFO_DATA_REG = 0x05;
 		static const int MODE_CONFIG_REG = 0x06;
 		static const int SPO2_CONFIG_REG = 0x07;
 		static const int LED_CONFIG_REG = 0x09;
-		static const int TEMP_REG = 0x16;
-		static const int TEMP_FRAC_REG = 0x17;
-		static const int FIFO_BUF_PTR = 0x05;
+
+		// The sensor buffers up to 16 samples of 4 bytes (IR, RED)
+		static const int FIFO_DEPTH = 16;
+		static const int FIFO_SAMPLE_BYTES = 4;
+
+		// Sample rate set in SPO2_CONFIG_REG
+		static const int SAMPLE_RATE = 100;
+
+		// Samples to let collect in the FIFO between reads. Half the FIFO
+		// keeps the transfers large while leaving 80 ms of slack before
+		// the sensor starts overwriting samples.
+		static const int FIFO_READ_THRESHOLD = 8;
+
+		std::unique_ptr<I2C_Device> ownedDevice;
+		I2C_Device* device;
 
 		// Threaded processing
-		bool running = false;
-		std::thread* collector;
-		std::thread* processor;
+		std::atomic<bool> running{false};
+		std::thread* collector{nullptr};
+		std::thread* processor{nullptr};
+
+		// Samples the sensor could not store because the FIFO was full
+		std::atomic<uint64_t> fifoOverflows{0};
+
+		// When the FIFO was last read, to tell a full FIFO from an empty one
+		std::chrono::steady_clock::time_point lastFifoRead;
+
+		void configure() {
+			// Reset the sensor
+			this->device->writeReg8(this->MODE_CONFIG_REG,
+				0b01000000); // 01000000b = 64
+
+			// Set the sensor mode to SPO2
+			this->device->writeReg8(this->MODE_CONFIG_REG,
+				0b00000011); //00000011b = 3
+
+			// Sets:
+			//  - High Resolution (16 bit) mode
+			//  - 100hz Sample Rate
+			//  - 1.6ms LED Pulse Width (req'd for high res)
+			this->device->writeReg8(this->SPO2_CONFIG_REG,
+				0b01000111); // 01000111b = 71
+
+			// Set the LED to the highest current level (50 mA)
+			this->device->writeReg8(this->LED_CONFIG_REG,
+				0b11111111);
+
+			// Start from an empty FIFO
+			this->device->writeReg8(this->FIFO_WR_PTR_REG, 0);
+			this->device->writeReg8(this->OVF_COUNTER_REG, 0);
+			this->device->writeReg8(this->FIFO_RD_PTR_REG, 0);
+			this->lastFifoRead = std::chrono::steady_clock::now();
+		};
+
+		// Number of unread samples in the sensor FIFO. The three pointer
+		// registers are consecutive so they are read in one transfer.
+		int fifoPending() {
+			uint8_t ptrs[3];
+			if (this->device->readBlock(this->FIFO_WR_PTR_REG, ptrs, 3) != 3)
+				return 0;
 
+			uint8_t ovf = ptrs[1] & 0x0f;
+			this->fifoOverflows += ovf;
+
+			auto elapsed = std::chrono::steady_clock::now() - this->lastFifoRead;
+			int expected = (int) (std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() * this->SAMPLE_RATE / 1000000);
+			return fifoPendingFrom(ptrs[0], ovf, ptrs[2], expected);
+		};
 
 		void dataCollectionRunner() {
 
-			// Keep track of time
-			std::chrono::high_resolution_clock::time_point t;
+			const std::chrono::microseconds samplePeriod(1000000 / this->SAMPLE_RATE);
+			uint8_t fifo[FIFO_DEPTH * FIFO_SAMPLE_BYTES];
+
+			// Sample currently being filled. It is only given up once it
+			// has been queued, so the slot of a dropped sample is reused
+			// here rather than released from this thread.
+			struct Sample* data = nullptr;
 
 			// Forever loop
 			while(this->running) {
-				// Only want to read at most 100hz
-				std::this_thread::sleep_for(std::chrono::milliseconds(10));
-				t =	std::chrono::high_resolution_clock::now();
-
-				// Create new sample struct
-				struct Sample* data = new struct Sample();
-				data->timestamp = (long) std::chrono::time_point_cast<std::chrono::milliseconds>(t).time_since_epoch().count();
-				// data->sourceType = MAX30100;
-				// Read temp data
-				// data->temperature.unit = CELSIUS;
-				// data->temperature.value = (double)
-					(wiringPiI2CReadReg8(this->fd, this->TEMP_REG) +
-					((double) wiringPiI2CReadReg8(this->fd,
-											this->TEMP_FRAC_REG) / 16));
-
-				// Read IR and RED Data
-				int ir = wiringPiI2CReadReg8(this->fd, this->FIFO_BUF_PTR) << 8;
-				ir += wiringPiI2CReadReg8(this->fd,	this->FIFO_BUF_PTR);
-				data->irLED = (uint16_t) ir;
-				// data->irLED.unit = NONE;
-
-				int r = wiringPiI2CReadReg8(this->fd, this->FIFO_BUF_PTR) << 8;
-				r += wiringPiI2CReadReg8(this->fd, this->FIFO_BUF_PTR);
-				data->redLED = (uint16_t) r;
-				// data->redLED.unit = NONE;
-
-				// Add to the queue
-				this->unprocessedData.push(data);
-
-				// Reset the temperature reading
-				wiringPiI2CWriteReg8(this->fd,
-					this->MODE_CONFIG_REG, 0b00001011); //00001011b = 11
+				int pending = this->fifoPending();
+
+				if (pending > 0) {
+					// Pull every pending sample in one block transfer
+					int bytes = this->device->readBlock(this->FIFO_DATA_REG,
+						fifo, pending * this->FIFO_SAMPLE_BYTES);
+					pending = bytes > 0 ? bytes / this->FIFO_SAMPLE_BYTES : 0;
+					this->lastFifoRead = std::chrono::steady_clock::now();
+
+					// The newest sample was taken about now, the rest one
+					// sample period apart before it
+					long now = (long) std::chrono::time_point_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now()).time_since_epoch().count();
+
+					for (int i = 0; i < pending; i++) {
+						// Take a sample from the pool
+						if (data == nullptr)
+							data = this->samplePool.acquire();
+						else
+							*data = Sample();
+
+						const uint8_t* b = fifo + i * this->FIFO_SAMPLE_BYTES;
+						data->irLED = (uint16_t) ((b[0] << 8) | b[1]);
+						data->redLED = (uint16_t) ((b[2] << 8) | b[3]);
+						data->timestamp = now - (pending - 1 - i) * 1000 / this->SAMPLE_RATE;
+
+						// Add to the queue. If the processor has fallen too far
+						// behind the sample is dropped (and counted as an overrun)
+						if (this->unprocessedData.push(data))
+							data = nullptr;
+					}
+				}
+
+				// Sleep until the FIFO should have filled up to the read
+				// threshold. Finding more samples than that means the thread
+				// woke late, so the next sleep is shortened by the same
+				// amount (and lengthened when it woke early).
+				int wait = 2 * this->FIFO_READ_THRESHOLD - pending;
+				if (wait < 1)
+					wait = 1;
+				if (wait > this->FIFO_READ_THRESHOLD + this->FIFO_READ_THRESHOLD / 2)
+					wait = this->FIFO_READ_THRESHOLD + this->FIFO_READ_THRESHOLD / 2;
+				std::this_thread::sleep_for(samplePeriod * wait);
 			}
 
 		};
@@ -81,57 +200,78 @@ class Max30100: public Datasource {
 			// Forever loop
 			while (this->running) {
 
-				if (this->unprocessedData.size() > 0) {
-
-					struct Sample* data = this->unprocessedData.front();
-					this->unprocessedData.pop();
+				// Sleep until the collector hands over a sample. The timeout
+				// lets the thread notice when running is cleared.
+				struct Sample* data;
+				if (this->unprocessedData.wait_pop(data, std::chrono::milliseconds(100))) {
 
 					// Pass a pointer to the latest data to all of the
 					// callback functions.
-					// When they are all done executing, delete the data.
-					std::forward_list<std::function<void(struct Sample*)>>::iterator callback;
-					for (callback = this->callbacks.begin(); callback != this->callbacks.end(); callback++) {
-						(*callback)(data);
-					}
+					// When they are all done executing, return the data to the pool.
+					this->dispatch(data, 1);
 
-					delete data;
+					this->samplePool.release(data);
 				}
 
 			}
 		};
 
 	public:
+#ifndef MAX30100_NO_WIRINGPI
 		Max30100() {
 
 			// Initialize WiringPi
-			this->fd = wiringPiI2CSetup(this->DEVICE_ADDRESS);
-			if (this->fd < 0) throw this->fd;
+			this->ownedDevice.reset(new WiringPi_I2C_Device(this->DEVICE_ADDRESS));
+			this->device = this->ownedDevice.get();
 
-			// Reset the sensor
-			wiringPiI2CWriteReg8(this->fd, this->MODE_CONFIG_REG,
-				0b01000000); // 01000000b = 64
+			this->configure();
+		};
+#endif
 
-			// Set the sensor mode to SPO2 and enable temperature
-			wiringPiI2CWriteReg8(this->fd, this->MODE_CONFIG_REG,
-				0b00001011); //00001011b = 11
+		// Read from an already opened device (ie: a Fake_Max30100 during tests)
+		Max30100(I2C_Device* device) {
+			this->device = device;
+			this->configure();
+		};
 
-			// Sets:
-			//  - High Resolution (16 bit) mode
-			//  - 100hz Sample Rate
-			//  - 1.6ms LED Pulse Width (req'd for high res)
-			wiringPiI2CWriteReg8(this->fd, this->SPO2_CONFIG_REG,
-				0b01000111); // 01000111b = 71
+		~Max30100() {
+			std::cout << "Killing threads...\n";
+			this->running = false;
+			this->unprocessedData.notify();
 
-			// Set the LED to the highest current level (50 mA)
-			wiringPiI2CWriteReg8(this->fd, this->LED_CONFIG_REG,
-				0b11111111);
+			if (this->collector != nullptr) {
+				this->collector->join();
+				delete this->collector;
+			}
+			if (this->processor != nullptr) {
+				this->processor->join();
+				delete this->processor;
+			}
+		};
 
+		// Number of samples dropped because the processing thread fell behind
+		uint64_t overruns() const {
+			return this->unprocessedData.overruns();
+		};
 
+		// Number of samples the sensor lost because the FIFO was not read in time
+		uint64_t fifoOverruns() const {
+			return this->fifoOverflows;
 		};
 
-		~Max30100() {
-			std::cout << "Killing threads...\n";
-			this->running = false;
+		// Number of unread samples from the FIFO pointer registers. Equal
+		// pointers mean either an empty or a full FIFO: with samples lost
+		// it is full, and without it is full if more than half a FIFO of
+		// samples should have arrived since the last read (expected), as
+		// an empty FIFO can only be seen shortly after reading it.
+		static int fifoPendingFrom(uint8_t wr, uint8_t ovf, uint8_t rd, int expected) {
+			wr &= 0x0f;
+			rd &= 0x0f;
+			if ((ovf & 0x0f) > 0)
+				return FIFO_DEPTH;
+			if (wr == rd)
+				return expected >= FIFO_DEPTH / 2 ? FIFO_DEPTH : 0;
+			return (wr - rd) & 0x0f;
 		};
 
 		void initializeConnection() {
@@ -142,12 +282,10 @@ class Max30100: public Datasource {
 			// Spawn a thread that reads the data
 			this->collector = new std::thread(&Max30100::dataCollectionRunner,
 				this);
-			this->collector->detach();
 
 			// Spawn a thread that processes the data
 			this->processor = new std::thread(&Max30100::dataProcessorRunner,
 				this);
-			this->processor->detach();
 		};
 
 };
@@ -3,6 +3,7 @@
  */
 
 #include "datasource.hpp"
+#include "ds_data_store.hpp"
 #include <future>
 #include "server_ws.hpp"
 #include "max30100Datasource.cpp"
@@ -12,14 +13,17 @@
 
 using WsServer = SimpleWeb::SocketServer<SimpleWeb::WS>;
 
+// how often new samples are read from the data store and broadcast
+#define WS_SEND_INTERVAL_MS 20
+
+// the dashboard only needs current values, a broadcast further behind skips to the newest ones
+#define WS_MAX_SAMPLES 256
+
 WsServer server;
 
-// Simple datasource callback.
-// This produces a json string and sends it to all websocket clients.
-void sendDataToAllClients(struct Sample *data)
+// Produce the json string sent to the frontend for one sample.
+std::string sampleToJson(const struct Sample *data, unsigned long sentTimestamp)
 {
-	srand(time(NULL));
-
 	std::string json = "{\"timestamp\": ";
 	json += std::to_string(data->timestamp);
 	json += ",\"temperature\": ";
@@ -29,20 +33,50 @@ void sendDataToAllClients(struct Sample *data)
 	json += ", \"SpO2\": ";
 	json += std::to_string(data->spo2);
 	json += ", \"sentTimestamp\": ";
-	json += std::to_string((unsigned long)std::chrono::time_point_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now()).time_since_epoch().count());
+	json += std::to_string(sentTimestamp);
 	json += "}";
+	return json;
+}
 
-	// Send the latest datapoint to all clients
+unsigned long sentTimestampNow()
+{
+	return (unsigned long)std::chrono::time_point_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now()).time_since_epoch().count();
+}
+
+// Send json strings to all websocket clients, looking up the connection list once.
+void sendMessagesToAllClients(const std::vector<std::string> &messages)
+{
+	// Send the latest datapoints to all clients
 	for (auto &c : server.get_connections())
 	{
 		if (c->path == "/data")
 		{
-			c->send(json);
+			for (auto &json : messages)
+				c->send(json);
 		}
 	}
 }
 
-void startServer(Datasource *datasource)
+// Data store reader.
+// This produces a json string per sample straight from the data store's buffer,
+// and sends them unless the samples were overwritten while they were read.
+void sendViewToAllClients(const Data_Store<Sample>::View &view)
+{
+	unsigned long sentTimestamp = sentTimestampNow();
+
+	std::vector<std::string> messages;
+	messages.reserve(view.size());
+	for (size_t i = 0; i < view.first_len; i++)
+		messages.push_back(sampleToJson(view.first + i, sentTimestamp));
+	for (size_t i = 0; i < view.second_len; i++)
+		messages.push_back(sampleToJson(view.second + i, sentTimestamp));
+
+	if (!view.valid())
+		return;
+	sendMessagesToAllClients(messages);
+}
+
+void startServer(Data_Store<Sample> *store)
 {
 	// Start the websocket server on port 8080 using 1 thread
 	server.config.port = 8080;
@@ -99,9 +133,18 @@ void startServer(Datasource *datasource)
 	std::cout << "Server listening on " << server_port.get_future().get()
 			  << "\n";
 
-	// Set up the datasource
-	std::function<void(struct Sample *)> callback = sendDataToAllClients;
-	datasource->registerCallback(callback);
+	// Read new samples from the data store
+	// Broadcasting runs on this thread so connected clients cannot slow down
+	// ingest. Samples are read in place, without a queue or a copy, and a
+	// broadcast that falls behind skips to the newest samples.
+	store->register_reader_thread();
+	while (true)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(WS_SEND_INTERVAL_MS));
+		Data_Store<Sample>::View view = store->view(WS_MAX_SAMPLES);
+		if (!view.empty())
+			sendViewToAllClients(view);
+	}
 
 	server_thread.join();
 }
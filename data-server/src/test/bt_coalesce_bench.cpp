@@ -0,0 +1,184 @@
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <cstring>
+#include <time.h>
+#include <sys/socket.h>
+#include <assert.h>
+
+#include "bluetooth_utils.hpp"
+
+/* Checks and benchmarks the PHMS_Bluetooth::Client transmit path:
+ *  - packets merged into bundles arrive at the Server as the packets that were pushed
+ *  - an idle client thread sleeps instead of spinning
+ *  - the sensor box's load (one small packet per sensor per tick) is sent with
+ *    one write per packet against coalescing up to the L2CAP MTU
+ * Every Communicator sends to itself over a socketpair.
+ */
+
+#define SENSORS 16
+#define PACKET_SAMPLES 5
+#define TICKS 500
+#define BUDGET_US 2000
+
+using bench_clock = std::chrono::steady_clock;
+
+// CPU time used by the whole process
+long long process_cpu_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+struct Loopback
+{
+    int fds[2];
+    PHMS_Bluetooth::Communicator comm;
+
+    Loopback(size_t coalesce_bytes, std::chrono::microseconds budget)
+    {
+        assert(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) == 0);
+        assert(comm.attach(fds[0], fds[1]) == 0);
+        comm.set_coalescing(coalesce_bytes, budget);
+        comm.run();
+    }
+
+    ~Loopback()
+    {
+        comm.quit();
+    }
+
+    // wait until count packets in total have arrived, passing new ones to f
+    template <typename FUNC>
+    void receive(uint64_t count, FUNC f)
+    {
+        while (comm.received() + comm.overruns() < count || comm.available() > 0)
+            if (comm.wait_for(std::chrono::milliseconds(100)))
+                comm.consume(f);
+    }
+};
+
+void test_bundles()
+{
+    std::cout << "Client coalescing tests: ";
+
+    Loopback l(BT_L2CAP_MTU, std::chrono::microseconds(BUDGET_US));
+
+    // packets of every size, some starting with the bundle marker
+    std::vector<std::vector<uint8_t>> pushed;
+    for (size_t i = 0; i < 60; i++)
+    {
+        std::vector<uint8_t> p(1 + (i * 37) % 600);
+        for (size_t j = 0; j < p.size(); j++)
+            p[j] = (uint8_t)(i + j);
+        if (i % 7 == 0)
+            p[0] = BT_BUNDLE_MARKER;
+        pushed.push_back(p);
+        assert(l.comm.push(p.data(), p.size()));
+    }
+
+    // a packet starting with the marker that is too big to be wrapped is dropped
+    std::vector<uint8_t> big(MAX_PKT_SIZE - 1, BT_BUNDLE_MARKER);
+    assert(l.comm.push(big.data(), big.size()));
+
+    size_t next{0};
+    l.receive(pushed.size(), [&](const uint8_t *data, size_t len) {
+        assert(next < pushed.size());
+        assert(len == pushed[next].size() && memcmp(data, pushed[next].data(), len) == 0);
+        next++;
+    });
+    while (l.comm.dropped() == 0)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    assert(next == pushed.size());
+    assert(l.comm.sent() == pushed.size() && l.comm.dropped() == 1);
+    assert(l.comm.writes() < pushed.size());
+    assert(l.comm.overruns() == 0);
+
+    // a cut off bundle is counted, the whole entries in it still arrive
+    uint8_t bad[] = {BT_BUNDLE_MARKER, 0, 2, 1, 1, 0, 9, 1};
+    assert(write(l.fds[1], bad, sizeof(bad)) == sizeof(bad));
+    l.receive(pushed.size() + 1, [](const uint8_t *data, size_t len) { assert(len == 2 && data[0] == 1); });
+    while (l.comm.malformed() == 0)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    std::cout << "Passed!" << std::endl;
+}
+
+void test_idle()
+{
+    std::cout << "Idle client CPU usage: ";
+
+    Loopback l(0, std::chrono::microseconds(0));
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+    long long cpu_start = process_cpu_ns();
+    auto wall_start = bench_clock::now();
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    double cpu_percent = 100.0 * (process_cpu_ns() - cpu_start) / std::chrono::duration<double, std::nano>(bench_clock::now() - wall_start).count();
+
+    printf("%.2f%% of a core ", cpu_percent);
+    assert(cpu_percent < 5);
+
+    std::cout << "Passed!" << std::endl;
+}
+
+struct Result
+{
+    double writes_per_packet{0};
+    double us_per_tick{0};
+};
+
+Result run(size_t coalesce_bytes)
+{
+    Loopback l(coalesce_bytes, std::chrono::microseconds(BUDGET_US));
+
+    std::vector<Sample> samples(PACKET_SAMPLES);
+    uint64_t pushed{0};
+
+    auto start = bench_clock::now();
+    for (int tick = 0; tick < TICKS; tick++)
+    {
+        for (int s = 0; s < SENSORS; s++)
+        {
+            assert(l.comm.push(packet_from_Sample_buffer(s, samples)));
+            pushed++;
+        }
+        l.receive(pushed, [](const uint8_t *, size_t) {});
+    }
+    double seconds = std::chrono::duration<double>(bench_clock::now() - start).count();
+
+    assert(l.comm.received() == pushed && l.comm.sent() == pushed);
+
+    Result r;
+    r.writes_per_packet = (double)l.comm.writes() / pushed;
+    r.us_per_tick = seconds * 1e6 / TICKS;
+    return r;
+}
+
+void print(const char *name, const Result &r)
+{
+    printf("%-22s writes per packet: %.3f  time per tick: %8.1f us\n", name, r.writes_per_packet, r.us_per_tick);
+}
+
+int main()
+{
+    test_bundles();
+    test_idle();
+
+    std::cout << SENSORS << " sensors sending " << PACKET_SAMPLES << " sample packets for " << TICKS << " ticks" << std::endl;
+
+    Result single = run(0);
+    print("one write per packet", single);
+
+    Result merged = run(BT_L2CAP_MTU);
+    print("coalesced to the MTU", merged);
+
+    assert(single.writes_per_packet == 1);
+    assert(merged.writes_per_packet < 0.25);
+
+    std::cout << "All tests passed" << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,133 @@
+#include <iostream>
+#include <atomic>
+#include <new>
+#include <cstdlib>
+#include <assert.h>
+
+#include "bluetooth_utils.hpp"
+#include "ds_data_store.hpp"
+
+#define SAMPLES_PER_PACKET 100
+
+// count every heap allocation made by the program
+std::atomic<uint64_t> global_new_count{0};
+
+void *operator new(size_t size)
+{
+    global_new_count++;
+    void *p = malloc(size);
+    if (p == nullptr)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+std::vector<Sample> make_samples(int n, int seed)
+{
+    std::vector<Sample> v(n);
+    for (int i = 0; i < n; i++)
+    {
+        v[i].irLED = 13000 + seed + i;
+        v[i].redLED = 0x8000 + seed + i;
+        v[i].spo2 = 97;
+        v[i].bpm = (seed + i) & 0xff;
+    }
+    return v;
+}
+
+bool same_values(const Sample &a, const Sample &b)
+{
+    return a.irLED == b.irLED && a.redLED == b.redLED && a.spo2 == b.spo2 && a.bpm == b.bpm;
+}
+
+void test_decode()
+{
+    std::cout << "Bluetooth packet decode tests: ";
+
+    std::vector<Sample> sent = make_samples(SAMPLES_PER_PACKET, 0);
+    PHMS_Bluetooth::Packet p = packet_from_Sample_buffer(5, sent);
+    assert(p.size() == 1 + SAMPLES_PER_PACKET * BT_SAMPLE_BYTES);
+
+    // decode into a caller buffer
+    Sample dst[BT_MAX_SAMPLES_PER_PACKET];
+    uint8_t src{0};
+    size_t n = decode_bt_packet(p.get(), p.size(), dst, BT_MAX_SAMPLES_PER_PACKET, src);
+    assert(n == SAMPLES_PER_PACKET);
+    assert(src == 5);
+    for (size_t i = 0; i < n; i++)
+        assert(same_values(dst[i], sent[i]));
+
+    // never writes past max
+    n = decode_bt_packet(p.get(), p.size(), dst, 10, src);
+    assert(n == 10);
+
+    // partial trailing samples are ignored
+    n = decode_bt_packet(p.get(), 1 + 3 * BT_SAMPLE_BYTES + 5, dst, BT_MAX_SAMPLES_PER_PACKET, src);
+    assert(n == 3);
+    assert(decode_bt_packet(p.get(), 0, dst, BT_MAX_SAMPLES_PER_PACKET, src) == 0);
+
+    // the vector version gives the same samples
+    Smp_with_Source smp = sample_buffer_from_bt_packet(p);
+    assert(smp.src == 5);
+    assert(smp.samples.size() == SAMPLES_PER_PACKET);
+    for (size_t i = 0; i < smp.samples.size(); i++)
+        assert(same_values(smp.samples[i], sent[i]));
+
+    std::cout << "Passed!" << std::endl;
+}
+
+void test_decode_in_place()
+{
+    std::cout << "Data_Store in place decode tests: ";
+
+    static Data_Store<Sample> ds;
+
+    // 11 packets of 100 samples wrap around the 1024 sample buffer
+    std::vector<PHMS_Bluetooth::Packet> packets;
+    for (int i = 0; i < 11; i++)
+        packets.push_back(packet_from_Sample_buffer(1, make_samples(SAMPLES_PER_PACKET, i * SAMPLES_PER_PACKET)));
+
+    uint64_t allocations = global_new_count;
+    for (auto &p : packets)
+    {
+        const uint8_t *samples = p.get() + 1;
+        int written = ds.emplace_data(bt_packet_sample_count(p.size()), [&](Sample *dest, size_t offset, size_t n) {
+            decode_bt_samples(samples + offset * BT_SAMPLE_BYTES, n, dest);
+        });
+        assert(written == SAMPLES_PER_PACKET);
+    }
+
+    // decoding into a stack buffer allocates nothing either
+    Sample dst[BT_MAX_SAMPLES_PER_PACKET];
+    uint8_t src{0};
+    for (auto &p : packets)
+        decode_bt_packet(p.get(), p.size(), dst, BT_MAX_SAMPLES_PER_PACKET, src);
+    assert(global_new_count == allocations);
+
+    // the newest 1000 samples are intact across the wrap
+    Sample out[1000];
+    assert(ds.copy(out, 1000) == 1000);
+    std::vector<Sample> expected = make_samples(1000, 100);
+    for (int i = 0; i < 1000; i++)
+        assert(same_values(out[i], expected[i]));
+
+    std::cout << "Passed!" << std::endl;
+}
+
+int main()
+{
+    test_decode();
+    test_decode_in_place();
+    std::cout << "All tests passed" << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,194 @@
+#include <iostream>
+#include <atomic>
+#include <vector>
+#include <thread>
+#include <new>
+#include <cstdlib>
+#include <type_traits>
+#include <sys/socket.h>
+#include <assert.h>
+
+#include "bluetooth_utils.hpp"
+
+#define PACKET_SAMPLES 64
+#define ROUNDS 200
+#define PACKETS_PER_ROUND 16
+
+// count every heap allocation made by the program
+std::atomic<uint64_t> global_new_count{0};
+
+void *operator new(size_t size)
+{
+    global_new_count++;
+    void *p = malloc(size);
+    if (p == nullptr)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+std::vector<Sample> make_samples(size_t n, uint16_t first)
+{
+    std::vector<Sample> ret(n);
+    for (size_t i = 0; i < n; i++)
+    {
+        ret[i].irLED = first + i;
+        ret[i].redLED = first + 2 * i;
+        ret[i].spo2 = 97;
+        ret[i].bpm = 70;
+    }
+    return ret;
+}
+
+void test_packet()
+{
+    std::cout << "Packet tests: ";
+
+    static_assert(!std::is_copy_constructible<PHMS_Bluetooth::Packet>::value, "Packet must be move-only");
+
+    PHMS_Bluetooth::Packet_Pool &pool = PHMS_Bluetooth::Packet_Pool::shared();
+    size_t free_buffers = pool.available();
+
+    {
+        const char text[] = "pilot";
+        PHMS_Bluetooth::Packet a(sizeof(text), text);
+        assert(a.size() == sizeof(text) && memcmp(a.get(), text, sizeof(text)) == 0);
+        assert(pool.available() == free_buffers - 1);
+
+        // moving hands over the buffer and leaves the source empty
+        const uint8_t *contents = a.get();
+        PHMS_Bluetooth::Packet b(std::move(a));
+        assert(b.get() == contents && a.empty() && a.get() == nullptr);
+        assert(pool.available() == free_buffers - 1);
+
+        // clone copies into a buffer of its own
+        PHMS_Bluetooth::Packet c = b.clone();
+        assert(c.get() != b.get() && c.size() == b.size() && memcmp(c.get(), b.get(), b.size()) == 0);
+        assert(c.time() == b.time());
+        assert(pool.available() == free_buffers - 2);
+
+        // move assignment returns the old buffer
+        c = std::move(b);
+        assert(c.get() == contents && pool.available() == free_buffers - 1);
+
+        // packets are cut off at MAX_PKT_SIZE
+        std::vector<uint8_t> big(MAX_PKT_SIZE + 100, 7);
+        PHMS_Bluetooth::Packet d(big.size(), big.data());
+        assert(d.size() == MAX_PKT_SIZE);
+    }
+    assert(pool.available() == free_buffers);
+
+    // the pool falls back to the heap when every buffer is in use
+    {
+        std::vector<PHMS_Bluetooth::Packet> held;
+        held.reserve(pool.size() + 1);
+        uint64_t heap = pool.heap_allocations();
+        for (size_t i = 0; i < pool.size() + 1; i++)
+            held.emplace_back(1);
+        assert(pool.available() == 0);
+        assert(pool.heap_allocations() == heap + (pool.size() + 1 - free_buffers));
+    }
+    assert(pool.available() == free_buffers);
+
+    // samples are encoded straight into the packet
+    std::vector<Sample> sent = make_samples(PACKET_SAMPLES, 100);
+    PHMS_Bluetooth::Packet p = packet_from_Sample_buffer(3, sent);
+    assert(p.size() == 1 + PACKET_SAMPLES * BT_SAMPLE_BYTES);
+    Smp_with_Source got = sample_buffer_from_bt_packet(p);
+    assert(got.src == 3 && got.samples.size() == PACKET_SAMPLES);
+    for (size_t i = 0; i < PACKET_SAMPLES; i++)
+        assert(got.samples[i].irLED == sent[i].irLED && got.samples[i].redLED == sent[i].redLED);
+
+    std::cout << "Passed!" << std::endl;
+}
+
+void test_client_queue()
+{
+    std::cout << "Client queue tests: ";
+
+    // nothing sends, so the queue fills and further packets are refused and left with the caller
+    PHMS_Bluetooth::Client c;
+    for (int i = 0; i < BT_TX_QUEUE_SLOTS; i++)
+        assert(c.push(&i, sizeof(i)));
+
+    PHMS_Bluetooth::Packet extra(4);
+    assert(!c.push(std::move(extra)));
+    assert(extra.size() == 4 && c.dropped() == 1);
+
+    std::cout << "Passed!" << std::endl;
+}
+
+void test_no_allocations()
+{
+    std::cout << "Steady state transmit and receive heap allocation tests: ";
+
+    // the Communicator sends to itself: its client writes into one end, its server reads the other
+    int fds[2];
+    assert(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) == 0);
+
+    PHMS_Bluetooth::Communicator comm;
+    assert(comm.attach(fds[0], fds[1]) == 0);
+    comm.run();
+
+    Sample samples[PACKET_SAMPLES];
+    std::vector<Sample> source = make_samples(PACKET_SAMPLES, 0);
+    std::copy(source.begin(), source.end(), samples);
+
+    Sample decoded[BT_MAX_SAMPLES_PER_PACKET];
+    uint64_t received{0};
+    uint64_t allocations{0};
+    uint64_t pool_heap_allocations = PHMS_Bluetooth::Packet_Pool::shared().heap_allocations();
+
+    for (int round = 0; round < ROUNDS; round++)
+    {
+        // the first rounds warm up the threads and the pool
+        if (round == ROUNDS / 10)
+            allocations = global_new_count;
+
+        for (int i = 0; i < PACKETS_PER_ROUND; i++)
+        {
+            samples[0].irLED = round;
+            assert(comm.push(packet_from_Sample_buffer(i, samples, PACKET_SAMPLES)));
+        }
+
+        while (received < (uint64_t)(round + 1) * PACKETS_PER_ROUND)
+        {
+            if (!comm.wait_for(std::chrono::milliseconds(100)))
+                continue;
+
+            received += comm.consume([&](const uint8_t *data, size_t len) {
+                uint8_t src;
+                assert(decode_bt_packet(data, len, decoded, BT_MAX_SAMPLES_PER_PACKET, src) == PACKET_SAMPLES);
+                assert(decoded[0].irLED == (uint16_t)round && decoded[1].irLED == 1);
+            });
+        }
+    }
+    uint64_t steady_allocations = global_new_count - allocations;
+
+    comm.quit();
+
+    assert(comm.overruns() == 0 && comm.dropped() == 0);
+    assert(PHMS_Bluetooth::Packet_Pool::shared().heap_allocations() == pool_heap_allocations);
+    assert(steady_allocations == 0);
+
+    std::cout << "Passed!" << std::endl;
+}
+
+int main()
+{
+    test_packet();
+    test_client_queue();
+    test_no_allocations();
+    std::cout << "All tests passed" << std::endl;
+
+    return 0;
+}
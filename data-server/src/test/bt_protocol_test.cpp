@@ -0,0 +1,370 @@
+#include <iostream>
+#include <atomic>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <assert.h>
+
+#include "bluetooth_sensor_data_recv.hpp"
+
+/* Checks and benchmarks the version 2 bluetooth sample packet (bt_protocol.hpp):
+ *  - varints and zigzag differences round trip, including 16 bit wrap around
+ *  - version 2 packets round trip, constant channels take no differences,
+ *    truncated and corrupt packets are rejected without reading past their end
+ *  - decode_bt_packet takes both versions
+ *  - a BluetoothReceiver negotiates version 2 with a sender that answers its
+ *    hello, and keeps decoding version 1 from one that does not
+ *  - bytes per sample and encode / decode throughput of both versions, on the
+ *    recorded sample data when it is found
+ */
+
+#define RECORDED_DATA "../../../bluetooth-sensor-data/jack_stressed.csv"
+#define BENCH_PACKET_SAMPLES 5
+#define BENCH_ROUNDS 200
+
+using bench_clock = std::chrono::steady_clock;
+
+// a pulse on top of a slow drift, with spo2 and bpm steady like the sensor box sends
+std::vector<Sample> make_samples(size_t n)
+{
+    std::vector<Sample> v(n);
+    for (size_t i = 0; i < n; i++)
+    {
+        v[i].irLED = 14000 + (uint16_t)(300 * sin(i * 0.1)) + (i * 37) % 50;
+        v[i].redLED = 15000 + (uint16_t)(500 * sin(i * 0.1 + 1)) + (i * 53) % 200;
+        v[i].spo2 = 97;
+        v[i].bpm = 70 + (i / 64) % 3;
+    }
+    return v;
+}
+
+bool same(const Sample &a, const Sample &b)
+{
+    return a.irLED == b.irLED && a.redLED == b.redLED && a.spo2 == b.spo2 && a.bpm == b.bpm && b.timestamp == 0 && b.pilot_state == 0;
+}
+
+void test_varint()
+{
+    std::cout << "Varint tests: ";
+
+    const uint64_t values[] = {0, 1, 127, 128, 300, 16383, 16384, 0xffff, 0xffffffffULL, 0xffffffffffffffffULL};
+    for (uint64_t v : values)
+    {
+        uint8_t buffer[10];
+        size_t n = bt_put_varint(buffer, v);
+        assert(n >= 1 && n <= 10);
+
+        const uint8_t *p = buffer;
+        uint64_t got;
+        assert(bt_get_varint(p, buffer + n, got) && got == v && p == buffer + n);
+
+        // cut short, it is rejected
+        p = buffer;
+        assert(!bt_get_varint(p, buffer + n - 1, got));
+    }
+
+    // every 16 bit difference round trips and takes at most BT_V2_MAX_VALUE_BYTES
+    for (int32_t d = -32768; d <= 32767; d++)
+    {
+        uint8_t buffer[10];
+        assert(bt_put_varint(buffer, bt_zigzag(d)) <= BT_V2_MAX_VALUE_BYTES);
+        assert(bt_unzigzag(bt_zigzag(d)) == d);
+    }
+    assert(bt_zigzag(0) == 0 && bt_zigzag(-1) == 1 && bt_zigzag(1) == 2);
+
+    std::cout << "Passed!" << std::endl;
+}
+
+void test_v2()
+{
+    std::cout << "Version 2 packet tests: ";
+
+    Sample_Packet_Header header, got_header;
+    header.sensor = 3;
+    header.sequence = 0xbeef;
+    header.base_timestamp = 123456789;
+
+    Sample decoded[BT_MAX_SAMPLES_PER_PACKET];
+    uint8_t packet[MAX_PKT_SIZE];
+
+    // every packet size round trips
+    std::vector<Sample> samples = make_samples(BT_V2_MAX_SAMPLES_PER_PACKET);
+    for (size_t n = 0; n <= samples.size(); n++)
+    {
+        size_t len = bt_encode_packet_v2(header, samples.data(), n, packet, sizeof(packet));
+        assert(len > 0 && len <= bt_v2_max_size(n) && len <= MAX_PKT_SIZE);
+        assert(bt_decode_packet_v2(packet, len, decoded, BT_MAX_SAMPLES_PER_PACKET, got_header) == n);
+        assert(got_header.version == BT_PROTOCOL_V2 && got_header.sensor == 3 && got_header.count == n);
+        assert(got_header.sequence == 0xbeef && got_header.base_timestamp == 123456789);
+        for (size_t i = 0; i < n; i++)
+            assert(same(samples[i], decoded[i]));
+    }
+
+    // the largest differences wrap around
+    Sample extremes[4];
+    extremes[0].irLED = 0;
+    extremes[1].irLED = 0xffff;
+    extremes[2].irLED = 0;
+    extremes[3].irLED = 0x8000;
+    extremes[1].redLED = 0x7fff;
+    extremes[2].redLED = 0x8000;
+    size_t len = bt_encode_packet_v2(header, extremes, 4, packet, sizeof(packet));
+    assert(bt_decode_packet_v2(packet, len, decoded, 4, got_header) == 4);
+    for (int i = 0; i < 4; i++)
+        assert(same(extremes[i], decoded[i]));
+
+    // constant channels are sent once, a packet of identical samples is header and first values only
+    std::vector<Sample> flat(20, samples[0]);
+    len = bt_encode_packet_v2(header, flat.data(), flat.size(), packet, sizeof(packet));
+    assert(len <= BT_V2_MAX_HEADER + BT_V2_CHANNELS * 2);
+    assert(bt_decode_packet_v2(packet, len, decoded, BT_MAX_SAMPLES_PER_PACKET, got_header) == flat.size());
+    for (size_t i = 0; i < flat.size(); i++)
+        assert(same(flat[i], decoded[i]));
+
+    // samples that do not fit in dst are skipped
+    len = bt_encode_packet_v2(header, samples.data(), 30, packet, sizeof(packet));
+    assert(bt_decode_packet_v2(packet, len, decoded, 10, got_header) == 10 && got_header.count == 30);
+    for (size_t i = 0; i < 10; i++)
+        assert(same(samples[i], decoded[i]));
+
+    // too little room to be sure it fits
+    assert(bt_encode_packet_v2(header, samples.data(), 30, packet, bt_v2_max_size(30) - 1) == 0);
+
+    // cut short anywhere, nothing is decoded and nothing past the end is read
+    len = bt_encode_packet_v2(header, samples.data(), 30, packet, sizeof(packet));
+    for (size_t cut = 0; cut < len; cut++)
+    {
+        std::vector<uint8_t> shorter(packet, packet + cut);
+        assert(bt_decode_packet_v2(shorter.data(), shorter.size(), decoded, BT_MAX_SAMPLES_PER_PACKET, got_header) == 0);
+    }
+
+    // a difference wider than 16 bits is corrupt
+    uint8_t corrupt[] = {BT_MSG_SAMPLES_V2, 0, 0, 0, 0, 2, 0, 0, 1, 0xff, 0xff, 0x7f};
+    assert(bt_decode_packet_v2(corrupt, sizeof(corrupt), decoded, 2, got_header) == 0);
+
+    std::cout << "Passed!" << std::endl;
+}
+
+void test_both_versions()
+{
+    std::cout << "Protocol version tests: ";
+
+    std::vector<Sample> samples = make_samples(BENCH_PACKET_SAMPLES);
+    Sample decoded[BT_MAX_SAMPLES_PER_PACKET];
+    Sample_Packet_Header header;
+    uint8_t src;
+
+    PHMS_Bluetooth::Packet v1 = packet_from_Sample_buffer(7, samples);
+    assert(decode_bt_packet(v1.get(), v1.size(), decoded, BT_MAX_SAMPLES_PER_PACKET, header) == samples.size());
+    assert(header.version == BT_PROTOCOL_V1 && header.sensor == 7 && header.count == samples.size());
+
+    PHMS_Bluetooth::Packet v2 = packet_from_Sample_buffer_v2(7, 42, 1000, samples);
+    assert(v2.size() < v1.size());
+    assert(decode_bt_packet(v2.get(), v2.size(), decoded, BT_MAX_SAMPLES_PER_PACKET, src) == samples.size() && src == 7);
+    assert(decode_bt_packet(v2.get(), v2.size(), decoded, BT_MAX_SAMPLES_PER_PACKET, header) == samples.size());
+    assert(header.version == BT_PROTOCOL_V2 && header.sequence == 42 && header.base_timestamp == 1000);
+    for (size_t i = 0; i < samples.size(); i++)
+        assert(same(samples[i], decoded[i]));
+
+    // more samples than a version 2 packet is sure to fit are cut off
+    std::vector<Sample> many = make_samples(BT_MAX_SAMPLES_PER_PACKET);
+    PHMS_Bluetooth::Packet big = packet_from_Sample_buffer_v2(0, 0, 0, many);
+    assert(decode_bt_packet(big.get(), big.size(), decoded, BT_MAX_SAMPLES_PER_PACKET, header) == BT_V2_MAX_SAMPLES_PER_PACKET);
+
+    // the most samples a sender puts in a packet fit one L2CAP write, even when every value swings end to end
+    std::vector<Sample> swings(BT_MAX_SAMPLES_PER_PACKET);
+    for (size_t i = 0; i < swings.size(); i++)
+    {
+        uint16_t v = (i % 2) ? 0xffff : 0;
+        swings[i].irLED = swings[i].redLED = swings[i].spo2 = swings[i].bpm = v;
+    }
+    PHMS_Bluetooth::Packet v1_mtu = packet_from_Sample_buffer(0, std::vector<Sample>(swings.begin(), swings.begin() + BT_MTU_SAMPLES_PER_PACKET));
+    PHMS_Bluetooth::Packet v2_mtu = packet_from_Sample_buffer_v2(0, 0, 0, std::vector<Sample>(swings.begin(), swings.begin() + BT_V2_MTU_SAMPLES_PER_PACKET));
+    assert(v1_mtu.size() <= BT_L2CAP_MTU && v2_mtu.size() <= BT_L2CAP_MTU);
+    assert(decode_bt_packet(v2_mtu.get(), v2_mtu.size(), decoded, BT_MAX_SAMPLES_PER_PACKET, header) == BT_V2_MTU_SAMPLES_PER_PACKET);
+
+    // control messages are not sample packets, version 2 packets and sensor ids are
+    const uint8_t hello[2] = {BT_MSG_HELLO, BT_PROTOCOL_VERSION};
+    const uint8_t ack[2] = {BT_MSG_HELLO_ACK, BT_PROTOCOL_V2};
+    assert(bt_is_control_message(hello, 2) && bt_is_control_message(ack, 2));
+    assert(!bt_is_control_message(v1.get(), v1.size()) && !bt_is_control_message(v2.get(), v2.size()));
+
+    // the hello ack says the sample rate, older senders' acks leave it out
+    uint8_t hello_ack[BT_HELLO_ACK_SIZE];
+    uint8_t version;
+    uint16_t rate;
+    assert(bt_hello_ack(BT_PROTOCOL_V2, 2000, hello_ack) == BT_HELLO_ACK_SIZE && bt_is_control_message(hello_ack, BT_HELLO_ACK_SIZE));
+    assert(bt_parse_hello_ack(hello_ack, BT_HELLO_ACK_SIZE, version, rate) && version == BT_PROTOCOL_V2 && rate == 2000);
+    assert(bt_parse_hello_ack(ack, 2, version, rate) && version == BT_PROTOCOL_V2 && rate == BT_SAMPLE_RATE);
+    assert(!bt_parse_hello_ack(hello, 2, version, rate) && !bt_parse_hello_ack(ack, 1, version, rate));
+
+    assert(bt_negotiate_version(0) == BT_PROTOCOL_V1);
+    assert(bt_negotiate_version(BT_PROTOCOL_V1) == BT_PROTOCOL_V1);
+    assert(bt_negotiate_version(BT_PROTOCOL_V2) == BT_PROTOCOL_V2);
+    assert(bt_negotiate_version(BT_PROTOCOL_VERSION + 1) == BT_PROTOCOL_VERSION);
+
+    std::cout << "Passed!" << std::endl;
+}
+
+// connect a sender to a BluetoothReceiver, answering its hello if answer_hello, and send packets of the negotiated version
+void negotiate(const std::string &name, bool answer_hello, uint8_t expected)
+{
+    std::atomic<uint64_t> delivered{0};
+    const std::string receiver_addr = "unix:@phms_protocol_receiver_" + name;
+    const std::string sender_addr = "unix:@phms_protocol_sender_" + name;
+
+    BluetoothReceiver receiver;
+    receiver.set_listen_address(receiver_addr);
+    receiver.set_bt_address(sender_addr);
+    receiver.registerBatchCallback([&](const Sample *, size_t n) { delivered += n; });
+
+    PHMS_Bluetooth::Communicator sender;
+    std::thread connect([&]() { assert(sender.open_con(sender_addr, receiver_addr, 5) == 0); });
+    receiver.initializeConnection();
+    connect.join();
+    sender.run();
+
+    // the hello is the first thing the receiver sends
+    while (!sender.wait_for(std::chrono::milliseconds(100)))
+    {
+    }
+    std::vector<PHMS_Bluetooth::Packet> v = sender.get_all();
+    assert(v.size() >= 1 && v[0].size() == 2 && v[0].get()[0] == BT_MSG_HELLO && v[0].get()[1] == BT_PROTOCOL_VERSION);
+
+    uint8_t version = BT_PROTOCOL_V1;
+    if (answer_hello)
+    {
+        version = bt_negotiate_version(v[0].get()[1]);
+        const uint8_t ack[2] = {BT_MSG_HELLO_ACK, version};
+        assert(sender.push(ack, sizeof(ack)));
+        while (receiver.get_protocol_version() != version)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    assert(version == expected && receiver.get_protocol_version() == expected);
+
+    std::vector<Sample> samples = make_samples(BENCH_PACKET_SAMPLES * 40);
+    for (uint16_t i = 0; i < 40; i++)
+    {
+        const Sample *s = samples.data() + i * BENCH_PACKET_SAMPLES;
+        PHMS_Bluetooth::Packet p = (version >= BT_PROTOCOL_V2) ? packet_from_Sample_buffer_v2(0, i, i * 78, s, BENCH_PACKET_SAMPLES)
+                                                              : packet_from_Sample_buffer(0, s, BENCH_PACKET_SAMPLES);
+        assert(sender.push(std::move(p)));
+    }
+
+    // one sensor, so every sample comes out of fusion as one sample
+    while (delivered < samples.size())
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    assert(delivered == samples.size());
+    sender.quit();
+}
+
+void test_negotiation()
+{
+    std::cout << "Protocol negotiation tests: ";
+
+    negotiate("v2", true, BT_PROTOCOL_V2);
+    negotiate("v1", false, BT_PROTOCOL_V1);
+
+    std::cout << "Passed!" << std::endl;
+}
+
+struct Codec_Result
+{
+    double bytes_per_sample;
+    double encode_rate;
+    double decode_rate;
+};
+
+// encode every packet_samples samples into a packet of either version, then decode them all again
+Codec_Result bench(const std::vector<Sample> &samples, size_t packet_samples, uint8_t version)
+{
+    size_t packets = samples.size() / packet_samples;
+    std::vector<uint8_t> wire(packets * MAX_PKT_SIZE);
+    std::vector<size_t> lengths(packets);
+    Sample decoded[BT_MAX_SAMPLES_PER_PACKET];
+
+    auto start = bench_clock::now();
+    size_t bytes{0};
+    for (int round = 0; round < BENCH_ROUNDS; round++)
+    {
+        bytes = 0;
+        for (size_t i = 0; i < packets; i++)
+        {
+            const Sample *s = samples.data() + i * packet_samples;
+            uint8_t *dst = wire.data() + i * MAX_PKT_SIZE;
+            if (version >= BT_PROTOCOL_V2)
+            {
+                Sample_Packet_Header header;
+                header.sequence = i;
+                header.base_timestamp = i * 78;
+                lengths[i] = bt_encode_packet_v2(header, s, packet_samples, dst, MAX_PKT_SIZE);
+            }
+            else
+            {
+                dst[0] = 0;
+                bt_encode_samples(s, packet_samples, dst + 1);
+                lengths[i] = 1 + packet_samples * BT_SAMPLE_BYTES;
+            }
+            bytes += lengths[i];
+        }
+    }
+    double encode_seconds = std::chrono::duration<double>(bench_clock::now() - start).count();
+
+    start = bench_clock::now();
+    uint64_t checksum{0};
+    for (int round = 0; round < BENCH_ROUNDS; round++)
+    {
+        for (size_t i = 0; i < packets; i++)
+        {
+            Sample_Packet_Header header;
+            size_t n = decode_bt_packet(wire.data() + i * MAX_PKT_SIZE, lengths[i], decoded, BT_MAX_SAMPLES_PER_PACKET, header);
+            assert(n == packet_samples);
+            checksum += decoded[n - 1].irLED;
+        }
+    }
+    double decode_seconds = std::chrono::duration<double>(bench_clock::now() - start).count();
+    assert(checksum > 0);
+
+    double total = (double)packets * packet_samples * BENCH_ROUNDS;
+    return {(double)bytes / (packets * packet_samples), total / encode_seconds, total / decode_seconds};
+}
+
+void benchmark()
+{
+    std::vector<Sample> samples = sample_buffer_from_file(RECORDED_DATA);
+    const char *source = "recorded sample data";
+    if (samples.size() < 1000)
+    {
+        samples = make_samples(10000);
+        source = "generated samples";
+    }
+    std::cout << "Encoding " << samples.size() << " " << source << std::endl;
+
+    printf("%-8s %8s %14s %16s %16s\n", "samples", "version", "bytes/sample", "encode smp/s", "decode smp/s");
+    const size_t sizes[] = {BENCH_PACKET_SAMPLES, 16, 64};
+    for (size_t n : sizes)
+    {
+        Codec_Result v1 = bench(samples, n, BT_PROTOCOL_V1);
+        Codec_Result v2 = bench(samples, n, BT_PROTOCOL_V2);
+        printf("%-8zu %8d %14.2f %16.3e %16.3e\n", n, 1, v1.bytes_per_sample, v1.encode_rate, v1.decode_rate);
+        printf("%-8zu %8d %14.2f %16.3e %16.3e\n", n, 2, v2.bytes_per_sample, v2.encode_rate, v2.decode_rate);
+
+        // the point of version 2
+        assert(v2.bytes_per_sample < v1.bytes_per_sample);
+    }
+}
+
+int main()
+{
+    test_varint();
+    test_v2();
+    test_both_versions();
+    test_negotiation();
+    benchmark();
+
+    std::cout << "All tests passed" << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,348 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <cstring>
+#include <sys/socket.h>
+#include <assert.h>
+
+#include "bluetooth_utils.hpp"
+
+/* Checks and benchmarks PHMS_Bluetooth::Reactor, one thread serving every link:
+ *  - several links send and receive on one reactor thread
+ *  - the Listener accepts connections and the Client connects without blocking
+ *  - a Client whose socket is full carries on when it has room again
+ *  - the coalescing budget is kept with a reactor deadline
+ *  - a Server notices when the other side hangs up
+ *  - LINKS links on a thread pair each against all of them on one reactor thread
+ * Every link is a Communicator sending to itself over a socketpair.
+ */
+
+#define LINKS 8
+#define PACKET_SAMPLES 5
+#define ROUNDS 2000
+#define BUDGET_US 2000
+
+using bench_clock = std::chrono::steady_clock;
+
+// threads the process is running
+int thread_count()
+{
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line))
+        if (line.compare(0, 8, "Threads:") == 0)
+            return std::stoi(line.substr(8));
+    return -1;
+}
+
+// a reactor running on a thread of its own until stopped, declared before the links using it so it outlives them
+struct Reactor_Thread
+{
+    PHMS_Bluetooth::Reactor reactor;
+    std::thread thread;
+
+    Reactor_Thread() : thread(&PHMS_Bluetooth::Reactor::run, &reactor) {}
+
+    void stop()
+    {
+        if (!thread.joinable())
+            return;
+        reactor.quit();
+        thread.join();
+    }
+
+    ~Reactor_Thread()
+    {
+        stop();
+    }
+};
+
+struct Loopback
+{
+    int fds[2];
+    PHMS_Bluetooth::Communicator comm;
+
+    Loopback()
+    {
+        assert(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) == 0);
+        assert(comm.attach(fds[0], fds[1]) == 0);
+    }
+};
+
+// push a numbered sample packet from sensor src
+bool push(PHMS_Bluetooth::Communicator &comm, uint8_t src, uint16_t seq)
+{
+    Sample samples[PACKET_SAMPLES];
+    samples[0].irLED = seq;
+    return comm.push(packet_from_Sample_buffer(src, samples, PACKET_SAMPLES));
+}
+
+// sequence number of a packet sent by push()
+uint16_t check(const uint8_t *data, size_t len, uint8_t src)
+{
+    Sample decoded[BT_MAX_SAMPLES_PER_PACKET];
+    uint8_t got_src;
+    assert(decode_bt_packet(data, len, decoded, BT_MAX_SAMPLES_PER_PACKET, got_src) == PACKET_SAMPLES);
+    assert(got_src == src);
+    return decoded[0].irLED;
+}
+
+// send rounds packets over every link and check they arrive in order, returns packets per second
+double exchange(Loopback *links, int rounds)
+{
+    uint16_t next[LINKS]{0};
+    int done{0};
+
+    auto start = bench_clock::now();
+    for (int round = 0; round < rounds; round++)
+    {
+        for (int i = 0; i < LINKS; i++)
+            assert(push(links[i].comm, i, round));
+
+        done = 0;
+        while (done < LINKS)
+        {
+            done = 0;
+            for (int i = 0; i < LINKS; i++)
+            {
+                links[i].comm.consume([&](const uint8_t *data, size_t len) {
+                    assert(check(data, len, i) == next[i]);
+                    next[i]++;
+                });
+                if (next[i] == round + 1)
+                    done++;
+                else
+                    links[i].comm.wait_for(std::chrono::milliseconds(1));
+            }
+        }
+    }
+    double seconds = std::chrono::duration<double>(bench_clock::now() - start).count();
+
+    for (int i = 0; i < LINKS; i++)
+        assert(links[i].comm.overruns() == 0 && links[i].comm.dropped() == 0);
+    return LINKS * rounds / seconds;
+}
+
+void test_links()
+{
+    std::cout << "Reactor link tests: ";
+
+    int threads = thread_count();
+    {
+        Reactor_Thread r;
+        Loopback links[LINKS];
+        for (auto &l : links)
+            assert(l.comm.run_on(r.reactor) == 0);
+
+        // one thread serves every link
+        assert(thread_count() == threads + 1);
+        exchange(links, 100);
+
+        // a Server notices the other side hanging up
+        int fds[2];
+        assert(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) == 0);
+        PHMS_Bluetooth::Server s;
+        assert(s.attach(fds[0]) == 0 && s.run_on(r.reactor) == 0);
+        assert(s.connected());
+        close(fds[1]);
+        while (s.connected())
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        assert(links[0].comm.received() == 100);
+
+        r.stop();
+    }
+    assert(thread_count() == threads);
+
+    std::cout << "Passed!" << std::endl;
+}
+
+void test_listener()
+{
+    std::cout << "Listener and asynchronous connect tests: ";
+
+    // abstract AF_UNIX address, stands in for an L2CAP PSM
+    const std::string address = "unix:@phms_bt_reactor_test";
+
+    Reactor_Thread r;
+    PHMS_Bluetooth::Server servers[LINKS];
+    PHMS_Bluetooth::Client clients[LINKS];
+    std::atomic<int> accepted{0};
+    {
+        PHMS_Bluetooth::Listener listener;
+        assert(listener.listen(r.reactor, address, [&](int fd, const std::string &) {
+            PHMS_Bluetooth::Server &s = servers[accepted];
+            assert(s.attach(fd) == 0 && s.run_on(r.reactor) == 0);
+            accepted++;
+        }) == 0);
+
+        // packets pushed before the connection is up wait for it
+        for (int i = 0; i < LINKS; i++)
+        {
+            assert(clients[i].push(&i, sizeof(i)));
+            assert(clients[i].open_con(r.reactor, address) == 0);
+        }
+
+        // connections are accepted in order, so server i receives from client i
+        int received{0};
+        while (received < LINKS)
+        {
+            received = 0;
+            for (int i = 0; i < LINKS; i++)
+            {
+                if (servers[i].wait_for(std::chrono::milliseconds(1)))
+                {
+                    std::vector<PHMS_Bluetooth::Packet> v = servers[i].get_all();
+                    assert(v.size() == 1 && v[0].size() == sizeof(i) && memcmp(v[0].get(), &i, sizeof(i)) == 0);
+                    assert(servers[i].get_connected_address().compare(0, 3, "fd:") == 0);
+                }
+                received += servers[i].received();
+            }
+        }
+        assert(accepted == LINKS);
+        for (int i = 0; i < LINKS; i++)
+        {
+            while (clients[i].sent() < 1)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            assert(clients[i].connected());
+        }
+
+        // connecting to nothing fails straight away
+        PHMS_Bluetooth::Client nobody;
+        assert(nobody.open_con(r.reactor, address + "_missing") != 0);
+        assert(!nobody.connected());
+
+        r.stop();
+    }
+
+    std::cout << "Passed!" << std::endl;
+}
+
+void test_stall()
+{
+    std::cout << "Full socket tests: ";
+
+    int fds[2];
+    assert(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) == 0);
+    int small = 4096;
+    assert(setsockopt(fds[1], SOL_SOCKET, SO_SNDBUF, &small, sizeof(small)) == 0);
+
+    Reactor_Thread r;
+    PHMS_Bluetooth::Client c;
+    assert(c.attach(fds[1]) == 0);
+    {
+        assert(c.run_on(r.reactor) == 0);
+
+        // nothing reads, so the socket fills up and the reactor waits for room
+        std::vector<uint8_t> pkt(MAX_PKT_SIZE - 1);
+        for (int i = 0; i < BT_TX_QUEUE_SLOTS; i++)
+        {
+            pkt[0] = i % 16;
+            pkt[1] = i;
+            assert(c.push(pkt.data(), pkt.size()));
+        }
+        while (c.stalls() == 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        assert(c.sent() < BT_TX_QUEUE_SLOTS);
+
+        // reading makes room, every packet still arrives once and in order
+        uint8_t got[MAX_PKT_SIZE];
+        for (int i = 0; i < BT_TX_QUEUE_SLOTS; i++)
+        {
+            assert(read(fds[0], got, sizeof(got)) == (ssize_t)pkt.size());
+            assert(got[0] == i % 16 && got[1] == i);
+        }
+        while (c.sent() < BT_TX_QUEUE_SLOTS)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        assert(c.dropped() == 0);
+        r.stop();
+    }
+    close(fds[0]);
+
+    std::cout << "Passed!" << std::endl;
+}
+
+void test_coalescing()
+{
+    std::cout << "Reactor coalescing tests: ";
+
+    Reactor_Thread r;
+    Loopback l;
+    l.comm.set_coalescing(BT_L2CAP_MTU, std::chrono::microseconds(BUDGET_US));
+    {
+        assert(l.comm.run_on(r.reactor) == 0);
+
+        // a lone packet waits out the budget for others to join it
+        auto start = bench_clock::now();
+        assert(push(l.comm, 0, 0));
+        while (!l.comm.wait_for(std::chrono::milliseconds(100)))
+        {
+        }
+        auto waited = std::chrono::duration_cast<std::chrono::microseconds>(bench_clock::now() - start).count();
+        assert(waited >= BUDGET_US && waited < 100 * BUDGET_US);
+        assert(l.comm.consume([](const uint8_t *data, size_t len) { assert(check(data, len, 0) == 0); }) == 1);
+
+        // packets pushed together go out together
+        for (int round = 1; round <= 50; round++)
+        {
+            for (int i = 0; i < 16; i++)
+                assert(push(l.comm, i, round));
+            while (l.comm.received() < 1 + 16 * (uint64_t)round)
+                l.comm.wait_for(std::chrono::milliseconds(100));
+            int next{0};
+            l.comm.consume([&](const uint8_t *data, size_t len) { assert(check(data, len, next++) == round); });
+            assert(next == 16);
+        }
+        assert(l.comm.writes() < l.comm.sent() / 4);
+        r.stop();
+    }
+
+    std::cout << "Passed!" << std::endl;
+}
+
+void benchmark()
+{
+    std::cout << LINKS << " links exchanging " << ROUNDS << " rounds of " << PACKET_SAMPLES << " sample packets" << std::endl;
+
+    int threads = thread_count();
+
+    int threaded_threads;
+    double threaded_rate;
+    {
+        Loopback threaded[LINKS];
+        for (auto &l : threaded)
+            l.comm.run();
+        threaded_threads = thread_count() - threads;
+        threaded_rate = exchange(threaded, ROUNDS);
+        for (auto &l : threaded)
+            l.comm.quit();
+    }
+
+    Reactor_Thread r;
+    Loopback shared[LINKS];
+    for (auto &l : shared)
+        assert(l.comm.run_on(r.reactor) == 0);
+    int shared_threads = thread_count() - threads;
+    double shared_rate = exchange(shared, ROUNDS);
+    r.stop();
+
+    printf("%-22s threads: %2d  %9.0f packets/s\n", "thread pair per link", threaded_threads, threaded_rate);
+    printf("%-22s threads: %2d  %9.0f packets/s\n", "one reactor thread", shared_threads, shared_rate);
+
+    assert(threaded_threads == 2 * LINKS && shared_threads == 1);
+}
+
+int main()
+{
+    test_links();
+    test_listener();
+    test_stall();
+    test_coalescing();
+    benchmark();
+
+    std::cout << "All tests passed" << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,199 @@
+#include <iostream>
+#include <atomic>
+#include <vector>
+#include <thread>
+#include <cstring>
+#include <sys/socket.h>
+#include <assert.h>
+
+#include "bluetooth/bt_comm.hpp"
+
+/* Pushes packets through a PHMS_Bluetooth::Communicator as fast as its server
+ * thread takes them and compares the two ways of draining the receive ring:
+ *  - get_all(), which copies every packet into a vector of Packets
+ *  - consume(), which reads every packet in place
+ * Packets are 64 sample bluetooth packets sent over a socketpair. Each one
+ * carries a sequence number and a fill pattern so torn or reordered slots
+ * are caught. Reports packets per second and ring overruns.
+ */
+
+#define PACKETS 200000
+#define PACKET_SIZE (1 + 64 * 8)
+
+using bench_clock = std::chrono::steady_clock;
+
+struct Result
+{
+    double packets_per_second{0};
+    uint64_t received{0};
+    uint64_t overruns{0};
+};
+
+// source byte, sequence number, fill pattern. Like a sample packet the first byte is a sensor
+// number, never BT_BUNDLE_MARKER
+void fill(uint8_t *pkt, uint32_t seq)
+{
+    pkt[0] = seq & 0x0f;
+    memcpy(pkt + 1, &seq, sizeof(seq));
+    memset(pkt + 1 + sizeof(seq), (uint8_t)seq, PACKET_SIZE - 1 - sizeof(seq));
+}
+
+// checks a received packet, returns its sequence number
+uint32_t check(const uint8_t *pkt, size_t len)
+{
+    uint32_t seq;
+    assert(len == PACKET_SIZE);
+    memcpy(&seq, pkt + 1, sizeof(seq));
+    assert(pkt[0] == (seq & 0x0f) && pkt[1 + sizeof(seq)] == (uint8_t)seq && pkt[len - 1] == (uint8_t)seq);
+    return seq;
+}
+
+Result run(bool in_place)
+{
+    int fds[2];
+    assert(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) == 0);
+
+    PHMS_Bluetooth::Communicator comm;
+    assert(comm.attach(fds[0]) == 0);
+    comm.run();
+
+    uint64_t seen{0};
+    int64_t last_seq{-1};
+    auto on_packet = [&](const uint8_t *data, size_t len) {
+        // packets may be dropped when the ring is full, never reordered
+        int64_t seq = check(data, len);
+        assert(seq > last_seq);
+        last_seq = seq;
+        seen++;
+    };
+
+    std::atomic<bool> sent_all{false};
+    std::thread sender([&]() {
+        uint8_t pkt[PACKET_SIZE];
+        for (uint32_t i = 0; i < PACKETS; i++)
+        {
+            fill(pkt, i);
+            assert(write(fds[1], pkt, PACKET_SIZE) == PACKET_SIZE);
+        }
+        sent_all = true;
+    });
+
+    auto start = bench_clock::now();
+    while (!sent_all || comm.received() + comm.overruns() < PACKETS || comm.available() > 0)
+    {
+        if (!comm.wait_for(std::chrono::milliseconds(10)))
+            continue;
+
+        if (in_place)
+        {
+            comm.consume(on_packet);
+        }
+        else
+        {
+            for (auto &p : comm.get_all())
+                on_packet(p.get(), p.size());
+        }
+    }
+    double seconds = std::chrono::duration<double>(bench_clock::now() - start).count();
+
+    sender.join();
+    comm.quit();
+    close(fds[1]);
+
+    Result r;
+    r.received = comm.received();
+    r.overruns = comm.overruns();
+    r.packets_per_second = seen / seconds;
+    assert(seen == r.received);
+    assert(r.received + r.overruns == PACKETS);
+    return r;
+}
+
+void print(const char *name, const Result &r)
+{
+    printf("%-10s %9.0f packets/s  received: %llu  overruns: %llu\n",
+           name, r.packets_per_second, (unsigned long long)r.received, (unsigned long long)r.overruns);
+}
+
+// sequence number of the i-th available packet, read in place
+uint32_t peek_seq(PHMS_Bluetooth::Server &server, size_t i)
+{
+    size_t len;
+    const uint8_t *data = server.peek(i, len);
+    assert(data != nullptr);
+    return check(data, len);
+}
+
+void test_overrun()
+{
+    std::cout << "Server receive ring overrun tests: ";
+
+    int fds[2];
+    assert(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) == 0);
+
+    PHMS_Bluetooth::Server server;
+    assert(server.attach(fds[0]) == 0);
+    std::thread server_thread(&PHMS_Bluetooth::Server::run, &server);
+
+    // nobody drains the ring, so it fills and the rest is dropped
+    const uint32_t sent = BT_RX_RING_SLOTS + 20;
+    uint8_t pkt[PACKET_SIZE];
+    for (uint32_t i = 0; i < sent; i++)
+    {
+        fill(pkt, i);
+        assert(write(fds[1], pkt, PACKET_SIZE) == PACKET_SIZE);
+    }
+    while (server.received() + server.overruns() < sent)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    assert(server.available() == BT_RX_RING_SLOTS);
+    assert(server.overruns() == sent - BT_RX_RING_SLOTS);
+
+    // peek and release drain by index, the oldest packets were kept
+    size_t len;
+    assert(peek_seq(server, 0) == 0);
+    assert(peek_seq(server, BT_RX_RING_SLOTS - 1) == BT_RX_RING_SLOTS - 1);
+    assert(server.peek(BT_RX_RING_SLOTS, len) == nullptr);
+    server.release(2);
+    assert(peek_seq(server, 0) == 2);
+
+    // consume stops at max and frees the slots it read
+    uint32_t next{2};
+    assert(server.consume([&](const uint8_t *data, size_t n) { assert(check(data, n) == next++); }, 10) == 10);
+    assert(server.available() == BT_RX_RING_SLOTS - 12);
+
+    // freed slots are filled again
+    fill(pkt, sent);
+    assert(write(fds[1], pkt, PACKET_SIZE) == PACKET_SIZE);
+    while (server.received() < BT_RX_RING_SLOTS + 1)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    std::vector<PHMS_Bluetooth::Packet> rest = server.get_all();
+    assert(rest.size() == BT_RX_RING_SLOTS - 11);
+    assert(check(rest.front().get(), rest.front().size()) == 12);
+    assert(check(rest.back().get(), rest.back().size()) == sent);
+    assert(server.available() == 0);
+
+    server.quit();
+    server_thread.join();
+    close(fds[1]);
+
+    std::cout << "Passed!" << std::endl;
+}
+
+int main()
+{
+    test_overrun();
+
+    std::cout << "Receiving " << PACKETS << " packets of " << PACKET_SIZE << " bytes as fast as possible" << std::endl;
+
+    Result copied = run(false);
+    print("get_all", copied);
+
+    Result in_place = run(true);
+    print("consume", in_place);
+
+    std::cout << "All tests passed" << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,340 @@
+#include <iostream>
+#include <atomic>
+#include <vector>
+#include <thread>
+#include <cstring>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <assert.h>
+
+#include "bluetooth_sensor_data_recv.hpp"
+
+/* Checks the PHMS_Bluetooth transports and load tests the ingest path without bluetooth:
+ *  - transport addresses are parsed into the right transport
+ *  - unix: and tcp: links deliver the packets that were pushed, one by one, bundled,
+ *    and through the Reactor when the socket fills up, on TCP part way through a frame
+ *  - a TCP Server puts frames split across reads back together
+ *  - a Communicator sending like bluetooth_sensor_data_send feeds a BluetoothReceiver
+ *    as fast as it takes the samples, over each transport
+ * Builds with or without BlueZ (-DPHMS_NO_BLUETOOTH).
+ */
+
+#define PACKET_SAMPLES 5
+#define LOAD_PACKETS 40000
+#define TCP_PORT 47310
+
+using bench_clock = std::chrono::steady_clock;
+
+// accept on local and connect to remote at the same time, like the two devices do
+void open_pair(PHMS_Bluetooth::Communicator &a, const std::string &a_addr, PHMS_Bluetooth::Communicator &b, const std::string &b_addr)
+{
+    int b_status{-1};
+    std::thread other([&]() { b_status = b.open_con(b_addr, a_addr, 5); });
+    assert(a.open_con(a_addr, b_addr, 5) == 0);
+    other.join();
+    assert(b_status == 0);
+}
+
+// packets of every size, never starting with the bundle marker like sample packets
+std::vector<std::vector<uint8_t>> make_packets(size_t n)
+{
+    std::vector<std::vector<uint8_t>> ret;
+    for (size_t i = 0; i < n; i++)
+    {
+        std::vector<uint8_t> p(1 + (i * 151) % (MAX_PKT_SIZE - 4));
+        for (size_t j = 0; j < p.size(); j++)
+            p[j] = (uint8_t)(i * 7 + j);
+        p[0] = i % 16;
+        ret.push_back(p);
+    }
+    return ret;
+}
+
+// a transport whose sockets have a small send buffer, so they fill up quickly
+class Small_Buffer_Transport : public PHMS_Bluetooth::Transport
+{
+private:
+    const PHMS_Bluetooth::Transport &t;
+
+public:
+    Small_Buffer_Transport(const PHMS_Bluetooth::Transport &t) : t(t) {}
+
+    int open_socket() const override
+    {
+        int fd = t.open_socket();
+        int small = 4096;
+        assert(fd >= 0 && setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &small, sizeof(small)) == 0);
+        return fd;
+    }
+    socklen_t get_address(struct sockaddr_storage &addr) const override { return t.get_address(addr); }
+    std::string name() const override { return t.name(); }
+};
+
+// read one message from a connected socket, taking the frame apart on stream sockets
+size_t read_message(int fd, uint8_t *dst)
+{
+    if (!bt_is_stream_socket(fd))
+        return read(fd, dst, MAX_PKT_SIZE);
+
+    auto read_all = [fd](uint8_t *p, size_t n) {
+        while (n > 0)
+        {
+            ssize_t r = read(fd, p, n);
+            assert(r > 0);
+            p += r;
+            n -= r;
+        }
+    };
+
+    uint8_t header[BT_FRAME_HEADER];
+    read_all(header, BT_FRAME_HEADER);
+    size_t len = ((size_t)header[0] << 8) | header[1];
+    assert(len <= MAX_PKT_SIZE);
+    read_all(dst, len);
+    return len;
+}
+
+// wait until the packets arrive at c in order
+void expect(PHMS_Bluetooth::Communicator &c, const std::vector<std::vector<uint8_t>> &pushed)
+{
+    size_t next{0};
+    while (next < pushed.size())
+    {
+        c.wait_for(std::chrono::milliseconds(100));
+        c.consume([&](const uint8_t *data, size_t len) {
+            assert(next < pushed.size());
+            assert(len == pushed[next].size() && memcmp(data, pushed[next].data(), len) == 0);
+            next++;
+        });
+    }
+    assert(c.overruns() == 0 && c.malformed() == 0);
+}
+
+void test_addresses()
+{
+    std::cout << "Transport address tests: ";
+
+    auto unix_t = PHMS_Bluetooth::Transport::from_address("unix:@phms");
+    assert(unix_t != nullptr && unix_t->name() == "unix:@phms");
+    assert(dynamic_cast<PHMS_Bluetooth::Unix_Transport *>(unix_t.get()) != nullptr);
+
+    auto tcp_t = PHMS_Bluetooth::Transport::from_address("tcp:localhost:5000");
+    assert(tcp_t != nullptr && tcp_t->name() == "tcp:localhost:5000");
+    struct sockaddr_storage addr;
+    assert(tcp_t->get_address(addr) == sizeof(struct sockaddr_in));
+    assert(ntohs(reinterpret_cast<struct sockaddr_in *>(&addr)->sin_port) == 5000);
+
+    assert(PHMS_Bluetooth::Transport::from_address("tcp:127.0.0.1") == nullptr);
+    assert(PHMS_Bluetooth::Transport::from_address("tcp:127.0.0.1:70000") == nullptr);
+    assert(PHMS_Bluetooth::Transport::from_address("unix:") == nullptr);
+    assert(PHMS_Bluetooth::Transport::from_address("not an address") == nullptr);
+
+#ifndef PHMS_NO_BLUETOOTH
+    auto l2cap = PHMS_Bluetooth::Transport::from_address("B8:27:EB:00:00:01");
+    assert(l2cap != nullptr && l2cap->name() == "l2cap:B8:27:EB:00:00:01");
+    assert(PHMS_Bluetooth::Transport::from_address(BT_L2CAP_ANY) != nullptr);
+#else
+    assert(PHMS_Bluetooth::Transport::from_address("B8:27:EB:00:00:01") == nullptr);
+#endif
+
+    std::cout << "Passed!" << std::endl;
+}
+
+void test_link(const char *name, const std::string &a_addr, const std::string &b_addr)
+{
+    std::cout << name << " link tests: ";
+
+    // threaded, one packet per write
+    {
+        PHMS_Bluetooth::Communicator a, b;
+        open_pair(a, a_addr, b, b_addr);
+        a.run();
+        b.run();
+
+        // a ring's worth at a time, the Server drops what does not fit
+        std::vector<std::vector<uint8_t>> packets = make_packets(200);
+        for (size_t i = 0; i < packets.size(); i += BT_RX_RING_SLOTS / 2)
+        {
+            std::vector<std::vector<uint8_t>> chunk(packets.begin() + i, packets.begin() + std::min(packets.size(), i + BT_RX_RING_SLOTS / 2));
+            for (auto &p : chunk)
+                assert(a.push(p.data(), p.size()));
+            expect(b, chunk);
+        }
+
+        // and back the other way, bundled
+        b.set_coalescing(BT_L2CAP_MTU, std::chrono::microseconds(1000));
+        for (size_t i = 0; i < 60; i++)
+            assert(b.push(packets[i].data(), packets[i].size()));
+        expect(a, std::vector<std::vector<uint8_t>>(packets.begin(), packets.begin() + 60));
+        assert(b.writes() < b.sent());
+
+        a.quit();
+        b.quit();
+    }
+
+    // on a reactor, into a socket nobody reads until the Client stalled, on tcp: part way through a frame
+    {
+        std::unique_ptr<PHMS_Bluetooth::Transport> t = PHMS_Bluetooth::Transport::from_address(b_addr);
+        int listener = t->open_listener();
+        int small = 4096;
+        assert(listener >= 0 && setsockopt(listener, SOL_SOCKET, SO_RCVBUF, &small, sizeof(small)) == 0);
+
+        PHMS_Bluetooth::Reactor reactor;
+        PHMS_Bluetooth::Client c;
+        assert(c.open_con(reactor, Small_Buffer_Transport(*t)) == 0);
+        int rx = accept(listener, nullptr, nullptr);
+        assert(rx >= 0);
+        close(listener);
+        std::thread reactor_thread(&PHMS_Bluetooth::Reactor::run, &reactor);
+
+        std::vector<std::vector<uint8_t>> packets = make_packets(2000);
+        std::thread reader([&]() {
+            while (c.stalls() == 0)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+            uint8_t got[MAX_PKT_SIZE];
+            for (size_t i = 0; i < packets.size(); i++)
+            {
+                size_t len = read_message(rx, got);
+                assert(len == packets[i].size() && memcmp(got, packets[i].data(), len) == 0);
+            }
+        });
+
+        for (size_t i = 0; i < packets.size(); i++)
+        {
+            while (!c.push(packets[i].data(), packets[i].size()))
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        reader.join();
+        // the reader can have the last frame before the reactor thread counts it as sent
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while (c.sent() < packets.size() && std::chrono::steady_clock::now() < deadline)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        assert(c.stalls() > 0 && c.sent() == packets.size());
+
+        reactor.quit();
+        reactor_thread.join();
+        c.close_con();
+        close(rx);
+    }
+
+    std::cout << "Passed!" << std::endl;
+}
+
+void test_tcp_framing()
+{
+    std::cout << "TCP framing tests: ";
+
+    PHMS_Bluetooth::TCP_Transport t("127.0.0.1", TCP_PORT + 2);
+    int listener = t.open_listener();
+    assert(listener >= 0);
+    int tx = t.open_connection();
+    assert(tx >= 0);
+    int rx = accept(listener, nullptr, nullptr);
+    assert(rx >= 0);
+    close(listener);
+
+    PHMS_Bluetooth::Server server;
+    assert(server.attach(rx) == 0);
+    std::thread server_thread(&PHMS_Bluetooth::Server::run, &server);
+
+    // two packets and a bundle of two, written a byte at a time
+    const uint8_t frames[] = {0, 3, 1, 2, 3,
+                              0, 1, 9,
+                              0, 8, BT_BUNDLE_MARKER, 0, 1, 4, 0, 2, 5, 6};
+    for (size_t i = 0; i < sizeof(frames); i++)
+    {
+        assert(write(tx, frames + i, 1) == 1);
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+    while (server.received() < 4)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    std::vector<PHMS_Bluetooth::Packet> got = server.get_all();
+    assert(got.size() == 4);
+    assert(got[0].size() == 3 && got[0].get()[2] == 3);
+    assert(got[1].size() == 1 && got[1].get()[0] == 9);
+    assert(got[2].size() == 1 && got[2].get()[0] == 4);
+    assert(got[3].size() == 2 && got[3].get()[1] == 6);
+
+    // a frame longer than any packet means the stream is out of step
+    const uint8_t bad[] = {0xff, 0xff, 1, 2};
+    assert(write(tx, bad, sizeof(bad)) == sizeof(bad));
+    while (server.malformed() == 0)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    server.quit();
+    server_thread.join();
+    close(tx);
+
+    std::cout << "Passed!" << std::endl;
+}
+
+// send LOAD_PACKETS sample packets to a BluetoothReceiver as fast as it takes them, returns samples per second
+double load(const std::string &receiver_addr, const std::string &sender_addr)
+{
+    std::atomic<uint64_t> delivered{0};
+
+    BluetoothReceiver receiver;
+    receiver.set_listen_address(receiver_addr);
+    receiver.set_bt_address(sender_addr);
+    receiver.registerBatchCallback([&](const Sample *, size_t n) { delivered += n; });
+
+    // the sensor box side, like bluetooth_sensor_data_send
+    PHMS_Bluetooth::Communicator sender;
+    std::thread connect([&]() { assert(sender.open_con(sender_addr, receiver_addr, 5) == 0); });
+    receiver.initializeConnection();
+    connect.join();
+    sender.set_coalescing(BT_L2CAP_MTU, std::chrono::microseconds(2000));
+    sender.run();
+
+    Sample samples[PACKET_SAMPLES];
+    for (int i = 0; i < PACKET_SAMPLES; i++)
+    {
+        samples[i].irLED = 50000;
+        samples[i].redLED = 40000;
+        samples[i].bpm = 70;
+        samples[i].spo2 = 97;
+    }
+
+    auto start = bench_clock::now();
+    for (int i = 0; i < LOAD_PACKETS; i++)
+    {
+        samples[0].irLED = 50000 + (i % 2);
+        PHMS_Bluetooth::Packet p = packet_from_Sample_buffer(0, samples, PACKET_SAMPLES);
+        while (!sender.push(std::move(p)))
+            std::this_thread::yield();
+
+        // the receiver drops what does not fit its ring, keep at most half a ring of packets in flight
+        while ((uint64_t)(i + 1) * PACKET_SAMPLES - delivered > BT_RX_RING_SLOTS / 2 * PACKET_SAMPLES)
+            std::this_thread::yield();
+    }
+
+    // one sensor, so every sample comes out of fusion as one sample
+    const uint64_t expected = (uint64_t)LOAD_PACKETS * PACKET_SAMPLES;
+    while (delivered < expected)
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    double seconds = std::chrono::duration<double>(bench_clock::now() - start).count();
+
+    assert(delivered == expected);
+    sender.quit();
+    return expected / seconds;
+}
+
+int main()
+{
+    test_addresses();
+    test_link("unix:", "unix:@phms_test_a", "unix:@phms_test_b");
+    test_link("tcp:", "tcp:127.0.0.1:" + std::to_string(TCP_PORT), "tcp:127.0.0.1:" + std::to_string(TCP_PORT + 1));
+    test_tcp_framing();
+
+    std::cout << "Sending " << LOAD_PACKETS << " packets of " << PACKET_SAMPLES << " samples to a BluetoothReceiver" << std::endl;
+    double over_unix = load("unix:@phms_load_receiver", "unix:@phms_load_sender");
+    double over_tcp = load("tcp:127.0.0.1:" + std::to_string(TCP_PORT + 3), "tcp:127.0.0.1:" + std::to_string(TCP_PORT + 4));
+    printf("%-6s %10.0f samples/s\n", "unix:", over_unix);
+    printf("%-6s %10.0f samples/s\n", "tcp:", over_tcp);
+
+    std::cout << "All tests passed" << std::endl;
+
+    return 0;
+}
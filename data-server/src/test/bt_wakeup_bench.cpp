@@ -0,0 +1,140 @@
+#include <iostream>
+#include <atomic>
+#include <algorithm>
+#include <vector>
+#include <thread>
+#include <time.h>
+#include <sys/socket.h>
+#include <assert.h>
+
+#include "bluetooth/bt_server.hpp"
+
+/* Compares the two ways of waiting for packets from PHMS_Bluetooth::Server:
+ *  - polling available() in a loop (how BluetoothReceiver used to wait)
+ *  - blocking in wait_for() until the server thread signals a packet
+ * Packets are sent over a socketpair at the rate the sensor box sends them.
+ * Reports the receiving thread's CPU usage and the latency from write() to
+ * the receiver seeing the packet.
+ */
+
+#define PACKETS_PER_SECOND 50
+#define RUN_SECONDS 3
+
+using bench_clock = std::chrono::steady_clock;
+
+struct Result
+{
+    double cpu_percent{0};
+    double avg_us{0};
+    double p99_us{0};
+    size_t received{0};
+};
+
+long long now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now().time_since_epoch()).count();
+}
+
+// CPU time used by the calling thread
+long long thread_cpu_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+Result run(bool event_driven)
+{
+    int fds[2];
+    assert(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) == 0);
+
+    PHMS_Bluetooth::Server server;
+    assert(server.attach(fds[0]) == 0);
+    std::thread server_thread(&PHMS_Bluetooth::Server::run, &server);
+
+    std::atomic<bool> quit{false};
+    std::vector<long long> latencies;
+    latencies.reserve(PACKETS_PER_SECOND * RUN_SECONDS);
+    long long cpu_ns{0};
+    long long wall_ns{0};
+
+    std::thread receiver([&]() {
+        long long cpu_start = thread_cpu_ns();
+        long long wall_start = now_ns();
+
+        while (!quit)
+        {
+            bool ready = event_driven ? server.wait_for(std::chrono::milliseconds(100)) : server.available() > 0;
+            if (!ready)
+                continue;
+
+            long long t = now_ns();
+            for (auto &p : server.get_all())
+            {
+                long long sent;
+                memcpy(&sent, p.get() + 1, sizeof(sent));
+                latencies.push_back(t - sent);
+            }
+        }
+
+        cpu_ns = thread_cpu_ns() - cpu_start;
+        wall_ns = now_ns() - wall_start;
+    });
+
+    auto next = bench_clock::now();
+    for (int i = 0; i < PACKETS_PER_SECOND * RUN_SECONDS; i++)
+    {
+        next += std::chrono::microseconds(1000000 / PACKETS_PER_SECOND);
+        std::this_thread::sleep_until(next);
+
+        // sensor number, then the send time
+        uint8_t pkt[1 + sizeof(long long)]{0};
+        long long sent = now_ns();
+        memcpy(pkt + 1, &sent, sizeof(sent));
+        assert(write(fds[1], pkt, sizeof(pkt)) == sizeof(pkt));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+    quit = true;
+    server.quit();
+    receiver.join();
+    server_thread.join();
+    close(fds[1]);
+
+    Result r;
+    r.received = latencies.size();
+    r.cpu_percent = 100.0 * cpu_ns / wall_ns;
+    if (!latencies.empty())
+    {
+        std::sort(latencies.begin(), latencies.end());
+        long long total{0};
+        for (auto l : latencies)
+            total += l;
+        r.avg_us = total / 1000.0 / latencies.size();
+        r.p99_us = latencies[latencies.size() * 99 / 100] / 1000.0;
+    }
+    return r;
+}
+
+void print(const char *name, const Result &r)
+{
+    printf("%-14s receiver cpu: %6.2f%%  latency avg: %8.1f us  p99: %8.1f us  packets: %zu\n",
+           name, r.cpu_percent, r.avg_us, r.p99_us, r.received);
+}
+
+int main()
+{
+    std::cout << "Receiving " << PACKETS_PER_SECOND * RUN_SECONDS << " packets at " << PACKETS_PER_SECOND << " per second" << std::endl;
+
+    Result polling = run(false);
+    print("polling", polling);
+
+    Result event = run(true);
+    print("event driven", event);
+
+    assert(polling.received == PACKETS_PER_SECOND * RUN_SECONDS);
+    assert(event.received == PACKETS_PER_SECOND * RUN_SECONDS);
+    assert(event.cpu_percent < polling.cpu_percent);
+
+    return 0;
+}
@@ -0,0 +1,281 @@
+#include <iostream>
+#include <atomic>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <cmath>
+#include <mutex>
+#include <assert.h>
+
+#include "bluetooth_sensor_data_recv.hpp"
+
+/* Checks Clock_Sync and the sample times of BluetoothReceiver:
+ *  - a remote clock's offset and drift are found through jittery, lopsided
+ *    link delays, far closer than a single exchange gets them
+ *  - exchanges whose times do not add up are rejected
+ *  - time messages round trip
+ *  - sample_buffer_from_bt_packet counts back from the receive time in ms
+ *  - a BluetoothReceiver measures a sender's drifting clock and times every
+ *    sample of its version 2 packets from it, at the rate its hello ack gives
+ */
+
+#define PACKET_SAMPLES 5
+#define LINK_PACKETS 40
+
+// true remote clock: started at remote_start, running drift faster than the local one
+struct Remote_Clock
+{
+    int64_t local_start;
+    int64_t remote_start;
+    double drift;
+
+    int64_t at(int64_t local) const { return remote_start + (int64_t)llround((local - local_start) * (1.0 + drift)); }
+};
+
+// exponential jitter from a small linear congruential generator, mean in us
+struct Jitter
+{
+    uint32_t rng{12345};
+
+    int64_t next(double mean)
+    {
+        rng = rng * 1103515245 + 12345;
+        double u = ((rng >> 8) + 0.5) / (double)(1 << 24);
+        return (int64_t)(-mean * log(u));
+    }
+};
+
+void test_offset_and_drift()
+{
+    std::cout << "Offset and drift tests: ";
+
+    const int64_t local_start = 1700000000000000LL;
+    Remote_Clock remote{local_start, 5000000, 80e-6};
+    Clock_Sync sync;
+    Jitter jitter;
+
+    double worst_single{0};
+    int64_t t1 = local_start;
+    for (int i = 0; i < 120; i++, t1 += 1000000)
+    {
+        // 1 ms each way plus jitter, every fifth exchange held up 20 ms on the way back only
+        int64_t there = 1000 + jitter.next(3000);
+        int64_t back = 1000 + jitter.next(3000) + ((i % 5 == 0) ? 20000 : 0);
+        int64_t turnaround = 200 + jitter.next(50000);
+
+        int64_t t2 = remote.at(t1 + there);
+        int64_t t3 = remote.at(t1 + there + turnaround);
+        int64_t t4 = t1 + there + turnaround + back;
+        assert(sync.add(t1, t2, t3, t4));
+        assert(sync.synced() == (i + 1 >= CLOCK_SYNC_MIN_EXCHANGES));
+
+        // what a single exchange would have said
+        double single = ((t2 - t1) + (t3 - t4)) / 2.0;
+        double truth = remote.at(t1 + (t4 - t1) / 2) - (t1 + (t4 - t1) / 2);
+        worst_single = std::max(worst_single, fabs(single - truth));
+    }
+
+    // between and after the exchanges, remote times map back to within half a millisecond
+    double worst{0};
+    for (int64_t local = t1 - 30000000; local < t1 + 2000000; local += 333333)
+        worst = std::max(worst, (double)llabs(sync.to_local(remote.at(local)) - local));
+    assert(worst < 500);
+    assert(llabs(sync.to_remote(t1) - remote.at(t1)) < 500);
+
+    Clock_Sync_Stats st = sync.stats(t1);
+    assert(st.synced && st.exchanges == 120 && st.rejected == 0);
+    assert(fabs(st.drift_ppm - 80) < 10);
+    // the quickest of the last exchanges, below the mean round trip of 8 ms
+    assert(st.delay_us >= 2000 && st.delay_us < 8000);
+
+    printf("Passed! (worst %.0f us, single exchange worst %.0f us, drift %.2f ppm)\n", worst, worst_single, st.drift_ppm);
+}
+
+void test_rejected()
+{
+    std::cout << "Rejected exchange tests: ";
+
+    Clock_Sync sync;
+    assert(!sync.add(100, 50, 40, 200)); // answered before it arrived
+    assert(!sync.add(100, 50, 60, 90));  // back before it was sent
+    assert(!sync.add(100, 50, 200, 180)); // took longer on the remote side than the whole exchange
+    assert(sync.stats(0).rejected == 3 && sync.stats(0).exchanges == 0 && !sync.synced());
+
+    // without a drift estimate the offset is the quickest exchange's
+    assert(sync.add(1000, 5600, 5700, 1300));
+    assert(sync.add(2000, 7000, 7100, 2900));
+    assert(sync.offset(2000) == 4500);
+    assert(sync.to_local(9500) == 5000);
+
+    sync.reset();
+    assert(sync.stats(0).rejected == 0 && sync.stats(0).exchanges == 0);
+
+    std::cout << "Passed!" << std::endl;
+}
+
+void test_messages()
+{
+    std::cout << "Time message tests: ";
+
+    uint8_t request[BT_TIME_REQUEST_SIZE];
+    uint8_t response[BT_TIME_RESPONSE_SIZE];
+    const uint64_t t1 = 1700000000123456ULL;
+    assert(bt_time_request(t1, request) == BT_TIME_REQUEST_SIZE);
+    assert(bt_is_control_message(request, sizeof(request)));
+
+    assert(bt_time_response(request, sizeof(request) - 1, 1, 2, response) == 0);
+    assert(bt_time_response(request, sizeof(request), 0xfedcba9876543210ULL, 42, response) == BT_TIME_RESPONSE_SIZE);
+    assert(bt_is_control_message(response, sizeof(response)));
+
+    uint64_t a, b, c;
+    assert(!bt_parse_time_response(response, sizeof(response) - 1, a, b, c));
+    assert(!bt_parse_time_response(request, sizeof(request), a, b, c));
+    assert(bt_parse_time_response(response, sizeof(response), a, b, c));
+    assert(a == t1 && b == 0xfedcba9876543210ULL && c == 42);
+
+    std::cout << "Passed!" << std::endl;
+}
+
+void test_packet_times()
+{
+    std::cout << "sample_buffer_from_bt_packet time tests: ";
+
+    std::vector<Sample> samples(PACKET_SAMPLES);
+    for (int v = 1; v <= 2; v++)
+    {
+        PHMS_Bluetooth::Packet p = (v == 1) ? packet_from_Sample_buffer(3, samples) : packet_from_Sample_buffer_v2(3, 0, 0, samples);
+        auto received = std::chrono::system_clock::time_point(std::chrono::microseconds(1700000000500000LL));
+        p.set_time(received);
+
+        Smp_with_Source got = sample_buffer_from_bt_packet(p);
+        assert(got.src == 3 && got.samples.size() == PACKET_SAMPLES);
+        for (size_t i = 0; i < PACKET_SAMPLES; i++)
+            assert(got.samples[i].timestamp == (1700000000500000ULL - (PACKET_SAMPLES - 1 - i) * BT_SAMPLE_PERIOD_US) / 1000);
+    }
+
+    std::cout << "Passed!" << std::endl;
+}
+
+// a sender whose clock started 5 s before ours and runs 300 ppm fast, sampling at rate Hz and
+// answering hellos and time requests
+void test_receiver(uint16_t rate)
+{
+    std::cout << "BluetoothReceiver sample time tests at " << rate << " Hz: ";
+
+    const std::string receiver_addr = "unix:@phms_clock_receiver_" + std::to_string(rate);
+    const std::string sender_addr = "unix:@phms_clock_sender_" + std::to_string(rate);
+    const uint64_t period = 1000000 / rate;
+    const size_t total = (size_t)LINK_PACKETS * PACKET_SAMPLES * rate / BT_SAMPLE_RATE;
+
+    std::mutex guard;
+    std::vector<unsigned long> delivered;
+
+    BluetoothReceiver receiver;
+    receiver.set_listen_address(receiver_addr);
+    receiver.set_bt_address(sender_addr);
+    receiver.registerBatchCallback([&](const Sample *s, size_t n) {
+        std::lock_guard<std::mutex> lock(guard);
+        for (size_t i = 0; i < n; i++)
+            delivered.push_back(s[i].timestamp);
+    });
+
+    PHMS_Bluetooth::Communicator sender;
+    std::thread connect([&]() { assert(sender.open_con(sender_addr, receiver_addr, 5) == 0); });
+    receiver.initializeConnection();
+    connect.join();
+    sender.run();
+
+    const int64_t start = (int64_t)bt_time_us(std::chrono::system_clock::now());
+    Remote_Clock remote{start, 5000000, 300e-6};
+    auto remote_now = [&](std::chrono::system_clock::time_point t) { return (uint64_t)remote.at((int64_t)bt_time_us(t)); };
+
+    // the true time of every sample sent, ms
+    std::vector<unsigned long> truth;
+    std::vector<Sample> samples(PACKET_SAMPLES);
+    uint16_t sequence{0};
+    uint64_t first_sample_us{0};
+    while (truth.size() < total)
+    {
+        // samples are taken a sample period apart from the first one, like the sensor box's pacer does,
+        // a packet goes out once its newest sample is taken
+        if (first_sample_us == 0)
+            std::this_thread::sleep_for(std::chrono::microseconds(PACKET_SAMPLES * period));
+        else
+            std::this_thread::sleep_until(std::chrono::system_clock::time_point(std::chrono::microseconds(
+                first_sample_us + (truth.size() + PACKET_SAMPLES - 1) * period)));
+
+        for (auto &m : sender.get_all())
+        {
+            if (m.get()[0] == BT_MSG_HELLO)
+            {
+                uint8_t ack[BT_HELLO_ACK_SIZE];
+                sender.push(ack, bt_hello_ack(BT_PROTOCOL_V2, rate, ack));
+            }
+            else if (m.get()[0] == BT_MSG_TIME_REQUEST)
+            {
+                uint8_t response[BT_TIME_RESPONSE_SIZE];
+                sender.push(response, bt_time_response(m.get(), m.size(), remote_now(m.time()), remote_now(std::chrono::system_clock::now()), response));
+            }
+        }
+
+        if (receiver.get_protocol_version() < BT_PROTOCOL_V2)
+            continue;
+
+        // the first packet's newest sample is taken now
+        if (first_sample_us == 0)
+            first_sample_us = bt_time_us(std::chrono::system_clock::now()) - (PACKET_SAMPLES - 1) * period;
+        uint64_t packet_us = first_sample_us + truth.size() * period;
+        for (int i = 0; i < PACKET_SAMPLES; i++)
+        {
+            int n = (int)truth.size();
+            samples[i].irLED = 14000 + (uint16_t)(300 * sin(n * 0.1)) + (n * 37) % 50;
+            samples[i].redLED = 15000 + (uint16_t)(500 * sin(n * 0.1 + 1)) + (n * 53) % 200;
+            samples[i].spo2 = 97;
+            samples[i].bpm = 70;
+            truth.push_back((first_sample_us + n * period) / 1000);
+        }
+        uint64_t first = (uint64_t)remote.at(packet_us) / 1000;
+        assert(sender.push(packet_from_Sample_buffer_v2(0, sequence++, first, samples.data(), PACKET_SAMPLES)));
+    }
+
+    while (true)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        std::lock_guard<std::mutex> lock(guard);
+        if (delivered.size() >= truth.size())
+            break;
+    }
+
+    assert(receiver.get_sample_period_us() == period);
+    Clock_Sync_Stats st = receiver.get_clock_stats();
+    assert(st.synced && st.rejected == 0);
+    assert(fabs(st.offset_us - (remote.at(start) - start)) < 2000);
+
+    // once synced every sample is within the packet times' 1 ms rounding and the link delay's spread
+    std::lock_guard<std::mutex> lock(guard);
+    assert(delivered.size() == truth.size());
+    size_t synced_from = truth.size() / 2;
+    long worst{0};
+    for (size_t i = synced_from; i < truth.size(); i++)
+        worst = std::max(worst, labs((long)delivered[i] - (long)truth[i]));
+    assert(worst <= 3);
+    receiver.print_link_stats();
+    sender.quit();
+
+    printf("Passed! (worst %ld ms)\n", worst);
+}
+
+int main()
+{
+    test_offset_and_drift();
+    test_rejected();
+    test_messages();
+    test_packet_times();
+    test_receiver(BT_SAMPLE_RATE);
+    // a stress test sender at another rate, its samples are timed at that rate
+    test_receiver(256);
+
+    std::cout << "All tests passed" << std::endl;
+
+    return 0;
+}
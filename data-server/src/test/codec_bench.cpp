@@ -0,0 +1,162 @@
+#include <iostream>
+#include <vector>
+#include <chrono>
+#include <assert.h>
+
+#include "bt_sample_codec.hpp"
+
+/* Checks every codec kernel supported by this CPU against the scalar kernel,
+ * then reports encode and decode throughput in samples per second.
+ * "bytewise" is the conversion bluetooth_utils.hpp used before the kernels:
+ * one byte at a time into a std::vector.
+ */
+
+#define SAMPLES_PER_PACKET 127
+#define PACKETS 20000
+
+using bench_clock = std::chrono::steady_clock;
+
+// previous encoder, kept for comparison
+void bytewise_encode(const std::vector<Sample> &samples, std::vector<uint8_t> &v)
+{
+    v.clear();
+    for (auto s : samples)
+    {
+        uint16_t fields[4] = {s.irLED, s.redLED, s.spo2, s.bpm};
+        for (uint16_t t : fields)
+        {
+            uint8_t *data = reinterpret_cast<uint8_t *>(&t);
+            v.push_back(data[1]);
+            v.push_back(data[0]);
+        }
+    }
+}
+
+// previous decoder, kept for comparison
+void bytewise_decode(const uint8_t *bytes, size_t n, std::vector<Sample> &v)
+{
+    v.clear();
+    for (size_t i = 0; i < n; i++, bytes += BT_SAMPLE_BYTES)
+    {
+        Sample s;
+        s.irLED = bytes[1] + (bytes[0] << 8);
+        s.redLED = bytes[3] + (bytes[2] << 8);
+        s.spo2 = bytes[5] + (bytes[4] << 8);
+        s.bpm = bytes[7] + (bytes[6] << 8);
+        v.push_back(s);
+    }
+}
+
+std::vector<Sample> make_samples(size_t n)
+{
+    std::vector<Sample> v(n);
+    for (size_t i = 0; i < n; i++)
+    {
+        v[i].irLED = 0x1234 + i * 7;
+        v[i].redLED = 0xfe01 - i;
+        v[i].spo2 = 0x00ff & (i * 3);
+        v[i].bpm = 0x8000 | i;
+        v[i].timestamp = 99;
+        v[i].pilot_state = 1;
+    }
+    return v;
+}
+
+void test_kernels()
+{
+    std::cout << "Codec kernel tests: ";
+
+    // every length exercises the vector loop and the scalar tail
+    for (size_t n = 0; n < 40; n++)
+    {
+        std::vector<Sample> in = make_samples(n);
+
+        std::vector<uint8_t> expected(n * BT_SAMPLE_BYTES + 1, 0xaa);
+        bt_encode_samples_scalar(in.data(), n, expected.data());
+        for (size_t i = 0; i < n; i++)
+        {
+            assert(expected[i * BT_SAMPLE_BYTES] == in[i].irLED >> 8);
+            assert(expected[i * BT_SAMPLE_BYTES + 7] == (in[i].bpm & 0xff));
+        }
+
+        for (int k = CODEC_SCALAR; k <= CODEC_NEON; k++)
+        {
+            if (!bt_codec_supported((Codec_Kernel)k))
+                continue;
+
+            // encode matches the scalar kernel and does not write past the end
+            std::vector<uint8_t> bytes(n * BT_SAMPLE_BYTES + 1, 0xaa);
+            bt_encode_samples_with((Codec_Kernel)k, in.data(), n, bytes.data());
+            assert(bytes == expected);
+
+            // decode restores the sent fields and resets the others
+            std::vector<Sample> out = make_samples(n + 1);
+            bt_decode_samples_with((Codec_Kernel)k, bytes.data(), n, out.data());
+            for (size_t i = 0; i < n; i++)
+            {
+                assert(out[i].irLED == in[i].irLED);
+                assert(out[i].redLED == in[i].redLED);
+                assert(out[i].spo2 == in[i].spo2);
+                assert(out[i].bpm == in[i].bpm);
+                assert(out[i].timestamp == 0);
+                assert(out[i].pilot_state == 0);
+            }
+            assert(out[n].timestamp == 99);
+        }
+    }
+
+    std::cout << "Passed!" << std::endl;
+}
+
+template <typename FN>
+double samples_per_second(FN fn)
+{
+    auto start = bench_clock::now();
+    for (int p = 0; p < PACKETS; p++)
+        fn();
+    double seconds = std::chrono::duration<double>(bench_clock::now() - start).count();
+    return (double)PACKETS * SAMPLES_PER_PACKET / seconds;
+}
+
+void bench_kernels()
+{
+    std::vector<Sample> samples = make_samples(SAMPLES_PER_PACKET);
+    std::vector<uint8_t> bytes(SAMPLES_PER_PACKET * BT_SAMPLE_BYTES);
+    bt_encode_samples_scalar(samples.data(), SAMPLES_PER_PACKET, bytes.data());
+    std::vector<Sample> decoded(SAMPLES_PER_PACKET);
+    std::vector<uint8_t> encoded;
+    volatile uint16_t sink{0};
+
+    printf("%-10s %16s %16s\n", "kernel", "encode smp/s", "decode smp/s");
+
+    double enc = samples_per_second([&]() { bytewise_encode(samples, encoded); sink = encoded[3]; });
+    double dec = samples_per_second([&]() { bytewise_decode(bytes.data(), SAMPLES_PER_PACKET, decoded); sink = decoded[3].bpm; });
+    printf("%-10s %16.3e %16.3e\n", "bytewise", enc, dec);
+
+    encoded.resize(bytes.size());
+    for (int k = CODEC_SCALAR; k <= CODEC_NEON; k++)
+    {
+        if (!bt_codec_supported((Codec_Kernel)k))
+            continue;
+
+        enc = samples_per_second([&]() {
+            bt_encode_samples_with((Codec_Kernel)k, samples.data(), SAMPLES_PER_PACKET, encoded.data());
+            sink = encoded[3];
+        });
+        dec = samples_per_second([&]() {
+            bt_decode_samples_with((Codec_Kernel)k, bytes.data(), SAMPLES_PER_PACKET, decoded.data());
+            sink = decoded[3].bpm;
+        });
+        printf("%-10s %16.3e %16.3e%s\n", bt_codec_name((Codec_Kernel)k), enc, dec, (k == bt_codec_best()) ? "  (selected)" : "");
+    }
+    (void)sink;
+}
+
+int main()
+{
+    test_kernels();
+    bench_kernels();
+    std::cout << "All tests passed" << std::endl;
+
+    return 0;
+}
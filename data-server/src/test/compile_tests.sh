@@ -8,5 +8,97 @@ g++ ds_test.cpp -lsqlite3 -lpthread -o ds_test.out
 # sql.cpp - Runs example table creation and data insert routines
 g++ sql.cpp -lsqlite3 -o sql_test.out
 
+# spsc_test.cpp - Runs tests for the SPSC_Queue used between collection and processing threads
+g++ -std=c++14 -O2 -I../../include spsc_test.cpp -lpthread -o spsc_test.out
+
+# sample_pool_test.cpp - Runs tests for the Sample_Pool and checks the pooled sample path makes no heap allocations
+g++ -std=c++14 -O2 -I../../include sample_pool_test.cpp -lpthread -o sample_pool_test.out
+
+# consumer_thread_test.cpp - Runs tests for Consumer_Thread overflow policies and lag statistics
+g++ -std=c++14 -O2 -I../../include consumer_thread_test.cpp -lpthread -o consumer_thread_test.out
+
+# pipeline_test.cpp - Runs tests for the Pipeline stage engine and prints per stage statistics
+g++ -std=c++14 -O2 -I../../include pipeline_test.cpp -lpthread -o pipeline_test.out
+
+# max30100_test.cpp - Runs the Max30100 datasource against Fake_Max30100 and reports I2C transactions per sample
+g++ -std=c++14 -O2 -I../../include max30100_test.cpp -lpthread -o max30100_test.out
+
+# bt_wakeup_bench.cpp - Benchmarks receiver CPU usage and latency of polling PHMS_Bluetooth::Server against waiting on it
+g++ -std=c++14 -O2 -I../../include bt_wakeup_bench.cpp -lpthread -lbluetooth -o bt_wakeup_bench.out
+
+# bt_decode_test.cpp - Runs tests for decoding bluetooth packets into caller buffers and into the Data_Store without allocating
+g++ -std=c++14 -O2 -I../../include bt_decode_test.cpp -lpthread -lbluetooth -o bt_decode_test.out
+
+# codec_bench.cpp - Checks the bluetooth sample codec kernels and reports samples per second for each
+g++ -std=c++14 -O2 -I../../include codec_bench.cpp -o codec_bench.out
+
+# spo2_bench.cpp - Runs the SpO2_Estimator over the recorded jack_*.csv data and compares it with the previous log() lookup
+g++ -std=c++14 -O2 -I../../include spo2_bench.cpp -o spo2_bench.out
+
+# sensor_validator_test.cpp - Runs Sensor_Validator tests on the recorded jack_*.csv data and a simulated faulty sensor
+g++ -std=c++14 -O2 -I../../include sensor_validator_test.cpp -o sensor_validator_test.out
+
+# sensor_fusion_test.cpp - Runs Sensor_Fusion tests on simulated sensors and the recorded jack_*.csv data
+g++ -std=c++14 -O2 -I../../include sensor_fusion_test.cpp -o sensor_fusion_test.out
+
+# heart_rate_test.cpp - Runs Heart_Rate_Detector tests on simulated pulses and the recorded jack_*.csv data
+g++ -std=c++14 -O2 -I../../include heart_rate_test.cpp -o heart_rate_test.out
+
+# bt_ring_bench.cpp - Checks the PHMS_Bluetooth::Server receive ring and benchmarks packets per second through a Communicator
+g++ -std=c++14 -O2 -I../../include bt_ring_bench.cpp -lpthread -lbluetooth -o bt_ring_bench.out
+
+# bt_packet_test.cpp - Runs tests for the pooled move-only PHMS_Bluetooth::Packet and checks steady state transmit and receive make no heap allocations
+g++ -std=c++14 -O2 -I../../include bt_packet_test.cpp -lpthread -lbluetooth -o bt_packet_test.out
+
+# bt_coalesce_bench.cpp - Checks the PHMS_Bluetooth::Client bundles packets correctly and sleeps when idle, and compares writes per packet with and without coalescing
+g++ -std=c++14 -O2 -I../../include bt_coalesce_bench.cpp -lpthread -lbluetooth -o bt_coalesce_bench.out
+
+# bt_reactor_test.cpp - Checks links share one PHMS_Bluetooth::Reactor thread, accepts, connects and waits for a full socket through it, and compares it with a thread pair per link
+g++ -std=c++14 -O2 -I../../include bt_reactor_test.cpp -lpthread -lbluetooth -o bt_reactor_test.out
+
+# bt_transport_test.cpp - Checks PHMS_Bluetooth links over unix: and tcp: addresses, TCP framing, and load tests a BluetoothReceiver without bluetooth
+g++ -std=c++14 -O2 -I../../include bt_transport_test.cpp -lpthread -lbluetooth -o bt_transport_test.out
+
+# bt_protocol_test.cpp - Checks version 2 bluetooth sample packets round trip and are negotiated, and compares bytes per sample and codec throughput with version 1
+g++ -std=c++14 -O2 -I../../include bt_protocol_test.cpp -lpthread -lbluetooth -o bt_protocol_test.out
+
+# sequence_tracker_test.cpp - Checks Sequence_Tracker gap, reorder, duplicate and late accounting and the BluetoothReceiver link counters, and times it per packet
+g++ -std=c++14 -O2 -I../../include sequence_tracker_test.cpp -lpthread -lbluetooth -o sequence_tracker_test.out
+
+# clock_sync_test.cpp - Checks Clock_Sync offset and drift through jittery link delays, the time messages and the sample times of BluetoothReceiver
+g++ -std=c++14 -O2 -I../../include clock_sync_test.cpp -lpthread -lbluetooth -o clock_sync_test.out
+
+# packet_sizer_test.cpp - Checks Packet_Sizer on simulated idle, congested and overloaded links and the BluetoothReceiver acks it is fed from
+g++ -std=c++14 -O2 -I../../include packet_sizer_test.cpp -lpthread -lbluetooth -o packet_sizer_test.out
+
+# pacer_test.cpp - Checks Pacer deadlines, missed deadline reporting and the rate held against the old usleep loop, from 64 Hz to 20 kHz
+g++ -std=c++14 -O2 -I../../include pacer_test.cpp -lpthread -o pacer_test.out
+
+# looping_buffer_bench.cpp - Checks torn read detection and views in the lock free Looping_Buffer and benchmarks it against the mutex version with 1 to 16 readers
+g++ -std=c++14 -O2 -I../../include looping_buffer_bench.cpp -lpthread -o looping_buffer_bench.out
+
 echo "Data_Store and Looping_Buffer tests compiled to ds_test.out (./ds_test.out)"
-echo "SQL_Connection tests compiled to sql_test.out (./sql_test.out)"
\ No newline at end of file
+echo "SQL_Connection tests compiled to sql_test.out (./sql_test.out)"
+echo "SPSC_Queue tests compiled to spsc_test.out (./spsc_test.out)"
+echo "Sample_Pool tests compiled to sample_pool_test.out (./sample_pool_test.out)"
+echo "Consumer_Thread tests compiled to consumer_thread_test.out (./consumer_thread_test.out)"
+echo "Pipeline tests compiled to pipeline_test.out (./pipeline_test.out)"
+echo "Max30100 tests compiled to max30100_test.out (./max30100_test.out)"
+echo "Bluetooth wakeup benchmark compiled to bt_wakeup_bench.out (./bt_wakeup_bench.out)"
+echo "Bluetooth decode tests compiled to bt_decode_test.out (./bt_decode_test.out)"
+echo "Codec benchmark compiled to codec_bench.out (./codec_bench.out)"
+echo "SpO2 benchmark compiled to spo2_bench.out (./spo2_bench.out)"
+echo "Sensor_Validator tests compiled to sensor_validator_test.out (./sensor_validator_test.out)"
+echo "Sensor_Fusion tests compiled to sensor_fusion_test.out (./sensor_fusion_test.out)"
+echo "Heart_Rate_Detector tests compiled to heart_rate_test.out (./heart_rate_test.out)"
+echo "Bluetooth receive ring benchmark compiled to bt_ring_bench.out (./bt_ring_bench.out)"
+echo "Bluetooth packet tests compiled to bt_packet_test.out (./bt_packet_test.out)"
+echo "Bluetooth coalescing benchmark compiled to bt_coalesce_bench.out (./bt_coalesce_bench.out)"
+echo "Bluetooth reactor tests compiled to bt_reactor_test.out (./bt_reactor_test.out)"
+echo "Bluetooth transport tests compiled to bt_transport_test.out (./bt_transport_test.out)"
+echo "Bluetooth protocol tests compiled to bt_protocol_test.out (./bt_protocol_test.out)"
+echo "Sequence_Tracker tests compiled to sequence_tracker_test.out (./sequence_tracker_test.out)"
+echo "Clock_Sync compiled to clock_sync_test.out (./clock_sync_test.out)"
+echo "Packet_Sizer compiled to packet_sizer_test.out (./packet_sizer_test.out)"
+echo "Pacer compiled to pacer_test.out (./pacer_test.out)"
+echo "Looping buffer benchmark compiled to looping_buffer_bench.out (./looping_buffer_bench.out)"
\ No newline at end of file
@@ -0,0 +1,133 @@
+#include <iostream>
+#include <atomic>
+#include <assert.h>
+
+#include "datasource.hpp"
+
+// a Datasource whose samples are pushed by the test
+class Test_Source : public Datasource
+{
+public:
+    void initializeConnection() {}
+    void send(Sample *s, size_t n) { dispatch(s, n); }
+};
+
+void fill(Sample *s, size_t n, uint16_t first)
+{
+    for (size_t i = 0; i < n; i++)
+        s[i].irLED = first + i;
+}
+
+void test_block()
+{
+    std::cout << "OVERFLOW_BLOCK tests: ";
+
+    Test_Source src;
+    std::atomic<int> received{0};
+    uint16_t expected{0};
+    Consumer_Thread<Sample> *c = src.registerAsyncBatchCallback("block", [&](const Sample *s, size_t n) {
+        // nothing is lost or reordered
+        for (size_t i = 0; i < n; i++)
+            assert(s[i].irLED == expected++);
+        received += n;
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }, OVERFLOW_BLOCK, 16);
+
+    Sample s[10];
+    for (int i = 0; i < 100; i++)
+    {
+        fill(s, 10, i * 10);
+        src.send(s, 10);
+    }
+
+    while (received != 1000)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    Consumer_Stats st = c->stats();
+    assert(st.delivered == 1000);
+    assert(st.dropped == 0 && st.coalesced == 0);
+    assert(st.max_depth <= 16);
+
+    std::cout << "Passed!" << std::endl;
+    c->print_stats();
+}
+
+void test_drop_oldest()
+{
+    std::cout << "OVERFLOW_DROP_OLDEST tests: ";
+
+    Test_Source src;
+    std::atomic<bool> release{false};
+    std::atomic<int> last{-1};
+    Consumer_Thread<Sample> *c = src.registerAsyncBatchCallback("drop_oldest", [&](const Sample *s, size_t n) {
+        while (!release)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        last = s[n - 1].irLED;
+    }, OVERFLOW_DROP_OLDEST, 16);
+
+    // the first batch is held by the consumer, the rest overflow the queue
+    Sample s[10];
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < 100; i++)
+    {
+        fill(s, 10, i * 10);
+        src.send(s, 10);
+    }
+    auto nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - start).count() / 100;
+
+    release = true;
+    while (last != 999)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    Consumer_Stats st = c->stats();
+    assert(st.dropped > 0);
+    assert(st.enqueued - st.dropped == st.delivered);
+
+    std::cout << "Passed! (producer spent " << nanos << " nanoseconds per packet while the consumer was stalled)" << std::endl;
+    c->print_stats();
+}
+
+void test_coalesce()
+{
+    std::cout << "OVERFLOW_COALESCE tests: ";
+
+    Test_Source src;
+    std::atomic<bool> release{false};
+    std::atomic<int> calls{0};
+    std::atomic<int> last{-1};
+    Consumer_Thread<Sample> *c = src.registerAsyncBatchCallback("coalesce", [&](const Sample *s, size_t n) {
+        while (!release)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        calls++;
+        last = s[n - 1].irLED;
+    }, OVERFLOW_COALESCE, 16);
+
+    Sample s[10];
+    for (int i = 0; i < 100; i++)
+    {
+        fill(s, 10, i * 10);
+        src.send(s, 10);
+    }
+
+    release = true;
+    while (last != 999)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    // the backlog collapsed so only a couple of deliveries were needed
+    Consumer_Stats st = c->stats();
+    assert(calls <= 3);
+    assert(st.coalesced > 0);
+
+    std::cout << "Passed!" << std::endl;
+    c->print_stats();
+}
+
+int main()
+{
+    test_block();
+    test_drop_oldest();
+    test_coalesce();
+    std::cout << "All tests passed" << std::endl;
+
+    return 0;
+}
@@ -119,8 +119,11 @@ void test_lb()
     // block_write() writes all 16 uint32_t to looping buffer
     assert(16 == lb.block_write(buffer_0, 16));
 
-    // block_read() reads all 16 uint32_t to buffer_1
-    assert(16 == lb.block_read(0, 16, buffer_1));
+    // block_read() does not read samples 0 to 16, they were overwritten
+    assert(0 == lb.block_read(0, 16, buffer_1));
+
+    // block_read() reads the 16 uint32_t written over them to buffer_1
+    assert(16 == lb.block_read(16, 32, buffer_1));
 
     // all 16 uint32_t are written from buffer_0 to buffer_1
     for (int i = 0; i < 16; i++)
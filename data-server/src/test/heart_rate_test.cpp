@@ -0,0 +1,254 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <cmath>
+#include <assert.h>
+
+#include "heart_rate_detector.hpp"
+
+#define DATA_DIR "../../../bluetooth-sensor-data/"
+
+// ir_led \t red_led \t spo2 \t bpm, first line is a header
+std::vector<Sample> load(const std::string &filename)
+{
+    std::vector<Sample> ret;
+    std::ifstream f(filename);
+    std::string line;
+    std::getline(f, line);
+    while (std::getline(f, line))
+    {
+        std::stringstream ss(line);
+        Sample s;
+        if (ss >> s.irLED >> s.redLED >> s.spo2 >> s.bpm)
+            ret.push_back(s);
+    }
+    return ret;
+}
+
+// PPG pulse over one beat (phase 0 to 1): a systolic peak and a smaller dicrotic wave
+double pulse_shape(double phase)
+{
+    auto bump = [](double x, double centre, double width) { return std::exp(-(x - centre) * (x - centre) / (2 * width * width)); };
+    return bump(phase, 0.2, 0.07) + 0.35 * bump(phase, 0.5, 0.1);
+}
+
+// simulated pulse with a few percent of beat to beat variation, bpm[i] is the rate at sample i
+std::vector<double> simulate(const std::vector<double> &bpm, double amplitude, unsigned seed)
+{
+    std::mt19937 rng(seed);
+    std::normal_distribution<double> variation(0, 0.03);
+    std::vector<double> ret(bpm.size());
+    double phase{0};
+    double beat_rate = bpm[0];
+    for (size_t i = 0; i < bpm.size(); i++)
+    {
+        ret[i] = amplitude * pulse_shape(phase);
+        phase += beat_rate / 60.0 / HR_SAMPLE_RATE;
+        if (phase >= 1)
+        {
+            phase -= 1;
+            beat_rate = bpm[i] * (1 + variation(rng));
+        }
+    }
+    return ret;
+}
+
+// fraction of samples from 'from' on where the detector is within tolerance of the simulated rate
+double agreement(const std::vector<uint16_t> &detected, const std::vector<double> &bpm, size_t from, double tolerance)
+{
+    size_t good{0};
+    for (size_t i = from; i < detected.size(); i++)
+        good += std::fabs(detected[i] - bpm[i]) <= tolerance;
+    return (double)good / (detected.size() - from);
+}
+
+// fraction of samples from 'from' on with a heart rate reported
+double reported(const std::vector<uint16_t> &detected, size_t from)
+{
+    size_t n{0};
+    for (size_t i = from; i < detected.size(); i++)
+        n += detected[i] != 0;
+    return (double)n / (detected.size() - from);
+}
+
+std::vector<uint16_t> run(Heart_Rate_Detector &d, const std::vector<double> &signal)
+{
+    std::vector<uint16_t> ret;
+    for (double x : signal)
+    {
+        d.update((uint16_t)x);
+        ret.push_back(d.bpm());
+    }
+    return ret;
+}
+
+void test_synthetic()
+{
+    std::cout << "Heart_Rate_Detector simulated pulse tests:" << std::endl;
+    std::mt19937 rng(1);
+    std::normal_distribution<double> noise(0, 20);
+
+    for (double rate : {45.0, 60.0, 90.0, 120.0, 180.0})
+    {
+        std::vector<double> bpm(60 * HR_SAMPLE_RATE, rate);
+        std::vector<double> signal = simulate(bpm, 150, 2);
+        for (auto &x : signal)
+            x += 14000 + noise(rng);
+
+        Heart_Rate_Detector d;
+        std::vector<uint16_t> detected = run(d, signal);
+        // the simulated beats vary by 3%, so the tolerance grows with the rate
+        double good = agreement(detected, bpm, 10 * HR_SAMPLE_RATE, std::max(3.0, 0.03 * rate));
+
+        uint16_t ibi[HR_IBI_HISTORY];
+        size_t count = d.intervals(ibi, HR_IBI_HISTORY);
+        printf("  %3.0f bpm: detected %3u, %3llu beats, last interval %4u ms, within 3%% %.1f%% of the time\n",
+               rate, d.bpm(), (unsigned long long)d.beats(), d.last_ibi(), 100 * good);
+
+        assert(good > 0.95);
+        assert(std::fabs(d.beats() - rate) <= 2);
+        assert(count == HR_IBI_HISTORY && ibi[count - 1] == d.last_ibi());
+        for (size_t i = 0; i < count; i++)
+            assert(std::fabs(ibi[i] - 60000 / rate) < 0.15 * 60000 / rate);
+    }
+}
+
+void test_recorded_noise()
+{
+    std::cout << "Heart_Rate_Detector recorded noise tests:" << std::endl;
+
+    // the recordings carry the real sensor's noise and glitches, a known pulse is added on top
+    for (const char *file : {"jack_stressed.csv", "jack_unstressed.csv"})
+    {
+        std::vector<Sample> data = load(std::string(DATA_DIR) + file);
+        assert(data.size() > 2000);
+
+        for (double rate : {60.0, 100.0})
+        {
+            std::vector<double> bpm(data.size(), rate);
+            std::vector<double> signal = simulate(bpm, 400, 3);
+            for (size_t i = 0; i < data.size(); i++)
+                signal[i] = std::min(65535.0, signal[i] + data[i].irLED);
+
+            // the recorded noise hides the pulse some of the time, then no rate is given rather than a wrong one
+            Heart_Rate_Detector d;
+            std::vector<uint16_t> detected = run(d, signal);
+            double given = reported(detected, 10 * HR_SAMPLE_RATE);
+            double good = agreement(detected, bpm, 10 * HR_SAMPLE_RATE, 5);
+            printf("  %-20s %3.0f bpm: reported %.1f%% of the time, within 5 bpm %.1f%% of the time, %llu glitches replaced\n",
+                   file, rate, 100 * given, 100 * good, (unsigned long long)d.rejected());
+            assert(given > 0.25);
+            assert(good > 0.99 * given);
+            assert(d.rejected() > 0);
+        }
+    }
+}
+
+void test_recorded()
+{
+    std::cout << "Heart_Rate_Detector recorded data tests:" << std::endl;
+
+    // the recordings have no pulse strong enough to find. The detector still finds beats in the
+    // noise, but they are neither high above it nor evenly spaced, so no heart rate is reported
+    // and process() leaves the sensor box's value in place
+    for (const char *file : {"jack_stressed.csv", "jack_unstressed.csv"})
+    {
+        std::vector<Sample> data = load(std::string(DATA_DIR) + file);
+        std::vector<Sample> processed = data;
+        Heart_Rate_Detector d;
+        d.process(processed.data(), processed.size());
+        for (size_t i = 0; i < data.size(); i++)
+            assert(processed[i].bpm == data[i].bpm);
+
+        Heart_Rate_Detector e;
+        for (auto &s : data)
+        {
+            e.update(s.irLED);
+            assert(e.bpm() == 0);
+        }
+        printf("  %-20s no heart rate reported, %llu beats found in the noise, last signal to noise %.2f interval spread %.2f\n",
+               file, (unsigned long long)e.beats(), e.snr(), e.ibi_spread());
+        assert(e.beats() > 0);
+    }
+}
+
+void test_tracking()
+{
+    std::cout << "Heart_Rate_Detector tracking tests: ";
+
+    // rate doubles half way through
+    std::vector<double> bpm(60 * HR_SAMPLE_RATE, 60);
+    for (size_t i = bpm.size() / 2; i < bpm.size(); i++)
+        bpm[i] = 120;
+    std::vector<double> signal = simulate(bpm, 150, 4);
+    for (auto &x : signal)
+        x += 14000;
+
+    // glitches like the recorded ones
+    for (size_t i = 7; i < signal.size(); i += 11)
+        signal[i] = (i % 2) ? 54 : 64823;
+
+    Heart_Rate_Detector d;
+    std::vector<uint16_t> detected = run(d, signal);
+    assert(agreement(detected, bpm, bpm.size() / 2 + 10 * HR_SAMPLE_RATE, 3) > 0.95);
+
+    // the process() interface fills in the bpm field, leaving the sensor's value until there is an estimate
+    std::vector<Sample> samples(8 * HR_SAMPLE_RATE);
+    for (size_t i = 0; i < samples.size(); i++)
+    {
+        samples[i].irLED = (uint16_t)signal[i];
+        samples[i].bpm = 77;
+    }
+    Heart_Rate_Detector p;
+    p.process(samples.data(), samples.size());
+    assert(samples.front().bpm == 77);
+    assert(std::fabs(samples.back().bpm - 60.0) <= 3);
+
+    // a lost pulse reports 0
+    for (int i = 0; i < 5 * HR_SAMPLE_RATE; i++)
+        d.update(14000);
+    assert(d.bpm() == 0);
+
+    std::cout << "Passed!" << std::endl;
+}
+
+void bench()
+{
+    // 16 sensors at 64 Hz, one detector each
+    std::vector<double> bpm(60 * HR_SAMPLE_RATE, 75);
+    std::vector<double> signal = simulate(bpm, 150, 5);
+    std::vector<uint16_t> readings;
+    for (auto x : signal)
+        readings.push_back((uint16_t)(x + 14000));
+
+    Heart_Rate_Detector detectors[16];
+    uint64_t beats{0};
+    auto start = std::chrono::steady_clock::now();
+    for (int rep = 0; rep < 20; rep++)
+        for (auto r : readings)
+            for (auto &d : detectors)
+                beats += d.update(r);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double ns = seconds * 1e9 / (20.0 * readings.size() * 16);
+
+    // share of one core needed for 16 sensors at HR_SAMPLE_RATE
+    double load = ns * 16 * HR_SAMPLE_RATE / 1e9;
+    printf("Heart_Rate_Detector: %.1f ns/sample, %.4f%% of a core for 16 sensors at %d Hz\n", ns, 100 * load, HR_SAMPLE_RATE);
+    assert(beats > 0);
+    assert(load < 0.01);
+}
+
+int main()
+{
+    test_synthetic();
+    test_recorded_noise();
+    test_recorded();
+    test_tracking();
+    bench();
+    std::cout << "All tests passed" << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,398 @@
+#include <iostream>
+#include <atomic>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <memory>
+#include <cstring>
+#include <assert.h>
+
+#include "ds_looping_buffer.hpp"
+#include "ds_data_store.hpp"
+
+/* Checks the lock free Looping_Buffer and benchmarks it against the mutex one it replaced:
+ *  - a read overlapping a write in progress is caught, try_read() gives up and
+ *    block_read() copies again, reads of other slots go through
+ *  - views give samples in place in one or two spans with their sequence range,
+ *    and stop being valid once a write reaches them, Data_Store::view() gives
+ *    each reader thread the samples it has not read yet
+ *  - one writer writes 5 sample batches as fast as it can while 1 to 16
+ *    readers copy the newest 64 samples, like Data_Store::copy(), for a while
+ *    each. Every sample carries its position so torn or misplaced copies are
+ *    caught. Reports reads and writes per second and copies done again.
+ */
+
+#define LENGTH BUFFER_LENGTH
+#define BATCH 5
+#define READ_LEN 64
+#define RUN_MS 300
+
+using bench_clock = std::chrono::steady_clock;
+
+// the Looping_Buffer before it was lock free, count kept under the lock so it is a fair baseline
+template <typename TYPE, int LEN>
+class Mutex_Looping_Buffer
+{
+private:
+    TYPE buffer[LEN];
+    std::mutex mut;
+    uint32_t count{0};
+
+public:
+    int block_write(const TYPE *src, size_t len)
+    {
+        if (len > LEN)
+            return 0;
+        std::lock_guard<std::mutex> lock(mut);
+        size_t sec_0_len = std::min(len, (size_t)(LEN - count % LEN));
+        memcpy(buffer + count % LEN, src, sec_0_len * sizeof(TYPE));
+        memcpy(buffer, src + sec_0_len, (len - sec_0_len) * sizeof(TYPE));
+        count += len;
+        return len;
+    }
+
+    int block_read(int from, int to, TYPE *dest)
+    {
+        std::lock_guard<std::mutex> lock(mut);
+        int len = to - from;
+        if (len <= 0 || len > LEN || to > (int)count || (int)count - from > LEN)
+            return 0;
+        int sec_0_len = std::min(len, LEN - from % LEN);
+        memcpy(dest, buffer + from % LEN, sec_0_len * sizeof(TYPE));
+        memcpy(dest + sec_0_len, buffer, (len - sec_0_len) * sizeof(TYPE));
+        return len;
+    }
+
+    int samples_recv()
+    {
+        std::lock_guard<std::mutex> lock(mut);
+        return count;
+    }
+
+    uint64_t torn_reads() const { return 0; }
+};
+
+// every field follows from the sample's position
+Sample make_sample(uint32_t pos)
+{
+    Sample s;
+    s.timestamp = pos;
+    s.irLED = pos & 0xffff;
+    s.redLED = ~pos & 0xffff;
+    s.spo2 = (pos * 7) & 0xffff;
+    s.bpm = pos >> 16;
+    s.pilot_state = (pos * 13) & 0xffff;
+    return s;
+}
+
+bool consistent(const Sample &s)
+{
+    Sample expect = make_sample((uint32_t)s.timestamp);
+    return s.irLED == expect.irLED && s.redLED == expect.redLED && s.spo2 == expect.spo2 && s.bpm == expect.bpm &&
+           s.pilot_state == expect.pilot_state;
+}
+
+void test_torn_reads()
+{
+    std::cout << "Torn read tests: ";
+
+    Looping_Buffer<Sample, 16> lb;
+    Sample batch[16];
+    for (uint32_t i = 0; i < 16; i++)
+        batch[i] = make_sample(i);
+    assert(16 == lb.block_write(batch, 16));
+
+    // reads from inside the writer, while samples 16 to 20 are claimed and half written to slots 0 to 3
+    Sample out[16];
+    int other{-1}, overlapping{-1};
+    lb.block_emplace(4, [&](Sample *dest, size_t offset, size_t n) {
+        for (size_t i = 0; i < n; i++)
+            dest[i] = make_sample(16 + offset + i);
+
+        // slots 4 to 12 are not being written
+        other = lb.try_read(4, 12, out);
+        // slots 0 to 8 are
+        overlapping = lb.try_read(0, 8, out);
+    });
+    assert(other == 8 && overlapping == 0 && lb.torn_reads() == 1);
+    assert(lb.samples_recv() == 20);
+
+    // samples 20 and 21 go to slots 4 and 5, over samples 4 and 5
+    int around{-1};
+    lb.block_emplace(2, [&](Sample *dest, size_t offset, size_t n) {
+        for (size_t i = 0; i < n; i++)
+            dest[i] = make_sample(20 + offset + i);
+        // samples 14 to 20 wrap around the end of the buffer to slots 14, 15 and 0 to 3, clear of the writer
+        assert(6 == lb.try_read(14, 20, out));
+        // 20 and 21 are not published yet
+        assert(0 == lb.try_read(18, 22, out));
+        // samples 4 to 20 are the whole ring, wrapping onto the slots being written
+        around = lb.try_read(4, 20, out);
+    });
+    assert(around == 0 && lb.torn_reads() == 2);
+    assert(6 == lb.block_read(16, 22, out));
+    for (uint32_t i = 0; i < 6; i++)
+        assert(out[i].timestamp == 16 + i && consistent(out[i]));
+
+    // once published they read as the new samples
+    assert(4 == lb.try_read(16, 20, out));
+    for (uint32_t i = 0; i < 4; i++)
+        assert(out[i].timestamp == 16 + i && consistent(out[i]));
+
+    // samples 6 to 22 were chosen to read, then samples 22 to 26 were written over slots 6 to 9
+    // before the read started. The copy would hold newer samples, so nothing is read
+    uint64_t torn = lb.torn_reads();
+    for (uint32_t i = 0; i < 4; i++)
+        batch[i] = make_sample(22 + i);
+    assert(4 == lb.block_write(batch, 4));
+    assert(0 == lb.try_read(6, 22, out));
+    assert(0 == lb.block_read(6, 22, out));
+    assert(0 == lb.block_read(9, 10, out));
+    assert(lb.torn_reads() == torn + 3);
+    // samples 10 on are still there
+    assert(16 == lb.block_read(10, 26, out));
+    for (uint32_t i = 0; i < 16; i++)
+        assert(out[i].timestamp == 10 + i && consistent(out[i]));
+
+    std::cout << "Passed!" << std::endl;
+}
+
+void test_views()
+{
+    std::cout << "View tests: ";
+
+    Looping_Buffer<Sample, 16> lb;
+    Sample batch[16];
+    for (uint32_t i = 0; i < 16; i++)
+        batch[i] = make_sample(i);
+    assert(10 == lb.block_write(batch, 10));
+
+    // one span
+    Looping_Buffer_View<Sample, 16> v = lb.view(2, 8);
+    assert(v.from == 2 && v.to == 8 && v.size() == 6);
+    assert(v.first_len == 6 && v.second_len == 0 && v.second == nullptr);
+    for (size_t i = 0; i < v.size(); i++)
+        assert(v[i].timestamp == 2 + i && &v[i] == v.first + i);
+    assert(v.valid());
+
+    // not written yet, too long, backwards
+    assert(lb.view(8, 11).empty() && lb.view(0, 17).empty() && lb.view(5, 3).empty());
+
+    // 10 to 20 wrap around the end of the buffer
+    for (uint32_t i = 0; i < 10; i++)
+        batch[i] = make_sample(10 + i);
+    assert(10 == lb.block_write(batch, 10));
+    v = lb.view(10, 20);
+    assert(v.first_len == 6 && v.second_len == 4);
+    for (size_t i = 0; i < v.size(); i++)
+        assert(v[i].timestamp == 10 + i && consistent(v[i]));
+    assert(v.valid());
+
+    // 4 to 20 is the whole ring, valid until the next write
+    Looping_Buffer_View<Sample, 16> ring = lb.view(4, 20);
+    assert(ring.size() == 16 && ring.valid());
+
+    // a write in progress on slot 4 already makes the ring view invalid, the one of 10 to 20 stays valid
+    lb.block_emplace(1, [&](Sample *dest, size_t offset, size_t n) {
+        dest[0] = make_sample(20);
+        assert(!ring.valid() && v.valid());
+        // and a view of samples being overwritten is not given out
+        assert(lb.view(4, 8).empty());
+    });
+    assert(!ring.valid());
+    assert(lb.view(4, 8).empty() && lb.view(5, 8).size() == 3);
+
+    // writes reaching 10 end the other one
+    for (uint32_t i = 0; i < 5; i++)
+        batch[i] = make_sample(21 + i);
+    assert(5 == lb.block_write(batch, 5));
+    assert(v.valid());
+    assert(1 == lb.block_write(batch, 1));
+    assert(!v.valid());
+
+    // Data_Store keeps each reader's place, a reader far behind skips to the newest samples
+    std::unique_ptr<Data_Store<Sample>> ds(new Data_Store<Sample>());
+    ds->register_reader_thread();
+    assert(ds->view().empty());
+    for (uint32_t i = 0; i < 16; i++)
+        batch[i] = make_sample(i);
+    assert(16 == ds->new_data(batch, 16));
+    Data_Store<Sample>::View dv = ds->view();
+    assert(dv.from == 0 && dv.to == 16 && dv.valid());
+    assert(ds->view().empty());
+    assert(ds->latest(4).from == 12 && ds->latest(4).to == 16 && ds->latest(17).empty());
+
+    std::thread other([&]() {
+        ds->register_reader_thread();
+        Data_Store<Sample>::View ov = ds->view(10);
+        assert(ov.from == 6 && ov.to == 16 && ov[0].timestamp == 6);
+    });
+    other.join();
+
+    uint32_t pos = 16;
+    for (int k = 0; k < 100; k++)
+    {
+        for (uint32_t i = 0; i < 16; i++)
+            batch[i] = make_sample(pos + i);
+        pos += ds->new_data(batch, 16);
+    }
+    dv = ds->view();
+    assert(dv.from == pos - BUFFER_LENGTH / 2 && dv.to == pos && dv.size() == BUFFER_LENGTH / 2);
+    for (size_t i = 0; i < dv.size(); i++)
+        assert(dv[i].timestamp == dv.from + i && consistent(dv[i]));
+    assert(dv.valid());
+
+    std::cout << "Passed!" << std::endl;
+}
+
+// a writer at full speed and a reader that follows it with Data_Store views
+void test_views_concurrent()
+{
+    std::cout << "Concurrent view tests: ";
+
+    std::unique_ptr<Data_Store<Sample>> ds(new Data_Store<Sample>());
+    std::atomic<bool> running{true};
+    uint64_t views{0}, samples{0}, invalid{0};
+
+    std::thread reader([&]() {
+        ds->register_reader_thread();
+        uint32_t next{0};
+        while (running.load(std::memory_order_relaxed))
+        {
+            Data_Store<Sample>::View v = ds->view();
+            if (v.empty())
+                continue;
+            // whatever was skipped, the view starts at or after where the last one ended
+            assert(v.from >= next);
+            next = v.to;
+            bool ok{true};
+            for (size_t i = 0; i < v.size(); i++)
+                ok = ok && consistent(v[i]) && v[i].timestamp == v.from + i;
+            if (!v.valid())
+            {
+                invalid++;
+                continue;
+            }
+            // a valid view never held torn or misplaced samples
+            assert(ok);
+            views++;
+            samples += v.size();
+        }
+    });
+
+    Sample batch[BATCH];
+    uint32_t pos{0};
+    auto end = bench_clock::now() + std::chrono::milliseconds(RUN_MS);
+    while (bench_clock::now() < end)
+    {
+        for (int i = 0; i < BATCH; i++)
+            batch[i] = make_sample(pos + i);
+        pos += ds->new_data(batch, BATCH);
+    }
+    running = false;
+    reader.join();
+    assert(views > 0);
+
+    printf("Passed! (%llu views of %.1f samples, %llu overwritten while read, of %u samples written)\n",
+           (unsigned long long)views, (double)samples / views, (unsigned long long)invalid, pos);
+}
+
+struct Result
+{
+    double reads_per_second{0};
+    double writes_per_second{0};
+    uint64_t torn{0};
+};
+
+template <typename BUFFER>
+Result contend(BUFFER &lb, int readers)
+{
+    std::atomic<bool> running{true};
+    std::atomic<uint64_t> reads{0};
+    uint64_t writes{0};
+
+    std::vector<std::thread> threads;
+    for (int r = 0; r < readers; r++)
+        threads.emplace_back([&]() {
+            Sample out[READ_LEN];
+            uint64_t n{0};
+            while (running.load(std::memory_order_relaxed))
+            {
+                int recv = lb.samples_recv();
+                if (recv < READ_LEN)
+                    continue;
+                int from = recv - READ_LEN;
+                // nothing is read if the writer lapped from after recv was taken
+                int k = lb.block_read(from, recv, out);
+                if (k == 0)
+                    continue;
+                assert(READ_LEN == k);
+                // each copied slot holds one whole sample, the one asked for
+                for (int i = 0; i < READ_LEN; i++)
+                {
+                    assert(consistent(out[i]));
+                    assert(out[i].timestamp == (uint32_t)(from + i));
+                }
+                n++;
+            }
+            reads += n;
+        });
+
+    Sample batch[BATCH];
+    uint32_t pos{0};
+    auto start = bench_clock::now();
+    auto end = start + std::chrono::milliseconds(RUN_MS);
+    while (bench_clock::now() < end)
+    {
+        for (int i = 0; i < BATCH; i++)
+            batch[i] = make_sample(pos + i);
+        assert(BATCH == lb.block_write(batch, BATCH));
+        pos += BATCH;
+        writes++;
+    }
+    running = false;
+    for (auto &t : threads)
+        t.join();
+    double elapsed = std::chrono::duration<double>(bench_clock::now() - start).count();
+
+    Result r;
+    r.reads_per_second = reads / elapsed;
+    r.writes_per_second = writes / elapsed;
+    r.torn = lb.torn_reads();
+    return r;
+}
+
+void benchmark()
+{
+    std::cout << "Contention benchmark, newest " << READ_LEN << " of " << LENGTH << " samples, " << BATCH
+              << " sample writes:" << std::endl;
+
+    const int reader_counts[] = {1, 2, 4, 8, 16};
+    for (int readers : reader_counts)
+    {
+        // too large for the stack with 16 readers' worth of threads around
+        std::unique_ptr<Mutex_Looping_Buffer<Sample, LENGTH>> locked(new Mutex_Looping_Buffer<Sample, LENGTH>());
+        std::unique_ptr<Looping_Buffer<Sample, LENGTH>> lock_free(new Looping_Buffer<Sample, LENGTH>());
+
+        Result m = contend(*locked, readers);
+        Result f = contend(*lock_free, readers);
+        printf("  %2d readers: mutex %10.0f reads/s %10.0f writes/s | lock free %10.0f reads/s %10.0f writes/s, "
+               "%llu torn or lapped\n",
+               readers, m.reads_per_second, m.writes_per_second, f.reads_per_second, f.writes_per_second,
+               (unsigned long long)f.torn);
+        assert(f.reads_per_second > 0 && f.writes_per_second > 0);
+    }
+}
+
+int main()
+{
+    test_torn_reads();
+    test_views();
+    test_views_concurrent();
+    benchmark();
+
+    std::cout << "All tests passed" << std::endl;
+
+    return 0;
+}
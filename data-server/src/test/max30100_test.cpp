@@ -0,0 +1,131 @@
+#include <iostream>
+#include <atomic>
+#include <vector>
+#include <mutex>
+#include <assert.h>
+
+#define MAX30100_NO_WIRINGPI
+#include "../max30100Datasource.cpp"
+
+#define RUN_SECONDS 3
+
+// the previous collector made 8 register reads and 1 register write per sample
+#define LEGACY_TRANSACTIONS_PER_SAMPLE 9
+
+// ir counts up from 0, red counts down from 0xffff
+void generate(uint64_t n, uint16_t &ir, uint16_t &red)
+{
+    ir = (uint16_t)n;
+    red = (uint16_t)(0xffff - n);
+}
+
+void test_fifo_burst()
+{
+    std::cout << "Max30100 FIFO burst read tests: ";
+
+    Fake_Max30100 device(100, generate);
+
+    // appended to by the datasource's processing thread
+    std::vector<Sample> received;
+    std::mutex received_guard;
+    received.reserve(RUN_SECONDS * 200);
+    {
+        Max30100 datasource(&device);
+        datasource.registerBatchCallback([&](const Sample *s, size_t n) {
+            std::lock_guard<std::mutex> lock(received_guard);
+            received.insert(received.end(), s, s + n);
+        });
+
+        uint64_t configure_transactions = device.getTransactions();
+        datasource.initializeConnection();
+        std::this_thread::sleep_for(std::chrono::seconds(RUN_SECONDS));
+
+        uint64_t transactions = device.getTransactions() - configure_transactions;
+        size_t received_count;
+        {
+            std::lock_guard<std::mutex> lock(received_guard);
+            received_count = received.size();
+        }
+        double per_sample = (double)transactions / received_count;
+        std::cout << "\n  " << received_count << " samples in " << RUN_SECONDS << " s, "
+                  << transactions << " I2C transactions (" << per_sample << " per sample, previously " << LEGACY_TRANSACTIONS_PER_SAMPLE << ")\n";
+        std::cout << "  sensor FIFO overruns: " << datasource.fifoOverruns() << ", queue overruns: " << datasource.overruns() << "\n";
+
+        assert(per_sample < 1.0);
+        assert(datasource.fifoOverruns() == 0);
+        assert(datasource.overruns() == 0);
+    }
+
+    // the datasource's threads are joined, every sample arrives once, in order, with the right values
+    assert(received.size() >= (RUN_SECONDS - 1) * 100);
+    for (size_t i = 0; i < received.size(); i++)
+    {
+        assert(received[i].irLED == (uint16_t)i);
+        assert(received[i].redLED == (uint16_t)(0xffff - i));
+        if (i > 0)
+            assert(received[i].timestamp >= received[i - 1].timestamp);
+    }
+    assert(device.getLostSamples() == 0);
+
+    std::cout << "Passed!" << std::endl;
+}
+
+void test_fifo_overflow()
+{
+    std::cout << "Fake_Max30100 overflow tests: ";
+
+    Fake_Max30100 device(1000, generate);
+
+    // nobody reads for 50 ms, 50 samples arrive into a 16 sample FIFO
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+    // a full FIFO has equal pointers, the samples that did not fit are counted
+    uint8_t ptrs[3];
+    assert(device.readBlock(Fake_Max30100::FIFO_WR_PTR, ptrs, 3) == 3);
+    assert(ptrs[0] == ptrs[2]);
+    assert(ptrs[1] > 0);
+    assert(device.getLostSamples() > 0);
+
+    // the FIFO keeps the first 16 samples, the later ones are the lost ones
+    uint8_t data[4];
+    device.readBlock(Fake_Max30100::FIFO_DATA, data, 4);
+    uint16_t ir = (data[0] << 8) | data[1];
+    assert(ir == 0);
+
+    // popping a sample clears the counter
+    assert(device.readReg8(Fake_Max30100::OVF_COUNTER) == 0);
+
+    std::cout << "Passed!" << std::endl;
+}
+
+void test_fifo_pending()
+{
+    std::cout << "Max30100 FIFO pending tests: ";
+
+    // pointers apart
+    assert(Max30100::fifoPendingFrom(7, 0, 5, 2) == 2);
+    assert(Max30100::fifoPendingFrom(2, 0, 14, 4) == 4);
+
+    // equal pointers right after a read: empty
+    assert(Max30100::fifoPendingFrom(5, 0, 5, 0) == 0);
+    assert(Max30100::fifoPendingFrom(5, 0, 5, 7) == 0);
+
+    // equal pointers after a late wake, 16 samples and none lost yet: full
+    assert(Max30100::fifoPendingFrom(5, 0, 5, 16) == 16);
+    assert(Max30100::fifoPendingFrom(5, 0, 5, 8) == 16);
+
+    // samples lost: full
+    assert(Max30100::fifoPendingFrom(5, 3, 5, 0) == 16);
+
+    std::cout << "Passed!" << std::endl;
+}
+
+int main()
+{
+    test_fifo_overflow();
+    test_fifo_pending();
+    test_fifo_burst();
+    std::cout << "All tests passed" << std::endl;
+
+    return 0;
+}
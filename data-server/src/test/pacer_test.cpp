@@ -0,0 +1,158 @@
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <cmath>
+#include <unistd.h>
+#include <assert.h>
+
+#include "pacer.hpp"
+
+/* Checks and benchmarks Pacer:
+ *  - deadlines are exact for any rate, fractional ones included, and never overflow
+ *  - at 64 Hz it holds the rate where the old usleep(1000000 / (64 / 5)) loop falls behind
+ *  - loop work shorter than a period does not slow it down
+ *  - missed deadlines are reported and caught up, falling too far behind skips instead
+ *  - held rate and wake up lateness from 64 Hz to 20 kHz
+ */
+
+using bench_clock = std::chrono::steady_clock;
+
+double seconds_since(bench_clock::time_point t)
+{
+    return std::chrono::duration<double>(bench_clock::now() - t).count();
+}
+
+void test_deadlines()
+{
+    std::cout << "Deadline tests: ";
+
+    Pacer p(64);
+    uint64_t start = p.deadline(0);
+    assert(p.deadline(1) - start == 15625000);
+    assert(p.deadline(5) - start == 78125000);
+    assert(p.deadline(64) - start == 1000000000);
+
+    // rounding never adds up: 3 Hz periods are 333333333 ns and a third
+    Pacer third(3);
+    start = third.deadline(0);
+    assert(third.deadline(1) - start == 333333333);
+    assert(third.deadline(3) - start == 1000000000);
+    assert(third.deadline(3000000) - start == 1000000ULL * 1000000000ULL);
+
+    // 2.5 Hz as 5 / 2
+    Pacer fractional(5, 2);
+    start = fractional.deadline(0);
+    assert(fractional.deadline(5) - start == 2000000000);
+
+    // a year at 1 MHz
+    Pacer fast(1000000);
+    start = fast.deadline(0);
+    uint64_t year = 365ULL * 24 * 3600;
+    assert(fast.deadline(year * 1000000) - start == year * 1000000000ULL);
+
+    std::cout << "Passed!" << std::endl;
+}
+
+// 64 Hz sent 5 samples at a time with 3 ms of work per packet, for about 2 s
+void test_against_usleep()
+{
+    std::cout << "64 Hz pacing tests: ";
+
+    const int packets = 26;
+    const int work_us = 3000;
+
+    auto start = bench_clock::now();
+    for (int i = 0; i < packets; i++)
+    {
+        usleep(1000000 / (64 / 5));
+        usleep(work_us);
+    }
+    double old_rate = packets * 5 / seconds_since(start);
+
+    Pacer pacer(64);
+    start = bench_clock::now();
+    for (int i = 0; i < packets; i++)
+    {
+        assert(pacer.wait(5));
+        usleep(work_us);
+    }
+    // the last wait ends on the deadline, the work after it is not part of the period
+    double rate = packets * 5 / (seconds_since(start) - work_us / 1e6);
+
+    const Pacer_Stats &st = pacer.stats();
+    assert(st.waits == packets && st.periods == packets * 5 && st.missed == 0 && st.skipped == 0);
+    assert(fabs(rate - 64) < 0.2);
+    assert(old_rate < 60);
+    printf("Passed! (held %.3f Hz, usleep loop %.3f Hz, woke late by %.1f us mean %.1f us max)\n", rate, old_rate,
+           st.mean_late_ns / 1000, st.max_late_ns / 1000.0);
+}
+
+void test_missed()
+{
+    std::cout << "Missed deadline tests: ";
+
+    // 100 Hz, one 35 ms hiccup: the next waits return at once until the loop is back on time
+    Pacer pacer(100);
+    assert(pacer.wait());
+    usleep(35000);
+    int caught_up{0};
+    while (!pacer.wait())
+        caught_up++;
+    assert(caught_up >= 2 && caught_up <= 4);
+    assert(pacer.stats().missed == (uint64_t)caught_up && pacer.stats().skipped == 0);
+
+    // the periods after it keep to the original deadlines
+    auto start = bench_clock::now();
+    for (int i = 0; i < 10; i++)
+        assert(pacer.wait());
+    assert(fabs(seconds_since(start) - 0.1) < 0.005);
+
+    // falling more than max_behind behind skips to now instead of running back to back
+    Pacer slow(1000, 1, 0);
+    assert(slow.wait());
+    usleep(50000);
+    assert(!slow.wait());
+    const Pacer_Stats &st = slow.stats();
+    assert(st.skipped >= 45 && st.skipped <= 60);
+    assert(slow.wait());
+    assert(slow.stats().missed == 1);
+
+    std::cout << "Passed!" << std::endl;
+}
+
+void benchmark()
+{
+    const uint64_t rates[] = {64, 1000, 5000, 20000};
+    for (uint64_t rate : rates)
+    {
+        // about 1 s, 5 samples per wait like the sender's packets, 1 per wait above 1 kHz
+        uint64_t per_wait = (rate <= 1000) ? 5 : 1;
+        uint64_t waits = rate / per_wait;
+
+        Pacer pacer(rate);
+        auto start = bench_clock::now();
+        for (uint64_t i = 0; i < waits; i++)
+            pacer.wait(per_wait);
+        double held = waits * per_wait / seconds_since(start);
+
+        const Pacer_Stats &st = pacer.stats();
+        printf("%6llu Hz: held %10.3f Hz (%+.4f%%), missed %llu of %llu, late mean %.1f us max %.1f us\n",
+               (unsigned long long)rate, held, 100 * (held - rate) / rate, (unsigned long long)st.missed,
+               (unsigned long long)st.waits, st.mean_late_ns / 1000, st.max_late_ns / 1000.0);
+        assert(fabs(held - rate) / rate < 0.01);
+        assert(st.skipped == 0);
+    }
+}
+
+int main()
+{
+    test_deadlines();
+    test_against_usleep();
+    test_missed();
+    benchmark();
+
+    std::cout << "All tests passed" << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,265 @@
+#include <iostream>
+#include <atomic>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <chrono>
+#include <cmath>
+#include <assert.h>
+
+#include "bluetooth_sensor_data_recv.hpp"
+#include "packet_sizer.hpp"
+
+/* Checks Packet_Sizer and the acks it is fed from:
+ *  - round trips are measured from acks, old and unknown acks are ignored
+ *  - on a simulated link that has airtime to spare packets shrink to one sample
+ *  - on one where every packet costs more airtime than a sample period they
+ *    grow until the link keeps up, and stay there instead of flapping
+ *  - the latency budget caps the size even when the link wants more
+ *  - a BluetoothReceiver acks the newest sequence number of every sensor
+ *  - samples per unit of airtime and latency against the fixed 5 sample packets
+ */
+
+#define SIM_SECONDS 120
+#define PERIOD_US BT_SAMPLE_PERIOD_US
+
+// a link sending one packet at a time, each taking per_packet_us of airtime plus per_byte_us for every byte
+struct Sim_Link
+{
+    int64_t per_packet_us;
+    double per_byte_us;
+    int64_t ack_delay_us{2000};
+};
+
+struct Sim_Result
+{
+    double mean_size{0};
+    size_t last_size{0};
+    size_t max_queue{0};
+    int64_t max_latency_us{0}; // oldest sample of a packet taken to the end of its airtime
+    double utilisation{0};     // fraction of the time the link was sending
+    double samples_per_airtime_s{0};
+    uint64_t changes{0};
+    Sizer_Stats stats;
+};
+
+struct Sim_Packet
+{
+    uint16_t seq;
+    int64_t sent;
+    int64_t oldest;
+    size_t bytes;
+};
+
+// run the sender loop against the link, with the sizer or a fixed size when fixed > 0
+Sim_Result simulate(const Sim_Link &link, const Sizer_Config &config, size_t fixed = 0)
+{
+    Packet_Sizer sizer(config, 5);
+    std::deque<Sim_Packet> queue;
+    std::deque<std::pair<uint16_t, int64_t>> acks;
+    int64_t busy_until{0}, airtime{0};
+    uint64_t samples_sent{0}, size_sum{0}, ticks{0};
+    uint16_t seq{0};
+    Sim_Result r;
+
+    const int64_t end = SIM_SECONDS * 1000000LL;
+    int64_t t{0};
+    while (t < end)
+    {
+        // the link sends whatever it could start by now
+        while (!queue.empty() && std::max(busy_until, queue.front().sent) <= t)
+        {
+            Sim_Packet &p = queue.front();
+            int64_t duration = link.per_packet_us + (int64_t)(p.bytes * link.per_byte_us);
+            busy_until = std::max(busy_until, p.sent) + duration;
+            acks.push_back({p.seq, busy_until + link.ack_delay_us});
+            if (t > end / 2)
+            {
+                r.max_latency_us = std::max(r.max_latency_us, busy_until - p.oldest);
+                airtime += duration;
+                samples_sent += (p.bytes - 8) / 4;
+            }
+            queue.pop_front();
+        }
+
+        // acks are read once per tick, with the time they arrived
+        while (!acks.empty() && acks.front().second <= t)
+        {
+            sizer.on_ack(acks.front().first, acks.front().second);
+            acks.pop_front();
+        }
+
+        size_t n = fixed ? fixed : sizer.next_size(t, queue.size(), 0);
+        if (t > end / 2)
+        {
+            size_sum += n;
+            ticks++;
+            r.max_queue = std::max(r.max_queue, queue.size());
+        }
+
+        // a version 2 packet is about 8 bytes of header and 4 per sample
+        sizer.on_sent(seq, t);
+        queue.push_back({seq++, t, t - (int64_t)(n - 1) * PERIOD_US, 8 + 4 * n});
+        t += n * PERIOD_US;
+    }
+
+    r.stats = sizer.stats();
+    r.mean_size = (double)size_sum / ticks;
+    r.last_size = fixed ? fixed : r.stats.samples;
+    r.utilisation = (double)airtime / (end / 2);
+    r.samples_per_airtime_s = airtime ? samples_sent / (airtime / 1e6) : 0;
+    r.changes = r.stats.grown + r.stats.shrunk;
+    return r;
+}
+
+void print(const char *name, const Sim_Result &r)
+{
+    printf("  %-26s size %5.2f queue %3zu latency %7.1f ms airtime %5.1f%% samples per airtime s %7.0f changes %llu\n",
+           name, r.mean_size, r.max_queue, r.max_latency_us / 1000.0, 100 * r.utilisation, r.samples_per_airtime_s,
+           (unsigned long long)r.changes);
+}
+
+void test_round_trips()
+{
+    std::cout << "Round trip tests: ";
+
+    Packet_Sizer sizer;
+    for (uint16_t s = 0; s < 10; s++)
+        sizer.on_sent(s, 1000 * s);
+
+    sizer.on_ack(3, 3000 + 5000);
+    assert(sizer.stats().srtt_us == 5000 && sizer.stats().min_rtt_us == 5000);
+    assert(sizer.stats().in_flight == 6 && sizer.stats().acks == 1);
+
+    // older and repeated acks say nothing new
+    sizer.on_ack(2, 20000);
+    sizer.on_ack(3, 20000);
+    assert(sizer.stats().acks == 1 && sizer.stats().srtt_us == 5000);
+
+    // smoothed 1/8 of the way, the least is the base
+    sizer.on_ack(5, 5000 + 13000);
+    assert(sizer.stats().srtt_us == 6000 && sizer.stats().min_rtt_us == 5000);
+
+    // an ack of a packet sent too long ago for its time to be kept moves forward without a round trip
+    sizer.on_ack(9 + SIZER_SEND_HISTORY, 100000);
+    assert(sizer.stats().acks == 3 && sizer.stats().srtt_us == 6000);
+
+    std::cout << "Passed!" << std::endl;
+}
+
+void test_simulated_links()
+{
+    std::cout << "Simulated link tests:" << std::endl;
+
+    Sizer_Config config;
+    config.max_samples = 64;
+
+    // 1 ms of airtime per packet, most of the time idle: as small as it gets
+    Sim_Link idle{1000, 10};
+    Sim_Result r = simulate(idle, config);
+    print("idle link, adaptive", r);
+    print("idle link, fixed 5", simulate(idle, config, 5));
+    assert(r.last_size == 1 && r.max_queue <= 1);
+    assert(r.max_latency_us < 10000);
+
+    // 25 ms per packet, more than a sample period: one sample packets would queue without end
+    Sim_Link slow{25000, 20};
+    r = simulate(slow, config);
+    Sim_Result fixed_one = simulate(slow, config, 1);
+    print("congested link, adaptive", r);
+    print("congested link, fixed 1", fixed_one);
+    print("congested link, fixed 5", simulate(slow, config, 5));
+    assert(r.last_size >= 2 && r.last_size <= 8);
+    assert(r.utilisation < 0.9 && r.max_queue <= 2);
+    assert(r.max_latency_us < config.latency_budget_us);
+    assert(fixed_one.max_queue > 100);
+    // settled, not flapping between sizes
+    assert(r.changes < 20);
+
+    // 200 ms per packet, the link wants more samples than the budget allows: the budget wins
+    Sim_Link overloaded{200000, 20};
+    r = simulate(overloaded, config);
+    print("overloaded link, adaptive", r);
+    assert(r.last_size == r.stats.limit);
+    assert((int64_t)(r.stats.limit - 1) * PERIOD_US + r.stats.min_rtt_us / 2 <= config.latency_budget_us);
+    assert((int64_t)r.stats.limit * PERIOD_US + r.stats.min_rtt_us / 2 > config.latency_budget_us);
+
+    // a tighter budget gives smaller packets at once
+    config.latency_budget_us = 40000;
+    Packet_Sizer sizer(config, 20);
+    assert(sizer.samples() == 40000 / PERIOD_US + 1);
+
+    std::cout << "Simulated link tests: Passed!" << std::endl;
+}
+
+void test_receiver_acks()
+{
+    std::cout << "BluetoothReceiver ack tests: ";
+
+    const std::string receiver_addr = "unix:@phms_sizer_receiver";
+    const std::string sender_addr = "unix:@phms_sizer_sender";
+
+    BluetoothReceiver receiver;
+    receiver.set_listen_address(receiver_addr);
+    receiver.set_bt_address(sender_addr);
+
+    PHMS_Bluetooth::Communicator sender;
+    std::thread connect([&]() { assert(sender.open_con(sender_addr, receiver_addr, 5) == 0); });
+    receiver.initializeConnection();
+    connect.join();
+    sender.run();
+
+    std::vector<Sample> samples(5);
+    for (auto &s : samples)
+    {
+        s.irLED = 14000;
+        s.redLED = 15000;
+        s.spo2 = 97;
+        s.bpm = 70;
+    }
+
+    // sensor 1 sends 0 to 9, sensor 4 sends 100 to 102
+    uint16_t newest[16]{};
+    bool acked[16]{};
+    for (uint16_t i = 0; i < 10; i++)
+    {
+        assert(sender.push(packet_from_Sample_buffer_v2(1, i, i * 78, samples)));
+        if (i < 3)
+            assert(sender.push(packet_from_Sample_buffer_v2(4, 100 + i, i * 78, samples)));
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (!(acked[1] && newest[1] == 9 && acked[4] && newest[4] == 102) && std::chrono::steady_clock::now() < deadline)
+    {
+        sender.wait_for(std::chrono::milliseconds(100));
+        sender.consume([&](const uint8_t *data, size_t len) {
+            uint8_t sensor;
+            uint16_t sequence;
+            if (!bt_parse_ack(data, len, sensor, sequence))
+                return;
+            assert(sensor < 16);
+            // acks only move forward
+            assert(!acked[sensor] || (int16_t)(sequence - newest[sensor]) > 0);
+            newest[sensor] = sequence;
+            acked[sensor] = true;
+        });
+    }
+    assert(acked[1] && newest[1] == 9 && acked[4] && newest[4] == 102);
+    for (int j = 0; j < 16; j++)
+        assert(acked[j] == (j == 1 || j == 4));
+    sender.quit();
+
+    std::cout << "Passed!" << std::endl;
+}
+
+int main()
+{
+    test_round_trips();
+    test_simulated_links();
+    test_receiver_acks();
+
+    std::cout << "All tests passed" << std::endl;
+
+    return 0;
+}
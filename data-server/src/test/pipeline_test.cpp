@@ -0,0 +1,240 @@
+#include <iostream>
+#include <atomic>
+#include <assert.h>
+
+#include "ds_pipeline.hpp"
+
+#define BATCH_COUNT 20000
+
+void test_pipeline()
+{
+    std::cout << "Pipeline tests: ";
+
+    static Pipeline<Sample_Batch> pipeline;
+
+    std::atomic<int> received{0};
+    uint32_t last_seen{0};
+    bool in_order{true};
+
+    // decode: stamp each sample with its batch number
+    pipeline.add_stage("decode", [](Sample_Batch &b) {
+        for (uint32_t i = 0; i < b.count; i++)
+            b.samples[i].bpm = b.source;
+        return true;
+    });
+
+    // filter: drop every tenth batch
+    pipeline.add_stage("filter", [](Sample_Batch &b) {
+        return b.samples[0].timestamp % 10 != 0;
+    }, 0);
+
+    // sink: check batches arrive in order and untouched
+    pipeline.add_sink("sink", [&](const Sample_Batch &b) {
+        assert(b.count == 5);
+        assert(b.samples[4].bpm == b.source);
+        if (b.samples[0].timestamp <= last_seen && last_seen != 0)
+            in_order = false;
+        last_seen = b.samples[0].timestamp;
+        received++;
+    });
+
+    pipeline.start();
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (uint32_t sent = 1; sent <= BATCH_COUNT;)
+    {
+        bool ok = pipeline.emplace([&](Sample_Batch &b) {
+            b.source = sent % 200;
+            b.count = 5;
+            for (int i = 0; i < 5; i++)
+                b.samples[i].timestamp = sent;
+        });
+
+        // wait for the pipeline to drain when it is full
+        if (ok)
+            sent++;
+        else
+            std::this_thread::yield();
+    }
+
+    while (received != BATCH_COUNT - BATCH_COUNT / 10)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    auto end = std::chrono::high_resolution_clock::now();
+
+    assert(in_order);
+
+    std::vector<Stage_Stats> st = pipeline.stats();
+    assert(st.size() == 3);
+    assert(st[0].items == BATCH_COUNT);
+    assert(st[1].filtered == BATCH_COUNT / 10);
+    assert(st[2].items == BATCH_COUNT - BATCH_COUNT / 10);
+
+    pipeline.stop();
+
+    auto nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / BATCH_COUNT;
+    std::cout << "Passed! (" << nanos << " nanoseconds per batch end to end)" << std::endl;
+    pipeline.print_stats();
+}
+
+void test_backpressure()
+{
+    std::cout << "Pipeline backpressure tests: ";
+
+    // a sink slower than the producer: emplace_wait holds the producer back instead of losing batches
+    static Pipeline<Sample_Batch> pipeline;
+    std::atomic<uint32_t> received{0};
+    std::atomic<bool> stall{false};
+    pipeline.add_sink("slow", [&](const Sample_Batch &b) {
+        assert(b.samples[0].timestamp == received + 1);
+        received++;
+        while (stall)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        if (received % 64 == 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    });
+    pipeline.start();
+
+    const uint32_t count = 4 * PIPELINE_POOL_LENGTH;
+    for (uint32_t sent = 1; sent <= count; sent++)
+        assert(pipeline.emplace_wait([&](Sample_Batch &b) {
+            b.count = 1;
+            b.samples[0].timestamp = sent;
+        }, std::chrono::seconds(5)));
+    while (received != count)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    assert(pipeline.total_overruns() == 0);
+
+    // a stalled sink: once every item is in flight emplace_wait gives up after the timeout
+    stall = true;
+    size_t accepted{0};
+    auto start = std::chrono::steady_clock::now();
+    while (pipeline.emplace_wait([&](Sample_Batch &b) { b.samples[0].timestamp = count + 1 + accepted; }, std::chrono::milliseconds(20)))
+        accepted++;
+    double waited = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    assert(accepted == PIPELINE_POOL_LENGTH);
+    assert(pipeline.total_overruns() == 1);
+    assert(waited >= 20);
+    stall = false;
+
+    pipeline.stop();
+    std::cout << "Passed! (gave up after " << waited << " ms)" << std::endl;
+}
+
+// typed items for the chained pipeline test
+struct Batch_Summary
+{
+    uint32_t batch{0};
+    uint32_t count{0};
+    uint32_t ir_sum{0};
+};
+
+void test_connect()
+{
+    std::cout << "Pipeline connect tests: ";
+
+    // samples -> summaries, the converting stage is the only producer into the second pipeline
+    static Pipeline<Sample_Batch> samples;
+    static Pipeline<Batch_Summary> summaries;
+
+    samples.add_stage("validate", [](Sample_Batch &b) { return b.count > 0; });
+    connect(samples, "feature", summaries, [](const Sample_Batch &b, Batch_Summary &s) {
+        s.batch = b.samples[0].timestamp;
+        s.count = b.count;
+        for (uint32_t i = 0; i < b.count; i++)
+            s.ir_sum += b.samples[i].irLED;
+    });
+
+    std::atomic<uint32_t> classified{0};
+    uint32_t last{0};
+    bool in_order{true};
+    summaries.add_stage("classify", [&](Batch_Summary &s) {
+        if (s.batch <= last)
+            in_order = false;
+        last = s.batch;
+        assert(s.ir_sum == s.count * (s.batch % 1000));
+        classified++;
+        return true;
+    });
+
+    summaries.start();
+    samples.start();
+
+    // every fourth batch is empty and filtered out before it is converted
+    for (uint32_t sent = 1; sent <= BATCH_COUNT; sent++)
+        assert(samples.emplace_wait([&](Sample_Batch &b) {
+            b.count = (sent % 4 == 0) ? 0 : 3;
+            for (int i = 0; i < 3; i++)
+            {
+                b.samples[i].timestamp = sent;
+                b.samples[i].irLED = sent % 1000;
+            }
+        }, std::chrono::seconds(5)));
+
+    uint32_t expected = BATCH_COUNT - BATCH_COUNT / 4;
+    while (classified != expected)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    assert(in_order);
+
+    std::vector<Stage_Stats> st = samples.stats();
+    assert(st.size() == 2 && st[1].name == "feature" && st[1].items == expected);
+    assert(summaries.total_pushed() == expected && summaries.total_overruns() == 0);
+
+    samples.stop();
+    summaries.stop();
+    std::cout << "Passed!" << std::endl;
+}
+
+void test_flush()
+{
+    std::cout << "Pipeline flush tests: ";
+
+    // a sink that collects items and writes them out on a timer, and once more at stop()
+    static Pipeline<Sample_Batch> pipeline;
+    std::atomic<uint32_t> collected{0};
+    std::atomic<uint32_t> written{0};
+    std::atomic<uint32_t> flushes{0};
+    std::thread::id init_thread, flush_thread;
+    pipeline.add_sink("database", [&](const Sample_Batch &b) { collected += b.count; }, [&]() {
+        // the init function ran first, on the same thread
+        assert(init_thread == std::this_thread::get_id());
+        flush_thread = std::this_thread::get_id();
+        written = collected.load();
+        flushes++;
+    }, std::chrono::milliseconds(20));
+    assert(pipeline.on_start("database", [&]() { init_thread = std::this_thread::get_id(); }));
+    assert(!pipeline.on_start("missing", []() {}));
+    pipeline.start();
+
+    for (int i = 0; i < 10; i++)
+        assert(pipeline.emplace_wait([](Sample_Batch &b) { b.count = 5; }, std::chrono::seconds(1)));
+
+    // no more items come, the timer still flushes them
+    auto start = std::chrono::steady_clock::now();
+    while (written != 50 && std::chrono::steady_clock::now() - start < std::chrono::seconds(5))
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    assert(written == 50);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    assert(flushes >= 3);
+
+    // items that arrive just before stop() are flushed by it
+    assert(pipeline.emplace_wait([](Sample_Batch &b) { b.count = 7; }, std::chrono::seconds(1)));
+    while (collected != 57)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    uint32_t before = flushes;
+    pipeline.stop();
+    assert(written == 57 && flushes > before);
+    assert(flush_thread == init_thread && init_thread != std::this_thread::get_id());
+
+    std::cout << "Passed!" << std::endl;
+}
+
+int main()
+{
+    test_pipeline();
+    test_backpressure();
+    test_connect();
+    test_flush();
+    std::cout << "All tests passed" << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,130 @@
+#include <iostream>
+#include <thread>
+#include <atomic>
+#include <new>
+#include <cstdlib>
+#include <assert.h>
+
+#include "datasource.hpp"
+
+#define SAMPLE_COUNT 100000
+
+// count every heap allocation made by the program
+std::atomic<uint64_t> global_new_count{0};
+
+void *operator new(size_t size)
+{
+    global_new_count++;
+    void *p = malloc(size);
+    if (p == nullptr)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+void test_pool()
+{
+    std::cout << "Sample_Pool tests: ";
+
+    Sample_Pool<Sample, 4> pool;
+    assert(pool.available() == 4);
+
+    // slots are handed out reset to default values
+    Sample *a = pool.acquire();
+    a->irLED = 7;
+    pool.release(a);
+    Sample *b = pool.acquire();
+    assert(b->irLED == 0);
+
+    // exhausting the pool falls back to the heap and is counted
+    Sample *held[4];
+    held[0] = b;
+    for (int i = 1; i < 4; i++)
+        held[i] = pool.acquire();
+    assert(pool.available() == 0);
+    assert(pool.heap_allocations() == 0);
+
+    Sample *extra = pool.acquire();
+    assert(extra != nullptr);
+    assert(pool.heap_allocations() == 1);
+
+    // heap samples are freed, pool samples are returned
+    pool.release(extra);
+    for (int i = 0; i < 4; i++)
+        pool.release(held[i]);
+    assert(pool.available() == 4);
+    assert(pool.allocations() == 6);
+    assert(pool.releases() == 6);
+
+    std::cout << "Passed!" << std::endl;
+}
+
+// collection and processing threads passing pooled samples, as Max30100 does
+void test_steady_state()
+{
+    std::cout << "Sample_Pool steady state tests: ";
+
+    static SPSC_Queue<Sample *, 256> queue;
+    static Sample_Pool<Sample, 512> pool;
+
+    uint64_t new_before = global_new_count.load();
+
+    std::thread processor([]() {
+        for (int received = 0; received < SAMPLE_COUNT;)
+        {
+            Sample *s;
+            if (queue.wait_pop(s, std::chrono::milliseconds(100)))
+            {
+                assert(s->irLED == static_cast<uint16_t>(received));
+                pool.release(s);
+                received++;
+            }
+        }
+    });
+
+    Sample *s = nullptr;
+    for (int sent = 0; sent < SAMPLE_COUNT;)
+    {
+        if (s == nullptr)
+            s = pool.acquire();
+        s->irLED = static_cast<uint16_t>(sent);
+        if (queue.push(s))
+        {
+            s = nullptr;
+            sent++;
+        }
+        else
+        {
+            std::this_thread::yield();
+        }
+    }
+    processor.join();
+
+    // the thread itself allocates, so only count the sample path
+    uint64_t thread_new = global_new_count.load() - new_before;
+    std::cout << "(" << pool.allocations() << " samples, " << pool.heap_allocations() << " pool heap allocations, " << thread_new << " other heap allocations) ";
+
+    assert(pool.heap_allocations() == 0);
+    assert(pool.available() == 512);
+    assert(thread_new <= 1);
+
+    std::cout << "Passed!" << std::endl;
+}
+
+int main()
+{
+    test_pool();
+    test_steady_state();
+    std::cout << "All tests passed" << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,440 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <cmath>
+#include <assert.h>
+
+#include "sensor_fusion.hpp"
+
+#define DATA_DIR "../../../bluetooth-sensor-data/"
+#define PACKET_LENGTH 16
+#define SENSORS 3
+
+// ir_led \t red_led \t spo2 \t bpm, first line is a header
+std::vector<Sample> load(const std::string &filename)
+{
+    std::vector<Sample> ret;
+    std::ifstream f(filename);
+    std::string line;
+    std::getline(f, line);
+    while (std::getline(f, line))
+    {
+        std::stringstream ss(line);
+        Sample s;
+        if (ss >> s.irLED >> s.redLED >> s.spo2 >> s.bpm)
+            ret.push_back(s);
+    }
+    return ret;
+}
+
+// what BluetoothReceiver does: validate each packet and hand it to the fusion stage,
+// then collect the fused samples once the packets that arrived together are in
+struct Rig
+{
+    Sensor_Validator validators[FUSION_MAX_SENSORS];
+    Sensor_Fusion fusion;
+    std::vector<Sample> out;
+
+    Rig(Fusion_Method method = FUSE_WEIGHTED_MEDIAN)
+    {
+        Fusion_Config cfg;
+        cfg.method = method;
+        fusion.configure(cfg);
+    }
+
+    void push(int sensor, const Sample *s, size_t n)
+    {
+        uint8_t flags[PACKET_LENGTH];
+        validators[sensor].check(s, n, flags);
+        fusion.push(sensor, s, n, flags, validators[sensor].stats());
+    }
+
+    void drain()
+    {
+        Sample fused[FUSION_WINDOW];
+        size_t k;
+        while ((k = fusion.fuse(fused, FUSION_WINDOW)) > 0)
+            out.insert(out.end(), fused, fused + k);
+    }
+};
+
+// fraction of samples a freshly trained validator flags
+double glitch_rate(const std::vector<Sample> &data)
+{
+    Sensor_Validator v;
+    size_t flagged{0};
+    for (size_t i = 0; i < data.size(); i += PACKET_LENGTH)
+        flagged += v.check(&data[i], std::min((size_t)PACKET_LENGTH, data.size() - i));
+    return (double)flagged / (v.stats().samples - v.get_config().warmup);
+}
+
+// simulated pulse: the same signal seen by every sensor at its own light level, with noise and glitches
+struct Simulation
+{
+    std::vector<double> truth;
+    std::vector<Sample> sensor[SENSORS];
+
+    Simulation(size_t n, double glitch_probability, unsigned seed)
+    {
+        const double offset[SENSORS] = {-600, 0, 900};
+        std::mt19937 rng(seed);
+        std::normal_distribution<double> noise(0, 25);
+        std::uniform_real_distribution<double> u(0, 1);
+
+        for (size_t i = 0; i < n; i++)
+        {
+            // 72 bpm at 64 Hz
+            double t = 14000 + 150 * std::sin(2 * M_PI * 1.2 * i / 64.0);
+            truth.push_back(t);
+            for (int s = 0; s < SENSORS; s++)
+            {
+                // the timestamp numbers the slot, from 1 so it is never taken for a missing one
+                Sample x;
+                x.timestamp = i + 1;
+                x.irLED = (uint16_t)(t + offset[s] + noise(rng));
+                x.redLED = (uint16_t)(t + 400 + offset[s] + noise(rng));
+                x.spo2 = 96;
+                x.bpm = 72;
+                if (u(rng) < glitch_probability)
+                    x.irLED = (u(rng) < 0.5) ? 54 : 64823;
+                sensor[s].push_back(x);
+            }
+        }
+    }
+};
+
+// standard deviation of the error against the simulated pulse from slot from on, the level is not compared.
+// Samples are matched to the pulse by their timestamps, slots without output are passed over
+double error_std(const std::vector<Sample> &out, const std::vector<double> &truth, size_t from)
+{
+    double sum{0}, sum_sq{0};
+    size_t n{0};
+    for (const Sample &x : out)
+    {
+        if (x.timestamp == 0 || x.timestamp - 1 < from || x.timestamp > truth.size())
+            continue;
+        double e = x.irLED - truth[x.timestamp - 1];
+        sum += e;
+        sum_sq += e * e;
+        n++;
+    }
+    double mean = sum / n;
+    return std::sqrt(sum_sq / n - mean * mean);
+}
+
+// one sensor on its own, flagged samples replaced with the previous reading
+std::vector<Sample> single_sensor(const std::vector<Sample> &data)
+{
+    Sensor_Validator v;
+    std::vector<Sample> ret;
+    Sample last;
+    for (size_t i = 0; i < data.size(); i += PACKET_LENGTH)
+    {
+        uint8_t flags[PACKET_LENGTH];
+        size_t n = std::min((size_t)PACKET_LENGTH, data.size() - i);
+        v.check(&data[i], n, flags);
+        for (size_t j = 0; j < n; j++)
+        {
+            if (!flags[j])
+                last = data[i + j];
+            ret.push_back(last);
+        }
+    }
+    return ret;
+}
+
+void test_simulated()
+{
+    std::cout << "Sensor_Fusion simulated sensor tests:" << std::endl;
+
+    Simulation sim(64 * 60, 0.25, 1);
+    size_t from = 512;
+
+    double best_single{1e9};
+    for (int s = 0; s < SENSORS; s++)
+        best_single = std::min(best_single, error_std(single_sensor(sim.sensor[s]), sim.truth, from));
+
+    for (Fusion_Method method : {FUSE_WEIGHTED_MEDIAN, FUSE_INVERSE_VARIANCE})
+    {
+        Rig rig(method);
+        for (size_t i = 0; i < sim.truth.size(); i += PACKET_LENGTH)
+        {
+            for (int s = 0; s < SENSORS; s++)
+                rig.push(s, &sim.sensor[s][i], PACKET_LENGTH);
+            rig.drain();
+        }
+
+        // every slot is produced at most once, in step with the sensors, and the ones
+        // where every reading was flagged are left out instead of repeating the last output
+        assert(rig.out.size() + rig.fusion.stats().held == sim.truth.size());
+        assert(rig.fusion.stats().realignments == SENSORS);
+        for (size_t i = 0; i < rig.out.size(); i++)
+            assert(rig.out[i].timestamp > (i == 0 ? 0 : rig.out[i - 1].timestamp));
+
+        double fused = error_std(rig.out, sim.truth, from);
+        printf("  %-16s error: %5.1f  best single sensor: %5.1f  held: %llu\n",
+               method == FUSE_WEIGHTED_MEDIAN ? "weighted median" : "inverse variance",
+               fused, best_single, (unsigned long long)rig.fusion.stats().held);
+        assert(rig.out[from].spo2 == 96 && rig.out[from].bpm == 72);
+
+        // redundant sensors make the signal better than any one of them
+        if (method == FUSE_INVERSE_VARIANCE)
+            assert(fused < 0.75 * best_single);
+        else
+            assert(fused < best_single);
+    }
+}
+
+void test_failover()
+{
+    std::cout << "Sensor_Fusion failover tests: ";
+
+    Simulation sim(64 * 40, 0.1, 2);
+    size_t n = sim.truth.size();
+    std::mt19937 rng(3);
+
+    Rig rig;
+    for (size_t i = 0; i < n; i += PACKET_LENGTH)
+    {
+        for (int s = 0; s < SENSORS; s++)
+        {
+            // sensor 0 disconnects a quarter of the way in
+            if (s == 0 && i >= n / 4)
+                continue;
+
+            // sensor 1 starts reporting random values half way through
+            std::vector<Sample> packet(&sim.sensor[s][i], &sim.sensor[s][i] + PACKET_LENGTH);
+            if (s == 1 && i >= n / 2)
+                for (auto &x : packet)
+                    x.irLED = rng() % 65536;
+
+            rig.push(s, packet.data(), packet.size());
+        }
+        rig.drain();
+    }
+
+    // no gap when a sensor disappears or goes bad, other than slots no sensor had a usable reading for
+    assert(rig.out.size() + rig.fusion.stats().held == n);
+    assert(!rig.validators[1].valid());
+    assert(rig.fusion.stats().invalid_skipped > 0);
+    assert(rig.fusion.stats().contributions[2] > rig.fusion.stats().contributions[0]);
+
+    // the last quarter comes from sensor 2 alone and still follows the pulse
+    assert(error_std(rig.out, sim.truth, 3 * n / 4) < 40);
+
+    // a sensor that comes back is lined up with the newest data
+    Sensor_Fusion f;
+    Sensor_Validator v;
+    Sample packet[PACKET_LENGTH];
+    Sample out[FUSION_WINDOW];
+    f.push(0, packet, PACKET_LENGTH, nullptr, v.stats());
+    f.push(1, packet, PACKET_LENGTH, nullptr, v.stats());
+    assert(f.fuse(out, FUSION_WINDOW) == PACKET_LENGTH);
+    for (int i = 0; i < 3; i++)
+        f.push(0, packet, PACKET_LENGTH, nullptr, v.stats());
+
+    // sensor 1 is late but within max_lag, so it is waited for
+    assert(f.fuse(out, FUSION_WINDOW) == 0);
+    assert(f.pending() == 3 * PACKET_LENGTH);
+
+    // it falls further behind, the slots are fused without it and it is realigned when it is back
+    for (int i = 0; i < 2; i++)
+        f.push(0, packet, PACKET_LENGTH, nullptr, v.stats());
+    assert(f.fuse(out, FUSION_WINDOW) == 5 * PACKET_LENGTH);
+    f.push(1, packet, PACKET_LENGTH, nullptr, v.stats());
+    assert(f.stats().realignments == 3);
+    f.push(0, packet, PACKET_LENGTH, nullptr, v.stats());
+    assert(f.fuse(out, FUSION_WINDOW) == PACKET_LENGTH);
+    assert(f.pending() == 0);
+
+    std::cout << "Passed!" << std::endl;
+}
+
+void test_vitals_lost()
+{
+    std::cout << "Sensor_Fusion vitals tests: ";
+
+    // every sensor's SpO2 and heart rate estimates run out half way through, the fused
+    // stream must say so too rather than keep showing the last estimate
+    Simulation sim(64 * 20, 0.0, 5);
+    size_t n = sim.truth.size();
+    for (int s = 0; s < SENSORS; s++)
+        for (size_t i = n / 2; i < n; i++)
+            sim.sensor[s][i].spo2 = sim.sensor[s][i].bpm = 0;
+
+    Rig rig;
+    for (size_t i = 0; i < n; i += PACKET_LENGTH)
+    {
+        for (int s = 0; s < SENSORS; s++)
+            rig.push(s, &sim.sensor[s][i], PACKET_LENGTH);
+        rig.drain();
+    }
+
+    assert(rig.out.size() == n);
+    for (const Sample &x : rig.out)
+    {
+        bool live = x.timestamp <= n / 2;
+        assert(x.spo2 == (live ? 96 : 0));
+        assert(x.bpm == (live ? 72 : 0));
+    }
+
+    // one sensor's estimate is enough
+    for (size_t i = 0; i < n; i++)
+    {
+        sim.sensor[2][i].spo2 = 97;
+        sim.sensor[2][i].bpm = 80;
+    }
+    Rig one;
+    for (size_t i = 0; i < n; i += PACKET_LENGTH)
+    {
+        for (int s = 0; s < SENSORS; s++)
+            one.push(s, &sim.sensor[s][i], PACKET_LENGTH);
+        one.drain();
+    }
+    assert(one.out.size() == n);
+    for (const Sample &x : one.out)
+        assert(x.timestamp <= n / 2 || (x.spo2 == 97 && x.bpm == 80));
+
+    std::cout << "Passed!" << std::endl;
+}
+
+void test_lost_packets()
+{
+    std::cout << "Sensor_Fusion lost packet tests: ";
+
+    // every fifth packet of sensor 1 and every seventh of sensor 2 never arrives. Their packets
+    // say which sample they start with, so the others still land in the right slots
+    Simulation sim(64 * 40, 0.0, 4);
+    size_t n = sim.truth.size();
+    size_t packets = n / PACKET_LENGTH;
+    auto lost = [packets](int s, size_t packet) {
+        return packet + 1 < packets && ((s == 1 && packet % 5 == 4) || (s == 2 && packet % 7 == 6));
+    };
+    size_t lost_count{0};
+    Rig rig;
+    for (size_t i = 0; i < n; i += PACKET_LENGTH)
+    {
+        size_t packet = i / PACKET_LENGTH;
+        for (int s = 0; s < SENSORS; s++)
+        {
+            if (lost(s, packet))
+            {
+                lost_count++;
+                continue;
+            }
+            uint8_t flags[PACKET_LENGTH];
+            rig.validators[s].check(&sim.sensor[s][i], PACKET_LENGTH, flags);
+            rig.fusion.push(s, &sim.sensor[s][i], PACKET_LENGTH, flags, rig.validators[s].stats(), i);
+        }
+        rig.drain();
+    }
+
+    const Fusion_Stats &st = rig.fusion.stats();
+    assert(st.realignments == SENSORS);
+    assert(lost_count > 0 && st.lost == lost_count * PACKET_LENGTH);
+
+    // no slot mixes samples taken at different times
+    assert(rig.out.size() == n);
+    for (size_t i = 0; i < n; i++)
+        assert(rig.out[i].timestamp == i + 1);
+    assert(error_std(rig.out, sim.truth, 512) < 30);
+
+    // a packet that arrives after the next one is waited for and fills its slots
+    Sensor_Fusion f;
+    Sensor_Validator v;
+    std::vector<Sample> late;
+    Sample out[FUSION_WINDOW];
+    for (size_t p : {0, 1, 3, 2, 4})
+    {
+        f.push(0, &sim.sensor[0][p * PACKET_LENGTH], PACKET_LENGTH, nullptr, v.stats(), p * PACKET_LENGTH);
+        size_t k = f.fuse(out, FUSION_WINDOW);
+        late.insert(late.end(), out, out + k);
+    }
+    assert(late.size() == 5 * PACKET_LENGTH && f.stats().lost == 0);
+    for (size_t i = 0; i < late.size(); i++)
+        assert(late[i].timestamp == i + 1);
+
+    // counted by packet instead the lost packets shift a sensor, the fused samples then mix readings
+    // from different points of the pulse until the sensor lags far enough behind to be realigned
+    Rig shifted;
+    for (size_t i = 0; i < n; i += PACKET_LENGTH)
+    {
+        size_t packet = i / PACKET_LENGTH;
+        for (int s = 0; s < SENSORS; s++)
+            if (!lost(s, packet))
+                shifted.push(s, &sim.sensor[s][i], PACKET_LENGTH);
+        shifted.drain();
+    }
+    double in_step = error_std(rig.out, sim.truth, 512);
+    double by_packet = error_std(shifted.out, sim.truth, 512);
+    printf("error in step: %.1f counted by packet: %.1f ", in_step, by_packet);
+    assert(shifted.fusion.stats().realignments > SENSORS);
+    assert(in_step < by_packet / 2);
+
+    std::cout << "Passed!" << std::endl;
+}
+
+void test_recorded()
+{
+    std::cout << "Sensor_Fusion recorded data tests: ";
+
+    // three working sensors from different parts of the same recording
+    std::vector<Sample> data = load(std::string(DATA_DIR) + "jack_stressed.csv");
+    size_t n = data.size() / SENSORS / PACKET_LENGTH * PACKET_LENGTH;
+    assert(n > 2000);
+
+    Rig rig;
+    for (size_t i = 0; i < n; i += PACKET_LENGTH)
+    {
+        for (int s = 0; s < SENSORS; s++)
+            rig.push(s, &data[s * n + i], PACKET_LENGTH);
+        rig.drain();
+    }
+    assert(rig.out.size() + rig.fusion.stats().held == n);
+
+    // about a quarter of each sensor's readings are glitches, fused ones almost never are
+    double single = glitch_rate(std::vector<Sample>(data.begin(), data.begin() + n));
+    double fused = glitch_rate(rig.out);
+    printf("glitch rate single sensor: %.3f fused: %.3f ", single, fused);
+    assert(fused < single / 4);
+
+    std::cout << "Passed!" << std::endl;
+}
+
+void bench()
+{
+    // 16 sensors, 64 samples per packet
+    Sensor_Fusion f;
+    Sensor_Validator v;
+    Validation_Stats st = v.stats();
+    std::vector<Sample> packet(64);
+    std::vector<Sample> out(FUSION_WINDOW);
+    size_t fused{0};
+
+    auto start = std::chrono::steady_clock::now();
+    for (int rep = 0; rep < 10000; rep++)
+    {
+        for (int s = 0; s < FUSION_MAX_SENSORS; s++)
+            f.push(s, packet.data(), packet.size(), nullptr, st);
+        fused += f.fuse(out.data(), out.size());
+    }
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / fused;
+    printf("Sensor_Fusion: %.1f ns per fused sample from %d sensors\n", ns, FUSION_MAX_SENSORS);
+    assert(fused == 10000 * packet.size());
+}
+
+int main()
+{
+    test_simulated();
+    test_failover();
+    test_vitals_lost();
+    test_lost_packets();
+    test_recorded();
+    bench();
+    std::cout << "All tests passed" << std::endl;
+
+    return 0;
+}
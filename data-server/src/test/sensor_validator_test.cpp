@@ -0,0 +1,170 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <cmath>
+#include <assert.h>
+
+#include "sensor_validator.hpp"
+
+#define DATA_DIR "../../../bluetooth-sensor-data/"
+#define PACKET_LENGTH 64
+
+// ir_led \t red_led \t spo2 \t bpm, first line is a header
+std::vector<Sample> load(const std::string &filename)
+{
+    std::vector<Sample> ret;
+    std::ifstream f(filename);
+    std::string line;
+    std::getline(f, line);
+    while (std::getline(f, line))
+    {
+        std::stringstream ss(line);
+        Sample s;
+        if (ss >> s.irLED >> s.redLED >> s.spo2 >> s.bpm)
+            ret.push_back(s);
+    }
+    return ret;
+}
+
+// values produced by a Mock_Sensor after make_invalid()
+std::vector<Sample> random_samples(size_t n)
+{
+    std::vector<Sample> ret(n);
+    for (auto &s : ret)
+    {
+        s.irLED = rand() % (UINT16_MAX - (22000 - 11800)) - (UINT16_MAX - 22000);
+        s.redLED = rand() % (UINT16_MAX - (23000 - 11900)) - (UINT16_MAX - 23000);
+    }
+    return ret;
+}
+
+// feed samples in packets, returns the packet the sensor first went invalid in, or -1
+int feed(Sensor_Validator &v, const std::vector<Sample> &data)
+{
+    int invalid_at{-1};
+    for (size_t i = 0, p = 0; i < data.size(); i += PACKET_LENGTH, p++)
+    {
+        v.check(&data[i], std::min((size_t)PACKET_LENGTH, data.size() - i));
+        if (!v.valid() && invalid_at < 0)
+            invalid_at = p;
+    }
+    return invalid_at;
+}
+
+void print(const char *name, const Sensor_Validator &v)
+{
+    Validation_Stats st = v.stats();
+    printf("  %-22s samples: %6llu flagged: %5llu (z: %5llu step: %5llu) score: %.3f invalidations: %llu ir: %.0f+-%.0f red: %.0f+-%.0f\n",
+           name, (unsigned long long)st.samples, (unsigned long long)st.flagged,
+           (unsigned long long)st.z_outliers, (unsigned long long)st.step_outliers, st.score,
+           (unsigned long long)st.invalidations, st.mean[0], st.std[0], st.mean[1], st.std[1]);
+}
+
+void test_recorded()
+{
+    std::cout << "Sensor_Validator recorded data tests:" << std::endl;
+
+    for (const char *file : {"jack_stressed.csv", "jack_unstressed.csv"})
+    {
+        std::vector<Sample> data = load(std::string(DATA_DIR) + file);
+        assert(data.size() > 1000);
+
+        // a working sensor stays valid
+        Sensor_Validator v;
+        assert(feed(v, data) < 0);
+        assert(v.stats().invalidations == 0);
+        print(file, v);
+
+        // so does one with a different baseline, which the old fixed ranges rejected
+        std::vector<Sample> shifted = data;
+        for (auto &s : shifted)
+        {
+            s.irLED = s.irLED / 2 + 3000;
+            s.redLED = s.redLED / 2 + 5000;
+        }
+        Sensor_Validator vs;
+        assert(feed(vs, shifted) < 0);
+        print("(shifted baseline)", vs);
+    }
+
+    std::cout << "Passed!" << std::endl;
+}
+
+void test_faulty()
+{
+    std::cout << "Sensor_Validator faulty sensor tests: ";
+
+    std::vector<Sample> good = load(std::string(DATA_DIR) + "jack_unstressed.csv");
+
+    Sensor_Validator v;
+    feed(v, std::vector<Sample>(good.begin(), good.begin() + 640));
+    assert(v.valid());
+
+    // a sensor producing random values is caught within a second or two
+    int invalid_at = feed(v, random_samples(20 * PACKET_LENGTH));
+    assert(invalid_at >= 0 && invalid_at < 3);
+    assert(v.stats().invalidations == 1);
+
+    // and is trusted again once it recovers
+    feed(v, good);
+    assert(v.valid());
+
+    // flags mark the bad samples
+    std::vector<Sample> packet(good.begin(), good.begin() + PACKET_LENGTH);
+    Sensor_Validator clean = v;
+    uint8_t clean_flags[PACKET_LENGTH];
+    size_t clean_flagged = clean.check(packet.data(), packet.size(), clean_flags);
+
+    int glitch{0};
+    while (clean_flags[glitch] || clean_flags[glitch + 1])
+        assert(++glitch < PACKET_LENGTH - 1);
+    packet[glitch].irLED = 60000;
+    uint8_t flags[PACKET_LENGTH];
+    size_t flagged = v.check(packet.data(), packet.size(), flags);
+    assert(flags[glitch] == 1);
+    assert(flags[glitch + 1] == 0);
+    assert(flagged == clean_flagged + 1);
+
+    // a sensor that moves to a new level is followed there
+    std::vector<Sample> moved = good;
+    for (auto &s : moved)
+        s.irLED += 2000;
+    feed(v, moved);
+    assert(v.valid());
+    assert(std::fabs(v.stats().mean[0] - 15900) < 200);
+
+    // the thresholds can be changed
+    Validation_Config strict;
+    strict.z_threshold = 0.1f;
+    strict.step_threshold = 0.1f;
+    Sensor_Validator s(strict);
+    feed(s, good);
+    assert(!s.valid());
+
+    std::cout << "Passed!" << std::endl;
+}
+
+void bench()
+{
+    std::vector<Sample> data = load(std::string(DATA_DIR) + "jack_stressed.csv");
+    Sensor_Validator v;
+    auto start = std::chrono::steady_clock::now();
+    for (int rep = 0; rep < 50; rep++)
+        feed(v, data);
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / (50 * data.size());
+    printf("Sensor_Validator: %.1f ns/sample\n", ns);
+}
+
+int main()
+{
+    srand(1);
+    test_recorded();
+    test_faulty();
+    bench();
+    std::cout << "All tests passed" << std::endl;
+
+    return 0;
+}
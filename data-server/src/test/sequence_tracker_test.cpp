@@ -0,0 +1,223 @@
+#include <iostream>
+#include <atomic>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <cmath>
+#include <assert.h>
+
+#include "bluetooth_sensor_data_recv.hpp"
+
+/* Checks and benchmarks Sequence_Tracker and the loss accounting of BluetoothReceiver:
+ *  - in order packets count nothing, skipped ones are missing until they leave the window and then lost
+ *  - reordered, duplicate and late packets are told apart, counting wraps around at 16 bits
+ *  - a far jump starts counting again
+ *  - a BluetoothReceiver counts what a sender skipped, repeated and reordered, and drops the repeats
+ *  - nanoseconds per tracked packet
+ */
+
+#define PACKET_SAMPLES 5
+#define BENCH_PACKETS 20000000
+
+using bench_clock = std::chrono::steady_clock;
+
+void test_in_order()
+{
+    std::cout << "In order tests: ";
+
+    Sequence_Tracker t;
+    for (uint32_t i = 0; i < 200000; i++)
+        assert(t.track(i + 65000) == SEQ_NEW);
+
+    const Sequence_Stats &st = t.stats();
+    assert(st.received == 200000 && st.lost == 0 && st.missing == 0 && st.gaps == 0);
+    assert(st.reordered == 0 && st.duplicates == 0 && st.late == 0 && st.resyncs == 0);
+    assert(st.loss() == 0.0);
+
+    std::cout << "Passed!" << std::endl;
+}
+
+void test_gaps()
+{
+    std::cout << "Gap tests: ";
+
+    Sequence_Tracker t;
+    for (uint16_t i = 0; i < 10; i++)
+        t.track(i);
+
+    // 10 and 11 skipped, they may still come
+    assert(t.track(12) == SEQ_NEW);
+    assert(t.stats().gaps == 1 && t.stats().missing == 2 && t.stats().lost == 0);
+
+    // one does, the other leaves the window and is lost
+    assert(t.track(11) == SEQ_REORDERED);
+    assert(t.stats().missing == 1 && t.stats().reordered == 1);
+    for (uint16_t i = 13; i < 13 + SEQ_WINDOW; i++)
+        t.track(i);
+    assert(t.stats().missing == 0 && t.stats().lost == 1);
+
+    // arriving now it is late, it was counted lost already
+    assert(t.track(10) == SEQ_LATE);
+    assert(t.stats().late == 1 && t.stats().lost == 1);
+
+    // a jump past the whole window loses what it skips
+    uint16_t newest = 12 + SEQ_WINDOW;
+    assert(t.track(newest + 201) == SEQ_NEW);
+    assert(t.stats().gaps == 2 && t.stats().missing == SEQ_WINDOW - 1 && t.stats().lost == 1 + 200 - (SEQ_WINDOW - 1));
+
+    // sent: everything up to the newest, received: all but 10, 200 skipped and the late 10
+    const Sequence_Stats &st = t.stats();
+    uint64_t sent = newest + 201 + 1;
+    assert(st.received - st.duplicates - st.late + st.missing + st.lost == sent);
+    assert(st.loss() > 200.0 / sent && st.loss() < 202.0 / sent);
+
+    std::cout << "Passed!" << std::endl;
+}
+
+void test_duplicates_and_wrap()
+{
+    std::cout << "Duplicate and wrap around tests: ";
+
+    Sequence_Tracker t;
+    assert(t.track(65534) == SEQ_NEW);
+    assert(t.track(65534) == SEQ_DUPLICATE);
+    assert(t.track(65535) == SEQ_NEW);
+    assert(t.track(1) == SEQ_NEW);
+    assert(t.track(0) == SEQ_REORDERED);
+    assert(t.track(65535) == SEQ_DUPLICATE);
+    assert(t.track(0) == SEQ_DUPLICATE);
+    assert(t.stats().duplicates == 3 && t.stats().reordered == 1 && t.stats().missing == 0 && t.stats().lost == 0);
+
+    // the sender starting over is not a burst of loss
+    assert(t.track(30000) == SEQ_RESYNC);
+    assert(t.track(30001) == SEQ_NEW);
+    assert(t.stats().resyncs == 1 && t.stats().lost == 0);
+
+    t.reset();
+    assert(t.stats().received == 0);
+    assert(t.track(7) == SEQ_NEW);
+
+    std::cout << "Passed!" << std::endl;
+}
+
+// send 100 packets from sensor 2, skipping 10 and 11, sending 20 twice and 31 before 30
+void test_receiver()
+{
+    std::cout << "BluetoothReceiver loss accounting tests: ";
+
+    std::atomic<uint64_t> delivered{0};
+    const std::string receiver_addr = "unix:@phms_sequence_receiver";
+    const std::string sender_addr = "unix:@phms_sequence_sender";
+
+    BluetoothReceiver receiver;
+    receiver.set_listen_address(receiver_addr);
+    receiver.set_bt_address(sender_addr);
+    receiver.registerBatchCallback([&](const Sample *, size_t n) { delivered += n; });
+
+    PHMS_Bluetooth::Communicator sender;
+    std::thread connect([&]() { assert(sender.open_con(sender_addr, receiver_addr, 5) == 0); });
+    receiver.initializeConnection();
+    connect.join();
+    sender.run();
+
+    std::vector<uint16_t> order;
+    for (uint16_t i = 0; i < 100; i++)
+    {
+        if (i == 10 || i == 11 || i == 30)
+            continue;
+        order.push_back(i);
+        if (i == 20)
+            order.push_back(i);
+        if (i == 31)
+            order.push_back(30);
+    }
+
+    Sample samples[PACKET_SAMPLES];
+    for (uint16_t seq : order)
+    {
+        // a steady pulse the validator is happy with
+        for (int i = 0; i < PACKET_SAMPLES; i++)
+        {
+            int n = seq * PACKET_SAMPLES + i;
+            samples[i].irLED = 14000 + (uint16_t)(300 * sin(n * 0.1)) + (n * 37) % 50;
+            samples[i].redLED = 15000 + (uint16_t)(500 * sin(n * 0.1 + 1)) + (n * 53) % 200;
+            samples[i].spo2 = 97;
+            samples[i].bpm = 70;
+        }
+        PHMS_Bluetooth::Packet p = packet_from_Sample_buffer_v2(2, seq, seq * 78, samples, PACKET_SAMPLES);
+        while (!sender.push(std::move(p)))
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+
+    // 98 packets once each, the repeat is dropped. Every slot of the 98 is fused once: delivered,
+    // or held when the validator flagged its only reading. The late packet fills its slots, the
+    // two lost ones leave theirs empty
+    auto fused = [&]() {
+        Fusion_Stats f = receiver.get_fusion_stats();
+        return delivered + f.held - f.lost;
+    };
+    while (receiver.get_sequence_stats(2).received < order.size())
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    while (fused() < 98 * PACKET_SAMPLES)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    Sequence_Stats st = receiver.get_sequence_stats(2);
+    assert(st.lost == 2 && st.missing == 0 && st.gaps == 2);
+    assert(st.duplicates == 1 && st.reordered == 1 && st.late == 0);
+    assert(receiver.get_link_stats().lost == 2 && receiver.get_sequence_stats(0).received == 0);
+    receiver.print_link_stats();
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    assert(fused() == 98 * PACKET_SAMPLES);
+    assert(receiver.get_fusion_stats().lost == 2 * PACKET_SAMPLES);
+    sender.quit();
+
+    std::cout << "Passed!" << std::endl;
+}
+
+void benchmark()
+{
+    // 1% of packets skipped, 1% swapped with the next one
+    std::vector<uint16_t> seqs;
+    seqs.reserve(BENCH_PACKETS);
+    uint32_t rng = 12345;
+    for (uint32_t i = 0; seqs.size() < BENCH_PACKETS; i++)
+    {
+        rng = rng * 1103515245 + 12345;
+        uint32_t r = (rng >> 16) % 100;
+        if (r == 0)
+            continue;
+        if (r == 1 && !seqs.empty())
+        {
+            uint16_t previous = seqs.back();
+            seqs.back() = i;
+            seqs.push_back(previous);
+        }
+        else
+            seqs.push_back(i);
+    }
+
+    Sequence_Tracker t;
+    auto start = bench_clock::now();
+    for (uint16_t s : seqs)
+        t.track(s);
+    double ns = std::chrono::duration<double, std::nano>(bench_clock::now() - start).count() / seqs.size();
+
+    const Sequence_Stats &st = t.stats();
+    printf("%d packets, %.2f ns per packet, loss %.3f%%, reordered %llu\n", BENCH_PACKETS, ns, 100.0 * st.loss(), (unsigned long long)st.reordered);
+    assert(st.loss() > 0.005 && st.loss() < 0.015 && st.reordered > 0);
+}
+
+int main()
+{
+    test_in_order();
+    test_gaps();
+    test_duplicates_and_wrap();
+    test_receiver();
+    benchmark();
+
+    std::cout << "All tests passed" << std::endl;
+
+    return 0;
+}
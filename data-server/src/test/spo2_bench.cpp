@@ -0,0 +1,198 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <chrono>
+#include <cmath>
+#include <assert.h>
+
+#include "spo2_estimator.hpp"
+
+/* Runs the SpO2_Estimator over the recorded sensor data in
+ * bluetooth-sensor-data/ and compares it with the per sample log() lookup
+ * run_receive used before: estimate range and time per sample.
+ * The recordings are mostly noise, the black box itself reports no SpO2 for
+ * them, and their ratio of ratios is mostly above the calibrated range, so
+ * the check is that every estimate given is physiological, 85 to 100 %, and
+ * that windows without a plausible one are held and then reported as 0.
+ */
+
+#define DATA_DIR "../../../bluetooth-sensor-data/"
+#define PACKET_LENGTH 64
+#define REPEATS 20
+
+using bench_clock = std::chrono::steady_clock;
+
+// ir_led \t red_led \t spo2 \t bpm, first line is a header
+std::vector<Sample> load(const std::string &filename)
+{
+    std::vector<Sample> ret;
+    std::ifstream f(filename);
+    std::string line;
+    std::getline(f, line);
+    while (std::getline(f, line))
+    {
+        std::stringstream ss(line);
+        Sample s;
+        if (ss >> s.irLED >> s.redLED >> s.spo2 >> s.bpm)
+            ret.push_back(s);
+    }
+    return ret;
+}
+
+// previous estimate, received_samples was the running packet count
+void legacy_spo2(Sample *samples, size_t n, int received_samples)
+{
+    const uint8_t spO2LUT[43] = {100, 100, 100, 100, 99, 99, 99, 99, 99, 99, 98, 98, 98, 98,
+                                 98, 97, 97, 97, 97, 97, 97, 96, 96, 96, 96, 96, 96, 95, 95,
+                                 95, 95, 95, 95, 94, 94, 94, 94, 94, 93, 93, 93, 93, 93};
+    uint16_t last_spo2{95};
+    for (size_t i = 0; i < n; i++)
+    {
+        Sample &s = samples[i];
+        float acSqRatio = 100.0 * log(s.redLED / received_samples) / log(s.irLED / received_samples);
+        uint8_t index = 0;
+        if (acSqRatio > 66)
+            index = (uint8_t)acSqRatio - 66;
+        else if (acSqRatio > 50)
+            index = (uint8_t)acSqRatio - 50;
+
+        if (index > 42)
+            s.spo2 = last_spo2;
+        else
+            s.spo2 = spO2LUT[index];
+        last_spo2 = s.spo2;
+    }
+}
+
+struct Summary
+{
+    double ns_per_sample{0};
+    uint16_t min{0xffff}; // of the samples given an estimate, 0 is none
+    uint16_t max{0};
+    double mean{0};
+    double reported{0}; // fraction of samples given an estimate
+};
+
+template <typename FN>
+Summary run(std::vector<Sample> data, FN fn)
+{
+    Summary r;
+    std::vector<Sample> input = data;
+    std::chrono::nanoseconds elapsed{0};
+    for (int rep = 0; rep < REPEATS; rep++)
+    {
+        data = input;
+        auto start = bench_clock::now();
+        fn(data);
+        elapsed += bench_clock::now() - start;
+    }
+    r.ns_per_sample = (double)elapsed.count() / (REPEATS * data.size());
+
+    // skip the first few seconds while the estimate settles
+    size_t counted{0};
+    for (size_t i = 4 * PACKET_LENGTH; i < data.size(); i++)
+    {
+        if (data[i].spo2 == 0)
+            continue;
+        r.min = std::min(r.min, data[i].spo2);
+        r.max = std::max(r.max, data[i].spo2);
+        r.mean += data[i].spo2;
+        counted++;
+    }
+    r.mean = counted ? r.mean / counted : 0;
+    r.reported = (double)counted / (data.size() - 4 * PACKET_LENGTH);
+    return r;
+}
+
+void print(const char *name, const Summary &r)
+{
+    printf("  %-10s %7.1f ns/sample  spo2 mean: %5.1f min: %3u max: %3u, given for %5.1f%% of samples\n", name, r.ns_per_sample,
+           r.mean, r.min, r.max, 100 * r.reported);
+}
+
+int main()
+{
+    for (const char *file : {"jack_stressed.csv", "jack_unstressed.csv"})
+    {
+        std::vector<Sample> data = load(std::string(DATA_DIR) + file);
+        assert(data.size() > 1000);
+        std::cout << file << " (" << data.size() << " samples)" << std::endl;
+
+        Summary legacy = run(data, [](std::vector<Sample> &d) {
+            int packets{0};
+            for (size_t i = 0; i < d.size(); i += PACKET_LENGTH)
+                legacy_spo2(&d[i], std::min((size_t)PACKET_LENGTH, d.size() - i), ++packets);
+        });
+        print("legacy", legacy);
+
+        Summary streaming = run(data, [](std::vector<Sample> &d) {
+            SpO2_Estimator est;
+            for (size_t i = 0; i < d.size(); i += PACKET_LENGTH)
+                est.process(&d[i], std::min((size_t)PACKET_LENGTH, d.size() - i));
+        });
+        print("streaming", streaming);
+
+        assert(streaming.max <= 100);
+        assert(streaming.reported == 0 || streaming.min >= 85);
+        assert(streaming.ns_per_sample < legacy.ns_per_sample);
+    }
+
+    // the estimator settles on a known ratio of ratios
+    SpO2_Estimator est;
+    for (int i = 0; i < 10 * SPO2_WINDOW_LENGTH; i++)
+    {
+        double phase = 2 * M_PI * i / 64.0;
+        uint16_t ir = 20000 + 200 * sin(phase);
+        uint16_t red = 15000 + 90 * sin(phase);
+        est.update(ir, red);
+    }
+    // R = (90 / 15000) / (200 / 20000) = 0.6, SpO2 = 110 - 25 * 0.6 = 95
+    assert(est.ready());
+    assert(std::fabs(est.ratio() - 0.6f) < 0.02f);
+    assert(est.value() == 95);
+
+    // single glitches are skipped, a lasting level change is followed
+    uint64_t before = est.rejected();
+    est.update(60000, 15000);
+    assert(est.rejected() == before + 1);
+    assert(est.value() == 95);
+    for (int i = 0; i < 4 * SPO2_WINDOW_LENGTH; i++)
+    {
+        double phase = 2 * M_PI * i / 64.0;
+        est.update(30000 + 300 * sin(phase), 15000 + 90 * sin(phase));
+    }
+    assert(est.ready());
+    assert(std::fabs(est.ratio() - 0.6f) < 0.02f);
+
+    // outside the calibration, R = (130 / 15000) / (100 / 20000) = 1.73: the last plausible estimate
+    // is held, then there is no reading, and no estimate outside 85 to 100 % is ever given
+    SpO2_Estimator high;
+    for (int i = 0; i < 4 * SPO2_WINDOW_LENGTH; i++)
+    {
+        double phase = 2 * M_PI * i / 64.0;
+        high.update(20000 + 200 * sin(phase), 15000 + 90 * sin(phase));
+    }
+    assert(high.value() == 95);
+    for (int i = 0; i < SPO2_WINDOW_LENGTH + SPO2_HOLD_LENGTH + 1; i++)
+    {
+        double phase = 2 * M_PI * i / 64.0;
+        uint16_t v = high.update(20000 + 100 * sin(phase), 15000 + 130 * sin(phase));
+        assert(v == 0 || (v >= 85 && v <= 100));
+        if (i == SPO2_WINDOW_LENGTH)
+            assert(v != 0);
+    }
+    assert(high.value() == 0 && high.ratio() > SPO2_MAX_RATIO && high.held() > SPO2_HOLD_LENGTH);
+
+    // no pulse, an AC part of 0.01 % of the DC level, gives no reading either
+    SpO2_Estimator flat;
+    for (int i = 0; i < 10 * SPO2_WINDOW_LENGTH; i++)
+    {
+        double phase = 2 * M_PI * i / 64.0;
+        flat.update(20000 + 2 * sin(phase), 15000 + 1 * sin(phase));
+    }
+    assert(flat.ready() && flat.value() == 0 && flat.perfusion() < SPO2_MIN_PERFUSION);
+
+    std::cout << "All tests passed" << std::endl;
+    return 0;
+}
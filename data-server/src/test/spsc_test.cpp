@@ -0,0 +1,120 @@
+#include <iostream>
+#include <thread>
+#include <assert.h>
+
+#include "ds_spsc_queue.hpp"
+
+#define ITEM_COUNT 1000000
+
+void test_single_thread()
+{
+    std::cout << "SPSC_Queue single thread tests: ";
+
+    SPSC_Queue<int, 8> q;
+    int out{0};
+
+    // empty queue cannot be popped
+    assert(q.empty());
+    assert(!q.pop(out));
+
+    // fill the queue
+    for (int i = 0; i < 8; i++)
+        assert(q.push(i));
+    assert(q.size() == 8);
+
+    // push to a full queue fails and is counted as an overrun
+    assert(!q.push(8));
+    assert(q.overruns() == 1);
+
+    // items come out in order
+    for (int i = 0; i < 8; i++)
+    {
+        assert(q.pop(out));
+        assert(out == i);
+    }
+    assert(q.empty());
+
+    // wait_pop on an empty queue times out
+    assert(!q.wait_pop(out, std::chrono::milliseconds(10)));
+
+    assert(q.total_pushed() == 8);
+    assert(q.total_popped() == 8);
+
+    std::cout << "Passed!" << std::endl;
+}
+
+void test_two_threads()
+{
+    std::cout << "SPSC_Queue producer/consumer tests: ";
+
+    static SPSC_Queue<uint32_t, 256> q;
+
+    std::thread producer([]() {
+        for (uint32_t i = 0; i < ITEM_COUNT; i++)
+        {
+            // spin when the consumer falls behind, nothing may be dropped in this test
+            while (!q.push(i))
+                std::this_thread::yield();
+        }
+    });
+
+    auto start = std::chrono::high_resolution_clock::now();
+
+    // every item must arrive exactly once and in order
+    uint32_t expected{0};
+    while (expected != ITEM_COUNT)
+    {
+        uint32_t v;
+        if (q.wait_pop(v, std::chrono::milliseconds(100)))
+        {
+            assert(v == expected);
+            expected++;
+        }
+    }
+
+    auto end = std::chrono::high_resolution_clock::now();
+    producer.join();
+
+    auto nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / ITEM_COUNT;
+    std::cout << "Passed! (" << nanos << " nanoseconds per item, " << q.overruns() << " overruns)" << std::endl;
+}
+
+void test_blocking_wakeup()
+{
+    std::cout << "SPSC_Queue wakeup latency: ";
+
+    static SPSC_Queue<std::chrono::high_resolution_clock::time_point, 16> q;
+    long total_nanos{0};
+    const int rounds{200};
+
+    std::thread consumer([&]() {
+        for (int i = 0; i < rounds; i++)
+        {
+            std::chrono::high_resolution_clock::time_point sent;
+            while (!q.wait_pop(sent, std::chrono::seconds(1)))
+            {
+            }
+            total_nanos += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - sent).count();
+        }
+    });
+
+    // give the consumer time to fall asleep before each push
+    for (int i = 0; i < rounds; i++)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        assert(q.push(std::chrono::high_resolution_clock::now()));
+    }
+    consumer.join();
+
+    std::cout << "Passed! (average " << total_nanos / rounds << " nanoseconds from push to wakeup)" << std::endl;
+}
+
+int main()
+{
+    test_single_thread();
+    test_two_threads();
+    test_blocking_wakeup();
+    std::cout << "All tests passed" << std::endl;
+
+    return 0;
+}